@@ -5,13 +5,46 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
 #include <string>
 #include <dirent.h>
 #include <array>
+#include <poll.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <sys/resource.h>
+#include <csignal>
+#include <pthread.h>
+#include <ctime>
+#include <vector>
+#include <algorithm>
+#include <cctype>
 
 #define PORT 7734
+/** Connections a script runs over unless -c is given */
+#define SCRIPT_CONNECTIONS 4
+/** Suffix of the OS line asking for binary LOOKUP, ADD and LIST frames */
+#define WIRE_OFFER " Encoding: binary"
+/** Opcodes of binary request frames */
+#define WIRE_LOOKUP 1
+#define WIRE_ADD 2
+#define WIRE_LIST 3
+/** Suffix of a LOOKUP or GET request line asking for the nearest holder */
+#define PREFER_NEAREST "Prefer: nearest"
+/** Pieces a swarm download fetches before it asks for the piece map again */
+#define SWARM_REFRESH 16
+/** Longest piece list sent in one HAVE */
+#define HAVE_LIST_LENGTH 100
+/** File in the client's directory keeping the last TLS session for the next run */
+#define TLS_SESSION_FILE ".tls_session"
 
 /**
  * Failing function to print to standard output 
@@ -55,13 +88,741 @@ void removeWhiteSpace(char *str) {
     }
 }
 
+// Context of the connections opened with -T, NULL for plaintext ones
+SSL_CTX *tls_context = NULL;
+// TLS session of each connected socket, by descriptor
+std::vector<SSL *> tls_sockets;
+// Last session the server issued, new connections resume it
+SSL_SESSION *tls_session = NULL;
+int tls_handshakes = 0;
+int tls_resumed = 0;
+/** Mutex lock for the kept session and the handshake counts */
+pthread_mutex_t tls_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/**
+ * Finds the TLS session of a socket
+ * @param clientSocket socket connected to the server
+ * @return its session, NULL for a plaintext connection
+*/
+SSL *tlsOf(int clientSocket) {
+    return (size_t)clientSocket < tls_sockets.size() ? tls_sockets[clientSocket] : NULL;
+}
 
 /**
- * Main function of client
+ * Sends to the server like send, through the socket's TLS session if it has one
+ * @param clientSocket socket connected to the server
+ * @param data bytes to send
+ * @param length number of bytes
+ * @param flags send flags, only used without TLS
+ * @return bytes sent, or -1 on error
+*/
+ssize_t sendServer(int clientSocket, const void *data, size_t length, int flags) {
+    SSL *tls = tlsOf(clientSocket);
+    if(tls == NULL) {
+        return send(clientSocket, data, length, flags);
+    }
+    if(length == 0) {
+        return 0;
+    }
+    ERR_clear_error();
+    return SSL_write(tls, data, length) > 0 ? (ssize_t)length : -1;
+}
+
+/**
+ * Receives from the server like recv, through the socket's TLS session if it has one
+ * MSG_DONTWAIT fails with EAGAIN when no whole record has arrived yet,
+ * such as when only a session ticket was readable
+ * @param clientSocket socket connected to the server
+ * @param data destination
+ * @param length size of the destination
+ * @param flags 0, MSG_PEEK or MSG_DONTWAIT
+ * @return bytes received, 0 on disconnect and -1 on error
+*/
+ssize_t recvServer(int clientSocket, void *data, size_t length, int flags) {
+    SSL *tls = tlsOf(clientSocket);
+    if(tls == NULL) {
+        return recv(clientSocket, data, length, flags);
+    }
+    int status = fcntl(clientSocket, F_GETFL);
+    if(flags & MSG_DONTWAIT) {
+        fcntl(clientSocket, F_SETFL, status | O_NONBLOCK);
+    }
+    ERR_clear_error();
+    int bytes = (flags & MSG_PEEK) ? SSL_peek(tls, data, length) : SSL_read(tls, data, length);
+    int error = bytes > 0 ? SSL_ERROR_NONE : SSL_get_error(tls, bytes);
+    if(flags & MSG_DONTWAIT) {
+        fcntl(clientSocket, F_SETFL, status);
+    }
+    if(error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if(error == SSL_ERROR_ZERO_RETURN) {
+        return 0;
+    }
+    return bytes > 0 ? bytes : -1;
+}
+
+/**
+ * Checks whether the socket's TLS session holds decrypted bytes not yet
+ * read, which polling the socket would not show
+ * @param clientSocket socket connected to the server
+ * @return true if a read returns without waiting
+*/
+bool serverPending(int clientSocket) {
+    SSL *tls = tlsOf(clientSocket);
+    return tls != NULL && SSL_pending(tls) > 0;
+}
+
+/**
+ * Keeps a session the server issued, in memory for the next connection
+ * and in TLS_SESSION_FILE for the next run
+ * @param tls connection the session was issued on
+ * @param session new session
+ * @return 1, the reference is kept
+*/
+int keepSession(SSL *tls, SSL_SESSION *session) {
+    pthread_mutex_lock(&tls_lock);
+    if(tls_session != NULL) {
+        SSL_SESSION_free(tls_session);
+    }
+    tls_session = session;
+    // Written aside and renamed, so a concurrent run never reads half a session
+    std::string temporary = std::string(TLS_SESSION_FILE) + "." + std::to_string(getpid());
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    FILE *output = fd == -1 ? NULL : fdopen(fd, "w");
+    if(output != NULL) {
+        bool written = PEM_write_SSL_SESSION(output, session) == 1;
+        fclose(output);
+        if(!written || rename(temporary.c_str(), TLS_SESSION_FILE) == -1) {
+            unlink(temporary.c_str());
+        }
+    }
+    pthread_mutex_unlock(&tls_lock);
+    return 1;
+}
+
+/**
+ * Sets up TLS for every connection to the server
+ * The server's certificate must be signed by, or be, one in the CA file.
+ * A session kept by an earlier run is resumed.
+ * @param ca_file PEM certificates the server is checked against
+*/
+void initTLS(const char *ca_file) {
+    tls_context = SSL_CTX_new(TLS_client_method());
+    if(tls_context == NULL) {
+        fail("SSL_CTX_new failed.");
+    }
+    SSL_CTX_set_min_proto_version(tls_context, TLS1_2_VERSION);
+    if(SSL_CTX_load_verify_locations(tls_context, ca_file, NULL) != 1) {
+        fail("Failed to load the TLS CA file.");
+    }
+    SSL_CTX_set_verify(tls_context, SSL_VERIFY_PEER, NULL);
+    SSL_CTX_set_session_cache_mode(tls_context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(tls_context, keepSession);
+    FILE *input = fopen(TLS_SESSION_FILE, "r");
+    if(input != NULL) {
+        tls_session = PEM_read_SSL_SESSION(input, NULL, NULL, NULL);
+        fclose(input);
+    }
+    // One slot per possible descriptor, sized once so threads never resize it
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    tls_sockets.assign(std::min(limit.rlim_cur, (rlim_t)65536), NULL);
+    // A server gone mid write shows as a failed read, as without TLS
+    signal(SIGPIPE, SIG_IGN);
+}
+
+/**
+ * Runs the TLS handshake on a new connection, resuming the kept session
+ * @param clientSocket socket connected to the server
+*/
+void startTLS(int clientSocket) {
+    if((size_t)clientSocket >= tls_sockets.size()) {
+        fail("Too many connections for TLS.");
+    }
+    // Each message is written as one record, Nagle would hold the
+    // first one back until the server acknowledges the handshake
+    int no_delay = 1;
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+    SSL *tls = SSL_new(tls_context);
+    SSL_set_fd(tls, clientSocket);
+    // Each connection resumes a copy, a TLS 1.3 session is spent by its first use
+    pthread_mutex_lock(&tls_lock);
+    SSL_SESSION *session = tls_session == NULL ? NULL : SSL_SESSION_dup(tls_session);
+    pthread_mutex_unlock(&tls_lock);
+    if(session != NULL) {
+        SSL_set_session(tls, session);
+        SSL_SESSION_free(session);
+    }
+    if(SSL_connect(tls) != 1) {
+        fail("TLS handshake failure.");
+    }
+    pthread_mutex_lock(&tls_lock);
+    tls_handshakes++;
+    tls_resumed += SSL_session_reused(tls);
+    pthread_mutex_unlock(&tls_lock);
+    tls_sockets[clientSocket] = tls;
+}
+
+/**
+ * Closes a connection to the server, ending its TLS session if it has one
+ * @param clientSocket socket connected to the server
+*/
+void closeServer(int clientSocket) {
+    SSL *tls = tlsOf(clientSocket);
+    if(tls != NULL) {
+        SSL_shutdown(tls);
+        SSL_free(tls);
+        tls_sockets[clientSocket] = NULL;
+    }
+    close(clientSocket);
+}
+
+/** Heartbeat frame sent by the server to an idle client, echoed back */
+const char heartbeat_frame[] = "HEARTBEAT P2P-CI/1.0\n";
+
+/**
+ * Prints bytes received from the server
+ * Fixed size responses are NUL padded, the padding is skipped so pushed
+ * EVENT lines after a response are still shown. Heartbeats are answered
+ * instead of printed.
+ * @param clientSocket socket connected to the server
+ * @param data received bytes
+ * @param length number of bytes
+*/
+void printReceived(int clientSocket, const char *data, ssize_t length) {
+    ssize_t heartbeat_length = strlen(heartbeat_frame);
+    for(ssize_t i = 0; i < length; i++) {
+        if(length - i >= heartbeat_length && memcmp(data + i, heartbeat_frame, heartbeat_length) == 0) {
+            sendServer(clientSocket, heartbeat_frame, heartbeat_length, 0);
+            i += heartbeat_length - 1;
+        } else if(data[i] != '\0') {
+            std::cout << data[i];
+        }
+    }
+}
+
+/**
+ * Waits for the next command on standard input
+ * EVENT lines pushed by the server for SUBSCRIBE are printed meanwhile
+ * @param clientSocket socket connected to the server
+*/
+void waitForInput(int clientSocket) {
+    char pushed[1024];
+    while( true ) {
+        struct pollfd fds[2];
+        fds[0].fd = STDIN_FILENO;
+        fds[0].events = POLLIN;
+        fds[1].fd = clientSocket;
+        fds[1].events = POLLIN;
+        bool pending = serverPending(clientSocket);
+        if(poll(fds, 2, pending ? 0 : -1) == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            fail("poll");
+        }
+        if(fds[1].revents != 0 || pending) {
+            ssize_t bytes = recvServer(clientSocket, pushed, sizeof(pushed), MSG_DONTWAIT);
+            if(bytes == -1 && errno == EAGAIN) {
+                continue;
+            }
+            if(bytes <= 0) {
+                fail("Server closed the connection.");
+            }
+            printReceived(clientSocket, pushed, bytes);
+        }
+        if(fds[0].revents != 0) {
+            return;
+        }
+    }
+}
+
+/**
+ * Formats a SHA-256 digest as hex
+ * @param context digest context, finished by this call
+ * @param hash destination, at least 65 bytes
+*/
+void finishHash(EVP_MD_CTX *context, char *hash) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length = 0;
+    EVP_DigestFinal_ex(context, digest, &digest_length);
+    for(unsigned int i = 0; i < digest_length; i++) {
+        snprintf(hash + i * 2, 3, "%02x", digest[i]);
+    }
+}
+
+/**
+ * Hashes an open rfc file from the start, for registration
+ * @param fp open file
+ * @param hash destination for the SHA-256 hex digest, at least 65 bytes
+*/
+void hashOpenFile(FILE *fp, char *hash) {
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(context, EVP_sha256(), NULL);
+    char block[65536];
+    size_t bytes;
+    rewind(fp);
+    while((bytes = fread(block, 1, sizeof(block), fp)) > 0) {
+        EVP_DigestUpdate(context, block, bytes);
+    }
+    finishHash(context, hash);
+    EVP_MD_CTX_free(context);
+}
+
+/**
+ * Receives exactly the requested number of bytes
+ * @param clientSocket socket connected to the server
+ * @param data destination buffer
+ * @param length number of bytes
+*/
+void recvExact(int clientSocket, char *data, size_t length) {
+    size_t received = 0;
+    while(received < length) {
+        ssize_t bytes = recvServer(clientSocket, data + received, length - received, 0);
+        if(bytes <= 0) {
+            fail("Server closed the connection.");
+        }
+        received += bytes;
+    }
+}
+
+/**
+ * Appends an unsigned LEB128 varint
+ * @param out destination
+ * @param value value to encode
+*/
+void putVarint(std::string &out, unsigned long value) {
+    while(value >= 0x80) {
+        out += (char)(value | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+/**
+ * Decodes an unsigned LEB128 varint
+ * @param data encoded bytes
+ * @param at position to decode at, advanced past the varint
+ * @return decoded value, 0 past the end of the data
+*/
+unsigned long takeVarint(const std::string &data, size_t *at) {
+    unsigned long value = 0;
+    for(int shift = 0; *at < data.size() && shift < 64; shift += 7) {
+        unsigned char byte = data[(*at)++];
+        value |= (unsigned long)(byte & 0x7f) << shift;
+        if((byte & 0x80) == 0) {
+            break;
+        }
+    }
+    return value;
+}
+
+/**
+ * Decodes a length-prefixed string
+ * @param data encoded bytes
+ * @param at position to decode at, advanced past the string
+ * @return decoded string
+*/
+std::string takeString(const std::string &data, size_t *at) {
+    size_t length = takeVarint(data, at);
+    length = std::min(length, data.size() - *at);
+    std::string text = data.substr(*at, length);
+    *at += length;
+    return text;
+}
+
+/**
+ * Encodes the first line of a LOOKUP, ADD or LIST command as a binary frame:
+ * an opcode byte, a varint payload length and the rfc number or ETag,
+ * followed for a LOOKUP with PREFER_NEAREST by a flags varint of 1
+ * @param request first line of the command
+ * @param frame receives the frame
+ * @return opcode, 0 if the command has no binary form (range LOOKUP and the rest)
+*/
+int encodeWire(const char *request, std::string &frame) {
+    char command[12];
+    char selector[256];
+    command[0] = selector[0] = '\0';
+    sscanf(request, "%11s%*s%255s", command, selector);
+    unsigned long argument = 0;
+    int opcode = 0;
+    if(strcmp(command, "LOOKUP") == 0 && strpbrk(selector, "-,") == NULL && sscanf(request, "LOOKUP RFC %lu P2P-CI/1.0", &argument) == 1) {
+        opcode = WIRE_LOOKUP;
+    } else if(strcmp(command, "ADD") == 0 && sscanf(request, "ADD RFC %lu P2P-CI/1.0", &argument) == 1) {
+        opcode = WIRE_ADD;
+    } else if(strncmp(request, "LIST ALL P2P-CI/1.0", 19) == 0) {
+        opcode = WIRE_LIST;
+        const char *match = strstr(request, "If-None-Match:");
+        if(match != NULL) {
+            argument = strtoul(match + strlen("If-None-Match:"), NULL, 10);
+        }
+    }
+    if(opcode != 0) {
+        std::string payload;
+        putVarint(payload, argument);
+        if(opcode == WIRE_LOOKUP && strstr(request, PREFER_NEAREST) != NULL) {
+            putVarint(payload, 1);
+        }
+        frame.assign(1, (char)opcode);
+        putVarint(frame, payload.size());
+        frame += payload;
+    }
+    return opcode;
+}
+
+/**
+ * Receives the status and payload length that start a binary response,
+ * answering heartbeats that arrive before it. The header is peeked so
+ * it is usually taken with a single read.
+ * @param clientSocket socket connected to the server
+ * @param status receives the status
+ * @param bytes receives the bytes of the header
+ * @return payload length
+*/
+unsigned long recvWireHeader(int clientSocket, unsigned long *status, size_t *bytes) {
+    char header[20];
+    ssize_t available = 0;
+    while(true) {
+        available = recvServer(clientSocket, header, sizeof(header), MSG_PEEK);
+        if(available <= 0) {
+            fail("Server closed the connection.");
+        }
+        if(header[0] != heartbeat_frame[0]) {
+            break;
+        }
+        char rest;
+        do {
+            recvExact(clientSocket, &rest, 1);
+        } while(rest != '\n');
+        sendServer(clientSocket, heartbeat_frame, strlen(heartbeat_frame), 0);
+    }
+
+    // Two varints, each ended by a byte without the high bit
+    size_t length = 0;
+    int ends = 0;
+    while(ends < 2 && length < (size_t)available) {
+        ends += (header[length++] & 0x80) == 0;
+    }
+    recvExact(clientSocket, header, length);
+    while(ends < 2 && length < sizeof(header)) {
+        recvExact(clientSocket, header + length, 1);
+        ends += (header[length++] & 0x80) == 0;
+    }
+    *bytes = length;
+    std::string encoded(header, length);
+    size_t at = 0;
+    *status = takeVarint(encoded, &at);
+    return takeVarint(encoded, &at);
+}
+
+/**
+ * Receives a binary response and renders it like the text one
+ * @param clientSocket socket connected to the server
+ * @param opcode opcode of the request, 0 for the reply to the offer
+ * @param strings hostnames by id, extended with the ones the response defines
+ * @param bytes receives the bytes of the response on the wire
+ * @return response as text
+*/
+std::string recvWire(int clientSocket, int opcode, std::vector<std::string> &strings, size_t *bytes) {
+    unsigned long status = 0;
+    unsigned long length = recvWireHeader(clientSocket, &status, bytes);
+    std::string payload(length, '\0');
+    recvExact(clientSocket, &payload[0], length);
+    *bytes += length;
+
+    size_t at = 0;
+    for(unsigned long count = takeVarint(payload, &at); count > 0; count--) {
+        strings.push_back(takeString(payload, &at));
+    }
+    std::string text;
+    if(status == 200 && (opcode == WIRE_LOOKUP || opcode == WIRE_ADD)) {
+        text = "Title: " + takeString(payload, &at) + "\n";
+        unsigned long port = opcode == WIRE_LOOKUP ? takeVarint(payload, &at) : 0;
+        if(port != 0) {
+            unsigned long id = takeVarint(payload, &at);
+            text += "Holder: " + (id < strings.size() ? strings[id] : std::string("?")) + " " + std::to_string(port) + "\n";
+        }
+        return text;
+    }
+
+    const char *reason = status == 200 ? "OK" : status == 304 ? "Not Modified" : status == 400 ? "Bad Request" :
+                         status == 404 ? "Not Found" : status == 429 ? "Too Many Requests" : "Error";
+    text = "P2P-CI/1.0 " + std::to_string(status) + " " + reason + "\n";
+    if(status == 429) {
+        text += "Retry-After: " + std::to_string(takeVarint(payload, &at)) + "\n";
+    } else if(opcode == WIRE_LIST && (status == 200 || status == 304)) {
+        text += "ETag: " + std::to_string(takeVarint(payload, &at)) + "\n";
+        while(at < payload.size()) {
+            unsigned long rfc_number = takeVarint(payload, &at);
+            std::string title = takeString(payload, &at);
+            unsigned long id = takeVarint(payload, &at);
+            unsigned long port = takeVarint(payload, &at);
+            text += "RFC " + std::to_string(rfc_number) + " " + title + " " +
+                    (id < strings.size() ? strings[id] : std::string("?")) + " " + std::to_string(port) + "\n";
+        }
+        text += "END\n";
+    }
+    return text;
+}
+
+/**
+ * Receives the size line that starts each chunk of a chunked GET body
+ * @param clientSocket socket connected to the server
+ * @return size of the chunk, 0 for the one ending the body
+*/
+size_t recvChunkSize(int clientSocket) {
+    char size_line[20];
+    size_t used = 0;
+    char c = '\0';
+    while(true) {
+        recvExact(clientSocket, &c, 1);
+        if(c == '\n') {
+            break;
+        }
+        if(used < sizeof(size_line) - 1) {
+            size_line[used++] = c;
+        }
+    }
+    size_line[used] = '\0';
+    return strtoul(size_line, NULL, 16);
+}
+
+//Structure for an in-band download that survives an interrupted transfer
+struct Partial_Download {
+    char file_name[32];
+    char part_name[48];
+    char progress_name[48];
+    int fd;
+    off_t offset;
+    char hash[65];
+    bool resumable;
+};
+
+/**
+ * Opens the partial file of a GET sent with Accept-Encoding
+ * rfc<number>.txt.part holds the bytes received so far and
+ * rfc<number>.txt.progress the SHA-256 and length of the whole file they
+ * belong to. Both are kept when a transfer is cut off, so the next GET
+ * asks only for the rest. A connection of a script that finds the part
+ * file in use by another downloads to a name of its own from the start.
+ * @param rfc_number number of the requested rfc
+ * @param clientSocket socket connected to the server
+ * @param download filled in, the part file is left open and locked
+ * @return byte to resume from, 0 for a fresh download
 */
-int main() {
+off_t beginDownload(int rfc_number, int clientSocket, Partial_Download *download) {
+    snprintf(download->file_name, sizeof(download->file_name), "rfc%d.txt", rfc_number);
+    snprintf(download->part_name, sizeof(download->part_name), "%s.part", download->file_name);
+    snprintf(download->progress_name, sizeof(download->progress_name), "%s.progress", download->file_name);
+    download->offset = 0;
+    download->hash[0] = '\0';
+    download->resumable = true;
+    download->fd = open(download->part_name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(download->fd != -1 && flock(download->fd, LOCK_EX | LOCK_NB) == -1) {
+        close(download->fd);
+        snprintf(download->part_name, sizeof(download->part_name), "%s.part%d", download->file_name, clientSocket);
+        download->fd = open(download->part_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        download->resumable = false;
+    }
+    if(download->fd == -1) {
+        fail("Trouble opening output file");
+    }
+    if(!download->resumable) {
+        return 0;
+    }
+
+    // The part only counts with a record of the file it is a prefix of
+    long long total = 0;
+    FILE *progress = fopen(download->progress_name, "r");
+    if(progress != NULL) {
+        if(fscanf(progress, "%64s %lld", download->hash, &total) != 2) {
+            download->hash[0] = '\0';
+        }
+        fclose(progress);
+    }
+    struct stat part_stat;
+    if(download->hash[0] != '\0' && fstat(download->fd, &part_stat) == 0 && part_stat.st_size < total) {
+        download->offset = part_stat.st_size;
+    } else {
+        download->hash[0] = '\0';
+    }
+    return download->offset;
+}
+
+/**
+ * Removes a part file and, for the shared one, its progress record
+ * @param download download started by beginDownload
+*/
+void discardDownload(Partial_Download *download) {
+    unlink(download->part_name);
+    if(download->resumable) {
+        unlink(download->progress_name);
+    }
+}
+
+/**
+ * Receives the response to a GET sent with Accept-Encoding
+ * A 200 or 206 response is followed by a chunked body (size in hex on a
+ * line, then the bytes, 0 ends it) that is written to the part file from
+ * beginDownload, inflated on the way if deflate encoded. A 206 continues
+ * the part file and the bytes already there are hashed again first, so
+ * the whole file is checked against the Content-Hash header either way;
+ * a file that does not match is removed. The file only replaces an
+ * existing one once it is complete and checked.
+ * @param clientSocket socket connected to the server
+ * @param download download started by beginDownload, closed by this call
+ * @param header receives the fixed size response header
+ * @return outcome of the download, empty if the response has no body
+*/
+std::string receiveEncodedGet(int clientSocket, Partial_Download *download, char *header) {
+    recvExact(clientSocket, header, 512);
+    header[511] = '\0';
+    int status = 0;
+    sscanf(header, "P2P-CI/1.0 %d", &status);
+    if(status == 416) {
+        close(download->fd);
+        discardDownload(download);
+        return std::string("Partial download of ") + download->file_name + " no longer matches, removed";
+    }
+    if((status != 200 && status != 206) || strstr(header, "Transfer-Encoding: chunked") == NULL) {
+        close(download->fd);
+        if(download->offset == 0) {
+            discardDownload(download);
+        }
+        return "";
+    }
+    bool deflated = strstr(header, "Content-Encoding: deflate") != NULL;
+    char expected_hash[65];
+    expected_hash[0] = '\0';
+    const char *hash_header = strstr(header, "Content-Hash: sha256:");
+    if(hash_header != NULL) {
+        sscanf(hash_header, "Content-Hash: sha256:%64s", expected_hash);
+    }
+    long long start = 0;
+    long long last = 0;
+    long long total = 0;
+    const char *range_header = strstr(header, "Content-Range: bytes ");
+    if(status == 206 && range_header != NULL) {
+        sscanf(range_header, "Content-Range: bytes %lld-%lld/%lld", &start, &last, &total);
+    } else if(const char *length_header = strstr(header, "Content-Length: ")) {
+        total = atoll(length_header + strlen("Content-Length: "));
+    }
+    // A 206 for other bytes than the part file holds cannot be used
+    bool stale = status == 206 && (start != download->offset || strcmp(expected_hash, download->hash) != 0);
 
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(context, EVP_sha256(), NULL);
+    char chunk[16384];
+    char out[16384];
+    FILE *output = NULL;
+    if(!stale) {
+        if(ftruncate(download->fd, start) == -1) {
+            fail("Trouble opening output file");
+        }
+        for(off_t at = 0; at < start; ) {
+            ssize_t bytes = pread(download->fd, chunk, std::min((off_t)sizeof(chunk), (off_t)(start - at)), at);
+            if(bytes <= 0) {
+                fail("Trouble reading partial download");
+            }
+            EVP_DigestUpdate(context, chunk, bytes);
+            at += bytes;
+        }
+        if(download->resumable) {
+            FILE *progress = fopen(download->progress_name, "w");
+            if(progress != NULL) {
+                fprintf(progress, "%s %lld\n", expected_hash, total);
+                fclose(progress);
+            }
+        }
+        output = fdopen(download->fd, "r+b");
+        if(output == NULL || fseeko(output, start, SEEK_SET) != 0) {
+            fail("Trouble opening output file");
+        }
+    }
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if(deflated && inflateInit(&stream) != Z_OK) {
+        fail("Trouble opening output file");
+    }
+
+    size_t wire_bytes = 0;
+    size_t file_bytes = start;
+    while(true) {
+        size_t length = recvChunkSize(clientSocket);
+        if(length == 0) {
+            break;
+        }
+        while(length > 0) {
+            size_t part = length < sizeof(chunk) ? length : sizeof(chunk);
+            recvExact(clientSocket, chunk, part);
+            wire_bytes += part;
+            length -= part;
+            if(stale) {
+                continue;
+            }
+            if(!deflated) {
+                fwrite(chunk, 1, part, output);
+                EVP_DigestUpdate(context, chunk, part);
+                file_bytes += part;
+                continue;
+            }
+            stream.next_in = (Bytef *)chunk;
+            stream.avail_in = part;
+            do {
+                stream.next_out = (Bytef *)out;
+                stream.avail_out = sizeof(out);
+                int status = inflate(&stream, Z_NO_FLUSH);
+                if(status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+                    fail("Corrupt GET body.");
+                }
+                size_t produced = sizeof(out) - stream.avail_out;
+                fwrite(out, 1, produced, output);
+                EVP_DigestUpdate(context, out, produced);
+                file_bytes += produced;
+            } while(stream.avail_out == 0);
+        }
+    }
+    if(deflated) {
+        inflateEnd(&stream);
+    }
+    char received_hash[65];
+    finishHash(context, received_hash);
+    EVP_MD_CTX_free(context);
+    if(stale) {
+        close(download->fd);
+        discardDownload(download);
+        return std::string("Partial download of ") + download->file_name + " no longer matches, removed";
+    }
+    fflush(output);
+    if(expected_hash[0] != '\0' && strcmp(expected_hash, received_hash) != 0) {
+        discardDownload(download);
+        fclose(output);
+        return std::string("Integrity check failed for ") + download->file_name + ", file removed";
+    }
+    // Renaming also replaces an earlier download that is a hardlink into the server's store
+    if(rename(download->part_name, download->file_name) == -1) {
+        fail("Trouble saving output file");
+    }
+    if(download->resumable) {
+        unlink(download->progress_name);
+    }
+    fclose(output);
+    std::string outcome = std::string("Saved ") + download->file_name + ": " + std::to_string(file_bytes) + " bytes, " +
+                          std::to_string(wire_bytes) + " bytes received";
+    if(start > 0) {
+        outcome += ", resumed at byte " + std::to_string(start);
+    }
+    return outcome;
+}
+
+/**
+ * Opens a connection to the server
+ * @param port server port
+ * @return connected socket
+*/
+int connectToServer(int port) {
     // Create a socket
     int clientSocket = socket(AF_INET, SOCK_STREAM, 0);
     if (clientSocket == -1) {
@@ -73,7 +834,7 @@ int main() {
     struct sockaddr_in serverAddr;
     memset(&serverAddr, '\0', sizeof(serverAddr));
     serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons( PORT );
+    serverAddr.sin_port = htons( port );
     serverAddr.sin_addr.s_addr = INADDR_ANY;
 
     if (connect(clientSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1) {
@@ -81,8 +842,43 @@ int main() {
         close(clientSocket);
         exit(EXIT_FAILURE);
     }
+    if(tls_context != NULL) {
+        startTLS(clientSocket);
+    }
+    return clientSocket;
+}
 
- 
+/**
+ * Finds the name of the operating system, as sent to the server
+ * @param os destination, without a trailing newline
+ * @param size size of the destination
+*/
+void readOS(char *os, size_t size) {
+    //Getting OS
+    const char* os_command = "uname";
+    std::array<char, 64> os_buffer;
+    os_buffer[0] = '\0';
+    std::string uname_res;
+    FILE* uname_pipe = popen(os_command, "r");
+    if( uname_pipe ) {
+         while (fgets(os_buffer.data(), os_buffer.size(), uname_pipe) != nullptr) {
+            uname_res += os_buffer.data();
+        }
+        pclose(uname_pipe);
+    }
+    os[0] = '\0';
+    strncat(os, os_buffer.data(), size - 1);
+    //Replace the newline character
+    os[strcspn(os, "\n")] = '\0';
+}
+
+/**
+ * Sends the OS, then the rfc files of the current directory, then END
+ * @param clientSocket socket connected to the server
+ * @param upload send the rfc files, otherwise only the OS and END
+ * @param wire_strings hostname table to offer binary frames with, NULL for text only
+*/
+void registerDirectory(int clientSocket, bool upload, std::vector<std::string> *wire_strings) {
     //Getting the path to the RFC 
     char currentPath[256]; 
     if (getcwd(currentPath, sizeof(currentPath)) != nullptr) {
@@ -98,7 +894,7 @@ int main() {
     DIR* dir = opendir(currentPath);
     //Line string for each line of the text file
     char line[75];
-    char title[70];
+    char title[75];
     //Variables for the rfc number and the array that it will be stored in
     int rfc_number_from_document = 0;
     char rfc_number_to_array[16];
@@ -106,37 +902,24 @@ int main() {
     int title_newline_counter = 0;
     char nodeInformationArray[256];
 
-    //Getting OS
-    const char* os_command = "uname";
-    std::array<char, 64> os_buffer;
     char tempArr[64];
-    std::string uname_res;
-    FILE* uname_pipe = popen(os_command, "r");
-    if( uname_pipe ) {
-         while (fgets(os_buffer.data(), os_buffer.size(), uname_pipe) != nullptr) {
-            uname_res += os_buffer.data();
-        }
-        pclose(uname_pipe);
-    }
-    std::copy(os_buffer.begin(), os_buffer.end(), tempArr);
-    //Replace the newline character
-    for(int i = 0; tempArr[i] != '\0'; i++) {
-        if(tempArr[i] == '\n') {
-            tempArr[i] = '\0';
-            break;
-        }
+    readOS(tempArr, sizeof(tempArr) - 1);
+
+    //Send OS, every message to the server is newline terminated
+    if(wire_strings != NULL) {
+        strcat(tempArr, WIRE_OFFER);
     }
-    
-    //Send OS
-    send(clientSocket, tempArr, strlen(tempArr), 0);
+    strcat(tempArr, "\n");
+    sendServer(clientSocket, tempArr, strlen(tempArr), 0);
   
     // Logic to open directory and upload file information. 
-    if (dir) {
+    if (dir && upload) {
         struct dirent* entry;
         while ((entry = readdir(dir)) != NULL) {
             if (entry->d_type == DT_REG && strncmp(entry->d_name, "rfc", 3) == 0 && strstr(entry->d_name, ".txt") != NULL) {
                 // std::cout << "File: " << entry->d_name << std::endl;
                 FILE *fp = fopen(entry->d_name, "r");
+                title[0] = '\0';
                 if(fp) {
                     //Looking for RFC number from file.
                     while(fgets(line, sizeof(line), fp)) {
@@ -155,7 +938,8 @@ int main() {
                             break;
                         }
 
-                        if( strlen(line) == 1 && line[0] == '\n') {
+                        //RFC text files may use CRLF line endings
+                        if( strcmp(line, "\n") == 0 || strcmp(line, "\r\n") == 0) {
                             title_newline_counter++;
                         } else {
                             title_newline_counter = 0;
@@ -180,50 +964,876 @@ int main() {
                 snprintf(rfc_number_to_array, sizeof(rfc_number_to_array), "%d", rfc_number_from_document); 
                 strcat(nodeInformationArray, rfc_number_to_array); 
                 strcat(nodeInformationArray, " ");
+                //Content hash, so the server can tell replicas apart
+                char content_hash[65];
+                hashOpenFile(fp, content_hash);
+                strcat(nodeInformationArray, "sha256:");
+                strcat(nodeInformationArray, content_hash);
+                strcat(nodeInformationArray, " ");
                 //Title
                 removeWhiteSpace(title);
-                title[strlen(title) - 1] = '\0';
+                title[strcspn(title, "\r\n")] = '\0';
                 strcat(nodeInformationArray, title); 
+                strcat(nodeInformationArray, "\n");
                 
-                if(send(clientSocket, nodeInformationArray, strlen(nodeInformationArray), 0) == -1) {
+                if(sendServer(clientSocket, nodeInformationArray, strlen(nodeInformationArray), 0) == -1) {
                     fail("Error uploading rfc.");
                 }
                 fclose(fp);
             }
         }
+    } else if (dir == NULL) {
+        fail("Failed to open directory.");
+    }
+    if (dir) {
         closedir(dir);
+    }
+
+    char end[] = "END\n";
+    sendServer(clientSocket, end, strlen(end), 0);
+
+    //The server accepts the offer once the directory is registered
+    if(wire_strings != NULL) {
+        size_t bytes = 0;
+        if(recvWire(clientSocket, 0, *wire_strings, &bytes).compare(0, 14, "P2P-CI/1.0 200") != 0) {
+            fail("Server refused binary frames.");
+        }
+    }
+}
+
+//Structure for one operation of a script
+struct Script_Op {
+    std::string request;
+    // First line of the response, with the outcome of a download
+    std::string status;
+    std::string response;
+    double milliseconds;
+    // Bytes of the response on the wire, GET bodies not counted
+    size_t bytes;
+    bool failed;
+};
+
+//Structure for the operations of a script between two WAIT lines
+//ADD runs on the first connection, the one that registered the directory,
+//so the added rfc has a path on the server
+struct Script_Phase {
+    std::vector<Script_Op *> adds;
+    std::vector<Script_Op *> others;
+    size_t next_add;
+    size_t next_other;
+};
+
+//Structure shared by the connections running a script
+struct Script_Pool {
+    Script_Phase *phase;
+    /** Mutex lock for taking operations and printing results */
+    pthread_mutex_t lock;
+    const char *host;
+    char os[64];
+    bool verbose;
+    // Send LOOKUP, ADD and LIST as binary frames
+    bool wire;
+};
+
+//Structure for one persistent connection of a script
+struct Script_Conn {
+    Script_Pool *pool;
+    int socket;
+    // Local port, sent as the third line of non-GET commands
+    int port;
+    int port_of_server;
+    bool first;
+    // Hostnames by id, as defined by the server on this connection
+    std::vector<std::string> wire_strings;
+};
+
+/**
+ * Answers heartbeats the server sent while the connection was idle,
+ * so they are not read as part of the next response
+ * @param clientSocket socket connected to the server
+*/
+void answerHeartbeats(int clientSocket) {
+    char pending[256];
+    struct pollfd fds;
+    fds.fd = clientSocket;
+    fds.events = POLLIN;
+    while(serverPending(clientSocket) || poll(&fds, 1, 0) > 0) {
+        ssize_t bytes = recvServer(clientSocket, pending, sizeof(pending), MSG_DONTWAIT);
+        if(bytes == -1 && errno == EAGAIN) {
+            break;
+        }
+        if(bytes <= 0) {
+            fail("Server closed the connection.");
+        }
+        // Nothing else arrives unasked, scripts cannot SUBSCRIBE
+        for(ssize_t i = 0; i < bytes; i++) {
+            if(pending[i] == '\n') {
+                sendServer(clientSocket, heartbeat_frame, strlen(heartbeat_frame), 0);
+            }
+        }
+    }
+}
+
+//Structure for the piece map of an rfc, as sent by PIECES
+struct Swarm_Map {
+    char content_hash[65];
+    long long length;
+    long long piece_size;
+    std::vector<std::string> hashes;
+    // Downloaders holding each piece, full holders have them all
+    std::vector<int> counts;
+};
+
+/**
+ * Waits out a 429 response
+ * @param response response of the server
+ * @return true if the request was rate limited and may be sent again
+*/
+bool waitIfLimited(const char *response) {
+    if(strncmp(response, "P2P-CI/1.0 429", 14) != 0) {
+        return false;
+    }
+    int seconds = 1;
+    const char *retry = strstr(response, "Retry-After: ");
+    if(retry != NULL) {
+        seconds = atoi(retry + strlen("Retry-After: "));
+    }
+    sleep(seconds > 0 ? seconds : 1);
+    return true;
+}
+
+/**
+ * Sends a text command of a swarm download, answering heartbeats first
+ * @param clientSocket socket connected to the server
+ * @param message whole command, three lines
+*/
+void sendSwarmCommand(int clientSocket, const std::string &message) {
+    answerHeartbeats(clientSocket);
+    if(sendServer(clientSocket, message.data(), message.size(), MSG_NOSIGNAL) != (ssize_t)message.size()) {
+        fail("Server closed the connection.");
+    }
+}
+
+/**
+ * Asks the server for the piece map of an rfc
+ * @param clientSocket socket connected to the server
+ * @param rfc_number number of the rfc
+ * @param host host line
+ * @param port local port, the third line
+ * @param map filled in from the response
+ * @param status receives the status line
+ * @return true if the rfc has a piece map
+*/
+bool requestPieces(int clientSocket, int rfc_number, const char *host, int port, Swarm_Map *map, std::string *status) {
+    std::string message = "PIECES RFC " + std::to_string(rfc_number) + " P2P-CI/1.0\n" + host + "\n" + std::to_string(port) + "\n";
+    std::string response;
+    do {
+        sendSwarmCommand(clientSocket, message);
+        response.clear();
+        char buffer[4096];
+        while(response.compare(0, 4, "END\n") != 0 && response.find("\nEND\n") == std::string::npos) {
+            ssize_t bytes = recvServer(clientSocket, buffer, sizeof(buffer), 0);
+            if(bytes <= 0) {
+                fail("Server closed the connection.");
+            }
+            response.append(buffer, bytes);
+        }
+    } while(waitIfLimited(response.c_str()));
+    *status = response.substr(0, response.find('\n'));
+    if(response.compare(0, 14, "P2P-CI/1.0 200") != 0) {
+        return false;
+    }
+
+    size_t count = 0;
+    map->content_hash[0] = '\0';
+    map->length = map->piece_size = 0;
+    const char *text = response.c_str();
+    const char *line = strstr(text, "Content-Length: ");
+    if(line != NULL) {
+        map->length = atoll(line + strlen("Content-Length: "));
+    }
+    if((line = strstr(text, "Content-Hash: sha256:")) != NULL) {
+        sscanf(line, "Content-Hash: sha256:%64s", map->content_hash);
+    }
+    if((line = strstr(text, "Piece-Size: ")) != NULL) {
+        map->piece_size = atoll(line + strlen("Piece-Size: "));
+    }
+    if((line = strstr(text, "Pieces: ")) != NULL) {
+        count = strtoul(line + strlen("Pieces: "), NULL, 10);
+    }
+    map->hashes.assign(count, "");
+    map->counts.assign(count, 0);
+    line = line == NULL ? NULL : strchr(line, '\n');
+    while(line != NULL && strncmp(line + 1, "END\n", 4) != 0) {
+        size_t piece = 0;
+        int holders = 0;
+        char hash[65];
+        if(sscanf(line + 1, "%zu %d %64s", &piece, &holders, hash) == 3 && piece < count) {
+            map->counts[piece] = holders;
+            map->hashes[piece] = hash;
+        }
+        line = strchr(line + 1, '\n');
+    }
+    return map->piece_size > 0 && map->content_hash[0] != '\0';
+}
+
+/**
+ * Announces pieces to the server so other downloaders can fetch them
+ * Long lists are split over several HAVE commands
+ * @param clientSocket socket connected to the server
+ * @param rfc_number number of the rfc
+ * @param host host line
+ * @param port local port, the third line
+ * @param content_hash whole-file hash of the version the pieces belong to
+ * @param directory name of this client's directory
+ * @param pieces indexes of the pieces, ascending
+*/
+void announcePieces(int clientSocket, int rfc_number, const char *host, int port, const char *content_hash, const char *directory,
+                    const std::vector<size_t> &pieces) {
+    size_t at = 0;
+    while(at < pieces.size()) {
+        std::string list;
+        while(at < pieces.size() && list.size() < HAVE_LIST_LENGTH) {
+            size_t last = at;
+            while(last + 1 < pieces.size() && pieces[last + 1] == pieces[last] + 1) {
+                last++;
+            }
+            list += (list.empty() ? "" : ",") + std::to_string(pieces[at]);
+            if(last > at) {
+                list += "-" + std::to_string(pieces[last]);
+            }
+            at = last + 1;
+        }
+        std::string message = "HAVE RFC " + std::to_string(rfc_number) + " P2P-CI/1.0 Content-Hash: sha256:" + content_hash +
+                              " Directory: " + directory + " Pieces: " + list + "\n" + host + "\n" + std::to_string(port) + "\n";
+        char response[512];
+        do {
+            sendSwarmCommand(clientSocket, message);
+            recvExact(clientSocket, response, sizeof(response));
+            response[sizeof(response) - 1] = '\0';
+        } while(waitIfLimited(response));
+    }
+}
+
+/**
+ * Records which pieces of a swarm download are on disk
+ * rfc<number>.txt.pieces holds the hash, length and piece size of the
+ * file, then a line with a 0 or 1 for every piece
+ * @param pieces_name path of the progress file
+ * @param map piece map of the download
+ * @param held one entry per piece, nonzero if on disk
+*/
+void saveSwarmProgress(const char *pieces_name, const Swarm_Map *map, const std::vector<char> &held) {
+    FILE *progress = fopen(pieces_name, "w");
+    if(progress == NULL) {
+        return;
+    }
+    fprintf(progress, "%s %lld %lld\n", map->content_hash, map->length, map->piece_size);
+    for(char piece : held) {
+        fputc(piece ? '1' : '0', progress);
+    }
+    fputc('\n', progress);
+    fclose(progress);
+}
+
+/**
+ * Hashes a range of an open file
+ * @param fd open file
+ * @param offset first byte
+ * @param length number of bytes
+ * @param hash destination for the SHA-256 hex digest, at least 65 bytes
+ * @return true if the whole range could be read
+*/
+bool hashRange(int fd, off_t offset, off_t length, char *hash) {
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(context, EVP_sha256(), NULL);
+    char block[65536];
+    off_t done = 0;
+    while(done < length) {
+        ssize_t bytes = pread(fd, block, std::min((off_t)sizeof(block), length - done), offset + done);
+        if(bytes <= 0) {
+            break;
+        }
+        EVP_DigestUpdate(context, block, bytes);
+        done += bytes;
+    }
+    finishHash(context, hash);
+    EVP_MD_CTX_free(context);
+    return done == length;
+}
+
+/**
+ * Downloads an rfc piece by piece, rarest first, from the swarm
+ * The server's piece map counts how many other downloaders hold each
+ * piece; the missing piece held by the fewest is fetched next, ties
+ * broken at random, so downloaders starting together spread over
+ * different pieces and soon serve each other. Pieces are written in place
+ * to rfc<number>.txt.swarm, checked against their hash and announced with
+ * HAVE; rfc<number>.txt.pieces records them so an interrupted download
+ * resumes. The finished file is checked whole and renamed to
+ * rfc<number>.txt, and keeps being served to the swarm from there until
+ * the connection closes.
+ * @param clientSocket socket connected to the server
+ * @param rfc_number number of the rfc
+ * @param host host line
+ * @param os OS line of the piece GETs
+ * @param port local port, the third line of PIECES and HAVE
+ * @param status receives the status line of the last response
+ * @return outcome of the download
+*/
+std::string swarmDownload(int clientSocket, int rfc_number, const char *host, const char *os, int port, std::string *status) {
+    char file_name[32];
+    char swarm_name[48];
+    char pieces_name[48];
+    snprintf(file_name, sizeof(file_name), "rfc%d.txt", rfc_number);
+    snprintf(swarm_name, sizeof(swarm_name), "%s.swarm", file_name);
+    snprintf(pieces_name, sizeof(pieces_name), "%s.pieces", file_name);
+    Swarm_Map map;
+    if(!requestPieces(clientSocket, rfc_number, host, port, &map, status)) {
+        return "";
+    }
+    int fd = open(swarm_name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd == -1) {
+        fail("Trouble opening output file");
+    }
+    if(flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        close(fd);
+        return std::string(file_name) + " is already being fetched from the swarm";
+    }
+
+    // Pieces of the same version already on disk are checked and kept
+    std::vector<char> held(map.hashes.size(), 0);
+    size_t resumed = 0;
+    char recorded_hash[65];
+    long long recorded_length = 0;
+    long long recorded_size = 0;
+    FILE *progress = fopen(pieces_name, "r");
+    if(progress != NULL) {
+        std::string bits(map.hashes.size() + 2, '\0');
+        if(fscanf(progress, "%64s %lld %lld ", recorded_hash, &recorded_length, &recorded_size) == 3 &&
+           strcmp(recorded_hash, map.content_hash) == 0 && recorded_length == map.length && recorded_size == map.piece_size &&
+           fgets(&bits[0], bits.size(), progress) != NULL) {
+            for(size_t piece = 0; piece < held.size() && bits[piece] != '\0'; piece++) {
+                char hash[65];
+                off_t offset = piece * map.piece_size;
+                if(bits[piece] == '1' && hashRange(fd, offset, std::min((long long)map.piece_size, map.length - offset), hash) &&
+                   map.hashes[piece] == hash) {
+                    held[piece] = 1;
+                    resumed++;
+                }
+            }
+        }
+        fclose(progress);
+    }
+    if(resumed == 0 && ftruncate(fd, 0) == -1) {
+        fail("Trouble opening output file");
+    }
+    if(ftruncate(fd, map.length) == -1) {
+        fail("Trouble opening output file");
+    }
+    saveSwarmProgress(pieces_name, &map, held);
+
+    char currentPath[256];
+    if(getcwd(currentPath, sizeof(currentPath)) == nullptr) {
+        fail("getcwd");
+    }
+    const char *directory = extractLastSlash(currentPath);
+    std::vector<size_t> announce;
+    for(size_t piece = 0; piece < held.size(); piece++) {
+        if(held[piece]) {
+            announce.push_back(piece);
+        }
+    }
+    announcePieces(clientSocket, rfc_number, host, port, map.content_hash, directory, announce);
+
+    unsigned int seed = (unsigned int)(time(NULL) ^ getpid() ^ (clientSocket << 16));
+    size_t fetched = 0;
+    size_t from_swarm = 0;
+    std::string piece_data;
+    while(true) {
+        // Rarest missing piece, a random one among equally rare pieces
+        std::vector<size_t> rarest;
+        for(size_t piece = 0; piece < held.size(); piece++) {
+            if(held[piece]) {
+                continue;
+            }
+            if(!rarest.empty() && map.counts[piece] < map.counts[rarest[0]]) {
+                rarest.clear();
+            }
+            if(rarest.empty() || map.counts[piece] == map.counts[rarest[0]]) {
+                rarest.push_back(piece);
+            }
+        }
+        if(rarest.empty()) {
+            break;
+        }
+        size_t piece = rarest[rand_r(&seed) % rarest.size()];
+
+        std::string message = "GET RFC " + std::to_string(rfc_number) + " P2P-CI/1.0 Accept-Encoding: identity Piece: " +
+                              std::to_string(piece) + "\n" + host + "\n" + os + "\n";
+        char header[512];
+        do {
+            sendSwarmCommand(clientSocket, message);
+            recvExact(clientSocket, header, sizeof(header));
+            header[sizeof(header) - 1] = '\0';
+        } while(waitIfLimited(header));
+        *status = std::string(header).substr(0, std::string(header).find('\n'));
+        if(strncmp(header, "P2P-CI/1.0 206", 14) != 0 || strstr(header, "Transfer-Encoding: chunked") == NULL) {
+            close(fd);
+            return std::string("Swarm download of ") + file_name + " stopped, " + std::to_string(fetched) + " pieces kept";
+        }
+        long long start = 0;
+        const char *range_header = strstr(header, "Content-Range: bytes ");
+        if(range_header != NULL) {
+            sscanf(range_header, "Content-Range: bytes %lld", &start);
+        }
+        piece_data.clear();
+        char chunk[16384];
+        for(size_t length = recvChunkSize(clientSocket); length != 0; length = recvChunkSize(clientSocket)) {
+            while(length > 0) {
+                size_t part = std::min(length, sizeof(chunk));
+                recvExact(clientSocket, chunk, part);
+                piece_data.append(chunk, part);
+                length -= part;
+            }
+        }
+
+        EVP_MD_CTX *context = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(context, EVP_sha256(), NULL);
+        EVP_DigestUpdate(context, piece_data.data(), piece_data.size());
+        char hash[65];
+        finishHash(context, hash);
+        EVP_MD_CTX_free(context);
+        if(map.hashes[piece] != hash || start != (long long)(piece * map.piece_size) ||
+           pwrite(fd, piece_data.data(), piece_data.size(), start) != (ssize_t)piece_data.size()) {
+            close(fd);
+            return std::string("Piece ") + std::to_string(piece) + " of " + file_name + " failed its check, " +
+                   std::to_string(fetched) + " pieces kept";
+        }
+        held[piece] = 1;
+        fetched++;
+        if(strstr(header, "Piece-Source: swarm") != NULL) {
+            from_swarm++;
+        }
+        saveSwarmProgress(pieces_name, &map, held);
+        announcePieces(clientSocket, rfc_number, host, port, map.content_hash, directory, std::vector<size_t>(1, piece));
+
+        // Fresh counts steer later pieces away from what others just fetched
+        if(fetched % SWARM_REFRESH == 0) {
+            Swarm_Map fresh;
+            std::string refresh_status;
+            if(requestPieces(clientSocket, rfc_number, host, port, &fresh, &refresh_status) &&
+               strcmp(fresh.content_hash, map.content_hash) == 0) {
+                map.counts = fresh.counts;
+            }
+        }
+    }
+
+    char whole[65];
+    bool complete = hashRange(fd, 0, map.length, whole) && strcmp(whole, map.content_hash) == 0;
+    if(!complete) {
+        unlink(swarm_name);
+        unlink(pieces_name);
+        close(fd);
+        return std::string("Integrity check failed for ") + file_name + ", file removed";
+    }
+    // Renaming also replaces an earlier download that is a hardlink into the server's store
+    if(rename(swarm_name, file_name) == -1) {
+        fail("Trouble saving output file");
+    }
+    unlink(pieces_name);
+    close(fd);
+    std::string outcome = std::string("Saved ") + file_name + ": " + std::to_string(map.length) + " bytes in " +
+                          std::to_string(held.size()) + " pieces, " + std::to_string(from_swarm) + " from other downloaders";
+    if(resumed > 0) {
+        outcome += ", " + std::to_string(resumed) + " already on disk";
+    }
+    return outcome;
+}
+
+/**
+ * Opens and registers a connection of a script's pool
+ * @param conn connection, its socket and port are set
+*/
+void openScriptConn(Script_Conn *conn) {
+    conn->socket = connectToServer(conn->port_of_server);
+    conn->wire_strings.clear();
+    registerDirectory(conn->socket, conn->first, conn->pool->wire ? &conn->wire_strings : NULL);
+    struct sockaddr_in local;
+    socklen_t local_length = sizeof(local);
+    getsockname(conn->socket, (struct sockaddr *)&local, &local_length);
+    conn->port = ntohs(local.sin_port);
+}
+
+/**
+ * Sends one operation of a script and waits for its whole response
+ * The host line and the port or OS line are filled in. GET without
+ * Accept-Encoding asks for a deflate body, so any connection of the pool
+ * can save the file. SWARM downloads the file piece by piece.
+ * @param conn connection to run the operation on
+ * @param op operation, its status, response and latency are filled in
+*/
+void runOperation(Script_Conn *conn, Script_Op *op) {
+    Script_Pool *pool = conn->pool;
+    char command[12];
+    char selector[256];
+    command[0] = selector[0] = '\0';
+    sscanf(op->request.c_str(), "%11s%*s%255s", command, selector);
+    bool get = strcmp(command, "GET") == 0;
+    // SWARM runs its own PIECES, GET and HAVE commands on the connection
+    bool swarm = strcmp(command, "SWARM") == 0;
+    std::string message = op->request;
+    if(get && message.find("Accept-Encoding:") == std::string::npos) {
+        message += " Accept-Encoding: deflate";
+    }
+    int get_rfc = 0;
+    Partial_Download download;
+    bool downloading = get && sscanf(op->request.c_str(), "GET RFC %d", &get_rfc) == 1;
+    if(downloading) {
+        off_t resume = beginDownload(get_rfc, conn->socket, &download);
+        if(resume > 0) {
+            message += " Range: bytes=" + std::to_string(resume) + "-";
+        }
+    }
+    message += std::string("\n") + pool->host + "\n" + (get ? std::string(pool->os) : std::to_string(conn->port)) + "\n";
+    std::string frame;
+    int opcode = pool->wire ? encodeWire(op->request.c_str(), frame) : 0;
+    if(opcode != 0) {
+        message = frame;
+    }
+
+    answerHeartbeats(conn->socket);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(!swarm && sendServer(conn->socket, message.data(), message.size(), MSG_NOSIGNAL) != (ssize_t)message.size()) {
+        fail("Server closed the connection.");
+    }
+
+    char buffer[1024];
+    bool conditional = strcmp(command, "LIST") == 0 && op->request.find("If-None-Match:") != std::string::npos;
+    int swarm_rfc = 0;
+    if(swarm) {
+        std::string outcome;
+        if(sscanf(op->request.c_str(), "SWARM RFC %d", &swarm_rfc) == 1) {
+            outcome = swarmDownload(conn->socket, swarm_rfc, pool->host, pool->os, conn->port, &op->status);
+        } else {
+            op->status = "Usage: SWARM RFC <number> P2P-CI/1.0";
+        }
+        op->response = op->status;
+        if(!outcome.empty()) {
+            op->status += ", " + outcome;
+        }
+        op->failed = outcome.compare(0, 5, "Saved") != 0;
+    } else if(opcode != 0) {
+        op->response = recvWire(conn->socket, opcode, conn->wire_strings, &op->bytes);
+        op->status = op->response.substr(0, op->response.find('\n'));
+        if(opcode == WIRE_LIST) {
+            long rows = std::count(op->response.begin(), op->response.end(), '\n') - 3;
+            op->status += " (" + std::to_string(rows > 0 ? rows : 0) + " rows)";
+        }
+    } else if((strcmp(command, "LOOKUP") == 0 && strpbrk(selector, "-,") != NULL) || conditional || strcmp(command, "PIECES") == 0) {
+        //Range and batch LOOKUP, conditional LIST and PIECES responses are streamed until END
+        while(op->response.compare(0, 4, "END\n") != 0 && op->response.find("\nEND\n") == std::string::npos) {
+            ssize_t bytes = recvServer(conn->socket, buffer, sizeof(buffer), 0);
+            if(bytes <= 0) {
+                fail("Server closed the connection.");
+            }
+            op->response.append(buffer, bytes);
+        }
+        op->bytes = op->response.size();
+        long header_lines = strcmp(command, "PIECES") == 0 ? 6 : conditional ? 3 : 2;
+        long rows = std::count(op->response.begin(), op->response.end(), '\n') - header_lines;
+        op->status = op->response.substr(0, op->response.find('\n'));
+        op->status += " (" + std::to_string(rows > 0 ? rows : 0) + " rows)";
+    } else if(downloading) {
+        char header[512];
+        std::string outcome = receiveEncodedGet(conn->socket, &download, header);
+        op->response = header;
+        op->status = op->response.substr(0, op->response.find('\n'));
+        if(!outcome.empty()) {
+            op->status += ", " + outcome;
+        }
+        op->failed = outcome.compare(0, 5, "Saved") != 0;
     } else {
-        fail("Failed to open directory.");
+        char fixed[512];
+        recvExact(conn->socket, fixed, sizeof(fixed));
+        op->bytes = sizeof(fixed);
+        fixed[sizeof(fixed) - 1] = '\0';
+        op->response = fixed;
+        op->status = op->response.substr(0, op->response.find('\n'));
+    }
+
+    struct timespec finish;
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    op->milliseconds = (finish.tv_sec - start.tv_sec) * 1000.0 + (finish.tv_nsec - start.tv_nsec) / 1e6;
+    // Errors are status lines, successful LOOKUP and ADD start with Title:
+    if(op->status.compare(0, 11, "P2P-CI/1.0 ") == 0 && op->status.compare(0, 14, "P2P-CI/1.0 200") != 0 &&
+       op->status.compare(0, 14, "P2P-CI/1.0 206") != 0 && op->status.compare(0, 14, "P2P-CI/1.0 304") != 0) {
+        op->failed = true;
+        // The server drops the connection after a failed GET, but not after a 429
+        if((get || swarm) && op->status.compare(0, 14, "P2P-CI/1.0 429") != 0) {
+            closeServer(conn->socket);
+            openScriptConn(conn);
+        }
+    }
+}
+
+/**
+ * Thread function running operations of the current phase on one
+ * connection until none are left
+ * @param arg connection of the pool
+*/
+void *runScriptConnection(void *arg) {
+    Script_Conn *conn = (Script_Conn *)arg;
+    Script_Pool *pool = conn->pool;
+    while(true) {
+        Script_Op *op = NULL;
+        pthread_mutex_lock(&pool->lock);
+        Script_Phase *phase = pool->phase;
+        if(conn->first && phase->next_add < phase->adds.size()) {
+            op = phase->adds[phase->next_add++];
+        } else if(phase->next_other < phase->others.size()) {
+            op = phase->others[phase->next_other++];
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if(op == NULL) {
+            return NULL;
+        }
+
+        runOperation(conn, op);
+        pthread_mutex_lock(&pool->lock);
+        printf("%9.2f ms  %s%s  <- %s\n", op->milliseconds, op->failed ? "FAILED " : "", op->status.c_str(), op->request.c_str());
+        if(pool->verbose) {
+            printReceived(conn->socket, op->response.data(), op->response.size());
+            std::cout << std::endl;
+        }
+        fflush(stdout);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/**
+ * Runs a script of commands over a small pool of persistent connections
+ * Each line is the first line of a command, the host, port and OS lines
+ * are filled in. Operations run concurrently in no particular order, a
+ * WAIT line lets every earlier operation finish before later ones start.
+ * @param port server port
+ * @param host host line sent with every command
+ * @param lines script lines
+ * @param connections number of connections, the first registers the directory
+ * @param verbose print every response in full
+ * @param wire send LOOKUP, ADD and LIST as binary frames
+ * @return 0 if every operation succeeded, 1 otherwise
+*/
+int runScript(int port, const char *host, std::vector<std::string> &lines, int connections, bool verbose, bool wire) {
+    std::vector<Script_Op> ops;
+    ops.reserve(lines.size());
+    std::vector<Script_Phase> phases(1);
+    for(std::string &line : lines) {
+        line.erase(line.find_last_not_of(" \t\r\n") + 1);
+        line.erase(0, line.find_first_not_of(" \t"));
+        if(line.empty() || line[0] == '#') {
+            continue;
+        }
+        if(line == "WAIT") {
+            phases.push_back(Script_Phase());
+            continue;
+        }
+        if(line.compare(0, 9, "SUBSCRIBE") == 0 || line.compare(0, 11, "UNSUBSCRIBE") == 0) {
+            fail("SUBSCRIBE is only available interactively.");
+        }
+        ops.push_back(Script_Op());
+        ops.back().request = line;
+        ops.back().milliseconds = 0;
+        ops.back().bytes = 0;
+        ops.back().failed = false;
+        std::vector<Script_Op *> &queue = line.compare(0, 4, "ADD ") == 0 ? phases.back().adds : phases.back().others;
+        queue.push_back(&ops.back());
+    }
+
+    Script_Pool pool;
+    pthread_mutex_init(&pool.lock, NULL);
+    pool.host = host;
+    pool.verbose = verbose;
+    pool.wire = wire;
+    readOS(pool.os, sizeof(pool.os));
+
+    std::vector<Script_Conn> pool_conns(connections);
+    for(int i = 0; i < connections; i++) {
+        pool_conns[i].pool = &pool;
+        pool_conns[i].port_of_server = port;
+        pool_conns[i].first = i == 0;
+        openScriptConn(&pool_conns[i]);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(Script_Phase &phase : phases) {
+        phase.next_add = phase.next_other = 0;
+        pool.phase = &phase;
+        std::vector<pthread_t> threads(connections);
+        for(int i = 0; i < connections; i++) {
+            if(pthread_create(&threads[i], NULL, runScriptConnection, &pool_conns[i]) != 0) {
+                fail("Thread incorrect");
+            }
+        }
+        for(int i = 0; i < connections; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    struct timespec finish;
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    for(Script_Conn &conn : pool_conns) {
+        closeServer(conn.socket);
+    }
+
+    //Summary with latency percentiles
+    double seconds = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
+    std::vector<double> latencies;
+    int failed = 0;
+    size_t bytes = 0;
+    size_t measured = 0;
+    for(Script_Op &op : ops) {
+        latencies.push_back(op.milliseconds);
+        failed += op.failed;
+        bytes += op.bytes;
+        measured += op.bytes != 0;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    printf("%zu operations, %d failed, %.3f s over %d connections\n", ops.size(), failed, seconds, connections);
+    if(!latencies.empty()) {
+        double total = 0;
+        for(double latency : latencies) {
+            total += latency;
+        }
+        printf("latency ms: min %.2f, avg %.2f, p50 %.2f, p99 %.2f, max %.2f\n", latencies.front(), total / latencies.size(),
+               latencies[latencies.size() / 2], latencies[(latencies.size() * 99) / 100], latencies.back());
+    }
+    if(measured != 0) {
+        printf("%.3f operations/s, %.1f bytes per response (GET excluded)\n", ops.size() / seconds, (double)bytes / measured);
+    }
+    if(tls_context != NULL) {
+        printf("%d TLS handshakes, %d resumed\n", tls_handshakes, tls_resumed);
+    }
+    return failed == 0 ? 0 : 1;
+}
+
+/**
+ * Main function of client
+ * Without a script the client is interactive, commands are read from
+ * standard input with prompts for the host and port or OS lines
+ * @param argc number of arguments
+ * @param argv [-f script] [-c connections] [-H host] [-v] [-b] [-T ca_file] [port] [command ...],
+ *             a script is a file of command lines, - for standard input,
+ *             -b sends LOOKUP, ADD and LIST as binary frames,
+ *             -T connects with TLS, checking the server against ca_file
+*/
+int main( int argc, char *argv[] ) {
+
+    int port = PORT;
+    const char *script = NULL;
+    int connections = SCRIPT_CONNECTIONS;
+    const char *host = "localhost";
+    bool verbose = false;
+    bool wire = false;
+    int option;
+    while((option = getopt(argc, argv, "f:c:H:vbT:")) != -1) {
+        if(option == 'f') {
+            script = optarg;
+        } else if(option == 'c' && atoi(optarg) > 0) {
+            connections = atoi(optarg);
+        } else if(option == 'H') {
+            host = optarg;
+        } else if(option == 'v') {
+            verbose = true;
+        } else if(option == 'b') {
+            wire = true;
+        } else if(option == 'T') {
+            initTLS(optarg);
+        } else {
+            fail("usage: client [-f script] [-c connections] [-H host] [-v] [-b] [-T ca_file] [port] [command ...]");
+        }
+    }
+    if(optind < argc && isdigit((unsigned char)argv[optind][0])) {
+        port = atoi(argv[optind++]);
+    }
+
+    //Scripted mode, commands come from the script file and the arguments
+    if(script != NULL || optind < argc) {
+        std::vector<std::string> lines;
+        if(script != NULL) {
+            FILE *input = strcmp(script, "-") == 0 ? stdin : fopen(script, "r");
+            if(input == NULL) {
+                fail("Failed to open the script.");
+            }
+            char line[512];
+            while(fgets(line, sizeof(line), input) != NULL) {
+                lines.push_back(line);
+            }
+            if(input != stdin) {
+                fclose(input);
+            }
+        }
+        for(int i = optind; i < argc; i++) {
+            lines.push_back(argv[i]);
+        }
+        return runScript(port, host, lines, connections, verbose, wire);
     }
 
+    int clientSocket = connectToServer(port);
+    std::vector<std::string> wire_strings;
+    registerDirectory(clientSocket, true, wire ? &wire_strings : NULL);
+
     char hostname[128];
     gethostname(hostname, sizeof(hostname));
 
     // Communication with the server
-    char end[] = "END";
-    send(clientSocket, end, strlen(end), 0);
     char buffer[1024];
     char input[512];
     char inputToSend[1024];
     bool OS_flag = false;
-    char command[7];
+    char command[12];
 
+    //Unbuffered so polling standard input sees every pending command
+    setvbuf(stdin, NULL, _IONBF, 0);
 
     //Loop for client-server communication 
     while( true ) {
             memset(buffer, 0, sizeof(buffer));
             memset(inputToSend,'\0', sizeof(inputToSend));
             memset(input,'\0', sizeof(input));
+            std::string frame;
+            int opcode = 0;
+            Partial_Download download;
+            bool downloading = false;
+            bool swarm = false;
 
         //Loop for input
         for(int i = 0; i < 3; i++) {
             if(i == 0) {
+                waitForInput(clientSocket);
                 fgets(input, sizeof(input), stdin);
-                sscanf(input, "%s", command);
+                command[0] = '\0';
+                sscanf(input, "%11s", command);
                 // std::cout << "   YOUR COMMAND: '" << command << "'" << std::endl; 
                 if(strncmp( "GET ", command, 3) == 0) {
                     OS_flag = true;
                 }
+                //SWARM asks for the OS of its piece GETs and sends nothing itself
+                swarm = strcmp(command, "SWARM") == 0;
+                if( swarm ) {
+                    OS_flag = true;
+                }
+                //An in-band GET continues a download that was cut off
+                int get_rfc = 0;
+                if( strstr(input, "Accept-Encoding:") != NULL && sscanf(input, "GET RFC %d", &get_rfc) == 1 ) {
+                    downloading = true;
+                    off_t resume = beginDownload(get_rfc, clientSocket, &download);
+                    char *newline = strchr(input, '\n');
+                    if( resume > 0 && newline != NULL ) {
+                        snprintf(newline, sizeof(input) - (newline - input), " Range: bytes=%lld-\n", (long long)resume);
+                    }
+                }
             }
             //First line
             if(i == 1) {
@@ -243,18 +1853,89 @@ int main() {
             }
             //Send
             strcat(inputToSend, input); 
-            if( i == 2 ) { 
-                send(clientSocket , inputToSend, strlen(inputToSend), 0);
+            if( i == 2 && swarm ) {
+                memset(input, '\0', sizeof(input));
+            } else if( i == 2 && wire && (opcode = encodeWire(inputToSend, frame)) != 0 ) {
+                sendServer(clientSocket, frame.data(), frame.size(), 0);
+                memset(input, '\0', sizeof(input));
+            } else if( i == 2 ) { 
+                sendServer(clientSocket , inputToSend, strlen(inputToSend), 0);
                 memset(input, '\0', sizeof(input));
             } 
         }
 
-            recv(clientSocket, &buffer, sizeof( buffer ), 0);
-            std::cout << buffer << std::endl;
+            if( swarm ) {
+                int swarm_rfc = 0;
+                char swarm_host[128];
+                char swarm_os[64];
+                swarm_host[0] = swarm_os[0] = '\0';
+                char *host_line = strchr(inputToSend, '\n');
+                if( sscanf(inputToSend, "SWARM RFC %d", &swarm_rfc) != 1 || host_line == NULL ||
+                    sscanf(host_line + 1, "%127s%63s", swarm_host, swarm_os) != 2 ) {
+                    std::cout << "Usage: SWARM RFC <number> P2P-CI/1.0" << std::endl << std::endl;
+                    continue;
+                }
+                struct sockaddr_in local;
+                socklen_t local_length = sizeof(local);
+                getsockname(clientSocket, (struct sockaddr *)&local, &local_length);
+                std::string status;
+                std::string outcome = swarmDownload(clientSocket, swarm_rfc, swarm_host, swarm_os, ntohs(local.sin_port), &status);
+                std::cout << status << std::endl;
+                if( !outcome.empty() ) {
+                    std::cout << outcome << std::endl;
+                }
+                std::cout << std::endl;
+                continue;
+            }
+
+            //Binary responses are shown in their text form
+            if( opcode != 0 ) {
+                size_t bytes = 0;
+                std::cout << recvWire(clientSocket, opcode, wire_strings, &bytes) << std::endl;
+                continue;
+            }
+
+            //Range and batch LOOKUP, conditional LIST and PIECES responses are streamed until END
+            char lookup_command[7];
+            char selector[256];
+            lookup_command[0] = selector[0] = '\0';
+            sscanf(inputToSend, "%6s%*s%255s", lookup_command, selector);
+            char *match = strstr(inputToSend, "If-None-Match:");
+            bool conditional = strcmp(lookup_command, "LIST") == 0 && match != NULL && match < strchr(inputToSend, '\n');
+            if( (strcmp(lookup_command, "LOOKUP") == 0 && strpbrk(selector, "-,") != NULL) || conditional ||
+                strcmp(lookup_command, "PIECES") == 0 ) {
+                std::string streamed;
+                while( streamed.compare(0, 4, "END\n") != 0 && streamed.find("\nEND\n") == std::string::npos ) {
+                    ssize_t bytes = recvServer(clientSocket, buffer, sizeof(buffer), 0);
+                    if( bytes <= 0 ) {
+                        fail("Server closed the connection.");
+                    }
+                    streamed.append(buffer, bytes);
+                    printReceived(clientSocket, buffer, bytes);
+                }
+                std::cout << std::endl;
+                continue;
+            }
+
+            //GET with Accept-Encoding carries the file body on this connection
+            if( downloading ) {
+                char header[512];
+                std::string outcome = receiveEncodedGet(clientSocket, &download, header);
+                printReceived(clientSocket, header, sizeof(header));
+                if( !outcome.empty() ) {
+                    std::cout << outcome << std::endl;
+                }
+                std::cout << std::endl;
+                continue;
+            }
+
+            ssize_t bytes = recvServer(clientSocket, &buffer, sizeof( buffer ), 0);
+            printReceived(clientSocket, buffer, bytes);
+            std::cout << std::endl;
     }
 
 
-    close(clientSocket);
+    closeServer(clientSocket);
 
     return 0;
 }
\ No newline at end of file
@@ -9,11 +9,165 @@
 #include <string>
 #include <netdb.h>
 #include <vector> 
+#include <map>
+#include <algorithm>
+#include <cctype>
+#include <deque>
+#include <atomic>
+#include <netinet/tcp.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <cstdint>
+#include <new>
 #include <ctime>
+#include <zlib.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <sys/sendfile.h>
+#include <coroutine>
+#include <memory>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/signalfd.h>
+#include <csignal>
+#include <set>
+#include <climits>
+#include <sched.h>
+#include <linux/mempolicy.h>
+#include <functional>
+#include <list>
+#include <linux/futex.h>
 
 #define PORT 7734
 
+/** Holder sets at or below this size are scanned for the least loaded peer,
+ *  larger sets use two random choices */
+#define HOLDER_SCAN_LIMIT 4
+/** Seconds after which a peer's recent bytes served are halved */
+#define RECENT_BYTES_HALF_LIFE 30
+/** A new RTT sample moves a peer's smoothed RTT by 1/2^RTT_SMOOTHING_SHIFT
+ *  of the difference, as TCP does */
+#define RTT_SMOOTHING_SHIFT 3
+/** Smoothed RTTs within this many microseconds rank as equally near,
+ *  the less loaded holder wins */
+#define RTT_TOLERANCE_US 1000
+/** Suffix of a LOOKUP or GET request line asking for the nearest holder */
+#define PREFER_NEAREST "Prefer: nearest"
+/** Number of independently locked partitions of the RFC registry */
+#define RFC_SHARDS 16
+/** RFC nodes allocated at once when a shard's free list runs dry */
+#define RFC_SLAB_SIZE 64
+/** Results returned by SEARCH when no LIMIT is given, and the cap on LIMIT */
+#define SEARCH_DEFAULT_LIMIT 10
+#define SEARCH_MAX_LIMIT 100
+/** Bytes of rows gathered under the catalog lock per range LOOKUP send */
+#define LOOKUP_CHUNK_SIZE 4096
+/** Default seconds a client has to send its OS and RFC list */
+#define HANDSHAKE_TIMEOUT 10
+/** Default seconds without any message before a client is evicted,
+ *  a heartbeat is sent after half of it */
+#define IDLE_TIMEOUT 120
+/** Slots in the connection timer wheel, one per second */
+#define WHEEL_SLOTS 64
+/** TCP keepalive probe interval and count on client sockets */
+#define KEEPALIVE_INTERVAL 5
+#define KEEPALIVE_COUNT 3
+/** Queued output above which a handler stops producing and reading
+ *  requests until the client drains it to the low watermark */
+#define OUTBOX_HIGH_WATER (64 * 1024)
+#define OUTBOX_LOW_WATER (16 * 1024)
+/** Queued output at which a client that does not read is disconnected,
+ *  reached only by pushed events and heartbeats */
+#define OUTBOX_LIMIT (1024 * 1024)
+/** Default commands per second a peer address may send over all its
+ *  connections, LOOKUP, SEARCH, ADD and SUBSCRIBE share one bucket that
+ *  holds two seconds' worth */
+#define CHEAP_RATE 100
+/** Default LIST and GET commands per second a peer address may send */
+#define EXPENSIVE_RATE 10
+/** Slots of the shared table of rate limit buckets, one per peer address */
+#define PEER_BUCKETS 4096
+/** Slots an address may occupy, starting at the one its hash picks */
+#define PEER_BUCKET_PROBE 8
+/** Default LIST and GET commands running at once in a worker */
+#define EXPENSIVE_LIMIT 64
+/** Bytes reserved for the registry segment, only touched pages use memory */
+#define REGISTRY_SIZE (256UL << 20)
+/** Registry changes kept for SUBSCRIBE notifiers, a notifier further
+ *  behind than this skips the oldest */
+#define EVENT_RING 16384
+/** Upper bound on -w worker processes */
+#define MAX_WORKERS 64
+/** NUMA nodes described by the masks given to mbind and set_mempolicy */
+#define NUMA_MAX_NODES 1024
+/** Submission queue entries of each event loop's io_uring */
+#define URING_ENTRIES 256
+/** Threads of each process running blocking calls for the event loops */
+#define OFFLOAD_THREADS 4
+/** Points each cluster member gets on the consistent hash ring */
+#define RING_POINTS 64
+/** Greeting a server sends instead of an OS when it opens a cluster link */
+#define CLUSTER_GREETING "PEER P2P-CI/1.0"
+/** Requests for a file before its compressed GET body is cached */
+#define COMPRESS_CACHE_AFTER 2
+/** Upper bound on the memory held by cached compressed bodies */
+#define COMPRESS_CACHE_BYTES (16UL << 20)
+/** Upper bound on the files the compressed body cache keeps request counts for */
+#define COMPRESS_CACHE_FILES 4096
+/** Chunk size of encoded GET bodies */
+#define COMPRESS_CHUNK_SIZE 16384
+/** Chunk size of identity GET bodies sent straight from the page cache */
+#define SENDFILE_CHUNK_SIZE (1 << 20)
+/** First byte of a TLS handshake record, no OS line or greeting starts with it */
+#define TLS_HANDSHAKE_RECORD 0x16
+/** Bytes of the session ticket name and keys a new server takes over */
+#define TLS_TICKET_KEYS_LENGTH 80
+/** Smallest piece a file is split into for swarm downloads */
+#define SWARM_PIECE_SIZE (256 * 1024)
+/** Most pieces of one file, larger files get larger pieces */
+#define SWARM_MAX_PIECES 1024
+/** Files whose piece hashes each worker keeps */
+#define PIECE_CACHE_FILES 64
+/** Directory of the content-addressed store for downloaded rfcs */
+#define RFC_STORE_DIR ".rfc_store"
+/** Suffix of the OS line asking for binary LOOKUP, ADD and LIST frames */
+#define WIRE_OFFER " Encoding: binary"
+/** Opcodes of binary request frames, all below any text command's first byte */
+#define WIRE_LOOKUP 1
+#define WIRE_ADD 2
+#define WIRE_LIST 3
+/** Largest payload of a binary request frame */
+#define WIRE_MAX_REQUEST 16
+/** Seconds a stopping server waits for running commands before dropping
+ *  the connections still in them */
+#define DRAIN_TIMEOUT 30
+/** Environment variable naming the socket a new server receives the
+ *  listener, registry and connections of the one it replaces on */
+#define HANDOFF_ENV "P2P_HANDOFF"
+/** Largest message on the handoff socket: a connection's buffered bytes
+ *  and subscription ranges */
+#define HANDOFF_MESSAGE_SIZE 4096
+/** Directory registry snapshots are written to by DUMP and SIGUSR1 */
+#define DUMP_DIR ".registry_dumps"
+/** First bytes and format version of a registry snapshot file */
+#define DUMP_MAGIC "P2PDUMP\0"
+#define DUMP_VERSION 1
+/** Column types of a registry snapshot file */
+#define DUMP_INT32 1
+#define DUMP_INT64 2
+#define DUMP_STRING 3
+/** Passes over the shards a snapshot makes looking for one in which no
+ *  shard changed, the last pass is kept even if one did */
+#define SNAPSHOT_ATTEMPTS 4
+
 /**
  * Failing function to print to standard output 
 */
@@ -22,12 +176,31 @@ static void fail( char const *message ) {
   exit( 1 );
 }
 
+// The client and RFC registries live in one mapped segment shared by every
+// worker process. Links are byte offsets from the start of the segment so
+// they stay valid wherever it is mapped, 0 is the NULL offset.
+typedef uint32_t Shm_Offset;
+
 //Structure for Client Node
 struct Client_Node {
     char hostname[254];
     int port_number;
     char os_string[32];
-    struct Client_Node *next;
+    // Worker process serving the client's connection, 0 for a peer that
+    // is connected to another cluster member
+    pid_t worker;
+    // Directory of the peer, recorded from its first uploaded rfc
+    char path[20];
+    // Load counters used when choosing which holder serves a GET
+    int active_transfers;
+    long bytes_served;
+    long recent_bytes;
+    time_t recent_stamp;
+    // Address of the connection and smoothed round trip time to it in
+    // microseconds, both 0 until known, used to pick the nearest holder
+    in_addr_t address;
+    long rtt_us;
+    Shm_Offset next;
 };
 
 //Structure for RFC Node
@@ -37,265 +210,1374 @@ struct RFC_Node {
     char hostname[254];
     int port_number;
     char path[20];
-    struct RFC_Node *next;
+    // SHA-256 of the holder's file, declared at registration or computed
+    // when first needed. A declared hash has hash_size -1 until the file
+    // has been checked against it, after that it is valid while the file
+    // keeps the mtime (in nanoseconds) and size it had when hashed
+    char content_hash[65];
+    long long hash_mtime;
+    off_t hash_size;
+    // Hash declared at registration, never changed afterwards; every
+    // rehash of the file must match it. Empty when none was declared
+    char registered_hash[65];
+    Shm_Offset next;
+    // Next holder of the same rfc number in its RFC_Entry
+    Shm_Offset next_holder;
+    // Client node the holder was last found at, only trusted while that
+    // node still has the holder's port, 0 until the holder is first chosen
+    Shm_Offset peer;
+};
+
+//Structure for an RFC index entry, one per rfc number
+struct RFC_Entry {
+    int rfc_number;
+    char title[80];
+    int holder_count;
+    Shm_Offset holders;
+    Shm_Offset next;
+};
+
+//Structure for the pieces a swarm downloader holds of one rfc
+struct Swarm_Peer {
+    int rfc_number;
+    int port_number;
+    // Directory of the downloader, its partial file is rfc<number>.txt.swarm
+    char path[20];
+    // Whole-file hash of the version the pieces belong to
+    char content_hash[65];
+    uint8_t pieces[SWARM_MAX_PIECES / 8];
+    Shm_Offset next;
+};
+
+//Structure for one partition of the RFC registry, keyed by rfc number
+struct RFC_Shard {
+    pthread_mutex_t lock;
+    Shm_Offset rfc_list;
+    Shm_Offset rfc_index;
+    // Shard-local allocator, recycled nodes and entries chained through next
+    Shm_Offset free_nodes;
+    Shm_Offset free_entries;
+    // Swarm downloaders of the shard's rfcs, recycled ones chained through next
+    Shm_Offset swarm_peers;
+    Shm_Offset free_swarm;
+    // Advanced whenever rfc_list changes, dates every worker's cached LIST rows
+    unsigned long generation;
+};
+
+//Structure for the rate limit buckets of one peer address, shared by all
+//of its connections in every worker
+struct Peer_Buckets {
+    in_addr_t address;
+    bool used;
+    double cheap_tokens;
+    double expensive_tokens;
+    // Monotonic microseconds of the last refill
+    long refilled;
 };
 
-// Creation of global linked lists
-Client_Node* client_list = NULL;
-RFC_Node* rfc_list = NULL;
+//Structure for a registry change pushed to SUBSCRIBE connections
+struct RFC_Event {
+    bool added;
+    int rfc_number;
+    char hostname[254];
+    int port_number;
+};
+
+//Structure at the start of the registry segment
+struct Registry {
+    /** Mutex lock for the client list and peer load counters
+     *  When both are needed a shard lock is always taken before this one */
+    pthread_mutex_t lock;
+    Shm_Offset client_list;
+    Shm_Offset free_clients;
+    // Bump allocator handing out slabs to the shards and client list
+    pthread_mutex_t alloc_lock;
+    size_t used;
+    // Advanced whenever an rfc number appears or disappears, in any worker
+    std::atomic<unsigned long> catalog_generation;
+    // Advanced with any shard generation, sent to clients as the LIST ETag
+    std::atomic<unsigned long> list_generation;
+    RFC_Shard shards[RFC_SHARDS];
+    // Taken only around a bucket update, never with another registry lock
+    pthread_mutex_t buckets_lock;
+    Peer_Buckets buckets[PEER_BUCKETS];
+    /** Mutex lock for the event ring, never held with another lock */
+    pthread_mutex_t events_lock;
+    // Changes published by any worker, the newest at events_published - 1
+    unsigned long events_published;
+    // Low bits of events_published that notifiers sleep on with FUTEX_WAIT,
+    // a condition variable stays blocked once a waiting worker is killed
+    std::atomic<uint32_t> events_futex;
+    RFC_Event events[EVENT_RING];
+};
+
+// Creation of the shared registry
+char *registry_base = NULL;
+Registry *registry = NULL;
+// Memory file holding the registry, handed to the server replacing this one
+int registry_fd = -1;
+
+/**
+ * Converts a registry offset to a pointer
+ * @param offset offset into the registry segment, 0 for NULL
+ * @return pointer into the segment or NULL
+*/
+template <typename T>
+T* fromOffset( Shm_Offset offset ) {
+  return offset == 0 ? NULL : (T *)(registry_base + offset);
+}
+
+/**
+ * Converts a pointer into the registry segment to an offset
+ * @param pointer pointer into the segment or NULL
+ * @return offset into the segment, 0 for NULL
+*/
+Shm_Offset toOffset( const void *pointer ) {
+  return pointer == NULL ? 0 : (Shm_Offset)((const char *)pointer - registry_base);
+}
+
+/**
+ * Locks a registry mutex
+ * The mutexes are robust, so a worker that died holding one only costs the
+ * update it was making; the next owner marks the mutex usable again
+ * @param mutex shard, client or allocator lock
+*/
+void lockRegistry( pthread_mutex_t *mutex ) {
+  if( pthread_mutex_lock(mutex) == EOWNERDEAD ) {
+    pthread_mutex_consistent(mutex);
+  }
+}
+
+/**
+ * Unlocks a registry mutex
+ * @param mutex shard, client or allocator lock
+*/
+void unlockRegistry( pthread_mutex_t *mutex ) {
+  pthread_mutex_unlock(mutex);
+}
+
+/**
+ * Carves a slab of same-sized objects out of the registry segment and
+ * chains them into a free list through their next field
+ * @param size size of one object
+ * @param count number of objects
+ * @param next_field byte offset of the Shm_Offset next field in the object
+ * @param free_list free list to push the objects on, caller holds its lock
+*/
+void allocSlab( size_t size, int count, size_t next_field, Shm_Offset *free_list ) {
+  lockRegistry(&registry->alloc_lock);
+  size_t start = (registry->used + 7) & ~(size_t)7;
+  if( start + size * count > REGISTRY_SIZE ) {
+    fail("Registry segment exhausted");
+  }
+  registry->used = start + size * count;
+  unlockRegistry(&registry->alloc_lock);
+
+  for( int i = 0; i < count; i++ ) {
+    char *object = registry_base + start + size * i;
+    *(Shm_Offset *)(object + next_field) = *free_list;
+    *free_list = toOffset(object);
+  }
+}
+
+/**
+ * Initializes a mutex that can be shared between worker processes
+ * @param mutex mutex inside the registry segment
+*/
+void initRegistryMutex( pthread_mutex_t *mutex ) {
+  pthread_mutexattr_t attributes;
+  pthread_mutexattr_init(&attributes);
+  pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(mutex, &attributes);
+  pthread_mutexattr_destroy(&attributes);
+}
+
+/**
+ * Maps the registry segment from its memory file
+ * @param fd memory file of REGISTRY_SIZE bytes
+*/
+void attachRegistry( int fd ) {
+  void *segment = mmap(NULL, REGISTRY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+  if( segment == MAP_FAILED ) {
+    fail("mmap() registry error");
+  }
+  registry_fd = fd;
+  registry_base = (char *)segment;
+  registry = (Registry *)segment;
+}
+
+// CPUs given with -a, ordered by NUMA node, and the node of each one;
+// both are empty when threads are left to the scheduler
+std::vector<int> affinity_cpus;
+std::vector<int> affinity_nodes;
+
+/**
+ * Lists the distinct NUMA nodes of the -a CPUs
+ * @return nodes in ascending order
+*/
+std::vector<int> affinityNodeList() {
+  std::vector<int> nodes;
+  for( int node : affinity_nodes ) {
+    if( std::find(nodes.begin(), nodes.end(), node) == nodes.end() ) {
+      nodes.push_back(node);
+    }
+  }
+  return nodes;
+}
+
+/**
+ * Fills a node mask for mbind and set_mempolicy
+ * @param mask NUMA_MAX_NODES bits
+ * @param nodes nodes set in the mask, all others are cleared
+*/
+void nodeMask( unsigned long *mask, const std::vector<int> &nodes ) {
+  memset(mask, 0, NUMA_MAX_NODES / 8);
+  for( int node : nodes ) {
+    mask[node / (8 * sizeof(long))] |= 1UL << (node % (8 * sizeof(long)));
+  }
+}
+
+/**
+ * Makes the calling thread, and threads it starts later, allocate from one node
+ * Only used when the -a CPUs span several nodes
+ * @param node NUMA node
+*/
+void preferNode( int node ) {
+  unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(long))];
+  nodeMask(mask, std::vector<int>(1, node));
+  if( syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, NUMA_MAX_NODES + 1) == -1 ) {
+    fail("set_mempolicy() error");
+  }
+}
+
+/**
+ * Spreads the registry segment's pages over the nodes of the -a CPUs
+ * Every worker reaches every shard, since shards are keyed by rfc number
+ * and not by worker, so no shard has a local node. Interleaving keeps the
+ * registry from sitting on the memory of whichever node touched it first.
+ * Must be called before the segment is first written
+*/
+void interleaveRegistry() {
+  std::vector<int> nodes = affinityNodeList();
+  if( nodes.size() < 2 ) {
+    return;
+  }
+  unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(long))];
+  nodeMask(mask, nodes);
+  if( syscall(SYS_mbind, registry_base, REGISTRY_SIZE, MPOL_INTERLEAVE, mask, NUMA_MAX_NODES + 1, 0) == -1 ) {
+    fail("mbind() registry error");
+  }
+}
+
+/**
+ * Maps the registry segment and initializes the shards and client list
+ * The segment is a memory file so an upgraded server can map it too
+ * Must be called before any worker is forked
+*/
+void initRegistry() {
+  int fd = memfd_create("p2p-registry", MFD_CLOEXEC);
+  if( fd == -1 || ftruncate(fd, REGISTRY_SIZE) == -1 ) {
+    fail("memfd_create() registry error");
+  }
+  attachRegistry(fd);
+  interleaveRegistry();
+  registry = new (registry_base) Registry;
+  initRegistryMutex(&registry->lock);
+  initRegistryMutex(&registry->alloc_lock);
+  registry->client_list = 0;
+  registry->free_clients = 0;
+  registry->used = sizeof(Registry);
+  registry->catalog_generation = 0;
+  registry->list_generation = 1;
+  for( int i = 0; i < RFC_SHARDS; i++ ) {
+    initRegistryMutex(&registry->shards[i].lock);
+    registry->shards[i].rfc_list = 0;
+    registry->shards[i].rfc_index = 0;
+    registry->shards[i].free_nodes = 0;
+    registry->shards[i].free_entries = 0;
+    registry->shards[i].swarm_peers = 0;
+    registry->shards[i].free_swarm = 0;
+    registry->shards[i].generation = 1;
+  }
+  initRegistryMutex(&registry->buckets_lock);
+  for( int i = 0; i < PEER_BUCKETS; i++ ) {
+    registry->buckets[i].used = false;
+  }
+  initRegistryMutex(&registry->events_lock);
+  registry->events_published = 0;
+  registry->events_futex = 0;
+}
 
-/** Mutex lock for all threads accessing the board */
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// Inverted index over titles: lowercased term -> sorted rfc numbers
+std::map<std::string, std::vector<int>> search_terms;
+// Ordered catalog of every registered rfc number and its title,
+// serves SEARCH results and range/batch LOOKUP
+std::map<int, std::string> rfc_catalog;
+/** Read/write lock for the search index and catalog, taken after a shard lock */
+pthread_rwlock_t catalog_lock = PTHREAD_RWLOCK_INITIALIZER;
+// Registry generation the process-local catalog reflects, it falls behind
+// when another worker adds or removes an rfc number
+unsigned long catalog_generation = 0;
 
 /** Threads */
-pthread_t userLock;
+pthread_t notifierThread;
 
 /**
  * Easy function to create client node
+ * Must be called with the registry lock held
  * @param hostname name of the host 
  * @param port integer value of the port that the client is connected to
  * @return ClientNode new client node object
 */
 Client_Node* createClientNode( char *hostname, int port, char *os_string ) {
-  Client_Node* newNode = (Client_Node *)malloc(sizeof(Client_Node));
-  if( newNode == NULL ) {
-    fail("MALLOC call failed - Client node");
+  if( registry->free_clients == 0 ) {
+    allocSlab(sizeof(Client_Node), RFC_SLAB_SIZE, offsetof(Client_Node, next), &registry->free_clients);
   }
+  Client_Node* newNode = fromOffset<Client_Node>(registry->free_clients);
+  registry->free_clients = newNode->next;
   strcpy(newNode->hostname, hostname);
   newNode->port_number = port;
   strcpy(newNode->os_string, os_string);
-  newNode->next = NULL;
+  newNode->worker = getpid();
+  newNode->path[0] = '\0';
+  newNode->active_transfers = 0;
+  newNode->bytes_served = 0;
+  newNode->recent_bytes = 0;
+  newNode->recent_stamp = time(NULL);
+  newNode->address = 0;
+  newNode->rtt_us = 0;
+  newNode->next = 0;
   return newNode;
 }
 
+/**
+ * Finds the client node registered with the given port
+ * @param port port number of the client
+ * @return Client_Node matching node or NULL
+*/
+Client_Node* findClientNode( int port ) {
+  Client_Node *search = fromOffset<Client_Node>(registry->client_list);
+  while( search != NULL ) {
+    if( search->port_number == port ) {
+      return search;
+    }
+    search = fromOffset<Client_Node>(search->next);
+  }
+  return NULL;
+}
+
+/**
+ * Finds the client node of an rfc's holder
+ * The node found is kept on the row and reused while it still belongs to
+ * the holder's port, so choosing among holders does not scan the client list
+ * Must be called with the registry lock held, and the shard lock too
+ * when the row is in the registry rather than a copy
+ * @param holder rfc row of the holder
+ * @return Client_Node of the holder or NULL
+*/
+Client_Node* holderPeer( RFC_Node *holder ) {
+  Client_Node *peer = fromOffset<Client_Node>(holder->peer);
+  if( peer != NULL && peer->port_number == holder->port_number ) {
+    return peer;
+  }
+  peer = findClientNode(holder->port_number);
+  holder->peer = peer == NULL ? 0 : toOffset(peer);
+  return peer;
+}
+
+/**
+ * Checks the host a client named in its request against its connection
+ * @param str_host host given in the request
+ * @param client_hostname host the connection resolved to
+ * @return true if both match a registered client
+*/
+bool clientHostKnown( const char *str_host, const char *client_hostname ) {
+  bool found = false;
+  lockRegistry(&registry->lock);
+  Client_Node *search = fromOffset<Client_Node>(registry->client_list);
+  while( search != NULL && !found ) {
+    found = strcmp(str_host, search->hostname) == 0 && strcmp(client_hostname, search->hostname) == 0;
+    search = fromOffset<Client_Node>(search->next);
+  }
+  unlockRegistry(&registry->lock);
+  return found;
+}
+
 /**
  * Function to add Client node to client linked list
- * @param head head of the linked list 
+ * Must be called with the registry lock held
  * @param newNode newNodeto be added to the linked list 
 */
-void addClientNode( Client_Node** head, Client_Node* newNode ) {
-  newNode->next = *head;
-  *head = newNode;
+void addClientNode( Client_Node* newNode ) {
+  newNode->next = registry->client_list;
+  registry->client_list = toOffset(newNode);
 }
 
 /**
  * Once TCP client disconnects we must remove all instances regarding his port
  * There will only be one instance of his port in this linked list
+ * Must be called with the registry lock held
  * @param port_toRemove integer value compared with all nodes in client_list 
 */
 void deleteClientNode(int port_toRemove) {
-    Client_Node* current = client_list;
+    Client_Node* current = fromOffset<Client_Node>(registry->client_list);
     Client_Node * previous = NULL;
     while( current != NULL ) {
       if(current->port_number == port_toRemove) {
         if(previous == NULL) {
-          client_list = current->next;
+          registry->client_list = current->next;
         } else {
           previous->next = current->next;
         }
-        free( current );
+        // Rows still pointing at the node stop trusting it
+        current->port_number = 0;
+        current->next = registry->free_clients;
+        registry->free_clients = toOffset(current);
         break;
       }
+      previous = current;
+      current = fromOffset<Client_Node>(current->next);
     }
 }
 
-/** 
- * Delete all RFC nodes containing the same hostname
- * This function is called upon the disconnect of a TCP Client
- * @param port_number number of the port we need to remove
- * 
+/**
+ * Shard responsible for an rfc number
+ * @param rfc_number number of the rfc
+ * @return RFC_Shard owning shard
 */
-void deleteRFCNode(int port_number) {
-    RFC_Node* current = rfc_list;
-    RFC_Node* prev = NULL;
+RFC_Shard* shardFor( int rfc_number ) {
+  unsigned int hash = (unsigned int)rfc_number * 2654435761u;
+  return &registry->shards[(hash >> 16) % RFC_SHARDS];
+}
 
-    // Loop to traverse linked list
-    while (current != NULL) {
-        if (current->port_number == port_number) { // Check if port matches
-            if (prev != NULL) {
-                prev->next = current->next;
-                free(current);
-                current = prev->next;
-            } else {
-                RFC_Node* temp = current;
-                current = current->next;
-                free(temp);
-                rfc_list = current;
-            }
-        } else {
-            prev = current;
-            current = current->next;
-        }
-    }
+/**
+ * Takes an RFC node from the shard's free list, refilling it with a slab
+ * Must be called with the shard lock held
+ * @param shard shard the node will live in
+ * @return RFC_Node uninitialized node
+*/
+RFC_Node* allocRFCNode( RFC_Shard *shard ) {
+  if( shard->free_nodes == 0 ) {
+    allocSlab(sizeof(RFC_Node), RFC_SLAB_SIZE, offsetof(RFC_Node, next), &shard->free_nodes);
+  }
+  RFC_Node *node = fromOffset<RFC_Node>(shard->free_nodes);
+  shard->free_nodes = node->next;
+  return node;
+}
+
+/**
+ * Marks a shard's rfc_list as changed so cached LIST rows are rebuilt
+ * Must be called with the shard lock held
+ * @param shard shard that changed
+*/
+void listChanged( RFC_Shard *shard ) {
+  shard->generation++;
+  registry->list_generation++;
 }
 
+/**
+ * Returns an RFC node to the shard's free list
+ * Must be called with the shard lock held
+ * @param shard shard the node was allocated from
+ * @param node node to recycle
+*/
+void freeRFCNode( RFC_Shard *shard, RFC_Node *node ) {
+  node->next = shard->free_nodes;
+  shard->free_nodes = toOffset(node);
+}
 
 /**
- * Easy function to create RFC related node
- * @param num number of rfc
- * @param title title of rfc
- * @param host name of host 
- * @return RFC_Node created node
+ * Finds the index entry for an rfc number
+ * Must be called with the shard lock held
+ * @param shard shard owning the rfc number
+ * @param rfc_number number of the rfc
+ * @return RFC_Entry matching entry or NULL
 */
-RFC_Node* createRFC_node(char *arrayString, int port, char *host) {
-  RFC_Node* newNode = (RFC_Node*)malloc(sizeof(RFC_Node));
-  if(newNode == NULL ) {
-    fail("MALLOC call failed - RFC node");
+RFC_Entry* findRFCEntry( RFC_Shard *shard, int rfc_number ) {
+  RFC_Entry *entry = fromOffset<RFC_Entry>(shard->rfc_index);
+  while( entry != NULL ) {
+    if( entry->rfc_number == rfc_number ) {
+      return entry;
+    }
+    entry = fromOffset<RFC_Entry>(entry->next);
   }
-    char file_location[20];
-    char file_name[12];
-    int rfc_number_scan = 0;   
-
-    sscanf(arrayString, "%s%s%d", file_location, file_name, &rfc_number_scan);
-    strcpy(newNode->path, file_location);
-    newNode->rfc_number = rfc_number_scan;
-    strcpy(newNode->path, file_location);
+  return NULL;
+}
 
-    // Logic for title
-    int count = 0;
-    char *pos = arrayString;
-    while(*pos != '\0' && count < 3) {
-        if(*pos == ' ') {
-            count++;
-        }
-        pos++;
+/**
+ * Splits a title into lowercased alphanumeric terms
+ * Single character terms are dropped
+ * @param title title to tokenize
+ * @return terms in order of appearance, without duplicates
+*/
+std::vector<std::string> tokenizeTitle( const char *title ) {
+  std::vector<std::string> terms;
+  std::string term;
+  for( const char *pos = title; ; pos++ ) {
+    if( *pos != '\0' && isalnum((unsigned char)*pos) ) {
+      term += (char)tolower((unsigned char)*pos);
+      continue;
     }
-    if(count >= 3) {
-        memmove(arrayString, pos, strlen(pos) + 1);
-    } else {
-        fail("error memmove");
+    if( term.size() > 1 && std::find(terms.begin(), terms.end(), term) == terms.end() ) {
+      terms.push_back(term);
     }
-
-    strcat(newNode->title, arrayString);
-    strcpy(newNode->hostname, host);
-    newNode->port_number = port;
-    newNode->next = NULL;
-
-  return newNode;
+    term.clear();
+    if( *pos == '\0' ) {
+      break;
+    }
+  }
+  return terms;
 }
 
 /**
- * Function to add node to RFC related linked list
- * @param head head of the linked list
- * @param newNode node to add to the front of the linked list
+ * Adds a newly indexed rfc number to the catalog and its title terms
+ * to the search index
+ * @param rfc_number number of the rfc
+ * @param title title of the rfc
 */
-void addRFC_Node(RFC_Node** head, RFC_Node* newNode ) {
-  if( *head == NULL ) {
-    *head = newNode;
-    newNode->next = NULL;
-  } else {
-    newNode->next = *head;
-    *head = newNode;
+void catalogAdd( int rfc_number, const char *title ) {
+  std::vector<std::string> terms = tokenizeTitle(title);
+  pthread_rwlock_wrlock(&catalog_lock);
+  unsigned long shared = registry->catalog_generation.fetch_add(1);
+  if( catalog_generation != shared ) {
+    // Already stale, the next reader rebuilds it
+    pthread_rwlock_unlock(&catalog_lock);
+    return;
+  }
+  catalog_generation = shared + 1;
+  for( const std::string &term : terms ) {
+    std::vector<int> &posting = search_terms[term];
+    std::vector<int>::iterator at = std::lower_bound(posting.begin(), posting.end(), rfc_number);
+    if( at == posting.end() || *at != rfc_number ) {
+      posting.insert(at, rfc_number);
+    }
   }
+  rfc_catalog[rfc_number] = title;
+  pthread_rwlock_unlock(&catalog_lock);
 }
 
 /**
- * Add command logic
- * Adds an existing rfc to the rfc_list 
- * Used after calling the GET command to update the list
- * @param buffer input of the client
- * @param client_hostname client's hostname
- * @param port number of client
- * @return response of the server
+ * Removes an rfc number whose last holder is gone from the catalog and
+ * the search index
+ * @param rfc_number number of the rfc
+ * @param title title the rfc was indexed with
 */
-char* addCommand(char *buffer, char *client_hostname, int __port) {
-  char *response = new char[1024];
-  response[0] = '\0';
-  char command[4];
-  char rfc[4];
-  int rfc_number_str = 0;
-  char version[12];
-  char str_host[50];
-  int port_user = 0;
-  
-  sscanf(buffer, "%s%s%d%s%s%d", command, rfc, &rfc_number_str, version, str_host, &port_user);
-  //Invalid command
-  if(strcmp(command, "ADD") != 0) {
-    strcat(response, "P2P-CI/1.0 400 Bad Request\n");
-    return response;
+void catalogRemove( int rfc_number, const char *title ) {
+  std::vector<std::string> terms = tokenizeTitle(title);
+  pthread_rwlock_wrlock(&catalog_lock);
+  unsigned long shared = registry->catalog_generation.fetch_add(1);
+  if( catalog_generation != shared ) {
+    pthread_rwlock_unlock(&catalog_lock);
+    return;
   }
-  //Invalid command
-  if(strcmp(rfc, "RFC") != 0) {
-    strcat(response, "P2P-CI/1.0 400 Bad Request\n");
-    return response;
+  catalog_generation = shared + 1;
+  for( const std::string &term : terms ) {
+    std::map<std::string, std::vector<int>>::iterator found = search_terms.find(term);
+    if( found == search_terms.end() ) {
+      continue;
+    }
+    std::vector<int> &posting = found->second;
+    std::vector<int>::iterator at = std::lower_bound(posting.begin(), posting.end(), rfc_number);
+    if( at != posting.end() && *at == rfc_number ) {
+      posting.erase(at);
+    }
+    if( posting.empty() ) {
+      search_terms.erase(found);
+    }
   }
-  //Invalid P2P
-  if(strcmp(version, "P2P-CI/1.0") != 0) {
-    strcat(response, "P2P-CI/1.0 505 P2P-CI Version Not Supported\n");
-    return response;
+  rfc_catalog.erase(rfc_number);
+  pthread_rwlock_unlock(&catalog_lock);
+}
+
+/**
+ * Rebuilds the catalog and search index from the shared registry
+ * Must be called without any shard or catalog lock held
+*/
+void catalogRebuild() {
+  unsigned long generation = registry->catalog_generation.load();
+  std::map<std::string, std::vector<int>> terms;
+  std::map<int, std::string> catalog;
+  for( int i = 0; i < RFC_SHARDS; i++ ) {
+    RFC_Shard *shard = &registry->shards[i];
+    lockRegistry(&shard->lock);
+    for( RFC_Entry *entry = fromOffset<RFC_Entry>(shard->rfc_index); entry != NULL; entry = fromOffset<RFC_Entry>(entry->next) ) {
+      catalog[entry->rfc_number] = entry->title;
+    }
+    unlockRegistry(&shard->lock);
   }
-  //Invalid port
-  if(__port != port_user) {
-    strcat(response, "P2P-CI/1.0 400 Bad Request\n");
-    return response;
+  // Walking the catalog in order keeps every posting list sorted
+  for( const std::pair<const int, std::string> &row : catalog ) {
+    for( const std::string &term : tokenizeTitle(row.second.c_str()) ) {
+      std::vector<int> &posting = terms[term];
+      if( posting.empty() || posting.back() != row.first ) {
+        posting.push_back(row.first);
+      }
+    }
   }
 
-  bool client_flag_found = false;
-  bool rfc_flag = false;
-  Client_Node *search = client_list;
-  while( search != NULL) {
-      if(strcmp(str_host, search->hostname) == 0 && strcmp(client_hostname, search->hostname) == 0) {
-        client_flag_found = true; 
-        break;
-      }
-      search = search->next;
+  pthread_rwlock_wrlock(&catalog_lock);
+  if( generation > catalog_generation ) {
+    search_terms.swap(terms);
+    rfc_catalog.swap(catalog);
+    catalog_generation = generation;
   }
+  pthread_rwlock_unlock(&catalog_lock);
+}
 
-  if(client_flag_found == false) {
-    strcat(response, "P2P-CI/1.0 404 Not Found\n");
-    return response;
+/**
+ * Takes the catalog lock for reading, first catching the catalog up with
+ * changes other workers made to the registry
+ * Must be called without any shard lock held
+*/
+void catalogReadLock() {
+  pthread_rwlock_rdlock(&catalog_lock);
+  if( catalog_generation != registry->catalog_generation.load() ) {
+    pthread_rwlock_unlock(&catalog_lock);
+    catalogRebuild();
+    pthread_rwlock_rdlock(&catalog_lock);
   }
+}
+
+/**
+ * Runs a search over the title index
+ * Every query term must match (AND), a trailing '*' makes it a prefix term
+ * Must be called with the catalog lock held for reading
+ * @param terms lowercased query terms
+ * @param limit maximum number of results
+ * @return matching rfc numbers in ascending order
+*/
+std::vector<int> searchIndexQuery( const std::vector<std::string> &terms, size_t limit ) {
+  std::vector<int> result;
+  for( size_t i = 0; i < terms.size(); i++ ) {
+    std::string term = terms[i];
+    std::vector<int> matches;
+    if( !term.empty() && term[term.size() - 1] == '*' ) {
+      term.erase(term.size() - 1);
+      std::map<std::string, std::vector<int>>::iterator at = search_terms.lower_bound(term);
+      // Gathered and sorted once, merging list by list is quadratic in the terms
+      for( ; at != search_terms.end() && at->first.compare(0, term.size(), term) == 0; at++ ) {
+        matches.insert(matches.end(), at->second.begin(), at->second.end());
+      }
+      std::sort(matches.begin(), matches.end());
+      matches.erase(std::unique(matches.begin(), matches.end()), matches.end());
+    } else {
+      std::map<std::string, std::vector<int>>::iterator found = search_terms.find(term);
+      if( found != search_terms.end() ) {
+        matches = found->second;
+      }
+    }
 
-  RFC_Node *current = rfc_list;
-  while( current != NULL ) {
-    if(rfc_number_str == current->rfc_number) {
-      rfc_flag = true;
+    if( i == 0 ) {
+      result.swap(matches);
+    } else {
+      std::vector<int> common;
+      std::set_intersection(result.begin(), result.end(), matches.begin(), matches.end(), std::back_inserter(common));
+      result.swap(common);
+    }
+    if( result.empty() ) {
       break;
     }
-    current = current->next;
   }
-
-  if(rfc_flag == false) {
-    strcat(response, "P2P-CI/1.0 404 Not Found\n");
-    return response;
+  if( result.size() > limit ) {
+    result.resize(limit);
   }
+  return result;
+}
 
-  RFC_Node *nodeToAdd = (RFC_Node*)malloc(sizeof(RFC_Node));
-  
+/**
+ * Publishes a registry change to the SUBSCRIBE connections of every worker
+ * Only appends to the shared event ring, each worker's notifier thread
+ * does the sending
+ * @param added true when a holder registered, false when it was removed
+ * @param node RFC node that changed
+*/
+void publishEvent( bool added, const RFC_Node *node ) {
+  lockRegistry(&registry->events_lock);
+  RFC_Event *event = &registry->events[registry->events_published % EVENT_RING];
+  event->added = added;
+  event->rfc_number = node->rfc_number;
+  strcpy(event->hostname, node->hostname);
+  event->port_number = node->port_number;
+  registry->events_published++;
+  registry->events_futex.store((uint32_t)registry->events_published);
+  unlockRegistry(&registry->events_lock);
+  syscall(SYS_futex, &registry->events_futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
 
-  RFC_Node *verifySearch = rfc_list;
-  while( verifySearch != NULL) {
-    if(__port == verifySearch->port_number) {
-      strcpy(nodeToAdd->path, verifySearch->path);
-      break;
+/**
+ * Adds an RFC node to the holder set of its index entry
+ * Creates the entry if this is the first holder of the rfc
+ * @param shard shard owning the node
+ * @param node registered RFC node
+*/
+void indexAddHolder( RFC_Shard *shard, RFC_Node *node ) {
+  RFC_Entry *entry = findRFCEntry(shard, node->rfc_number);
+  if( entry == NULL ) {
+    if( shard->free_entries == 0 ) {
+      allocSlab(sizeof(RFC_Entry), RFC_SLAB_SIZE, offsetof(RFC_Entry, next), &shard->free_entries);
     }
-    verifySearch = verifySearch->next;
+    entry = fromOffset<RFC_Entry>(shard->free_entries);
+    shard->free_entries = entry->next;
+    entry->rfc_number = node->rfc_number;
+    strcpy(entry->title, node->title);
+    entry->holder_count = 0;
+    entry->holders = 0;
+    entry->next = shard->rfc_index;
+    shard->rfc_index = toOffset(entry);
+    catalogAdd(entry->rfc_number, entry->title);
   }
-
-  strcpy(nodeToAdd->hostname, client_hostname);
-  nodeToAdd->port_number = __port;
-  nodeToAdd->rfc_number = rfc_number_str;
-  strcpy(nodeToAdd->title, current->title);
-
-  pthread_mutex_lock(&lock);
-  addRFC_Node(&rfc_list, nodeToAdd);
-  pthread_mutex_unlock(&lock);
-
-  strcat(response, "Title: ");
-  strcat(response, nodeToAdd->title);
-
-  return response;
+  node->next_holder = entry->holders;
+  entry->holders = toOffset(node);
+  entry->holder_count++;
 }
 
 /**
- * Lookup command to lookup the title of an RFC given the number
- * @param buffer client input
- * @param client_hostname hostname of client
- * @return response of the server
+ * Removes an RFC node from the holder set of its index entry
+ * The entry is freed once its last holder is gone
+ * @param shard shard owning the node
+ * @param node RFC node about to be freed
 */
-char* lookupCommand(char *buffer, char *client_hostname, int __port) {
+void indexRemoveHolder( RFC_Shard *shard, RFC_Node *node ) {
+  RFC_Entry *entry = fromOffset<RFC_Entry>(shard->rfc_index);
+  RFC_Entry *prevEntry = NULL;
+  while( entry != NULL && entry->rfc_number != node->rfc_number ) {
+    prevEntry = entry;
+    entry = fromOffset<RFC_Entry>(entry->next);
+  }
+  if( entry == NULL ) {
+    return;
+  }
 
-  char *response = new char[1024];
+  Shm_Offset *link = &entry->holders;
+  Shm_Offset target = toOffset(node);
+  while( *link != 0 ) {
+    if( *link == target ) {
+      *link = node->next_holder;
+      entry->holder_count--;
+      break;
+    }
+    link = &fromOffset<RFC_Node>(*link)->next_holder;
+  }
+
+  if( entry->holders == 0 ) {
+    catalogRemove(entry->rfc_number, entry->title);
+    if( prevEntry == NULL ) {
+      shard->rfc_index = entry->next;
+    } else {
+      prevEntry->next = entry->next;
+    }
+    entry->next = shard->free_entries;
+    shard->free_entries = toOffset(entry);
+  }
+}
+
+/**
+ * Current load of a peer, ordered by active transfers then recent bytes
+ * Recent bytes are halved for every RECENT_BYTES_HALF_LIFE seconds elapsed
+ * @param peer client node of the holder
+ * @return load score, lower is less loaded
+*/
+long peerLoad( Client_Node *peer ) {
+  time_t now = time(NULL);
+  long halvings = (now - peer->recent_stamp) / RECENT_BYTES_HALF_LIFE;
+  if( halvings > 0 ) {
+    peer->recent_bytes = halvings >= 63 ? 0 : peer->recent_bytes >> halvings;
+    peer->recent_stamp += halvings * RECENT_BYTES_HALF_LIFE;
+  }
+  return (long)peer->active_transfers * (1L << 40) + peer->recent_bytes;
+}
+
+/**
+ * Records a round trip time measured to a peer
+ * @param port port number of the peer
+ * @param sample round trip time in microseconds
+*/
+void peerRttSample( int port, long sample ) {
+  if( sample <= 0 ) {
+    sample = 1;
+  }
+  lockRegistry(&registry->lock);
+  Client_Node *peer = findClientNode(port);
+  if( peer != NULL ) {
+    peer->rtt_us = peer->rtt_us == 0 ? sample : peer->rtt_us + ((sample - peer->rtt_us) >> RTT_SMOOTHING_SHIFT);
+  }
+  unlockRegistry(&registry->lock);
+}
+
+/**
+ * Distance of a holder from a requester, ordered by locality then RTT
+ * A holder on the requester's address is nearest, then one in the same
+ * /24, then the rest by their RTT to the server, unmeasured ones last
+ * Must be called with the client lock held
+ * @param peer client node of the holder
+ * @param requester client node of the requesting client, may be NULL
+ * @return distance score, lower is nearer
+*/
+long peerDistance( Client_Node *peer, Client_Node *requester ) {
+  long locality = 2;
+  if( requester != NULL && peer->address != 0 && requester->address != 0 ) {
+    if( peer->address == requester->address ) {
+      locality = 0;
+    } else if( (ntohl(peer->address) >> 8) == (ntohl(requester->address) >> 8) ) {
+      locality = 1;
+    }
+  }
+  long rtt = peer->rtt_us == 0 ? (1L << 30) : peer->rtt_us / RTT_TOLERANCE_US;
+  return locality * (1L << 31) + rtt;
+}
+
+/**
+ * Picks the holder of an rfc that should serve the next request
+ * Small holder sets are scanned for the least loaded peer, larger ones
+ * compare two random holders (power of two choices). Asked for the
+ * nearest holder, every holder is scanned for the lowest peerDistance,
+ * load only breaking ties.
+ * Must be called with the shard lock held, takes the client lock itself
+ * @param shard shard owning the rfc number
+ * @param rfc_number number of the rfc
+ * @param os_string required OS of the holder, NULL for any
+ * @param exclude_port port of the requesting client, skipped when possible
+ * @param nearest prefer the holder nearest the requesting client
+ * @return RFC_Node chosen holder or NULL
+*/
+RFC_Node* selectHolder( RFC_Shard *shard, int rfc_number, const char *os_string, int exclude_port, bool nearest ) {
+  RFC_Entry *entry = findRFCEntry(shard, rfc_number);
+  if( entry == NULL ) {
+    return NULL;
+  }
+
+  lockRegistry(&registry->lock);
+  RFC_Node *chosen = NULL;
+
+  std::vector<RFC_Node *> candidates;
+  RFC_Node *self = NULL;
+  for( RFC_Node *holder = fromOffset<RFC_Node>(entry->holders); holder != NULL; holder = fromOffset<RFC_Node>(holder->next_holder) ) {
+    Client_Node *peer = holderPeer(holder);
+    if( peer == NULL ) {
+      continue;
+    }
+    if( os_string != NULL && strcmp(os_string, peer->os_string) != 0 ) {
+      continue;
+    }
+    if( holder->port_number == exclude_port ) {
+      self = holder;
+      continue;
+    }
+    candidates.push_back(holder);
+  }
+  if( candidates.empty() ) {
+    chosen = self;
+  } else if( nearest ) {
+    Client_Node *requester = findClientNode(exclude_port);
+    long bestDistance = 0;
+    long bestLoad = 0;
+    for( RFC_Node *holder : candidates ) {
+      Client_Node *peer = holderPeer(holder);
+      long distance = peerDistance(peer, requester);
+      long load = peerLoad(peer);
+      if( chosen == NULL || distance < bestDistance || (distance == bestDistance && load < bestLoad) ) {
+        chosen = holder;
+        bestDistance = distance;
+        bestLoad = load;
+      }
+    }
+  } else if( candidates.size() <= HOLDER_SCAN_LIMIT ) {
+    long bestLoad = 0;
+    for( RFC_Node *holder : candidates ) {
+      long load = peerLoad(holderPeer(holder));
+      if( chosen == NULL || load < bestLoad ) {
+        chosen = holder;
+        bestLoad = load;
+      }
+    }
+  } else {
+    size_t first = rand() % candidates.size();
+    size_t second = rand() % (candidates.size() - 1);
+    if( second >= first ) {
+      second++;
+    }
+    RFC_Node *a = candidates[first];
+    RFC_Node *b = candidates[second];
+    chosen = peerLoad(holderPeer(a)) <= peerLoad(holderPeer(b)) ? a : b;
+  }
+  unlockRegistry(&registry->lock);
+  return chosen;
+}
+
+/**
+ * Finds the directory of a connected peer
+ * @param port port number of the peer
+ * @param path destination for the directory, at least 20 bytes
+ * @return true if the peer has uploaded an rfc
+*/
+bool findPeerPath( int port, char *path ) {
+  lockRegistry(&registry->lock);
+  Client_Node *peer = findClientNode(port);
+  bool found = peer != NULL && peer->path[0] != '\0';
+  if( found ) {
+    strcpy(path, peer->path);
+  }
+  unlockRegistry(&registry->lock);
+  return found;
+}
+
+/** 
+ * Delete all RFC nodes containing the same hostname
+ * This function is called upon the disconnect of a TCP Client
+ * Shards are locked one at a time, never all at once
+ * @param port_number number of the port we need to remove
+ * 
+*/
+void deleteRFCNode(int port_number) {
+  for( int i = 0; i < RFC_SHARDS; i++ ) {
+    RFC_Shard *shard = &registry->shards[i];
+    lockRegistry(&shard->lock);
+    RFC_Node* current = fromOffset<RFC_Node>(shard->rfc_list);
+    RFC_Node* prev = NULL;
+
+    // Loop to traverse linked list
+    while (current != NULL) {
+        if (current->port_number == port_number) { // Check if port matches
+            listChanged(shard);
+            indexRemoveHolder(shard, current);
+            publishEvent(false, current);
+            if (prev != NULL) {
+                prev->next = current->next;
+                freeRFCNode(shard, current);
+                current = fromOffset<RFC_Node>(prev->next);
+            } else {
+                RFC_Node* temp = current;
+                current = fromOffset<RFC_Node>(current->next);
+                shard->rfc_list = temp->next;
+                freeRFCNode(shard, temp);
+            }
+        } else {
+            prev = current;
+            current = fromOffset<RFC_Node>(current->next);
+        }
+    }
+    unlockRegistry(&shard->lock);
+  }
+}
+
+
+/**
+ * Reads an optional "sha256:<hex>" token declaring a file's content hash
+ * @param text text that may start with the token
+ * @param node node receiving the declared hash, cleared without a token
+ * @return length of the token and its trailing space, 0 without a token
+*/
+size_t parseHashToken( const char *text, RFC_Node *node ) {
+  node->content_hash[0] = '\0';
+  node->registered_hash[0] = '\0';
+  node->hash_mtime = 0;
+  node->hash_size = -1;
+  if( strncmp(text, "sha256:", 7) != 0 || strspn(text + 7, "0123456789abcdef") != 64 || (text[71] != ' ' && text[71] != '\0') ) {
+    return 0;
+  }
+  memcpy(node->content_hash, text + 7, 64);
+  node->content_hash[64] = '\0';
+  strcpy(node->registered_hash, node->content_hash);
+  return text[71] == ' ' ? 72 : 71;
+}
+
+/**
+ * Formats the registered hash of a node for a request line
+ * @param node node with or without a registered hash
+ * @return "sha256:<hex> " or an empty string
+*/
+std::string hashToken( const RFC_Node *node ) {
+  return node->registered_hash[0] == '\0' ? "" : std::string("sha256:") + node->registered_hash + " ";
+}
+
+/**
+ * Easy function to fill an RFC related node from an upload line
+ * The node is registered afterwards with addRFC_Node
+ * @param newNode node to fill
+ * @param arrayString upload line: path, file name, number, optional
+ *                    sha256:<hex> content hash and title
+ * @param port port of the client
+ * @param host name of host 
+ * @return false if a field is missing or the path or file name is too long
+*/
+bool createRFC_node(RFC_Node *newNode, char *arrayString, int port, char *host) {
+    char file_location[sizeof(newNode->path)];
+    char file_name[48];
+    int rfc_number_scan = 0;   
+    int location_end = 0;
+    int name_end = 0;
+
+    // Widths are one short of the buffers, a longer token stops short of a space
+    if( sscanf(arrayString, "%19s%n%47s%n%d", file_location, &location_end, file_name, &name_end, &rfc_number_scan) != 3
+        || !isspace((unsigned char)arrayString[location_end]) || !isspace((unsigned char)arrayString[name_end]) ) {
+      return false;
+    }
+    strcpy(newNode->path, file_location);
+    newNode->rfc_number = rfc_number_scan;
+
+    // Logic for title
+    int count = 0;
+    char *pos = arrayString;
+    while(*pos != '\0' && count < 3) {
+        if(*pos == ' ') {
+            count++;
+        }
+        pos++;
+    }
+    if(count >= 3) {
+        memmove(arrayString, pos, strlen(pos) + 1);
+    } else {
+        return false;
+    }
+
+    size_t hash_length = parseHashToken(arrayString, newNode);
+    newNode->title[0] = '\0';
+    strncat(newNode->title, arrayString + hash_length, sizeof(newNode->title) - 1);
+    strcpy(newNode->hostname, host);
+    newNode->port_number = port;
+    newNode->next = 0;
+    newNode->next_holder = 0;
+    return true;
+}
+
+/**
+ * Function to add node to RFC related linked list
+ * The row is copied into a node from its shard's allocator, added to the
+ * front of the shard list and to the holder set of its index entry
+ * @param row filled node describing the rfc and its holder
+*/
+void addRFC_Node( const RFC_Node* row ) {
+  RFC_Shard *shard = shardFor(row->rfc_number);
+  lockRegistry(&shard->lock);
+  RFC_Node *newNode = allocRFCNode(shard);
+  *newNode = *row;
+  newNode->peer = 0;
+  newNode->next = shard->rfc_list;
+  indexAddHolder(shard, newNode);
+  shard->rfc_list = toOffset(newNode);
+  listChanged(shard);
+  publishEvent(true, newNode);
+  unlockRegistry(&shard->lock);
+}
+
+/**
+ * Appends an unsigned LEB128 varint
+ * @param out destination
+ * @param value value to encode
+*/
+void putVarint( std::string &out, unsigned long value ) {
+  while( value >= 0x80 ) {
+    out += (char)(value | 0x80);
+    value >>= 7;
+  }
+  out += (char)value;
+}
+
+/**
+ * Appends a length-prefixed string
+ * @param out destination
+ * @param text string to encode
+*/
+void putString( std::string &out, const char *text ) {
+  size_t length = strlen(text);
+  putVarint(out, length);
+  out.append(text, length);
+}
+
+// Hostnames sent in binary frames as ids, append only, so a connection
+// only needs to know how many of them it has already been sent
+std::vector<std::string> wire_strings;
+std::map<std::string, unsigned long> wire_string_ids;
+/** Mutex lock for the binary string table, never held with another lock taken after it */
+pthread_mutex_t wire_string_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Finds the binary id of a hostname, assigning the next one if it is new
+ * @param text hostname
+ * @return id
+*/
+unsigned long wireStringId( const char *text ) {
+  pthread_mutex_lock(&wire_string_lock);
+  std::map<std::string, unsigned long>::iterator at = wire_string_ids.find(text);
+  unsigned long id;
+  if( at == wire_string_ids.end() ) {
+    id = wire_strings.size();
+    wire_strings.push_back(text);
+    wire_string_ids[text] = id;
+  } else {
+    id = at->second;
+  }
+  pthread_mutex_unlock(&wire_string_lock);
+  return id;
+}
+
+/**
+ * Builds the header of a binary response frame: status, payload length,
+ * the string ids the connection has not been sent yet, then the body
+ * @param status P2P-CI status code
+ * @param strings_sent string ids the connection already knows, advanced
+ * @param body start of the payload
+ * @param trailing payload bytes the caller sends after the header
+ * @return header
+*/
+std::string wireHeader( int status, unsigned long *strings_sent, const std::string &body, size_t trailing ) {
+  std::string strings;
+  pthread_mutex_lock(&wire_string_lock);
+  putVarint(strings, wire_strings.size() - *strings_sent);
+  for( ; *strings_sent < wire_strings.size(); (*strings_sent)++ ) {
+    putString(strings, wire_strings[*strings_sent].c_str());
+  }
+  pthread_mutex_unlock(&wire_string_lock);
+
+  std::string frame;
+  putVarint(frame, status);
+  putVarint(frame, strings.size() + body.size() + trailing);
+  return frame + strings + body;
+}
+
+/**
+ * Appends one LIST row in the binary encoding:
+ * rfc number, title, hostname id and port
+ * @param out destination
+ * @param rfc_number number of the rfc
+ * @param title title of the rfc
+ * @param hostname hostname of the holder
+ * @param port port of the holder
+*/
+void putWireRow( std::string &out, int rfc_number, const char *title, const char *hostname, int port ) {
+  putVarint(out, rfc_number);
+  putString(out, title);
+  putVarint(out, wireStringId(hostname));
+  putVarint(out, port);
+}
+
+//Structure for the serialized LIST rows of one shard, shared by every LIST reading them
+struct List_Chunk {
+    unsigned long generation;
+    std::shared_ptr<const std::string> rows;
+    // Same rows in the binary encoding, built on the first binary LIST
+    unsigned long wire_generation;
+    std::shared_ptr<const std::string> wire_rows;
+};
+
+// This worker's LIST rows, one chunk per shard
+List_Chunk list_chunks[RFC_SHARDS];
+/** Mutex lock for the chunk table, taken after a shard lock */
+pthread_mutex_t list_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Returns a shard's LIST rows, serializing them again only if the shard
+ * changed since they were last built
+ * @param index number of the shard
+ * @param wire binary rows instead of text
+ * @return rows, "RFC <number> <title> <hostname> <port>" each
+*/
+std::shared_ptr<const std::string> listShardRows( int index, bool wire ) {
+  RFC_Shard *shard = &registry->shards[index];
+  unsigned long *built = wire ? &list_chunks[index].wire_generation : &list_chunks[index].generation;
+  std::shared_ptr<const std::string> *cached = wire ? &list_chunks[index].wire_rows : &list_chunks[index].rows;
+  lockRegistry(&shard->lock);
+  std::shared_ptr<const std::string> rows;
+  pthread_mutex_lock(&list_cache_lock);
+  if( *built == shard->generation ) {
+    rows = *cached;
+  }
+  pthread_mutex_unlock(&list_cache_lock);
+
+  if( rows == nullptr ) {
+    std::string *text = new std::string;
+    char f_line[512];
+    for( RFC_Node *current = fromOffset<RFC_Node>(shard->rfc_list); current != NULL; current = fromOffset<RFC_Node>(current->next) ) {
+      if( wire ) {
+        putWireRow(*text, current->rfc_number, current->title, current->hostname, current->port_number);
+        continue;
+      }
+      int length = snprintf(f_line, sizeof(f_line), "RFC %d %s %s %d\n", current->rfc_number, current->title, current->hostname, current->port_number);
+      text->append(f_line, length);
+    }
+    rows.reset(text);
+    pthread_mutex_lock(&list_cache_lock);
+    *built = shard->generation;
+    *cached = rows;
+    pthread_mutex_unlock(&list_cache_lock);
+  }
+  unlockRegistry(&shard->lock);
+  return rows;
+}
+
+/**
+ * Appends whole rows from the front of a listing while they fit
+ * @param response response being built, NUL-terminated
+ * @param used bytes already in the response, advanced
+ * @param size capacity of the response
+ * @param rows rows to take from
+ * @return false once a row did not fit
+*/
+bool appendRows( char *response, size_t *used, size_t size, const std::string &rows ) {
+  size_t row_start = 0;
+  while( row_start < rows.size() ) {
+    size_t row_end = rows.find('\n', row_start) + 1;
+    if( *used + row_end - row_start >= size ) {
+      return false;
+    }
+    memcpy(response + *used, rows.data() + row_start, row_end - row_start);
+    *used += row_end - row_start;
+    response[*used] = '\0';
+    row_start = row_end;
+  }
+  return true;
+}
+
+/**
+ * Looks up an rfc in this server's registry and picks a holder for it
+ * @param rfc_number number of the rfc
+ * @param os_string required OS of the holder, NULL for any
+ * @param exclude_port port of the requesting client, skipped when possible
+ * @param holder filled with the title, and with the chosen holder if any
+ * @param holder_os filled with the OS of the chosen holder, may be NULL
+ * @param nearest prefer the holder nearest the requesting client
+ * @return true if the rfc is registered; holder->port_number is 0 when no holder matches
+*/
+bool resolveLocal( int rfc_number, const char *os_string, int exclude_port, RFC_Node *holder, char *holder_os, bool nearest ) {
+  holder->port_number = 0;
+  holder->peer = 0;
+  RFC_Shard *shard = shardFor(rfc_number);
+  lockRegistry(&shard->lock);
+  RFC_Entry *entry = findRFCEntry(shard, rfc_number);
+  if( entry == NULL ) {
+    unlockRegistry(&shard->lock);
+    return false;
+  }
+  RFC_Node *chosen = selectHolder(shard, rfc_number, os_string, exclude_port, nearest);
+  if( chosen != NULL ) {
+    *holder = *chosen;
+  }
+  strcpy(holder->title, entry->title);
+  unlockRegistry(&shard->lock);
+
+  if( holder->port_number != 0 ) {
+    lockRegistry(&registry->lock);
+    Client_Node *peer = holderPeer(holder);
+    if( peer == NULL ) {
+      holder->port_number = 0;
+    } else if( holder_os != NULL ) {
+      strcpy(holder_os, peer->os_string);
+    }
+    unlockRegistry(&registry->lock);
+  }
+  return true;
+}
+
+// Defined with the cluster links, they route to the member owning the rfc
+bool resolveRFC( int rfc_number, const char *os_string, int exclude_port, RFC_Node *holder, char *holder_os, bool nearest );
+void registerRFC( const RFC_Node *row );
+
+/**
+ * Registers a client as another holder of an rfc that is already known
+ * @param rfc_number number of the rfc
+ * @param client_hostname hostname of client
+ * @param port port of client
+ * @param added filled with the registered row, including the title
+ * @return false if the rfc is not registered anywhere
+*/
+bool addHolder( int rfc_number, const char *client_hostname, int port, RFC_Node *added ) {
+  if( !resolveRFC(rfc_number, NULL, 0, added, NULL, false) ) {
+    return false;
+  }
+
+  added->path[0] = '\0';
+  findPeerPath(port, added->path);
+
+  strcpy(added->hostname, client_hostname);
+  added->port_number = port;
+  added->rfc_number = rfc_number;
+  added->content_hash[0] = '\0';
+  added->registered_hash[0] = '\0';
+  added->hash_mtime = 0;
+  added->hash_size = -1;
+  added->next = 0;
+  added->next_holder = 0;
+
+  registerRFC(added);
+  return true;
+}
+
+/**
+ * Add command logic
+ * Adds an existing rfc to the rfc_list 
+ * Used after calling the GET command to update the list
+ * @param buffer input of the client
+ * @param client_hostname client's hostname
+ * @param port number of client
+ * @return response of the server
+*/
+char* addCommand(char *buffer, char *client_hostname, int __port) {
+  char *response = new char[1024];
+  response[0] = '\0';
+  char command[4];
+  char rfc[4];
+  int rfc_number_str = 0;
+  char version[12];
+  char str_host[50];
+  int port_user = 0;
+  
+  command[0] = rfc[0] = version[0] = '\0';
+  sscanf(buffer, "%3s%3s%d%11s%49s%d", command, rfc, &rfc_number_str, version, str_host, &port_user);
+  //Invalid command
+  if(strcmp(command, "ADD") != 0) {
+    strcat(response, "P2P-CI/1.0 400 Bad Request\n");
+    return response;
+  }
+  //Invalid command
+  if(strcmp(rfc, "RFC") != 0) {
+    strcat(response, "P2P-CI/1.0 400 Bad Request\n");
+    return response;
+  }
+  //Invalid P2P
+  if(strcmp(version, "P2P-CI/1.0") != 0) {
+    strcat(response, "P2P-CI/1.0 505 P2P-CI Version Not Supported\n");
+    return response;
+  }
+  //Invalid port
+  if(__port != port_user) {
+    strcat(response, "P2P-CI/1.0 400 Bad Request\n");
+    return response;
+  }
+
+  bool client_flag_found = false;
+  bool rfc_flag = false;
+  client_flag_found = clientHostKnown(str_host, client_hostname);
+
+  if(client_flag_found == false) {
+    strcat(response, "P2P-CI/1.0 404 Not Found\n");
+    return response;
+  }
+
+  RFC_Node nodeToAdd;
+  rfc_flag = addHolder(rfc_number_str, client_hostname, __port, &nodeToAdd);
+
+  if(rfc_flag == false) {
+    strcat(response, "P2P-CI/1.0 404 Not Found\n");
+    return response;
+  }
+
+  strcat(response, "Title: ");
+  strcat(response, nodeToAdd.title);
+
+  return response;
+}
+
+/**
+ * Lookup command to lookup the title of an RFC given the number
+ * @param buffer client input
+ * @param client_hostname hostname of client
+ * @param nearest name the holder nearest the client instead of the least loaded
+ * @return response of the server
+*/
+char* lookupCommand(char *buffer, char *client_hostname, int __port, bool nearest) {
+
+  char *response = new char[1024];
   response[0] = '\0';
   char command[7];
   char rfc[4];
@@ -303,7 +1585,8 @@ char* lookupCommand(char *buffer, char *client_hostname, int __port) {
   char version[12];
   char str_host[50];
   int user_port = 0;
-  sscanf(buffer, "%s%s%d%s%s%d", command, rfc, &rfc_number_str, version, str_host, &user_port);
+  command[0] = rfc[0] = version[0] = '\0';
+  sscanf(buffer, "%6s%3s%d%11s%49s%d", command, rfc, &rfc_number_str, version, str_host, &user_port);
 
   //Invalid command
   if(strcmp(command, "LOOKUP") != 0) {
@@ -323,490 +1606,5546 @@ char* lookupCommand(char *buffer, char *client_hostname, int __port) {
     return response;
   }
 
-  if(__port != user_port) {
-     strcat(response, "P2P-CI/1.0 400 Bad Request\n");
-    return response;
-  }
+  if(__port != user_port) {
+     strcat(response, "P2P-CI/1.0 400 Bad Request\n");
+    return response;
+  }
+
+
+  // Look for the host
+  bool client_flag_found = false;
+  bool rfc_flag = false;
+  client_flag_found = clientHostKnown(str_host, client_hostname);
+
+  char holder_line[300];
+  holder_line[0] = '\0';
+  RFC_Node holder;
+  rfc_flag = resolveRFC(rfc_number_str, NULL, __port, &holder, NULL, nearest);
+  if( rfc_flag && holder.port_number != 0 ) {
+    snprintf(holder_line, sizeof(holder_line), "Holder: %s %d\n", holder.hostname, holder.port_number);
+  }
+
+  if(rfc_flag == false) {
+    strcat(response, "P2P-CI/1.0 404 Not Found\n");
+    return response;
+  }
+
+  if(client_flag_found == false) {
+    strcat(response, "P2P-CI/1.0 404 Not Found\n");
+    return response;
+  }
+
+  if( rfc_flag == true && client_flag_found == true) {
+    strcat(response, "Title: ");
+    strcat(response, holder.title);
+    strcat(response, "\n");
+    strcat(response, holder_line);
+  }
+
+  return response;
+}
+
+/**
+ * Sends a whole buffer, retrying on short writes
+ * @param socket socket connection to the client
+ * @param data bytes to send
+ * @param length number of bytes
+ * @return true if everything was sent
+*/
+bool sendAll( int socket, const char *data, size_t length ) {
+  while( length > 0 ) {
+    ssize_t sent = send(socket, data, length, MSG_NOSIGNAL);
+    if( sent <= 0 ) {
+      if( sent == -1 && errno == EINTR ) {
+        continue;
+      }
+      return false;
+    }
+    data += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+/**
+ * Lazily started coroutine returning a value to the coroutine awaiting it
+ * Awaiting it runs the body on the awaiting thread. A body that finishes
+ * without suspending returns to the awaiter like a call, one that suspended
+ * resumes the awaiter directly when it finishes. Unoptimized builds do not
+ * turn symmetric transfer into tail calls, so chaining every completion
+ * would grow the stack with each await until the handler suspends.
+*/
+template<typename T>
+struct Co {
+    struct promise_type {
+        T value;
+        std::coroutine_handle<> continuation;
+        // Set while the awaiter's await_suspend is running the body
+        bool inline_start = false;
+
+        Co get_return_object() {
+          return Co(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        struct Final_Awaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend( std::coroutine_handle<promise_type> handle ) noexcept {
+              if( handle.promise().inline_start ) {
+                return std::noop_coroutine();
+              }
+              return handle.promise().continuation;
+            }
+            void await_resume() noexcept {}
+        };
+        Final_Awaiter final_suspend() noexcept { return {}; }
+        void return_value( T result ) { value = result; }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Co( std::coroutine_handle<promise_type> h ) : handle(h) {}
+    Co( Co &&other ) noexcept : handle(other.handle) { other.handle = nullptr; }
+    Co( const Co & ) = delete;
+    ~Co() {
+      if( handle ) {
+        handle.destroy();
+      }
+    }
+
+    bool await_ready() { return false; }
+    bool await_suspend( std::coroutine_handle<> awaiter ) {
+      handle.promise().continuation = awaiter;
+      handle.promise().inline_start = true;
+      handle.resume();
+      handle.promise().inline_start = false;
+      return !handle.done();
+    }
+    T await_resume() { return handle.promise().value; }
+};
+
+/**
+ * Coroutine that starts immediately and frees itself when it finishes,
+ * used for connection handlers nobody awaits
+*/
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+//Structure for the io_uring of an event loop, mapped without liburing
+//Only the loop's own thread submits and reaps, so no locking is needed
+struct Uring {
+    // -1 when io_uring is unavailable and file operations run inline
+    int fd;
+    // Signalled by the kernel on completions, watched by the loop's epoll
+    int event_fd;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    // Entries queued since the last io_uring_enter
+    unsigned pending;
+};
+
+//Structure for an event loop thread running connection handlers
+//Handlers suspend on socket readiness instead of blocking their thread
+struct Event_Loop {
+    int epoll_fd;
+    // Signalled when accepted sockets or finished offloaded calls are queued for the loop
+    int wake_fd;
+    pthread_mutex_t lock;
+    // Sockets with the handoff record of a connection taken over from the
+    // previous server, empty for a newly accepted one
+    std::vector<std::pair<int, std::string>> accepted;
+    pthread_t thread;
+    Uring ring;
+    // Node whose memory the loop's thread allocates from, -1 to leave it to the kernel
+    int node;
+    // Handlers whose offloaded calls have finished, resumed on the next wake
+    std::vector<std::coroutine_handle<>> offloaded;
+};
+
+// Event loops of this process, accepted connections are dealt round robin
+std::vector<Event_Loop *> event_loops;
+std::atomic<unsigned> next_loop(0);
+// Number of event loop threads, 0 means one per processor
+int loop_threads = 0;
+// CPUs the event loops of this process are pinned to, loop i on the i-th
+// modulo their count; empty when -a is not given
+std::vector<int> loop_cpus;
+// Slot of a -w worker, taken over by the replacement of a worker that
+// exits, -1 for a single process
+int worker_slot = -1;
+
+/**
+ * Sets up an io_uring for an event loop and maps its rings
+ * Leaves ring->fd at -1 if the kernel does not allow io_uring
+ * @param ring ring to set up
+*/
+void uringInit( Uring *ring ) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  ring->event_fd = -1;
+  ring->pending = 0;
+  if( ring->fd == -1 ) {
+    return;
+  }
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if( params.features & IORING_FEAT_SINGLE_MMAP ) {
+    sq_size = cq_size = std::max(sq_size, cq_size);
+  }
+  char *sq = (char *)mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  char *cq = sq;
+  if( sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP) ) {
+    cq = (char *)mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  }
+  ring->sqes = (struct io_uring_sqe *)mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if( sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED || ring->event_fd == -1
+      || syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_EVENTFD, &ring->event_fd, 1) == -1 ) {
+    fail("Error mapping io_uring");
+  }
+
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+}
+
+/**
+ * Hands the queued entries to the kernel in one system call
+ * @param ring event loop's ring
+*/
+void uringSubmit( Uring *ring ) {
+  while( ring->pending > 0 ) {
+    int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->pending, 0, 0, NULL, 0);
+    if( submitted == -1 ) {
+      if( errno == EINTR || errno == EAGAIN || errno == EBUSY ) {
+        continue;
+      }
+      fail("io_uring_enter() error");
+    }
+    ring->pending -= submitted;
+  }
+}
+
+//Structure for a file operation awaited on an event loop's io_uring
+//The entry is queued when the handler suspends and submitted with the
+//rest of the loop's batch, the loop resumes the handler on completion
+struct Uring_Op {
+    Uring *ring;
+    struct io_uring_sqe sqe;
+    int result;
+    std::coroutine_handle<> waiter;
+
+    bool await_ready() { return false; }
+    void await_suspend( std::coroutine_handle<> handle ) {
+      waiter = handle;
+      // A full queue is flushed first, the kernel copies entries on submit
+      if( ring->pending > ring->sq_mask ) {
+        uringSubmit(ring);
+      }
+      unsigned tail = *ring->sq_tail;
+      unsigned index = tail & ring->sq_mask;
+      sqe.user_data = (uint64_t)(uintptr_t)this;
+      ring->sqes[index] = sqe;
+      ring->sq_array[index] = index;
+      __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+      ring->pending++;
+    }
+    int await_resume() { return result; }
+};
+
+/**
+ * Resumes the handlers whose file operations have completed
+ * @param ring event loop's ring
+*/
+void uringReap( Uring *ring ) {
+  uint64_t count;
+  if( read(ring->event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN ) {
+    fail("eventfd read() error");
+  }
+  while( true ) {
+    unsigned head = *ring->cq_head;
+    if( head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) ) {
+      break;
+    }
+    struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    Uring_Op *op = (Uring_Op *)(uintptr_t)cqe->user_data;
+    op->result = cqe->res;
+    // The entry is released before the handler runs and queues more
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    op->waiter.resume();
+  }
+}
+
+/**
+ * Prepares an io_uring operation
+ * @param op operation to fill in
+ * @param ring event loop's ring
+ * @param opcode IORING_OP_ code
+ * @param fd file descriptor the operation works on
+*/
+void uringPrepare( Uring_Op *op, Uring *ring, int opcode, int fd ) {
+  memset(&op->sqe, 0, sizeof(op->sqe));
+  op->ring = ring;
+  op->sqe.opcode = opcode;
+  op->sqe.fd = fd;
+}
+
+/**
+ * Looks up the size and modification time of a file without blocking the loop
+ * @param loop event loop of the calling handler
+ * @param path file path
+ * @param info filled with the result
+ * @return 0, or a negative errno
+*/
+Co<int> fileStatx( Event_Loop *loop, const char *path, struct statx *info ) {
+  if( loop->ring.fd == -1 ) {
+    co_return statx(AT_FDCWD, path, 0, STATX_SIZE | STATX_MTIME, info) == 0 ? 0 : -errno;
+  }
+  Uring_Op op;
+  uringPrepare(&op, &loop->ring, IORING_OP_STATX, AT_FDCWD);
+  op.sqe.addr = (uint64_t)(uintptr_t)path;
+  op.sqe.len = STATX_SIZE | STATX_MTIME;
+  op.sqe.off = (uint64_t)(uintptr_t)info;
+  co_return co_await op;
+}
+
+/**
+ * Opens a file for reading without blocking the loop
+ * @param loop event loop of the calling handler
+ * @param path file path
+ * @return file descriptor, or a negative errno
+*/
+Co<int> fileOpen( Event_Loop *loop, const char *path ) {
+  if( loop->ring.fd == -1 ) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    co_return fd == -1 ? -errno : fd;
+  }
+  Uring_Op op;
+  uringPrepare(&op, &loop->ring, IORING_OP_OPENAT, AT_FDCWD);
+  op.sqe.addr = (uint64_t)(uintptr_t)path;
+  op.sqe.open_flags = O_RDONLY | O_CLOEXEC;
+  co_return co_await op;
+}
+
+/**
+ * Reads part of a file without blocking the loop
+ * @param loop event loop of the calling handler
+ * @param fd open file
+ * @param buffer destination
+ * @param length bytes wanted
+ * @param offset file offset to read at
+ * @return bytes read, 0 at the end of the file, or a negative errno
+*/
+Co<int> fileRead( Event_Loop *loop, int fd, char *buffer, size_t length, off_t offset ) {
+  if( loop->ring.fd == -1 ) {
+    ssize_t bytes = pread(fd, buffer, length, offset);
+    co_return bytes == -1 ? -errno : (int)bytes;
+  }
+  Uring_Op op;
+  uringPrepare(&op, &loop->ring, IORING_OP_READ, fd);
+  op.sqe.addr = (uint64_t)(uintptr_t)buffer;
+  op.sqe.len = length;
+  op.sqe.off = offset;
+  co_return co_await op;
+}
+
+//Structure for a blocking call run by the offload pool while its handler
+//is suspended, so the loop keeps serving its other clients meanwhile.
+//The pool hands the handler back to its loop, which resumes it
+struct Offload_Op {
+    Event_Loop *loop;
+    std::function<void()> work;
+    std::coroutine_handle<> waiter;
+
+    bool await_ready() { return false; }
+    void await_suspend( std::coroutine_handle<> handle );
+    void await_resume() {}
+};
+
+// Calls waiting for an offload thread
+std::deque<Offload_Op *> offload_queue;
+/** Mutex lock for the offload queue */
+pthread_mutex_t offload_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t offload_ready = PTHREAD_COND_INITIALIZER;
+
+void Offload_Op::await_suspend( std::coroutine_handle<> handle ) {
+  waiter = handle;
+  pthread_mutex_lock(&offload_lock);
+  offload_queue.push_back(this);
+  pthread_cond_signal(&offload_ready);
+  pthread_mutex_unlock(&offload_lock);
+}
+
+/**
+ * Runs a blocking call on the offload pool without holding up the loop
+ * @param loop event loop of the calling handler
+ * @param work call to make
+ * @return true once the call has returned
+*/
+Co<bool> offload( Event_Loop *loop, std::function<void()> work ) {
+  Offload_Op op;
+  op.loop = loop;
+  op.work = work;
+  co_await op;
+  co_return true;
+}
+
+//Structure for a connection's entry in the timer wheel
+struct Conn_Timer {
+    struct Client_Conn *conn;
+    // Wheel slot holding the timer, -1 while it is not in the wheel
+    int slot;
+    int rounds;
+    struct Conn_Timer *prev;
+    struct Conn_Timer *next;
+};
+
+//Structure for the sending side and liveness state of a client connection
+//Responses and pushed events share the socket, so whole messages are
+//queued in the outbox under the send lock and written in order
+struct Client_Conn {
+    int socket;
+    pthread_mutex_t send_lock;
+    // Queued bytes not yet accepted by the socket, the first outbox_sent are done
+    std::string outbox;
+    size_t outbox_sent;
+    // Set while the handler streams a multi part response, other senders
+    // queue into deferred until it ends so they cannot land in the middle
+    bool streaming;
+    std::string deferred;
+    // Set once a send fails or the client is dropped for not reading
+    bool send_failed;
+    // TLS session once the handshake is done, NULL for a plaintext client.
+    // Reads and writes both take the send lock, the session is not thread safe
+    SSL *tls;
+    Event_Loop *loop;
+    // Handler suspended on the socket, resumed by the loop when it is ready
+    std::coroutine_handle<> waiter;
+    // Updated whenever data arrives, read by the timer thread
+    std::atomic<time_t> last_activity;
+    std::atomic<bool> handshake_done;
+    std::atomic<bool> heartbeat_sent;
+    // Monotonic microseconds the unanswered heartbeat was sent at, or 0
+    std::atomic<long> heartbeat_at;
+    Conn_Timer timer;
+    // Set while the handler waits for the first byte of a request with
+    // nothing buffered, the only point where a drain may stop it
+    bool parked;
+};
+
+//Structure for the hashed timer wheel driving connection timeouts
+struct Timer_Wheel {
+    pthread_mutex_t lock;
+    Conn_Timer *slots[WHEEL_SLOTS];
+    int cursor;
+};
+
+Timer_Wheel timer_wheel = { PTHREAD_MUTEX_INITIALIZER, { NULL }, 0 };
+int handshake_timeout = HANDSHAKE_TIMEOUT;
+int idle_timeout = IDLE_TIMEOUT;
+pthread_t timerThread;
+
+/** Heartbeat frame, sent by the server to an idle client and echoed back */
+const char heartbeat_frame[] = "HEARTBEAT P2P-CI/1.0\n";
+// Context of the TLS clients, NULL unless -C and -K are given
+SSL_CTX *tls_context = NULL;
+// Off with -u, TLS records are then always made in user space
+bool kernel_tls = true;
+
+// Connections with a running handler, found by the drain
+std::set<Client_Conn *> client_conns;
+// Sockets and handoff records of connections stopped for the next server
+std::vector<std::pair<int, std::string>> handoff_conns;
+/** Mutex lock for the connection set and handoff records */
+pthread_mutex_t client_conns_lock = PTHREAD_MUTEX_INITIALIZER;
+// Set once the server stops, handlers end at their next request boundary
+std::atomic<bool> draining(false);
+// Set with draining when stopped handlers hand their connections over
+// instead of closing them
+std::atomic<bool> handing_off(false);
+
+/**
+ * Counts the bytes queued on a connection that the socket has not taken
+ * Must be called with the send lock held
+ * @param conn client connection
+ * @return queued bytes
+*/
+size_t outboxPending( Client_Conn *conn ) {
+  return conn->outbox.size() - conn->outbox_sent + conn->deferred.size();
+}
+
+/**
+ * Writes to a client connection without blocking, through its TLS session
+ * if it has one
+ * Must be called with the send lock held
+ * @param conn client connection
+ * @param data bytes to send
+ * @param length number of bytes, not 0
+ * @return bytes written, or -1 with errno EAGAIN if the socket is full
+*/
+ssize_t connSendSome( Client_Conn *conn, const char *data, size_t length ) {
+  if( conn->tls == NULL ) {
+    return send(conn->socket, data, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+  }
+  ERR_clear_error();
+  int sent = SSL_write(conn->tls, data, std::min(length, (size_t)INT_MAX));
+  if( sent > 0 ) {
+    return sent;
+  }
+  int error = SSL_get_error(conn->tls, sent);
+  errno = error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ ? EAGAIN : EPIPE;
+  return -1;
+}
+
+/**
+ * Writes as much of a connection's outbox as the socket accepts without blocking
+ * Must be called with the send lock held
+ * @param conn client connection
+ * @return false if the connection failed
+*/
+bool flushOutbox( Client_Conn *conn ) {
+  if( conn->send_failed ) {
+    return false;
+  }
+  while( conn->outbox_sent < conn->outbox.size() ) {
+    ssize_t sent = connSendSome(conn, conn->outbox.data() + conn->outbox_sent,
+                                conn->outbox.size() - conn->outbox_sent);
+    if( sent == -1 && errno == EINTR ) {
+      continue;
+    }
+    if( sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ) {
+      // A partly drained outbox is compacted so it never outgrows the high watermark
+      if( conn->outbox_sent >= OUTBOX_LOW_WATER ) {
+        conn->outbox.erase(0, conn->outbox_sent);
+        conn->outbox_sent = 0;
+      }
+      return true;
+    }
+    if( sent <= 0 ) {
+      conn->send_failed = true;
+      return false;
+    }
+    conn->outbox_sent += sent;
+  }
+  // Memory left by a large burst is given back
+  if( conn->outbox.capacity() > OUTBOX_HIGH_WATER ) {
+    std::string().swap(conn->outbox);
+  }
+  conn->outbox.clear();
+  conn->outbox_sent = 0;
+  return true;
+}
+
+/**
+ * Arms a connection's socket for both directions so its loop flushes
+ * the outbox once the socket drains, any suspended handler rechecks its wait
+ * @param conn client connection
+*/
+void armConnection( Client_Conn *conn ) {
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLONESHOT;
+  event.data.ptr = conn;
+  epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_MOD, conn->socket, &event);
+}
+
+/**
+ * Queues a whole message on a client connection from outside its handler
+ * Never blocks, what the socket does not take now is sent by the loop.
+ * A client whose queue reaches OUTBOX_LIMIT is not reading at all and is
+ * shut down, which wakes its handler to remove the registration.
+ * @param conn client connection
+ * @param data bytes to send
+ * @param length number of bytes
+ * @return false if the connection failed
+*/
+bool connSend( Client_Conn *conn, const char *data, size_t length ) {
+  pthread_mutex_lock(&conn->send_lock);
+  bool sent = !conn->send_failed;
+  if( sent && outboxPending(conn) + length > OUTBOX_LIMIT ) {
+    std::cout << "Dropping client on socket " << conn->socket << ", it stopped reading" << std::endl;
+    conn->send_failed = true;
+    shutdown(conn->socket, SHUT_RDWR);
+    sent = false;
+  }
+  if( sent && conn->streaming ) {
+    conn->deferred.append(data, length);
+  } else if( sent ) {
+    conn->outbox.append(data, length);
+    sent = flushOutbox(conn);
+    if( sent && !conn->outbox.empty() ) {
+      armConnection(conn);
+    }
+  }
+  pthread_mutex_unlock(&conn->send_lock);
+  return sent;
+}
+
+/**
+ * Awaitable that suspends a handler until its socket is ready
+ * The socket is registered one shot, so each wait re-arms it
+*/
+struct IO_Wait {
+    Client_Conn *conn;
+    uint32_t events;
+
+    bool await_ready() { return false; }
+    void await_suspend( std::coroutine_handle<> handle ) {
+      conn->waiter = handle;
+      struct epoll_event event;
+      event.events = events | EPOLLONESHOT;
+      event.data.ptr = conn;
+      pthread_mutex_lock(&conn->send_lock);
+      if( !conn->outbox.empty() ) {
+        event.events |= EPOLLOUT;
+      }
+      pthread_mutex_unlock(&conn->send_lock);
+      epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_MOD, conn->socket, &event);
+    }
+    void await_resume() {
+      conn->waiter = nullptr;
+      pthread_mutex_lock(&conn->send_lock);
+      flushOutbox(conn);
+      pthread_mutex_unlock(&conn->send_lock);
+    }
+};
+
+/**
+ * Suspends a handler while its client is behind on reading
+ * Once more than trigger bytes are queued, waits until at most target remain
+ * @param conn client connection
+ * @param trigger queued bytes that start the wait
+ * @param target queued bytes that end it
+ * @return false if the connection failed
+*/
+Co<bool> outboxDrain( Client_Conn *conn, size_t trigger, size_t target ) {
+  pthread_mutex_lock(&conn->send_lock);
+  bool sent = flushOutbox(conn);
+  bool waiting = sent && outboxPending(conn) > trigger;
+  pthread_mutex_unlock(&conn->send_lock);
+  while( waiting ) {
+    co_await IO_Wait{conn, EPOLLOUT};
+    pthread_mutex_lock(&conn->send_lock);
+    sent = flushOutbox(conn);
+    waiting = sent && outboxPending(conn) > target;
+    pthread_mutex_unlock(&conn->send_lock);
+  }
+  co_return sent;
+}
+
+/**
+ * Queues a whole message from a connection's handler
+ * Returns once the socket took it or the queue is below the high
+ * watermark, so a slow client holds up only its own handler
+ * @param conn client connection
+ * @param data bytes to send
+ * @param length number of bytes
+ * @return false if the connection failed
+*/
+Co<bool> connWrite( Client_Conn *conn, const char *data, size_t length ) {
+  pthread_mutex_lock(&conn->send_lock);
+  conn->outbox.append(data, length);
+  pthread_mutex_unlock(&conn->send_lock);
+  co_return co_await outboxDrain(conn, OUTBOX_HIGH_WATER, OUTBOX_LOW_WATER);
+}
+
+/**
+ * Starts a multi part response, messages from other threads are held back
+ * @param conn client connection
+*/
+void connBeginStream( Client_Conn *conn ) {
+  pthread_mutex_lock(&conn->send_lock);
+  conn->streaming = true;
+  pthread_mutex_unlock(&conn->send_lock);
+}
+
+/**
+ * Ends a multi part response and queues the messages held back meanwhile
+ * @param conn client connection
+*/
+Co<bool> connEndStream( Client_Conn *conn ) {
+  pthread_mutex_lock(&conn->send_lock);
+  conn->streaming = false;
+  conn->outbox += conn->deferred;
+  std::string().swap(conn->deferred);
+  pthread_mutex_unlock(&conn->send_lock);
+  co_return co_await outboxDrain(conn, OUTBOX_HIGH_WATER, OUTBOX_LOW_WATER);
+}
+
+/**
+ * Reads the monotonic clock
+ * @return microseconds since an arbitrary start
+*/
+long monotonicMicros() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+/**
+ * Takes the round trip time of a heartbeat from its echo
+ * @param conn client connection the echo arrived on
+ * @param port port number of the client
+*/
+void heartbeatEchoed( Client_Conn *conn, int port ) {
+  long sent = conn->heartbeat_at.exchange(0);
+  if( sent != 0 ) {
+    peerRttSample(port, monotonicMicros() - sent);
+  }
+}
+
+/**
+ * Places a connection timer in the wheel to fire after a delay
+ * Must be called with the wheel lock held
+ * @param timer connection timer, not currently in the wheel
+ * @param seconds delay in seconds, at least one
+*/
+void timerInsert( Conn_Timer *timer, int seconds ) {
+  if( seconds < 1 ) {
+    seconds = 1;
+  }
+  timer->slot = (timer_wheel.cursor + seconds) % WHEEL_SLOTS;
+  timer->rounds = (seconds - 1) / WHEEL_SLOTS;
+  timer->prev = NULL;
+  timer->next = timer_wheel.slots[timer->slot];
+  if( timer->next != NULL ) {
+    timer->next->prev = timer;
+  }
+  timer_wheel.slots[timer->slot] = timer;
+}
+
+/**
+ * Takes a connection timer out of the wheel
+ * A timer that already fired without being rescheduled, such as an
+ * evicted client's, is not in the wheel and is left alone
+ * Must be called with the wheel lock held
+ * @param timer connection timer
+*/
+void timerUnlink( Conn_Timer *timer ) {
+  if( timer->slot == -1 ) {
+    return;
+  }
+  if( timer->prev != NULL ) {
+    timer->prev->next = timer->next;
+  } else {
+    timer_wheel.slots[timer->slot] = timer->next;
+  }
+  if( timer->next != NULL ) {
+    timer->next->prev = timer->prev;
+  }
+  timer->slot = -1;
+  timer->prev = NULL;
+  timer->next = NULL;
+}
+
+/**
+ * Starts timing a new connection against the handshake timeout
+ * @param conn client connection
+*/
+void timerStart( Client_Conn *conn ) {
+  conn->timer.conn = conn;
+  conn->timer.slot = -1;
+  conn->last_activity = time(NULL);
+  conn->handshake_done = false;
+  conn->heartbeat_sent = false;
+  conn->heartbeat_at = 0;
+  pthread_mutex_lock(&timer_wheel.lock);
+  timerInsert(&conn->timer, handshake_timeout);
+  pthread_mutex_unlock(&timer_wheel.lock);
+}
+
+/**
+ * Stops timing a connection that is being closed
+ * @param conn client connection
+*/
+void timerStop( Client_Conn *conn ) {
+  pthread_mutex_lock(&timer_wheel.lock);
+  timerUnlink(&conn->timer);
+  pthread_mutex_unlock(&timer_wheel.lock);
+}
+
+/**
+ * Handles an expired connection timer
+ * Activity since the timer was set only reschedules it. An idle client
+ * first gets a heartbeat and is shut down if the idle timeout passes
+ * anyway, which wakes its thread so the registration is removed.
+ * Must be called with the wheel lock held, never blocks
+ * @param conn client connection whose timer fired
+ * @param now current time
+*/
+void timerExpired( Client_Conn *conn, time_t now ) {
+  int limit = conn->handshake_done ? idle_timeout : handshake_timeout;
+  int idle = now - conn->last_activity;
+  if( idle >= limit ) {
+    std::cout << "Evicting idle client on socket " << conn->socket << std::endl;
+    shutdown(conn->socket, SHUT_RDWR);
+    return;
+  }
+
+  if( conn->handshake_done && idle >= limit / 2 && !conn->heartbeat_sent ) {
+    conn->heartbeat_at = monotonicMicros();
+    connSend(conn, heartbeat_frame, strlen(heartbeat_frame));
+    conn->heartbeat_sent = true;
+    timerInsert(&conn->timer, limit - idle);
+    return;
+  }
+
+  int next = conn->handshake_done && idle < limit / 2 ? limit / 2 - idle : limit - idle;
+  timerInsert(&conn->timer, next);
+}
+
+/**
+ * Thread function that advances the timer wheel once per second
+ * @param unused thread argument
+*/
+void *runTimerWheel( void *unused ) {
+  struct timespec last;
+  clock_gettime(CLOCK_MONOTONIC, &last);
+  while( true ) {
+    sleep(1);
+    struct timespec current;
+    clock_gettime(CLOCK_MONOTONIC, &current);
+    long ticks = current.tv_sec - last.tv_sec;
+    last.tv_sec += ticks;
+
+    pthread_mutex_lock(&timer_wheel.lock);
+    for( long tick = 0; tick < ticks; tick++ ) {
+      timer_wheel.cursor = (timer_wheel.cursor + 1) % WHEEL_SLOTS;
+      Conn_Timer *expired = NULL;
+      Conn_Timer *timer = timer_wheel.slots[timer_wheel.cursor];
+      while( timer != NULL ) {
+        Conn_Timer *next = timer->next;
+        if( timer->rounds > 0 ) {
+          timer->rounds--;
+        } else {
+          // Unlinked timers are chained through next until they are handled
+          timerUnlink(timer);
+          timer->next = expired;
+          expired = timer;
+        }
+        timer = next;
+      }
+      time_t now = time(NULL);
+      while( expired != NULL ) {
+        Conn_Timer *next = expired->next;
+        expired->next = NULL;
+        timerExpired(expired->conn, now);
+        expired = next;
+      }
+    }
+    pthread_mutex_unlock(&timer_wheel.lock);
+  }
+  return NULL;
+}
+
+/**
+ * Enables TCP keepalive on a client socket so dead hosts are noticed
+ * even when the client never sends a FIN
+ * @param socket accepted client socket
+*/
+void configureKeepalive( int socket ) {
+  int enable = 1;
+  int idle = idle_timeout / 2 > 1 ? idle_timeout / 2 : 1;
+  int interval = KEEPALIVE_INTERVAL;
+  int count = KEEPALIVE_COUNT;
+  setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+  setsockopt(socket, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+  setsockopt(socket, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+  setsockopt(socket, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+}
+
+/**
+ * Buffered reader for the newline framed messages a client sends
+*/
+struct Conn_Reader {
+    int socket;
+    // Connection whose timer is refreshed on receive, NULL for cluster links
+    Client_Conn *conn;
+    char data[1024];
+    size_t start;
+    size_t end;
+};
+
+/**
+ * Moves buffered bytes into a line until a newline is found
+ * The newline is stripped, overlong lines are truncated to fit
+ * @param reader connection reader
+ * @param line destination buffer
+ * @param size size of the destination buffer
+ * @param length bytes of the line gathered so far, updated
+ * @return true if the line is complete
+*/
+bool takeLine( Conn_Reader *reader, char *line, size_t size, size_t *length ) {
+  while( reader->start < reader->end ) {
+    char c = reader->data[reader->start++];
+    if( c == '\n' ) {
+      line[*length] = '\0';
+      return true;
+    }
+    if( *length < size - 1 ) {
+      line[(*length)++] = c;
+    }
+  }
+  return false;
+}
+
+/**
+ * Records that data arrived on a reader's connection
+ * @param reader connection reader that just received bytes
+ * @param bytes number of bytes received
+*/
+void readerFilled( Conn_Reader *reader, ssize_t bytes ) {
+  reader->start = 0;
+  reader->end = bytes;
+  if( reader->conn != NULL ) {
+    reader->conn->last_activity = time(NULL);
+    reader->conn->heartbeat_sent = false;
+    reader->conn->parked = false;
+  }
+}
+
+/**
+ * Reads one newline terminated line from a blocking socket
+ * @param reader connection reader
+ * @param line destination buffer
+ * @param size size of the destination buffer
+ * @return length of the line, 0 on disconnect and -1 on error
+*/
+ssize_t recvLine( Conn_Reader *reader, char *line, size_t size ) {
+  size_t length = 0;
+  while( !takeLine(reader, line, size, &length) ) {
+    ssize_t bytes = recv(reader->socket, reader->data, sizeof(reader->data), 0);
+    if( bytes <= 0 ) {
+      line[length] = '\0';
+      return bytes;
+    }
+    readerFilled(reader, bytes);
+  }
+  return length;
+}
+
+/**
+ * Reads what a client sent without blocking, through its TLS session if
+ * it has one
+ * @param conn client connection
+ * @param data destination buffer
+ * @param size size of the destination buffer
+ * @param events set to the socket events to wait for before trying again,
+ *               0 unless nothing could be read yet
+ * @return bytes received, 0 on disconnect and -1 on error or to wait
+*/
+ssize_t connRecv( Client_Conn *conn, char *data, size_t size, uint32_t *events ) {
+  *events = 0;
+  if( conn->tls == NULL ) {
+    ssize_t bytes = recv(conn->socket, data, size, 0);
+    if( bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ) {
+      *events = EPOLLIN;
+    }
+    return bytes;
+  }
+  // Senders on other threads write through the same session
+  pthread_mutex_lock(&conn->send_lock);
+  ERR_clear_error();
+  int bytes = SSL_read(conn->tls, data, size);
+  int error = bytes > 0 ? SSL_ERROR_NONE : SSL_get_error(conn->tls, bytes);
+  pthread_mutex_unlock(&conn->send_lock);
+  if( error == SSL_ERROR_WANT_READ ) {
+    *events = EPOLLIN;
+  } else if( error == SSL_ERROR_WANT_WRITE ) {
+    *events = EPOLLOUT;
+  } else if( error == SSL_ERROR_ZERO_RETURN ) {
+    return 0;
+  } else if( error != SSL_ERROR_NONE ) {
+    errno = EIO;
+  }
+  return bytes > 0 ? bytes : -1;
+}
+
+/**
+ * Refills an empty reader from the client, suspending the handler until
+ * data arrives. No more requests are read from a client while its output
+ * is above the high watermark.
+ * @param reader connection reader of a client connection, all bytes taken
+ * @return bytes received, 0 on disconnect and -1 on error or a drain
+*/
+Co<ssize_t> readerRefill( Conn_Reader *reader ) {
+  while( true ) {
+    if( reader->conn->parked && draining ) {
+      co_return -1;
+    }
+    if( !co_await outboxDrain(reader->conn, OUTBOX_HIGH_WATER, OUTBOX_LOW_WATER) ) {
+      co_return -1;
+    }
+    uint32_t events;
+    ssize_t bytes = connRecv(reader->conn, reader->data, sizeof(reader->data), &events);
+    if( events != 0 ) {
+      co_await IO_Wait{reader->conn, events};
+      continue;
+    }
+    if( bytes == -1 && errno == EINTR ) {
+      continue;
+    }
+    if( bytes > 0 ) {
+      readerFilled(reader, bytes);
+    }
+    co_return bytes;
+  }
+}
+
+/**
+ * Reads one newline terminated line from the client
+ * @param reader connection reader of a client connection
+ * @param line destination buffer
+ * @param size size of the destination buffer
+ * @return length of the line, 0 on disconnect and -1 on error
+*/
+Co<ssize_t> readLine( Conn_Reader *reader, char *line, size_t size ) {
+  size_t length = 0;
+  while( !takeLine(reader, line, size, &length) ) {
+    ssize_t bytes = co_await readerRefill(reader);
+    if( bytes <= 0 ) {
+      line[length] = '\0';
+      co_return bytes;
+    }
+  }
+  co_return (ssize_t)length;
+}
+
+/**
+ * Reads an exact number of bytes from the client
+ * @param reader connection reader of a client connection
+ * @param data destination buffer
+ * @param length number of bytes
+ * @return false on disconnect or error
+*/
+Co<bool> readBytes( Conn_Reader *reader, char *data, size_t length ) {
+  size_t taken = 0;
+  while( taken < length ) {
+    if( reader->start == reader->end ) {
+      ssize_t bytes = co_await readerRefill(reader);
+      if( bytes <= 0 ) {
+        co_return false;
+      }
+    }
+    size_t part = std::min(length - taken, reader->end - reader->start);
+    memcpy(data + taken, reader->data + reader->start, part);
+    reader->start += part;
+    taken += part;
+  }
+  co_return true;
+}
+
+/**
+ * Waits for the next byte from the client without taking it
+ * @param reader connection reader of a client connection
+ * @return the byte, or -1 on disconnect or error
+*/
+Co<int> readerPeek( Conn_Reader *reader ) {
+  if( reader->start == reader->end ) {
+    ssize_t bytes = co_await readerRefill(reader);
+    if( bytes <= 0 ) {
+      co_return -1;
+    }
+  }
+  co_return (unsigned char)reader->data[reader->start];
+}
+
+/**
+ * Decodes an unsigned LEB128 varint
+ * @param data encoded bytes
+ * @param length number of bytes
+ * @param at position to decode at, advanced past the varint
+ * @param value decoded value
+ * @return false if the bytes end before the varint does or it is too long
+*/
+bool takeVarint( const char *data, size_t length, size_t *at, unsigned long *value ) {
+  *value = 0;
+  for( int shift = 0; *at < length && shift < 64; shift += 7 ) {
+    unsigned char byte = data[(*at)++];
+    *value |= (unsigned long)(byte & 0x7f) << shift;
+    if( (byte & 0x80) == 0 ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Reads an unsigned LEB128 varint from the client
+ * @param reader connection reader of a client connection
+ * @param value decoded value
+ * @return false on disconnect, error or an overlong varint
+*/
+Co<bool> readVarint( Conn_Reader *reader, unsigned long *value ) {
+  char encoded[10];
+  for( size_t length = 1; length <= sizeof(encoded); length++ ) {
+    if( !co_await readBytes(reader, encoded + length - 1, 1) ) {
+      co_return false;
+    }
+    if( (encoded[length - 1] & 0x80) == 0 ) {
+      size_t at = 0;
+      co_return takeVarint(encoded, length, &at, value);
+    }
+  }
+  co_return false;
+}
+
+//Structure for a server of a federated cluster
+struct Cluster_Member {
+    char host[254];
+    int port;
+    // Address the member's links to this server come from
+    in_addr_t address;
+    // Links to the member not in use. A request takes one, or opens one
+    // when there is none, and puts it back once answered, so requests to
+    // the same member run side by side
+    std::vector<Conn_Reader *> idle_links;
+    /** Mutex lock for idle_links, never held while a link is in use */
+    pthread_mutex_t link_lock;
+};
+
+// Members of the cluster, empty when this server runs alone
+std::vector<Cluster_Member *> cluster;
+// Entry for this server in the cluster
+Cluster_Member *cluster_self = NULL;
+// Consistent hash ring: a key belongs to the member of the next point
+std::map<uint32_t, Cluster_Member *> cluster_ring;
+// Port the server listens on, -p
+int server_port = PORT;
+
+/**
+ * Hashes a key onto the ring
+ * FNV-1a followed by a final avalanche so nearby keys spread out
+ * @param key member point or rfc key
+ * @return position on the ring
+*/
+uint32_t ringHash( const std::string &key ) {
+  uint32_t hash = 2166136261u;
+  for( char c : key ) {
+    hash ^= (unsigned char)c;
+    hash *= 16777619u;
+  }
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+/**
+ * Builds the cluster and its hash ring from the -c member list
+ * Every member must be started with the same list
+ * @param members comma separated host:port list including this server
+*/
+void initCluster( char *members ) {
+  for( char *item = strtok(members, ","); item != NULL; item = strtok(NULL, ",") ) {
+    char *colon = strrchr(item, ':');
+    if( colon == NULL || atoi(colon + 1) <= 0 || colon - item >= 254 ) {
+      fail("cluster members are given as host:port");
+    }
+    Cluster_Member *member = new Cluster_Member;
+    member->host[0] = '\0';
+    strncat(member->host, item, colon - item);
+    member->port = atoi(colon + 1);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *address = NULL;
+    if( getaddrinfo(member->host, NULL, &hints, &address) != 0 ) {
+      fail("cluster member host not found");
+    }
+    member->address = ((struct sockaddr_in *)address->ai_addr)->sin_addr.s_addr;
+    freeaddrinfo(address);
+    pthread_mutex_init(&member->link_lock, NULL);
+    if( member->port == server_port ) {
+      cluster_self = member;
+    }
+    for( int i = 0; i < RING_POINTS; i++ ) {
+      cluster_ring[ringHash(std::string(item) + "#" + std::to_string(i))] = member;
+    }
+    cluster.push_back(member);
+  }
+  if( cluster_self == NULL ) {
+    fail("the cluster list must include this server's port");
+  }
+}
+
+/**
+ * Finds the cluster member that owns an rfc number
+ * @param rfc_number number of the rfc
+ * @return owning member, NULL when this server owns it
+*/
+Cluster_Member* ownerOf( int rfc_number ) {
+  if( cluster_ring.empty() ) {
+    return NULL;
+  }
+  std::map<uint32_t, Cluster_Member *>::iterator at = cluster_ring.lower_bound(ringHash("RFC " + std::to_string(rfc_number)));
+  if( at == cluster_ring.end() ) {
+    at = cluster_ring.begin();
+  }
+  return at->second == cluster_self ? NULL : at->second;
+}
+
+/**
+ * Tells whether a connection comes from a cluster member, the only ones
+ * allowed to open a link
+ * @param address source address of the connection
+ * @return true if clustering is on and a member has the address
+*/
+bool clusterMemberAt( in_addr_t address ) {
+  for( Cluster_Member *member : cluster ) {
+    if( member->address == address ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Opens a new link to a cluster member
+ * @param member member to connect to
+ * @return reader of the link, NULL if the member could not be reached
+*/
+Conn_Reader* clusterConnect( Cluster_Member *member ) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *address = NULL;
+  if( getaddrinfo(member->host, std::to_string(member->port).c_str(), &hints, &address) != 0 ) {
+    return NULL;
+  }
+  int link = socket(AF_INET, SOCK_STREAM, 0);
+  if( link == -1 || connect(link, address->ai_addr, address->ai_addrlen) == -1 ) {
+    freeaddrinfo(address);
+    if( link != -1 ) {
+      close(link);
+    }
+    return NULL;
+  }
+  freeaddrinfo(address);
+
+  // A member that stops answering fails the request instead of hanging it
+  struct timeval timeout;
+  timeout.tv_sec = HANDSHAKE_TIMEOUT;
+  timeout.tv_usec = 0;
+  setsockopt(link, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  if( !sendAll(link, CLUSTER_GREETING "\n", strlen(CLUSTER_GREETING) + 1) ) {
+    close(link);
+    return NULL;
+  }
+  Conn_Reader *reader = new Conn_Reader;
+  reader->socket = link;
+  reader->conn = NULL;
+  reader->start = 0;
+  reader->end = 0;
+  return reader;
+}
+
+/**
+ * Sends one request over a cluster link and collects the reply
+ * Replies are lines terminated by an END line
+ * @param member member to ask
+ * @param request request line, newline terminated
+ * @param reply filled with the reply lines, without the END line
+ * @return true if the member answered
+*/
+bool clusterRequest( Cluster_Member *member, const std::string &request, std::string &reply ) {
+  bool answered = false;
+  // An idle link the member closed since its last use is retried once on a new link
+  for( int attempt = 0; attempt < 2 && !answered; attempt++ ) {
+    Conn_Reader *link = NULL;
+    if( attempt == 0 ) {
+      pthread_mutex_lock(&member->link_lock);
+      if( !member->idle_links.empty() ) {
+        link = member->idle_links.back();
+        member->idle_links.pop_back();
+      }
+      pthread_mutex_unlock(&member->link_lock);
+    }
+    if( link == NULL && (link = clusterConnect(member)) == NULL ) {
+      break;
+    }
+    reply.clear();
+    if( sendAll(link->socket, request.data(), request.size()) ) {
+      char line[512];
+      while( recvLine(link, line, sizeof(line)) > 0 ) {
+        if( strcmp(line, "END") == 0 ) {
+          answered = true;
+          break;
+        }
+        reply += line;
+        reply += "\n";
+      }
+    }
+    if( answered ) {
+      pthread_mutex_lock(&member->link_lock);
+      member->idle_links.push_back(link);
+      pthread_mutex_unlock(&member->link_lock);
+    } else {
+      close(link->socket);
+      delete link;
+    }
+  }
+  return answered;
+}
+
+/**
+ * Looks up an rfc at the cluster member owning it and picks a holder
+ * @param rfc_number number of the rfc
+ * @param os_string required OS of the holder, NULL for any
+ * @param exclude_port port of the requesting client, skipped when possible
+ * @param holder filled with the title, and with the chosen holder if any
+ * @param holder_os filled with the OS of the chosen holder, may be NULL
+ * @param nearest prefer the holder nearest the requesting client, the
+ *                owner only knows the RTTs of its own clients
+ * @return true if the rfc is registered; holder->port_number is 0 when no holder matches
+*/
+bool resolveRFC( int rfc_number, const char *os_string, int exclude_port, RFC_Node *holder, char *holder_os, bool nearest ) {
+  Cluster_Member *owner = ownerOf(rfc_number);
+  if( owner == NULL ) {
+    return resolveLocal(rfc_number, os_string, exclude_port, holder, holder_os, nearest);
+  }
+
+  std::string request = "RESOLVE " + std::to_string(rfc_number) + " " + (os_string != NULL ? os_string : "*") + " " + std::to_string(exclude_port) + (nearest ? " nearest" : "") + "\n";
+  std::string reply;
+  holder->port_number = 0;
+  holder->peer = 0;
+  parseHashToken("", holder);
+  if( !clusterRequest(owner, request, reply) || reply.empty() ) {
+    return false;
+  }
+  reply.erase(reply.find('\n'));
+
+  // HOLDER <port> <os> <host> <path> [sha256:<hex>] <title> or TITLE <title>
+  const char *title = reply.c_str();
+  int consumed = 0;
+  char os_found[32];
+  if( sscanf(title, "HOLDER %d %31s %253s %19s %n", &holder->port_number, os_found, holder->hostname, holder->path, &consumed) == 4 ) {
+    holder->rfc_number = rfc_number;
+    if( holder_os != NULL ) {
+      strcpy(holder_os, os_found);
+    }
+    title += consumed;
+    title += parseHashToken(title, holder);
+  } else {
+    holder->port_number = 0;
+    title += strlen("TITLE ");
+  }
+  holder->title[0] = '\0';
+  strncat(holder->title, title, sizeof(holder->title) - 1);
+  return true;
+}
+
+/**
+ * Registers an rfc row at the cluster member owning the rfc
+ * @param row filled node describing the rfc and its holder
+*/
+void registerRFC( const RFC_Node *row ) {
+  Cluster_Member *owner = ownerOf(row->rfc_number);
+  if( owner == NULL ) {
+    addRFC_Node(row);
+    return;
+  }
+
+  char os_string[32];
+  strcpy(os_string, "*");
+  lockRegistry(&registry->lock);
+  Client_Node *peer = findClientNode(row->port_number);
+  if( peer != NULL ) {
+    strcpy(os_string, peer->os_string);
+  }
+  unlockRegistry(&registry->lock);
+
+  std::string request = "REGISTER " + std::to_string(row->port_number) + " " + os_string + " " + row->hostname + " "
+      + row->path + " " + std::to_string(row->rfc_number) + " " + hashToken(row) + row->title + "\n";
+  std::string reply;
+  if( !clusterRequest(owner, request, reply) ) {
+    std::cout << "Cluster member " << owner->host << ":" << owner->port << " unreachable, RFC " << row->rfc_number << " not registered" << std::endl;
+  }
+}
+
+/**
+ * Drops a disconnected peer's rows from the other cluster members
+ * @param port port of the peer
+*/
+void clusterUnregister( int port ) {
+  std::string request = "UNREGISTER " + std::to_string(port) + "\n";
+  std::string reply;
+  for( Cluster_Member *member : cluster ) {
+    if( member != cluster_self ) {
+      clusterRequest(member, request, reply);
+    }
+  }
+}
+
+/**
+ * Collects the rows owned by the other cluster members
+ * @param rows filled with "RFC <number> <title> <host> <port>" lines
+ * @param all true for every row, otherwise about 1KB from each member
+*/
+void clusterListRows( std::string &rows, bool all ) {
+  std::string reply;
+  for( Cluster_Member *member : cluster ) {
+    if( member != cluster_self && clusterRequest(member, all ? "LIST ALL\n" : "LIST\n", reply) ) {
+      rows += reply;
+    }
+  }
+}
+
+/**
+ * Makes a call that may wait on a cluster link, on the offload pool so
+ * the event loop is not held up by a slow member. A server running alone
+ * never waits on a link, so its calls are made inline
+ * @param loop event loop of the calling handler
+ * @param call call to make
+ * @return true once the call has returned
+*/
+Co<bool> clusterCall( Event_Loop *loop, std::function<void()> call ) {
+  if( cluster.empty() ) {
+    call();
+    co_return true;
+  }
+  co_return co_await offload(loop, call);
+}
+
+/**
+ * Makes a call about one rfc, inline when this server owns the rfc since
+ * the call then never waits on a link
+ * @param loop event loop of the calling handler
+ * @param rfc_number number of the rfc the call is about
+ * @param call call to make
+ * @return true once the call has returned
+*/
+Co<bool> clusterCall( Event_Loop *loop, int rfc_number, std::function<void()> call ) {
+  if( ownerOf(rfc_number) == NULL ) {
+    call();
+    co_return true;
+  }
+  co_return co_await offload(loop, call);
+}
+
+/**
+ * Thread function serving the link another cluster member opened to this server
+ * Requests: REGISTER, UNREGISTER, RESOLVE and LIST, each answered with
+ * zero or more lines and an END line. Links get their own thread because
+ * answering blocks on the link, while the member's side waits for the
+ * answer on its offload pool.
+ * @param link reader of the blocking link socket, positioned after the greeting
+*/
+void *servePeerLink( void *link ) {
+  pthread_detach( pthread_self() );
+  Conn_Reader *reader = (Conn_Reader *)link;
+  char line[512];
+  while( recvLine(reader, line, sizeof(line)) > 0 ) {
+    std::string reply;
+    char kind[16];
+    kind[0] = '\0';
+    sscanf(line, "%15s", kind);
+
+    if( strcmp(kind, "REGISTER") == 0 ) {
+      RFC_Node row;
+      char os_string[32];
+      int consumed = 0;
+      if( sscanf(line, "REGISTER %d %31s %253s %19s %d %n", &row.port_number, os_string, row.hostname, row.path, &row.rfc_number, &consumed) == 5 ) {
+        consumed += parseHashToken(line + consumed, &row);
+        row.title[0] = '\0';
+        strncat(row.title, line + consumed, sizeof(row.title) - 1);
+        row.next = 0;
+        row.next_holder = 0;
+        // The peer is connected elsewhere, its node only serves holder selection
+        lockRegistry(&registry->lock);
+        if( findClientNode(row.port_number) == NULL ) {
+          Client_Node *peer = createClientNode(row.hostname, row.port_number, os_string);
+          peer->worker = 0;
+          strcpy(peer->path, row.path);
+          addClientNode(peer);
+        }
+        unlockRegistry(&registry->lock);
+        addRFC_Node(&row);
+      }
+    } else if( strcmp(kind, "UNREGISTER") == 0 ) {
+      int port = 0;
+      sscanf(line, "UNREGISTER %d", &port);
+      lockRegistry(&registry->lock);
+      Client_Node *peer = findClientNode(port);
+      bool remote = peer != NULL && peer->worker == 0;
+      unlockRegistry(&registry->lock);
+      if( remote ) {
+        deleteRFCNode(port);
+        lockRegistry(&registry->lock);
+        deleteClientNode(port);
+        unlockRegistry(&registry->lock);
+      }
+    } else if( strcmp(kind, "RESOLVE") == 0 ) {
+      int rfc_number = 0;
+      int exclude_port = 0;
+      char os_string[32];
+      RFC_Node holder;
+      char holder_os[32];
+      int consumed = 0;
+      if( sscanf(line, "RESOLVE %d %31s %d%n", &rfc_number, os_string, &exclude_port, &consumed) == 3
+          && resolveLocal(rfc_number, strcmp(os_string, "*") == 0 ? NULL : os_string, exclude_port, &holder, holder_os, strcmp(line + consumed, " nearest") == 0) ) {
+        if( holder.port_number != 0 ) {
+          reply = "HOLDER " + std::to_string(holder.port_number) + " " + holder_os + " " + holder.hostname + " " + holder.path + " " + hashToken(&holder) + holder.title + "\n";
+        } else {
+          reply = std::string("TITLE ") + holder.title + "\n";
+        }
+      }
+    } else if( strcmp(kind, "LIST") == 0 ) {
+      // Plain LIST has the same bound as the LIST response the rows end up in
+      bool all = strncmp(line, "LIST ALL", 8) == 0;
+      for( int i = 0; i < RFC_SHARDS && (all || reply.size() < 1024); i++ ) {
+        reply += *listShardRows(i, false);
+      }
+    }
+
+    reply += "END\n";
+    if( !sendAll(reader->socket, reply.data(), reply.size()) ) {
+      break;
+    }
+  }
+  close(reader->socket);
+  delete reader;
+  return NULL;
+}
+
+//Structure for the cached compressed body of a popular rfc file
+struct Compressed_File {
+    // Modification time in nanoseconds and length of the file counted and compressed
+    long long mtime;
+    off_t size;
+    int requests;
+    // Shared with the handlers sending it, NULL until compressed
+    std::shared_ptr<const std::string> body;
+    // Position of the path in compressed_lru
+    std::list<std::string>::iterator used;
+};
+
+// Request counts and compressed bodies keyed by file path, a file whose
+// modification time or length changed is counted and compressed again
+std::map<std::string, Compressed_File> compressed_cache;
+// Paths in compressed_cache, most recently requested first
+std::list<std::string> compressed_lru;
+size_t compressed_cache_bytes = 0;
+/** Mutex lock for the compressed body cache, never held while sending */
+pthread_mutex_t compressed_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Drops the least recently requested files from the compressed body cache
+ * until it is within COMPRESS_CACHE_BYTES and COMPRESS_CACHE_FILES
+ * Must be called with the compressed lock held
+*/
+void compressedEvict() {
+  while( !compressed_lru.empty() && (compressed_cache_bytes > COMPRESS_CACHE_BYTES || compressed_lru.size() > COMPRESS_CACHE_FILES) ) {
+    std::map<std::string, Compressed_File>::iterator victim = compressed_cache.find(compressed_lru.back());
+    if( victim->second.body != NULL ) {
+      compressed_cache_bytes -= victim->second.body->size();
+    }
+    compressed_cache.erase(victim);
+    compressed_lru.pop_back();
+  }
+}
+
+/**
+ * Counts a deflate request for a file in the compressed body cache
+ * @param file_name path of the rfc file
+ * @param info modification time and length of the file as it is now
+ * @param keep set when the caller should compress the file and store the body
+ * @return cached body, NULL if there is none for the file as it is now
+*/
+std::shared_ptr<const std::string> compressedLookup( const char *file_name, const struct statx *info, bool *keep ) {
+  long long mtime = info->stx_mtime.tv_sec * 1000000000LL + info->stx_mtime.tv_nsec;
+  pthread_mutex_lock(&compressed_lock);
+  std::pair<std::map<std::string, Compressed_File>::iterator, bool> found = compressed_cache.emplace(file_name, Compressed_File());
+  Compressed_File &entry = found.first->second;
+  if( found.second ) {
+    compressed_lru.push_front(file_name);
+    entry.used = compressed_lru.begin();
+    entry.mtime = -1;
+  } else {
+    compressed_lru.splice(compressed_lru.begin(), compressed_lru, entry.used);
+  }
+  if( entry.mtime != mtime || entry.size != (off_t)info->stx_size ) {
+    if( entry.body != NULL ) {
+      compressed_cache_bytes -= entry.body->size();
+    }
+    entry.body.reset();
+    entry.mtime = mtime;
+    entry.size = info->stx_size;
+    entry.requests = 0;
+  }
+  entry.requests++;
+  std::shared_ptr<const std::string> cached = entry.body;
+  *keep = cached == NULL && entry.requests >= COMPRESS_CACHE_AFTER;
+  compressedEvict();
+  pthread_mutex_unlock(&compressed_lock);
+  return cached;
+}
+
+/**
+ * Stores a file's compressed body, unless the file changed or another
+ * request stored it meanwhile. Older bodies make room for it
+ * @param file_name path of the rfc file
+ * @param info modification time and length of the file that was compressed
+ * @param body compressed body, taken over
+*/
+void compressedStore( const char *file_name, const struct statx *info, std::string &body ) {
+  long long mtime = info->stx_mtime.tv_sec * 1000000000LL + info->stx_mtime.tv_nsec;
+  pthread_mutex_lock(&compressed_lock);
+  std::map<std::string, Compressed_File>::iterator found = compressed_cache.find(file_name);
+  if( found != compressed_cache.end() && found->second.body == NULL && found->second.mtime == mtime
+      && found->second.size == (off_t)info->stx_size && body.size() <= COMPRESS_CACHE_BYTES ) {
+    std::shared_ptr<std::string> kept = std::make_shared<std::string>();
+    kept->swap(body);
+    compressed_cache_bytes += kept->size();
+    found->second.body = kept;
+    compressedEvict();
+  }
+  pthread_mutex_unlock(&compressed_lock);
+}
+
+/**
+ * Checks whether an Accept-Encoding list names a content coding
+ * @param list comma or space separated codings
+ * @param coding coding to look for
+ * @return true if the coding is listed
+*/
+bool acceptsEncoding( const char *list, const char *coding ) {
+  size_t length = strlen(coding);
+  const char *at = list;
+  while( *at != '\0' ) {
+    at += strspn(at, ", ");
+    size_t token = strcspn(at, ", ");
+    if( token == length && strncasecmp(at, coding, length) == 0 ) {
+      return true;
+    }
+    at += token;
+  }
+  return false;
+}
+
+/**
+ * Sends one chunk of a chunked GET body: its size in hex on a line, then the bytes
+ * Must be called while the connection is streaming
+ * @param conn connection of the requesting client
+ * @param data chunk bytes
+ * @param length number of bytes, 0 ends the body
+ * @return true if sent
+*/
+Co<bool> sendChunk( Client_Conn *conn, const char *data, size_t length ) {
+  char size_line[20];
+  int size_length = snprintf(size_line, sizeof(size_line), "%zx\n", length);
+  std::string chunk(size_line, size_length);
+  chunk.append(data, length);
+  conn->last_activity = time(NULL);
+  co_return co_await connWrite(conn, chunk.data(), chunk.size());
+}
+
+/**
+ * Checks whether a connection can send file bytes without copying them
+ * through user space, plaintext or with the kernel doing the TLS records
+ * @param conn client connection
+ * @return true if sendFileChunk may be used
+*/
+bool connZeroCopy( Client_Conn *conn ) {
+  return conn->tls == NULL || BIO_get_ktls_send(SSL_get_wbio(conn->tls));
+}
+
+/**
+ * Sends one chunk of a chunked GET body straight from the page cache,
+ * with sendfile or SSL_sendfile over kernel TLS
+ * Must be called while the connection is streaming, so nothing but the
+ * handler's own output is in the outbox and it goes out first
+ * @param conn connection of the requesting client, connZeroCopy holds
+ * @param input open rfc file
+ * @param offset file offset of the chunk
+ * @param length number of bytes, not 0
+ * @return true if sent, a file shrunk meanwhile drops the connection
+*/
+Co<bool> sendFileChunk( Client_Conn *conn, int input, off_t offset, size_t length ) {
+  char size_line[20];
+  int size_length = snprintf(size_line, sizeof(size_line), "%zx\n", length);
+  conn->last_activity = time(NULL);
+  if( !co_await connWrite(conn, size_line, size_length) ) {
+    co_return false;
+  }
+  while( true ) {
+    pthread_mutex_lock(&conn->send_lock);
+    bool sent = flushOutbox(conn);
+    bool queued = !conn->outbox.empty();
+    pthread_mutex_unlock(&conn->send_lock);
+    if( !sent ) {
+      co_return false;
+    }
+    if( !queued ) {
+      break;
+    }
+    co_await IO_Wait{conn, EPOLLOUT};
+  }
+
+  while( length > 0 ) {
+    pthread_mutex_lock(&conn->send_lock);
+    ssize_t sent;
+    if( conn->tls == NULL ) {
+      sent = sendfile(conn->socket, input, &offset, length);
+    } else {
+      ERR_clear_error();
+      sent = SSL_sendfile(conn->tls, input, offset, length, 0);
+      if( sent > 0 ) {
+        offset += sent;
+      } else {
+        int error = SSL_get_error(conn->tls, sent);
+        errno = error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ ? EAGAIN : EPIPE;
+      }
+    }
+    bool wait = sent == -1 && (errno == EAGAIN || errno == EINTR);
+    if( sent <= 0 && !wait ) {
+      conn->send_failed = true;
+      shutdown(conn->socket, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&conn->send_lock);
+    if( sent > 0 ) {
+      length -= sent;
+    } else if( wait ) {
+      co_await IO_Wait{conn, EPOLLOUT};
+    } else {
+      co_return false;
+    }
+  }
+  co_return true;
+}
+
+/**
+ * Sends a GET response header followed by the file as a chunked body
+ * Deflate bodies of files requested COMPRESS_CACHE_AFTER times are kept
+ * compressed in memory, the least recently requested making way for new
+ * ones, other files are compressed while they are sent.
+ * The connection streams throughout so heartbeats and events cannot land
+ * inside the body. A body resumed from an offset is compressed on its own
+ * and never cached. An identity body goes from the page cache to the
+ * socket without a copy unless the client uses TLS in user space.
+ * @param conn connection of the requesting client
+ * @param file_name path of the rfc file
+ * @param deflate_body compress the body, otherwise send it as is
+ * @param offset first byte of the file to send
+ * @param header fixed size response header
+ * @param header_length size of the header
+ * @return true if everything was sent
+*/
+Co<bool> sendEncodedBody( Client_Conn *conn, const char *file_name, bool deflate_body, off_t offset, const char *header, size_t header_length ) {
+  // A vanished file is sent as an empty body so the client is not left waiting
+  struct statx fileStat;
+  int input = -1;
+  if( co_await fileStatx(conn->loop, file_name, &fileStat) != 0 || (input = co_await fileOpen(conn->loop, file_name)) < 0 ) {
+    connBeginStream(conn);
+    bool sent = co_await connWrite(conn, header, header_length) && co_await sendChunk(conn, NULL, 0);
+    co_return co_await connEndStream(conn) && sent;
+  }
+
+  // The body is shared, holding it across a suspension keeps it alive
+  std::shared_ptr<const std::string> cached;
+  bool keep = false;
+  if( deflate_body && offset == 0 ) {
+    cached = compressedLookup(file_name, &fileStat, &keep);
+  }
+
+  connBeginStream(conn);
+  bool sent = co_await connWrite(conn, header, header_length);
+  if( sent && cached != NULL ) {
+    for( size_t at = 0; sent && at < cached->size(); at += COMPRESS_CHUNK_SIZE ) {
+      sent = co_await sendChunk(conn, cached->data() + at, std::min((size_t)COMPRESS_CHUNK_SIZE, cached->size() - at));
+    }
+  } else if( sent && !deflate_body && connZeroCopy(conn) ) {
+    posix_fadvise(input, offset, 0, POSIX_FADV_SEQUENTIAL);
+    while( sent && offset < (off_t)fileStat.stx_size ) {
+      size_t length = std::min((off_t)SENDFILE_CHUNK_SIZE, (off_t)fileStat.stx_size - offset);
+      sent = co_await sendFileChunk(conn, input, offset, length);
+      offset += length;
+    }
+  } else if( sent ) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if( deflate_body && deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK ) {
+      fail("Trouble opening input file");
+    }
+    std::string kept;
+    char in[COMPRESS_CHUNK_SIZE];
+    char out[COMPRESS_CHUNK_SIZE];
+    int flush = Z_NO_FLUSH;
+    while( sent && flush != Z_FINISH ) {
+      int read_result = co_await fileRead(conn->loop, input, in, sizeof(in), offset);
+      size_t bytes = read_result > 0 ? read_result : 0;
+      offset += bytes;
+      flush = bytes < sizeof(in) ? Z_FINISH : Z_NO_FLUSH;
+      if( !deflate_body ) {
+        sent = bytes == 0 || co_await sendChunk(conn, in, bytes);
+        continue;
+      }
+      stream.next_in = (Bytef *)in;
+      stream.avail_in = bytes;
+      do {
+        stream.next_out = (Bytef *)out;
+        stream.avail_out = sizeof(out);
+        deflate(&stream, flush);
+        size_t produced = sizeof(out) - stream.avail_out;
+        if( produced > 0 ) {
+          sent = sent && co_await sendChunk(conn, out, produced);
+          if( keep ) {
+            kept.append(out, produced);
+          }
+        }
+      } while( stream.avail_out == 0 );
+    }
+    if( deflate_body ) {
+      deflateEnd(&stream);
+    }
+
+    if( sent && keep ) {
+      compressedStore(file_name, &fileStat, kept);
+    }
+  }
+  close(input);
+  sent = sent && co_await sendChunk(conn, NULL, 0);
+  co_return co_await connEndStream(conn) && sent;
+}
+
+//Structure for a connection's SUBSCRIBE registration
+struct Subscriber {
+    Client_Conn *conn;
+    bool all;
+    std::vector<std::pair<int, int>> ranges;
+    struct Subscriber *next;
+};
+
+// Connections receiving change events
+Subscriber* subscriber_list = NULL;
+/** Mutex lock for the subscriber list, held by the notifier while sending */
+pthread_mutex_t subscriber_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Checks whether a subscription covers an rfc number
+ * @param subscriber subscription to check
+ * @param rfc_number number of the rfc
+ * @return true if events for the rfc should be sent
+*/
+bool subscriberWants( Subscriber *subscriber, int rfc_number ) {
+  if( subscriber->all ) {
+    return true;
+  }
+  std::vector<std::pair<int, int>>::iterator at = std::upper_bound(subscriber->ranges.begin(),
+      subscriber->ranges.end(), std::make_pair(rfc_number, INT32_MAX));
+  return at != subscriber->ranges.begin() && (at - 1)->second >= rfc_number;
+}
+
+/**
+ * Removes a connection's subscription, if it has one
+ * Waits for an in-progress fan out to the connection to finish
+ * @param conn client connection
+*/
+void unsubscribe( Client_Conn *conn ) {
+  pthread_mutex_lock(&subscriber_lock);
+  Subscriber **link = &subscriber_list;
+  while( *link != NULL ) {
+    if( (*link)->conn == conn ) {
+      Subscriber *gone = *link;
+      *link = gone->next;
+      delete gone;
+      break;
+    }
+    link = &(*link)->next;
+  }
+  pthread_mutex_unlock(&subscriber_lock);
+}
+
+/**
+ * Adds a subscription for a connection that has none
+ * @param conn client connection
+ * @param all every rfc number is covered
+ * @param ranges sorted ranges covered otherwise, taken
+*/
+void subscribe( Client_Conn *conn, bool all, std::vector<std::pair<int, int>> &ranges ) {
+  Subscriber *subscriber = new Subscriber;
+  subscriber->conn = conn;
+  subscriber->all = all;
+  subscriber->ranges.swap(ranges);
+  pthread_mutex_lock(&subscriber_lock);
+  subscriber->next = subscriber_list;
+  subscriber_list = subscriber;
+  pthread_mutex_unlock(&subscriber_lock);
+}
+
+/**
+ * Thread function that fans registry changes from every worker out to
+ * this worker's subscribers
+ * Events are copied off the shared ring in batches so mutating threads
+ * only ever wait for the ring append
+ * @param unused thread argument
+*/
+void *notifyClients( void *unused ) {
+  lockRegistry(&registry->events_lock);
+  unsigned long next = registry->events_published;
+  unlockRegistry(&registry->events_lock);
+  while( true ) {
+    lockRegistry(&registry->events_lock);
+    while( registry->events_published == next ) {
+      // Returns at once if an event was published after the unlock
+      uint32_t seen = registry->events_futex.load();
+      unlockRegistry(&registry->events_lock);
+      syscall(SYS_futex, &registry->events_futex, FUTEX_WAIT, seen, NULL, NULL, 0);
+      lockRegistry(&registry->events_lock);
+    }
+    // Events overwritten before they were read are skipped
+    if( registry->events_published - next > EVENT_RING ) {
+      next = registry->events_published - EVENT_RING;
+    }
+    std::vector<RFC_Event> batch;
+    for( ; next != registry->events_published; next++ ) {
+      batch.push_back(registry->events[next % EVENT_RING]);
+    }
+    unlockRegistry(&registry->events_lock);
+
+    pthread_mutex_lock(&subscriber_lock);
+    for( Subscriber *subscriber = subscriber_list; subscriber != NULL; subscriber = subscriber->next ) {
+      std::string frames;
+      for( const RFC_Event &event : batch ) {
+        if( subscriberWants(subscriber, event.rfc_number) ) {
+          char frame[300];
+          snprintf(frame, sizeof(frame), "EVENT %s RFC %d %s %d\n", event.added ? "ADD" : "DEL",
+              event.rfc_number, event.hostname, event.port_number);
+          frames += frame;
+        }
+      }
+      if( !frames.empty() ) {
+        connSend(subscriber->conn, frames.data(), frames.size());
+      }
+    }
+    pthread_mutex_unlock(&subscriber_lock);
+  }
+  return NULL;
+}
+
+/**
+ * Parses the rfc selector of a range or batch LOOKUP
+ * Comma separated items, each a number or an inclusive range a-b
+ * @param selector selector token, e.g. 1-100,250,300-310
+ * @param ranges destination for the merged, ascending ranges
+ * @return false if the selector is malformed
+*/
+bool parseRFCSelector( const char *selector, std::vector<std::pair<int, int>> &ranges ) {
+  const char *pos = selector;
+  while( *pos != '\0' ) {
+    char *end;
+    long low = strtol(pos, &end, 10);
+    if( end == pos || low < 0 ) {
+      return false;
+    }
+    long high = low;
+    if( *end == '-' ) {
+      pos = end + 1;
+      high = strtol(pos, &end, 10);
+      if( end == pos || high < low ) {
+        return false;
+      }
+    }
+    if( high > INT32_MAX ) {
+      return false;
+    }
+    ranges.push_back(std::make_pair((int)low, (int)high));
+    if( *end == ',' ) {
+      end++;
+    } else if( *end != '\0' ) {
+      return false;
+    }
+    pos = end;
+  }
+  if( ranges.empty() ) {
+    return false;
+  }
+
+  std::sort(ranges.begin(), ranges.end());
+  std::vector<std::pair<int, int>> merged;
+  for( const std::pair<int, int> &range : ranges ) {
+    if( !merged.empty() && (long)range.first <= (long)merged.back().second + 1 ) {
+      merged.back().second = std::max(merged.back().second, range.second);
+    } else {
+      merged.push_back(range);
+    }
+  }
+  ranges.swap(merged);
+  return true;
+}
+
+/**
+ * Range and batch lookup, e.g. LOOKUP RFC 1-9999 or LOOKUP RFC 12,80-90
+ * Streams one "RFC <number> <title>" row per registered rfc from the
+ * ordered catalog, followed by END. Rows are gathered a chunk at a time
+ * so the catalog lock is never held across a send
+ * @param conn client connection
+ * @param buffer client input
+ * @param client_hostname hostname of client
+ * @param __port port of client
+*/
+Co<bool> lookupBulkCommand(Client_Conn *conn, char *buffer, char *client_hostname, int __port) {
+  char command[7];
+  char rfc[4];
+  char selector[256];
+  char version[12];
+  char str_host[50];
+  int user_port = 0;
+  command[0] = rfc[0] = selector[0] = version[0] = str_host[0] = '\0';
+  sscanf(buffer, "%6s%3s%255s%11s%49s%d", command, rfc, selector, version, str_host, &user_port);
+
+  std::vector<std::pair<int, int>> ranges;
+  const char *status = "P2P-CI/1.0 200 OK\n";
+  if(strcmp(command, "LOOKUP") != 0 || strcmp(rfc, "RFC") != 0 || !parseRFCSelector(selector, ranges)) {
+    status = "P2P-CI/1.0 400 Bad Request\n";
+  } else if(strcmp(version, "P2P-CI/1.0") != 0) {
+    status = "P2P-CI/1.0 505 P2P-CI Version Not Supported\n";
+  } else if(__port != user_port) {
+    status = "P2P-CI/1.0 400 Bad Request\n";
+  } else {
+    if(clientHostKnown(str_host, client_hostname) == false) {
+      status = "P2P-CI/1.0 404 Not Found\n";
+    }
+  }
+  if( strncmp(status, "P2P-CI/1.0 200", 14) != 0 ) {
+    ranges.clear();
+  }
+
+  std::string chunk = status;
+  connBeginStream(conn);
+  for( const std::pair<int, int> &range : ranges ) {
+    long next = range.first;
+    while( next <= range.second ) {
+      catalogReadLock();
+      std::map<int, std::string>::iterator at = rfc_catalog.lower_bound((int)next);
+      for( ; at != rfc_catalog.end() && at->first <= range.second && chunk.size() < LOOKUP_CHUNK_SIZE; at++ ) {
+        chunk += "RFC " + std::to_string(at->first) + " " + at->second + "\n";
+      }
+      next = (at == rfc_catalog.end() || at->first > range.second) ? (long)range.second + 1 : at->first;
+      pthread_rwlock_unlock(&catalog_lock);
+
+      if( chunk.size() >= LOOKUP_CHUNK_SIZE ) {
+        if( !co_await connWrite(conn, chunk.data(), chunk.size()) ) {
+          co_await connEndStream(conn);
+          co_return false;
+        }
+        chunk.clear();
+      }
+    }
+  }
+  chunk += "END\n";
+  bool sent = co_await connWrite(conn, chunk.data(), chunk.size());
+  co_return co_await connEndStream(conn) && sent;
+}
+
+/**
+ * Subscribe command to receive pushed registry changes
+ * SUBSCRIBE ALL P2P-CI/1.0 or SUBSCRIBE RFC <selector> P2P-CI/1.0 replaces
+ * the connection's subscription, UNSUBSCRIBE ALL P2P-CI/1.0 removes it.
+ * Changes then arrive as "EVENT ADD|DEL RFC <number> <host> <port>" lines
+ * @param conn client connection
+ * @param buffer client input
+ * @param client_hostname hostname of client
+ * @param __port port of client
+ * @return response of the server
+*/
+char* subscribeCommand(Client_Conn *conn, char *buffer, char *client_hostname, int __port) {
+  char *response = new char[1024];
+  response[0] = '\0';
+  char command[12];
+  char scope[4];
+  char selector[256];
+  char version[12];
+  char str_host[50];
+  int user_port = 0;
+  command[0] = scope[0] = selector[0] = version[0] = str_host[0] = '\0';
+
+  bool all = strncmp(buffer, "UNSUBSCRIBE", 11) == 0 || strncmp(buffer, "SUBSCRIBE ALL", 13) == 0;
+  if( all ) {
+    sscanf(buffer, "%11s%3s%11s%49s%d", command, scope, version, str_host, &user_port);
+  } else {
+    sscanf(buffer, "%11s%3s%255s%11s%49s%d", command, scope, selector, version, str_host, &user_port);
+  }
+
+  std::vector<std::pair<int, int>> ranges;
+  //Invalid command
+  if(strcmp(command, "SUBSCRIBE") != 0 && strcmp(command, "UNSUBSCRIBE") != 0) {
+    strcat(response, "P2P-CI/1.0 400 Bad Request\n");
+    return response;
+  }
+  //Second string should be ALL, or RFC with a selector
+  if(all ? strcmp(scope, "ALL") != 0 : strcmp(scope, "RFC") != 0 || !parseRFCSelector(selector, ranges)) {
+    strcat(response, "P2P-CI/1.0 400 Bad Request\n");
+    return response;
+  }
+  //Invalid version
+  if(strcmp(version, "P2P-CI/1.0") != 0) {
+    strcat(response, "P2P-CI/1.0 505 P2P-CI Version Not Supported\n");
+    return response;
+  }
+  //Invalid port
+  if(__port != user_port) {
+    strcat(response, "P2P-CI/1.0 400 Bad Request\n");
+    return response;
+  }
+  if(strcmp(str_host, client_hostname) != 0) {
+    strcat(response, "P2P-CI/1.0 404 Not Found\n");
+    return response;
+  }
+
+  unsubscribe(conn);
+  if(strcmp(command, "SUBSCRIBE") == 0) {
+    subscribe(conn, all, ranges);
+  }
+
+  strcat(response, "P2P-CI/1.0 200 OK\n");
+  return response;
+}
+
+/**
+ * Validates a LIST request
+ * @param buffer client's input char array
+ * @param client_hostname clients hostname
+ * @param __port port of client
+ * @return error status line, or NULL if the request is valid
+*/
+const char* listStatus(char *buffer, char *client_hostname, int __port) {
+  int user_port = 0;
+  char command[5];
+  char all[4];
+  char version[12];
+  char str_host[50];
+  command[0] = all[0] = version[0] = str_host[0] = '\0';
+  sscanf(buffer, "%4s%3s%11s%49s%d", command, all, version, str_host, &user_port);
+
+  //First string should be list
+  if(strcmp(command, "LIST") != 0) {
+    return "P2P-CI/1.0 400 Bad Request\n";
+  }
+  //Second string should be all
+  if(strcmp(all, "ALL") != 0) {
+    return "P2P-CI/1.0 400 Bad Request\n";
+  }
+  //Thrid string should be P2P
+  if(strcmp(version, "P2P-CI/1.0") != 0) {
+    return "P2P-CI/1.0 505 P2P-CI Version Not Supported\n";
+  }
+  //Fifth string should be user's port
+  if(__port != user_port) {
+    return "P2P-CI/1.0 400 Bad Request\n";
+  }
+
+  //Search for client and verify host name
+  if(clientHostKnown(str_host, client_hostname) == false) {
+    return "P2P-CI/1.0 404 Not Found\n";
+  }
+  return NULL;
+}
+
+/**
+ * List command function 
+ * @param buffer client's input char array
+ * @param client_hostname clients hostname
+ * @return response message for server to send to client
+*/
+char* listCommand(char *buffer, char *client_hostname, int __port) {
+
+  char *response = new char[1024];
+  response[0] = '\0';
+  const char *status = listStatus(buffer, client_hostname, __port);
+  if( status != NULL ) {
+    strcat(response, status);
+    return response;
+  }
+
+  //Once validated, take the cached rows of each shard
+  size_t used = 0;
+  bool fits = true;
+  for( int i = 0; i < RFC_SHARDS; i++ ) {
+    std::shared_ptr<const std::string> rows = listShardRows(i, false);
+    std::cout << *rows;
+    fits = fits && appendRows(response, &used, 1024, *rows);
+  }
+  std::cout << std::flush;
+
+  // Rows owned by the other cluster members
+  if( fits ) {
+    std::string remote_rows;
+    clusterListRows(remote_rows, false);
+    appendRows(response, &used, 1024, remote_rows);
+  }
+    return response;
+}
+
+/**
+ * Conditional LIST, streamed in full and ended by an END line
+ * Request line: LIST ALL P2P-CI/1.0 If-None-Match: <etag>
+ * The ETag is the registry's LIST generation, a client presenting the
+ * current one only gets a 304. Clustered servers always send the rows,
+ * the other members' changes do not move this server's generation.
+ * @param conn client connection
+ * @param buffer client input, without the If-None-Match header
+ * @param etag generation the client already holds
+ * @param client_hostname hostname of client
+ * @param __port port of client
+ * @return false if the connection failed
+*/
+Co<bool> listConditionalCommand(Client_Conn *conn, char *buffer, unsigned long etag, char *client_hostname, int __port) {
+  const char *status = listStatus(buffer, client_hostname, __port);
+  if( status != NULL ) {
+    std::string reply = std::string(status) + "END\n";
+    co_return co_await connWrite(conn, reply.data(), reply.size());
+  }
+
+  // Read first, rows changed while gathering only make the ETag older than them
+  unsigned long generation = registry->list_generation;
+  std::string header = "ETag: " + std::to_string(generation) + "\n";
+  if( etag == generation && cluster.size() <= 1 ) {
+    header = "P2P-CI/1.0 304 Not Modified\n" + header + "END\n";
+    co_return co_await connWrite(conn, header.data(), header.size());
+  }
+
+  header = "P2P-CI/1.0 200 OK\n" + header;
+  connBeginStream(conn);
+  bool sent = co_await connWrite(conn, header.data(), header.size());
+  // The chunks are shared, holding one across a suspension keeps it alive
+  for( int i = 0; i < RFC_SHARDS && sent; i++ ) {
+    std::shared_ptr<const std::string> rows = listShardRows(i, false);
+    sent = co_await connWrite(conn, rows->data(), rows->size());
+  }
+  if( sent && cluster.size() > 1 ) {
+    std::string remote_rows;
+    co_await clusterCall(conn->loop, [&]() { clusterListRows(remote_rows, true); });
+    sent = co_await connWrite(conn, remote_rows.data(), remote_rows.size());
+  }
+  sent = sent && co_await connWrite(conn, "END\n", 4);
+  std::cout << "LIST sent ETag " << generation << std::endl;
+  co_return co_await connEndStream(conn) && sent;
+}
+
+/**
+ * Binary LOOKUP, ADD and LIST, for connections that offered WIRE_OFFER
+ * Requests are an opcode byte, a varint payload length and a payload of
+ * one varint: the rfc number, or the ETag for LIST (0 for any). A LOOKUP
+ * may add a flags varint, 1 asking for the nearest holder. The
+ * connection identifies the client, so no host or port is sent.
+ * Responses are a varint status, a varint payload length, the hostnames
+ * newly given ids, then the body:
+ *   LOOKUP 200: title, holder port and hostname id (port 0 for none)
+ *   ADD 200: title
+ *   LIST 200: ETag then rows, 304: ETag
+ *   429: seconds to wait
+ * Strings are a varint length and bytes.
+ * @param conn client connection
+ * @param opcode request opcode
+ * @param argument varint of the request payload
+ * @param flags varint following it, 0 if absent
+ * @param client_hostname hostname of client
+ * @param client_port port of client
+ * @param strings_sent string ids the connection already knows, advanced
+ * @return false if the connection failed
+*/
+Co<bool> wireCommand( Client_Conn *conn, int opcode, unsigned long argument, unsigned long flags, char *client_hostname, int client_port, unsigned long *strings_sent ) {
+  std::string body;
+  std::string frame;
+  RFC_Node holder;
+  if( opcode == WIRE_LOOKUP ) {
+    bool found = false;
+    co_await clusterCall(conn->loop, (int)argument, [&]() { found = resolveRFC((int)argument, NULL, client_port, &holder, NULL, (flags & 1) != 0); });
+    if( !found ) {
+      frame = wireHeader(404, strings_sent, body, 0);
+    } else {
+      putString(body, holder.title);
+      putVarint(body, holder.port_number);
+      if( holder.port_number != 0 ) {
+        putVarint(body, wireStringId(holder.hostname));
+      }
+      frame = wireHeader(200, strings_sent, body, 0);
+    }
+  } else if( opcode == WIRE_ADD ) {
+    bool added = false;
+    co_await clusterCall(conn->loop, (int)argument, [&]() { added = addHolder((int)argument, client_hostname, client_port, &holder); });
+    if( !added ) {
+      frame = wireHeader(404, strings_sent, body, 0);
+    } else {
+      putString(body, holder.title);
+      frame = wireHeader(200, strings_sent, body, 0);
+    }
+  } else if( opcode == WIRE_LIST ) {
+    unsigned long generation = registry->list_generation;
+    putVarint(body, generation);
+    if( argument == generation && cluster.size() <= 1 ) {
+      frame = wireHeader(304, strings_sent, body, 0);
+    } else {
+      // Rows are gathered first so the header defines every hostname id they use
+      std::vector<std::shared_ptr<const std::string>> chunks;
+      size_t trailing = 0;
+      for( int i = 0; i < RFC_SHARDS; i++ ) {
+        chunks.push_back(listShardRows(i, true));
+        trailing += chunks.back()->size();
+      }
+      if( cluster.size() > 1 ) {
+        std::string remote_rows;
+        co_await clusterCall(conn->loop, [&]() { clusterListRows(remote_rows, true); });
+        std::string *wire_rows = new std::string;
+        char title[256];
+        char hostname[254];
+        int rfc_number = 0;
+        int port = 0;
+        size_t row_start = 0;
+        while( row_start < remote_rows.size() ) {
+          size_t row_end = remote_rows.find('\n', row_start);
+          std::string row = remote_rows.substr(row_start, row_end - row_start);
+          // The title may hold spaces, the hostname and port are the last two fields
+          size_t port_at = row.rfind(' ');
+          size_t host_at = row.rfind(' ', port_at - 1);
+          int title_at = 0;
+          if( port_at != std::string::npos && host_at != std::string::npos && host_at > 0 &&
+              sscanf(row.c_str(), "RFC %d %n", &rfc_number, &title_at) == 1 && (size_t)title_at <= host_at ) {
+            snprintf(title, sizeof(title), "%.*s", (int)(host_at - title_at), row.c_str() + title_at);
+            snprintf(hostname, sizeof(hostname), "%.*s", (int)(port_at - host_at - 1), row.c_str() + host_at + 1);
+            port = atoi(row.c_str() + port_at + 1);
+            putWireRow(*wire_rows, rfc_number, title, hostname, port);
+          }
+          row_start = row_end + 1;
+        }
+        chunks.emplace_back(wire_rows);
+        trailing += wire_rows->size();
+      }
+
+      connBeginStream(conn);
+      frame = wireHeader(200, strings_sent, body, trailing);
+      bool sent = co_await connWrite(conn, frame.data(), frame.size());
+      for( size_t i = 0; i < chunks.size() && sent; i++ ) {
+        sent = co_await connWrite(conn, chunks[i]->data(), chunks[i]->size());
+      }
+      co_return co_await connEndStream(conn) && sent;
+    }
+  } else {
+    frame = wireHeader(400, strings_sent, body, 0);
+  }
+  co_return co_await connWrite(conn, frame.data(), frame.size());
+}
+
+/**
+ * Search command to find rfcs by title terms
+ * Request line: SEARCH <term> [<term> ...] [LIMIT <n>] P2P-CI/1.0
+ * A term ending in '*' matches every title term with that prefix
+ * @param buffer client input
+ * @param client_hostname hostname of client
+ * @param __port port of client
+ * @return response of the server
+*/
+char* searchCommand(char *buffer, char *client_hostname, int __port) {
+  char *response = new char[1024];
+  response[0] = '\0';
+
+  // Request line is tokenized separately from the host and port lines
+  char *lineEnd = strchr(buffer, '\n');
+  if( lineEnd == NULL ) {
+    strcat(response, "P2P-CI/1.0 400 Bad Request\n");
+    return response;
+  }
+  std::vector<std::string> tokens;
+  std::string token;
+  for( char *pos = buffer; pos <= lineEnd; pos++ ) {
+    if( pos == lineEnd || isspace((unsigned char)*pos) ) {
+      if( !token.empty() ) {
+        tokens.push_back(token);
+      }
+      token.clear();
+    } else {
+      token += *pos;
+    }
+  }
+  char str_host[50];
+  int user_port = 0;
+  str_host[0] = '\0';
+  sscanf(lineEnd + 1, "%49s%d", str_host, &user_port);
+
+  //Invalid command
+  if(tokens.size() < 3 || tokens[0] != "SEARCH") {
+    strcat(response, "P2P-CI/1.0 400 Bad Request\n");
+    return response;
+  }
+  //Invalid version
+  if(tokens.back() != "P2P-CI/1.0") {
+    strcat(response, "P2P-CI/1.0 505 P2P-CI Version Not Supported\n");
+    return response;
+  }
+  //Invalid port
+  if(__port != user_port) {
+    strcat(response, "P2P-CI/1.0 400 Bad Request\n");
+    return response;
+  }
+
+  size_t limit = SEARCH_DEFAULT_LIMIT;
+  std::vector<std::string> terms;
+  for( size_t i = 1; i + 1 < tokens.size(); i++ ) {
+    if( tokens[i] == "LIMIT" && i + 2 < tokens.size() ) {
+      int requested = atoi(tokens[++i].c_str());
+      if( requested <= 0 ) {
+        strcat(response, "P2P-CI/1.0 400 Bad Request\n");
+        return response;
+      }
+      limit = std::min((size_t)requested, (size_t)SEARCH_MAX_LIMIT);
+      continue;
+    }
+    std::string term;
+    for( char c : tokens[i] ) {
+      term += (char)tolower((unsigned char)c);
+    }
+    terms.push_back(term);
+  }
+  if( terms.empty() ) {
+    strcat(response, "P2P-CI/1.0 400 Bad Request\n");
+    return response;
+  }
+
+  if(clientHostKnown(str_host, client_hostname) == false) {
+    strcat(response, "P2P-CI/1.0 404 Not Found\n");
+    return response;
+  }
+
+  catalogReadLock();
+  std::vector<int> matches = searchIndexQuery(terms, limit);
+  size_t used = 0;
+  for( int rfc_number : matches ) {
+    char f_line[128];
+    int length = snprintf(f_line, sizeof(f_line), "RFC %d %s\n", rfc_number, rfc_catalog[rfc_number].c_str());
+    if( used + length >= 1024 ) {
+      break;
+    }
+    strcpy(response + used, f_line);
+    used += length;
+  }
+  pthread_rwlock_unlock(&catalog_lock);
+
+  if( matches.empty() ) {
+    strcat(response, "P2P-CI/1.0 404 Not Found\n");
+  }
+  return response;
+}
+
+/**
+ * Formats a SHA-256 digest as hex
+ * @param context digest context, finished by this call
+ * @param hash destination, at least 65 bytes
+*/
+void finishHash( EVP_MD_CTX *context, char *hash ) {
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_length = 0;
+  EVP_DigestFinal_ex(context, digest, &digest_length);
+  for( unsigned int i = 0; i < digest_length; i++ ) {
+    snprintf(hash + i * 2, 3, "%02x", digest[i]);
+  }
+}
+
+/**
+ * Computes the SHA-256 of a file
+ * @param file_name path of the file
+ * @param hash destination for the hex digest, at least 65 bytes
+ * @return true if the file could be read
+*/
+bool hashFile( const char *file_name, char *hash ) {
+  int input = open(file_name, O_RDONLY);
+  if( input == -1 ) {
+    return false;
+  }
+  EVP_MD_CTX *context = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(context, EVP_sha256(), NULL);
+  char block[65536];
+  ssize_t bytes;
+  while( (bytes = read(input, block, sizeof(block))) > 0 ) {
+    EVP_DigestUpdate(context, block, bytes);
+  }
+  finishHash(context, hash);
+  EVP_MD_CTX_free(context);
+  close(input);
+  return bytes == 0;
+}
+
+/**
+ * Records the content hash of a holder's file on its registry node
+ * Only rfcs owned by this server are updated
+ * @param holder holder whose content_hash, hash_mtime and hash_size are set
+*/
+void storeContentHash( const RFC_Node *holder ) {
+  if( ownerOf(holder->rfc_number) != NULL ) {
+    return;
+  }
+  RFC_Shard *shard = shardFor(holder->rfc_number);
+  lockRegistry(&shard->lock);
+  RFC_Entry *entry = findRFCEntry(shard, holder->rfc_number);
+  for( RFC_Node *node = entry == NULL ? NULL : fromOffset<RFC_Node>(entry->holders); node != NULL; node = fromOffset<RFC_Node>(node->next_holder) ) {
+    if( node->port_number == holder->port_number ) {
+      strcpy(node->content_hash, holder->content_hash);
+      node->hash_mtime = holder->hash_mtime;
+      node->hash_size = holder->hash_size;
+      break;
+    }
+  }
+  unlockRegistry(&shard->lock);
+}
+
+/**
+ * Finds the content hash of a holder's file
+ * The hash on the registry node is reused while the file's mtime and
+ * size are unchanged, otherwise the file is hashed and the node updated
+ * @param holder holder of the rfc, updated with the hash
+ * @param file_name path of the holder's file
+ * @return true if the file could be hashed and matches the registered hash
+*/
+bool contentHash( RFC_Node *holder, const char *file_name ) {
+  struct stat fileStat;
+  if( stat(file_name, &fileStat) != 0 ) {
+    return false;
+  }
+  long long mtime = fileStat.st_mtim.tv_sec * 1000000000LL + fileStat.st_mtim.tv_nsec;
+  if( holder->content_hash[0] != '\0' && holder->hash_mtime == mtime && holder->hash_size == fileStat.st_size ) {
+    return true;
+  }
+  char actual[65];
+  if( !hashFile(file_name, actual) ) {
+    return false;
+  }
+  // A replica that differs from what its holder registered is not served,
+  // however often the file has been rehashed since
+  if( holder->registered_hash[0] != '\0' && strcmp(actual, holder->registered_hash) != 0 ) {
+    std::cout << "RFC " << holder->rfc_number << " at port " << holder->port_number << " does not match its registered hash" << std::endl;
+    return false;
+  }
+  strcpy(holder->content_hash, actual);
+  holder->hash_mtime = mtime;
+  holder->hash_size = fileStat.st_size;
+  storeContentHash(holder);
+  return true;
+}
+
+/**
+ * Checks whether the content hash on a holder is still valid for its file,
+ * that is the file keeps the mtime and size it had when hashed
+ * @param holder holder of the rfc
+ * @param file_name path of the holder's file
+ * @return true if contentHash would not need to read the file
+*/
+bool contentHashCurrent( const RFC_Node *holder, const char *file_name ) {
+  struct stat fileStat;
+  if( holder->content_hash[0] == '\0' || stat(file_name, &fileStat) != 0 ) {
+    return false;
+  }
+  return holder->hash_mtime == fileStat.st_mtim.tv_sec * 1000000000LL + fileStat.st_mtim.tv_nsec && holder->hash_size == fileStat.st_size;
+}
+
+/**
+ * contentHash for a handler: a hash still valid for the file is used at
+ * once, reading and hashing the file is left to the offload pool
+ * @param loop event loop of the calling handler
+ * @param holder holder of the rfc, updated with the hash
+ * @param file_name path of the holder's file
+ * @return true if the file could be hashed and matches the registered hash
+*/
+Co<bool> verifyContent( Event_Loop *loop, RFC_Node *holder, const char *file_name ) {
+  if( contentHashCurrent(holder, file_name) ) {
+    co_return true;
+  }
+  bool matched = false;
+  co_await offload(loop, [&]() { matched = contentHash(holder, file_name); });
+  co_return matched;
+}
+
+/**
+ * Copies a file byte for byte, as a reflink when the filesystem allows it
+ * @param from source path
+ * @param to destination path, created or truncated
+ * @return true if copied
+*/
+bool copyFileBytes( const char *from, const char *to ) {
+  int input = open(from, O_RDONLY);
+  if( input == -1 ) {
+    return false;
+  }
+  int output = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0444);
+  if( output == -1 ) {
+    close(input);
+    return false;
+  }
+  bool copied = ioctl(output, FICLONE, input) == 0;
+  if( !copied ) {
+    char block[65536];
+    ssize_t bytes;
+    copied = true;
+    while( copied && (bytes = read(input, block, sizeof(block))) != 0 ) {
+      copied = bytes > 0 && write(output, block, bytes) == bytes;
+    }
+  }
+  close(input);
+  close(output);
+  return copied;
+}
+
+/**
+ * Hardlinks the stored copy of a holder's rfc file into the requester's
+ * directory, without reading the file
+ * @param holder holder of the rfc, its content hash already checked
+ * @param file_name_write path in the requester's directory
+ * @return true if the store held the content and it was linked
+*/
+bool linkFromStore( const RFC_Node *holder, const char *file_name_write ) {
+  std::string stored = std::string(RFC_STORE_DIR) + "/" + holder->content_hash;
+  if( holder->content_hash[0] == '\0' || access(stored.c_str(), F_OK) != 0 ) {
+    return false;
+  }
+  unlink(file_name_write);
+  return link(stored.c_str(), file_name_write) == 0 || errno == EEXIST;
+}
+
+/**
+ * Places a holder's rfc file into the requester's directory through the
+ * content-addressed store: the content is kept once under its hash in
+ * RFC_STORE_DIR and hardlinked into every directory that downloads it
+ * Falls back to a plain copy when the store cannot be used
+ * @param holder holder of the rfc, updated with the content hash
+ * @param file_name path of the holder's file
+ * @param file_name_write path in the requester's directory
+ * @return true if the file was placed
+*/
+bool placeFromStore( RFC_Node *holder, const char *file_name, const char *file_name_write ) {
+  if( !contentHash(holder, file_name) ) {
+    return false;
+  }
+  std::string stored = std::string(RFC_STORE_DIR) + "/" + holder->content_hash;
+  if( access(stored.c_str(), F_OK) != 0 ) {
+    // Concurrent GETs in every worker each copy to their own name, the renames are atomic
+    static std::atomic<unsigned long> staging_serial(0);
+    char temporary[48];
+    snprintf(temporary, sizeof(temporary), ".%d.%lu", (int)getpid(), staging_serial++);
+    std::string staging = stored + temporary;
+    if( !copyFileBytes(file_name, staging.c_str()) ) {
+      unlink(staging.c_str());
+      return copyFileBytes(file_name, file_name_write);
+    }
+    rename(staging.c_str(), stored.c_str());
+  }
+  if( linkFromStore(holder, file_name_write) ) {
+    return true;
+  }
+  return copyFileBytes(stored.c_str(), file_name_write);
+}
+
+/**
+ * Size of the pieces a file is split into for swarm downloads
+ * SWARM_PIECE_SIZE, doubled until the file has at most SWARM_MAX_PIECES
+ * @param length length of the file
+ * @return piece size in bytes
+*/
+off_t swarmPieceSize( off_t length ) {
+  off_t size = SWARM_PIECE_SIZE;
+  while( (length + size - 1) / size > SWARM_MAX_PIECES ) {
+    size *= 2;
+  }
+  return size;
+}
+
+// Piece hashes of recently served files, keyed by whole-file hash
+std::map<std::string, std::vector<std::string>> piece_hashes;
+/** Mutex lock for the piece hash cache, never held while reading a file */
+pthread_mutex_t piece_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Finds the SHA-256 of every piece of a holder's file
+ * The pieces are hashed together with the whole file, and only kept if
+ * the file still has the content hash the holder was checked against
+ * @param holder holder of the rfc, its content hash already checked
+ * @param file_name path of the holder's file
+ * @param hashes destination for the hex digests, one per piece
+ * @return true if the file could be read and was unchanged
+*/
+bool pieceHashes( const RFC_Node *holder, const char *file_name, std::vector<std::string> &hashes ) {
+  pthread_mutex_lock(&piece_lock);
+  std::map<std::string, std::vector<std::string>>::iterator found = piece_hashes.find(holder->content_hash);
+  if( found != piece_hashes.end() ) {
+    hashes = found->second;
+    pthread_mutex_unlock(&piece_lock);
+    return true;
+  }
+  pthread_mutex_unlock(&piece_lock);
+
+  int input = open(file_name, O_RDONLY);
+  if( input == -1 ) {
+    return false;
+  }
+  off_t piece_size = swarmPieceSize(holder->hash_size);
+  EVP_MD_CTX *whole = EVP_MD_CTX_new();
+  EVP_MD_CTX *piece = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(whole, EVP_sha256(), NULL);
+  hashes.clear();
+  char block[65536];
+  char hash[65];
+  off_t in_piece = 0;
+  ssize_t bytes;
+  while( (bytes = read(input, block, sizeof(block))) > 0 ) {
+    EVP_DigestUpdate(whole, block, bytes);
+    for( ssize_t at = 0; at < bytes; ) {
+      if( in_piece == 0 ) {
+        EVP_DigestInit_ex(piece, EVP_sha256(), NULL);
+      }
+      size_t part = std::min((off_t)(bytes - at), piece_size - in_piece);
+      EVP_DigestUpdate(piece, block + at, part);
+      at += part;
+      in_piece += part;
+      if( in_piece == piece_size ) {
+        finishHash(piece, hash);
+        hashes.push_back(hash);
+        in_piece = 0;
+      }
+    }
+  }
+  if( in_piece > 0 ) {
+    finishHash(piece, hash);
+    hashes.push_back(hash);
+  }
+  finishHash(whole, hash);
+  EVP_MD_CTX_free(whole);
+  EVP_MD_CTX_free(piece);
+  close(input);
+  if( bytes != 0 || strcmp(hash, holder->content_hash) != 0 ) {
+    return false;
+  }
+
+  pthread_mutex_lock(&piece_lock);
+  if( piece_hashes.size() >= PIECE_CACHE_FILES ) {
+    piece_hashes.erase(piece_hashes.begin());
+  }
+  piece_hashes[holder->content_hash] = hashes;
+  pthread_mutex_unlock(&piece_lock);
+  return true;
+}
+
+/**
+ * Finds a downloader's swarm record for an rfc
+ * Must be called with the shard lock held
+ * @param shard shard owning the rfc number
+ * @param rfc_number number of the rfc
+ * @param port port number of the downloader
+ * @return Swarm_Peer matching record or NULL
+*/
+Swarm_Peer* findSwarmPeer( RFC_Shard *shard, int rfc_number, int port ) {
+  for( Swarm_Peer *peer = fromOffset<Swarm_Peer>(shard->swarm_peers); peer != NULL; peer = fromOffset<Swarm_Peer>(peer->next) ) {
+    if( peer->rfc_number == rfc_number && peer->port_number == port ) {
+      return peer;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Records pieces a downloader has received and checked
+ * Pieces of another version of the file than the recorded one replace them
+ * @param rfc_number number of the rfc
+ * @param port port number of the downloader
+ * @param path directory of the downloader
+ * @param content_hash whole-file hash of the version the pieces belong to
+ * @param pieces ascending ranges of piece indexes
+*/
+void swarmHave( int rfc_number, int port, const char *path, const char *content_hash, const std::vector<std::pair<int, int>> &pieces ) {
+  RFC_Shard *shard = shardFor(rfc_number);
+  lockRegistry(&shard->lock);
+  Swarm_Peer *peer = findSwarmPeer(shard, rfc_number, port);
+  if( peer == NULL ) {
+    if( shard->free_swarm == 0 ) {
+      allocSlab(sizeof(Swarm_Peer), RFC_SLAB_SIZE, offsetof(Swarm_Peer, next), &shard->free_swarm);
+    }
+    peer = fromOffset<Swarm_Peer>(shard->free_swarm);
+    shard->free_swarm = peer->next;
+    peer->rfc_number = rfc_number;
+    peer->port_number = port;
+    peer->content_hash[0] = '\0';
+    peer->next = shard->swarm_peers;
+    shard->swarm_peers = toOffset(peer);
+  }
+  if( strcmp(peer->content_hash, content_hash) != 0 ) {
+    strcpy(peer->content_hash, content_hash);
+    memset(peer->pieces, 0, sizeof(peer->pieces));
+  }
+  strcpy(peer->path, path);
+  for( const std::pair<int, int> &range : pieces ) {
+    for( int piece = range.first; piece <= range.second && piece < SWARM_MAX_PIECES; piece++ ) {
+      peer->pieces[piece / 8] |= 1 << (piece % 8);
+    }
+  }
+  unlockRegistry(&shard->lock);
+}
+
+/**
+ * Takes a piece away from a downloader whose copy did not match its hash
+ * @param rfc_number number of the rfc
+ * @param port port number of the downloader
+ * @param piece index of the piece
+*/
+void swarmDrop( int rfc_number, int port, int piece ) {
+  RFC_Shard *shard = shardFor(rfc_number);
+  lockRegistry(&shard->lock);
+  Swarm_Peer *peer = findSwarmPeer(shard, rfc_number, port);
+  if( peer != NULL ) {
+    peer->pieces[piece / 8] &= ~(1 << (piece % 8));
+  }
+  unlockRegistry(&shard->lock);
+}
+
+/**
+ * Removes every swarm record of a disconnected client
+ * Shards are locked one at a time, never all at once
+ * @param port port number of the client
+*/
+void swarmForget( int port ) {
+  for( int i = 0; i < RFC_SHARDS; i++ ) {
+    RFC_Shard *shard = &registry->shards[i];
+    lockRegistry(&shard->lock);
+    Shm_Offset *link = &shard->swarm_peers;
+    while( *link != 0 ) {
+      Swarm_Peer *peer = fromOffset<Swarm_Peer>(*link);
+      if( peer->port_number == port ) {
+        *link = peer->next;
+        peer->next = shard->free_swarm;
+        shard->free_swarm = toOffset(peer);
+      } else {
+        link = &peer->next;
+      }
+    }
+    unlockRegistry(&shard->lock);
+  }
+}
+
+/**
+ * Counts the downloaders holding each piece of one version of an rfc
+ * @param rfc_number number of the rfc
+ * @param content_hash whole-file hash of the version
+ * @param counts one count per piece, added to
+*/
+void swarmAvailability( int rfc_number, const char *content_hash, std::vector<int> &counts ) {
+  RFC_Shard *shard = shardFor(rfc_number);
+  lockRegistry(&shard->lock);
+  for( Swarm_Peer *peer = fromOffset<Swarm_Peer>(shard->swarm_peers); peer != NULL; peer = fromOffset<Swarm_Peer>(peer->next) ) {
+    if( peer->rfc_number != rfc_number || strcmp(peer->content_hash, content_hash) != 0 ) {
+      continue;
+    }
+    for( size_t piece = 0; piece < counts.size(); piece++ ) {
+      if( peer->pieces[piece / 8] & (1 << (piece % 8)) ) {
+        counts[piece]++;
+      }
+    }
+  }
+  unlockRegistry(&shard->lock);
+}
+
+/**
+ * Picks the least loaded connected downloader holding a piece
+ * Takes the shard lock, then the client lock
+ * @param rfc_number number of the rfc
+ * @param content_hash whole-file hash of the version
+ * @param piece index of the piece
+ * @param exclude_port port of the requesting client
+ * @param port receives the downloader's port
+ * @param path receives the downloader's directory, at least 20 bytes
+ * @param load receives the downloader's load
+ * @return true if a downloader was found
+*/
+bool swarmSource( int rfc_number, const char *content_hash, int piece, int exclude_port, int *port, char *path, long *load ) {
+  bool found = false;
+  RFC_Shard *shard = shardFor(rfc_number);
+  lockRegistry(&shard->lock);
+  lockRegistry(&registry->lock);
+  for( Swarm_Peer *peer = fromOffset<Swarm_Peer>(shard->swarm_peers); peer != NULL; peer = fromOffset<Swarm_Peer>(peer->next) ) {
+    if( peer->rfc_number != rfc_number || peer->port_number == exclude_port || strcmp(peer->content_hash, content_hash) != 0 ||
+        !(peer->pieces[piece / 8] & (1 << (piece % 8))) ) {
+      continue;
+    }
+    Client_Node *client = findClientNode(peer->port_number);
+    if( client == NULL ) {
+      continue;
+    }
+    long peer_load = peerLoad(client);
+    if( !found || peer_load < *load ) {
+      found = true;
+      *port = peer->port_number;
+      strcpy(path, peer->path);
+      *load = peer_load;
+    }
+  }
+  unlockRegistry(&registry->lock);
+  unlockRegistry(&shard->lock);
+  return found;
+}
+
+/**
+ * Reads one piece of a file and checks it against its hash
+ * @param loop event loop of the connection
+ * @param file_name path of the file
+ * @param offset first byte of the piece
+ * @param piece destination, sized to the piece
+ * @param expected hex SHA-256 of the piece
+ * @return true if the piece was read whole and matches
+*/
+Co<bool> readPiece( Event_Loop *loop, const char *file_name, off_t offset, std::string &piece, const std::string &expected ) {
+  int input = co_await fileOpen(loop, file_name);
+  if( input < 0 ) {
+    co_return false;
+  }
+  size_t done = 0;
+  while( done < piece.size() ) {
+    int bytes = co_await fileRead(loop, input, &piece[done], piece.size() - done, offset + done);
+    if( bytes <= 0 ) {
+      break;
+    }
+    done += bytes;
+  }
+  close(input);
+  if( done < piece.size() ) {
+    co_return false;
+  }
+  EVP_MD_CTX *context = EVP_MD_CTX_new();
+  EVP_DigestInit_ex(context, EVP_sha256(), NULL);
+  EVP_DigestUpdate(context, piece.data(), piece.size());
+  char hash[65];
+  finishHash(context, hash);
+  EVP_MD_CTX_free(context);
+  co_return expected == hash;
+}
+
+/**
+ * Starts or finishes a transfer in a peer's load counters
+ * @param port port number of the peer, peers of other servers are skipped
+ * @param started true when the transfer starts
+ * @param bytes bytes served by a finished transfer
+*/
+void peerTransfer( int port, bool started, off_t bytes ) {
+  lockRegistry(&registry->lock);
+  Client_Node *peer = findClientNode(port);
+  if( peer != NULL && started ) {
+    peer->active_transfers++;
+  } else if( peer != NULL ) {
+    peerLoad(peer);
+    peer->active_transfers--;
+    peer->bytes_served += bytes;
+    peer->recent_bytes += bytes;
+  }
+  unlockRegistry(&registry->lock);
+}
+
+/**
+ * Sends one piece of an rfc for a swarm GET
+ * The piece comes from the least loaded of the full holder and the
+ * downloaders that announced it with HAVE, a downloader being preferred
+ * on equal load so the holder is left for pieces nobody else has yet. A
+ * downloader's piece is read from its partial file, or from the finished
+ * file once it has been renamed. Whatever the source, the piece is read
+ * whole and checked against its hash before anything is sent; a
+ * downloader whose copy does not match loses the piece and the holder
+ * serves it. A Piece-Source line naming the source is added to the header.
+ * Peers never connect to each other, so every piece goes out over this
+ * connection whichever file it was read from.
+ * @param conn connection of the requesting client
+ * @param holder full holder chosen for the GET
+ * @param file_name path of the holder's file
+ * @param piece index of the piece
+ * @param offset first byte of the piece
+ * @param length bytes in the piece
+ * @param expected hex SHA-256 of the piece
+ * @param requester_port port of the requesting client
+ * @param header fixed size response header
+ * @param header_length size of the header
+ * @return true if the piece was sent
+*/
+Co<bool> sendPiece( Client_Conn *conn, RFC_Node *holder, const char *file_name, int piece, off_t offset, off_t length,
+                    const std::string &expected, int requester_port, char *header, size_t header_length ) {
+  std::string data(length, '\0');
+  int source_port = 0;
+  char source_path[20];
+  long source_load = 0;
+  bool from_swarm = swarmSource(holder->rfc_number, holder->content_hash, piece, requester_port, &source_port, source_path, &source_load);
+  if( from_swarm ) {
+    lockRegistry(&registry->lock);
+    Client_Node *holder_peer = holderPeer(holder);
+    from_swarm = holder_peer == NULL || source_load <= peerLoad(holder_peer);
+    unlockRegistry(&registry->lock);
+  }
+
+  bool read = false;
+  if( from_swarm ) {
+    char swarm_file[48];
+    snprintf(swarm_file, sizeof(swarm_file), "%s/rfc%d.txt.swarm", source_path, holder->rfc_number);
+    peerTransfer(source_port, true, 0);
+    read = co_await readPiece(conn->loop, swarm_file, offset, data, expected);
+    if( !read ) {
+      snprintf(swarm_file, sizeof(swarm_file), "%s/rfc%d.txt", source_path, holder->rfc_number);
+      read = co_await readPiece(conn->loop, swarm_file, offset, data, expected);
+    }
+    if( !read ) {
+      peerTransfer(source_port, false, 0);
+      swarmDrop(holder->rfc_number, source_port, piece);
+    }
+  }
+  if( !read ) {
+    source_port = holder->port_number;
+    from_swarm = false;
+    peerTransfer(source_port, true, 0);
+    read = co_await readPiece(conn->loop, file_name, offset, data, expected);
+  }
+  if( !read ) {
+    peerTransfer(source_port, false, 0);
+    memset(header, '\0', header_length);
+    strcpy(header, "P2P-CI/1.0 404 Not Found\n");
+    co_await connWrite(conn, header, header_length);
+    co_return false;
+  }
+
+  char source_line[48];
+  snprintf(source_line, sizeof(source_line), "Piece-Source: %s %d\n", from_swarm ? "swarm" : "holder", source_port);
+  strncat(header, source_line, header_length - strlen(header) - 1);
+  connBeginStream(conn);
+  bool sent = co_await connWrite(conn, header, header_length);
+  for( size_t at = 0; sent && at < data.size(); at += COMPRESS_CHUNK_SIZE ) {
+    sent = co_await sendChunk(conn, data.data() + at, std::min((size_t)COMPRESS_CHUNK_SIZE, data.size() - at));
+  }
+  if( sent ) {
+    sent = co_await sendChunk(conn, NULL, 0);
+  }
+  peerTransfer(source_port, false, length);
+  co_return co_await connEndStream(conn) && sent;
+}
+
+/**
+ * Pieces command, the piece map of an rfc for a swarm download
+ * PIECES RFC <number> P2P-CI/1.0 is answered with the file's length and
+ * hash, its piece size and number of pieces, then one
+ * "<index> <downloaders> <sha256>" line per piece, followed by END.
+ * Every piece is also on each full holder, so the downloader counts are
+ * what a client orders pieces by, rarest first.
+ * @param conn client connection
+ * @param buffer client input
+ * @param client_hostname hostname of client
+ * @param __port port of client
+ * @return true if sent
+*/
+Co<bool> piecesCommand(Client_Conn *conn, char *buffer, char *client_hostname, int __port) {
+  char command[8];
+  char rfc[4];
+  int rfc_number = 0;
+  char version[12];
+  char str_host[50];
+  int user_port = 0;
+  command[0] = rfc[0] = version[0] = str_host[0] = '\0';
+  sscanf(buffer, "%7s%3s%d%11s%49s%d", command, rfc, &rfc_number, version, str_host, &user_port);
+
+  const char *status = "P2P-CI/1.0 200 OK\n";
+  RFC_Node holder;
+  char file_name[48];
+  std::vector<std::string> hashes;
+  if(strcmp(command, "PIECES") != 0 || strcmp(rfc, "RFC") != 0 || __port != user_port) {
+    status = "P2P-CI/1.0 400 Bad Request\n";
+  } else if(strcmp(version, "P2P-CI/1.0") != 0) {
+    status = "P2P-CI/1.0 505 P2P-CI Version Not Supported\n";
+  } else if(clientHostKnown(str_host, client_hostname) == false) {
+    status = "P2P-CI/1.0 404 Not Found\n";
+  } else {
+    // The pieces are cut from a full holder's checked file
+    bool found = false;
+    co_await clusterCall(conn->loop, rfc_number, [&]() { found = resolveRFC(rfc_number, NULL, __port, &holder, NULL, false); });
+    if( !found || holder.port_number == 0 ) {
+      status = "P2P-CI/1.0 404 Not Found\n";
+    } else {
+      snprintf(file_name, sizeof(file_name), "%s/rfc%d.txt", holder.path, rfc_number);
+      bool checked = co_await verifyContent(conn->loop, &holder, file_name);
+      if( checked ) {
+        co_await offload(conn->loop, [&]() { checked = pieceHashes(&holder, file_name, hashes); });
+      }
+      if( !checked ) {
+        status = "P2P-CI/1.0 404 Not Found\n";
+      }
+    }
+  }
+
+  std::string chunk = status;
+  connBeginStream(conn);
+  if( strncmp(status, "P2P-CI/1.0 200", 14) == 0 ) {
+    std::vector<int> counts(hashes.size(), 0);
+    swarmAvailability(rfc_number, holder.content_hash, counts);
+    chunk += "Content-Length: " + std::to_string(holder.hash_size) + "\n";
+    chunk += std::string("Content-Hash: sha256:") + holder.content_hash + "\n";
+    chunk += "Piece-Size: " + std::to_string(swarmPieceSize(holder.hash_size)) + "\n";
+    chunk += "Pieces: " + std::to_string(hashes.size()) + "\n";
+    for( size_t piece = 0; piece < hashes.size(); piece++ ) {
+      chunk += std::to_string(piece) + " " + std::to_string(counts[piece]) + " " + hashes[piece] + "\n";
+      if( chunk.size() >= LOOKUP_CHUNK_SIZE ) {
+        if( !co_await connWrite(conn, chunk.data(), chunk.size()) ) {
+          co_await connEndStream(conn);
+          co_return false;
+        }
+        chunk.clear();
+      }
+    }
+  }
+  chunk += "END\n";
+  bool sent = co_await connWrite(conn, chunk.data(), chunk.size());
+  co_return co_await connEndStream(conn) && sent;
+}
+
+/**
+ * Have command, announces pieces a swarm downloader has received
+ * HAVE RFC <number> P2P-CI/1.0 Content-Hash: sha256:<hash> Directory: <dir> Pieces: <list>
+ * The list is comma separated piece indexes and ranges a-b. The pieces
+ * are read from <dir>/rfc<number>.txt.swarm when other downloaders ask
+ * for them, and only for GETs of the version with that hash.
+ * @param buffer client input
+ * @param client_hostname hostname of client
+ * @param __port port of client
+ * @return response of the server
+*/
+char* haveCommand(char *buffer, char *client_hostname, int __port) {
+  char *response = new char[1024];
+  response[0] = '\0';
+  char command[6];
+  char rfc[4];
+  int rfc_number = 0;
+  char version[12];
+  command[0] = rfc[0] = version[0] = '\0';
+  sscanf(buffer, "%5s%3s%d%11s", command, rfc, &rfc_number, version);
+  char *second_line = strchr(buffer, '\n');
+  char str_host[50];
+  int user_port = 0;
+  str_host[0] = '\0';
+  sscanf(second_line + 1, "%49s%d", str_host, &user_port);
+
+  char content_hash[65];
+  char directory[32];
+  char piece_list[256];
+  content_hash[0] = directory[0] = piece_list[0] = '\0';
+  char *hash_header = strstr(buffer, "Content-Hash: sha256:");
+  char *directory_header = strstr(buffer, "Directory: ");
+  char *pieces_header = strstr(buffer, "Pieces: ");
+  if( hash_header != NULL && hash_header < second_line ) {
+    sscanf(hash_header, "Content-Hash: sha256:%64s", content_hash);
+  }
+  if( directory_header != NULL && directory_header < second_line ) {
+    sscanf(directory_header, "Directory: %31s", directory);
+  }
+  if( pieces_header != NULL && pieces_header < second_line ) {
+    sscanf(pieces_header, "Pieces: %255s", piece_list);
+  }
+
+  std::vector<std::pair<int, int>> pieces;
+  if(strcmp(command, "HAVE") != 0 || strcmp(rfc, "RFC") != 0 || __port != user_port) {
+    strcat(response, "P2P-CI/1.0 400 Bad Request\n");
+    return response;
+  }
+  if(strcmp(version, "P2P-CI/1.0") != 0) {
+    strcat(response, "P2P-CI/1.0 505 P2P-CI Version Not Supported\n");
+    return response;
+  }
+  // The directory is a sibling of the holders' directories, like a registered path
+  if(strlen(content_hash) != 64 || directory[0] == '\0' || strlen(directory) >= 20 || strchr(directory, '/') != NULL ||
+     strcmp(directory, ".") == 0 || strcmp(directory, "..") == 0 || !parseRFCSelector(piece_list, pieces)) {
+    strcat(response, "P2P-CI/1.0 400 Bad Request\n");
+    return response;
+  }
+  if(clientHostKnown(str_host, client_hostname) == false) {
+    strcat(response, "P2P-CI/1.0 404 Not Found\n");
+    return response;
+  }
+
+  swarmHave(rfc_number, __port, directory, content_hash, pieces);
+  strcat(response, "P2P-CI/1.0 200 OK\n");
+  return response;
+}
+
+//Structure for one column of a registry snapshot file while it is filled
+struct Dump_Column {
+    const char *name;
+    uint8_t type;
+    // Values of an integer column, or the row offsets of a string column
+    std::string values;
+    // Bytes of a string column
+    std::string strings;
+};
+
+//Structure for a point-in-time copy of the registry, written out by a dump thread
+struct Registry_Snapshot {
+    std::string file_name;
+    struct timespec taken_at;
+    unsigned long list_generation;
+    size_t client_rows;
+    size_t rfc_rows;
+    std::vector<Dump_Column> clients;
+    // Rows of each shard, put together into one table when written
+    std::vector<Dump_Column> rfcs[RFC_SHARDS];
+    // False when every pass saw a shard change, each shard is then
+    // consistent on its own
+    bool consistent;
+};
+
+/**
+ * Appends an integer to a snapshot file in little-endian byte order
+ * @param out bytes of the file
+ * @param value integer to append
+ * @param bytes width of the integer
+*/
+void putLittleEndian( std::string &out, uint64_t value, int bytes ) {
+  char encoded[8];
+  for( int i = 0; i < bytes; i++ ) {
+    encoded[i] = (char)(value >> (8 * i));
+  }
+  out.append(encoded, bytes);
+}
+
+/**
+ * Makes an empty column, a string column starts with the offset of its first row
+ * @param name column name
+ * @param type DUMP_INT32, DUMP_INT64 or DUMP_STRING
+ * @return the column
+*/
+Dump_Column dumpColumn( const char *name, uint8_t type ) {
+  Dump_Column column;
+  column.name = name;
+  column.type = type;
+  if( type == DUMP_STRING ) {
+    putLittleEndian(column.values, 0, 4);
+  }
+  return column;
+}
+
+/**
+ * Appends one row to an integer column
+ * @param column DUMP_INT32 or DUMP_INT64 column
+ * @param value value of the row
+*/
+void dumpInteger( Dump_Column &column, int64_t value ) {
+  putLittleEndian(column.values, (uint64_t)value, column.type == DUMP_INT32 ? 4 : 8);
+}
+
+/**
+ * Appends one row to a string column
+ * @param column DUMP_STRING column
+ * @param text NUL-terminated value of the row
+*/
+void dumpString( Dump_Column &column, const char *text ) {
+  column.strings += text;
+  putLittleEndian(column.values, column.strings.size(), 4);
+}
+
+/**
+ * Appends a table to a snapshot file: its name, row count and columns,
+ * each column holding the values of every row one after another
+ * @param out bytes of the file
+ * @param name table name
+ * @param rows number of rows
+ * @param columns filled columns of the table
+*/
+void dumpTable( std::string &out, const char *name, size_t rows, std::vector<Dump_Column> &columns ) {
+  putLittleEndian(out, strlen(name), 1);
+  out += name;
+  putLittleEndian(out, rows, 8);
+  putLittleEndian(out, columns.size(), 4);
+  for( Dump_Column &column : columns ) {
+    putLittleEndian(out, strlen(column.name), 1);
+    out += column.name;
+    putLittleEndian(out, column.type, 1);
+    putLittleEndian(out, column.values.size() + column.strings.size(), 8);
+    out += column.values;
+    out += column.strings;
+  }
+}
+
+/**
+ * Appends the rows of one column to another of the same type
+ * @param into column appended to
+ * @param from column whose rows are appended
+*/
+void dumpAppend( Dump_Column &into, const Dump_Column &from ) {
+  if( into.type != DUMP_STRING ) {
+    into.values += from.values;
+    return;
+  }
+  // Offsets past the first 0 are moved by the bytes already in into
+  uint32_t base = into.strings.size();
+  for( size_t at = 4; at + 4 <= from.values.size(); at += 4 ) {
+    uint32_t offset = 0;
+    for( int i = 0; i < 4; i++ ) {
+      offset |= (uint32_t)(unsigned char)from.values[at + i] << (8 * i);
+    }
+    putLittleEndian(into.values, base + offset, 4);
+  }
+  into.strings += from.strings;
+}
+
+/**
+ * Makes the empty columns of the rfcs table
+ * @param rfcs filled with one empty column per field
+*/
+void rfcColumns( std::vector<Dump_Column> &rfcs ) {
+  rfcs.clear();
+  rfcs.push_back(dumpColumn("rfc_number", DUMP_INT32));
+  rfcs.push_back(dumpColumn("title", DUMP_STRING));
+  rfcs.push_back(dumpColumn("hostname", DUMP_STRING));
+  rfcs.push_back(dumpColumn("port", DUMP_INT32));
+  rfcs.push_back(dumpColumn("path", DUMP_STRING));
+  rfcs.push_back(dumpColumn("content_hash", DUMP_STRING));
+}
+
+/**
+ * Copies the client and RFC lists as they are at one instant
+ * Each shard is copied under its own lock only, so requests on the other
+ * shards carry on. After the clients are copied each shard is checked
+ * again: if none changed since it was last copied, every row is as it was
+ * between the last shard copy and the first check, and the client copy was
+ * made in that window. Otherwise the shards that changed are copied again
+ * and all are checked, up to SNAPSHOT_ATTEMPTS times. The file is put
+ * together and written afterwards without any lock
+ * @return the copy, with the name of the file it is to be written to
+*/
+Registry_Snapshot *snapshotRegistry() {
+  Registry_Snapshot *snapshot = new Registry_Snapshot;
+  size_t shard_counts[RFC_SHARDS];
+  unsigned long copied[RFC_SHARDS];
+  bool stale[RFC_SHARDS];
+  for( int i = 0; i < RFC_SHARDS; i++ ) {
+    stale[i] = true;
+  }
+  snapshot->consistent = false;
+  for( int attempt = 0; attempt < SNAPSHOT_ATTEMPTS && !snapshot->consistent; attempt++ ) {
+    for( int i = 0; i < RFC_SHARDS; i++ ) {
+      if( !stale[i] ) {
+        continue;
+      }
+      std::vector<Dump_Column> &rfcs = snapshot->rfcs[i];
+      rfcColumns(rfcs);
+      shard_counts[i] = 0;
+      RFC_Shard *shard = &registry->shards[i];
+      lockRegistry(&shard->lock);
+      copied[i] = shard->generation;
+      for( RFC_Node *rfc = fromOffset<RFC_Node>(shard->rfc_list); rfc != NULL; rfc = fromOffset<RFC_Node>(rfc->next) ) {
+        dumpInteger(rfcs[0], rfc->rfc_number);
+        dumpString(rfcs[1], rfc->title);
+        dumpString(rfcs[2], rfc->hostname);
+        dumpInteger(rfcs[3], rfc->port_number);
+        dumpString(rfcs[4], rfc->path);
+        dumpString(rfcs[5], rfc->content_hash);
+        shard_counts[i]++;
+      }
+      unlockRegistry(&shard->lock);
+    }
+
+    std::vector<Dump_Column> &clients = snapshot->clients;
+    clients.clear();
+    clients.push_back(dumpColumn("hostname", DUMP_STRING));
+    clients.push_back(dumpColumn("port", DUMP_INT32));
+    clients.push_back(dumpColumn("os", DUMP_STRING));
+    clients.push_back(dumpColumn("worker", DUMP_INT32));
+    clients.push_back(dumpColumn("path", DUMP_STRING));
+    clients.push_back(dumpColumn("address", DUMP_STRING));
+    clients.push_back(dumpColumn("rtt_us", DUMP_INT64));
+    clients.push_back(dumpColumn("active_transfers", DUMP_INT32));
+    clients.push_back(dumpColumn("bytes_served", DUMP_INT64));
+    snapshot->client_rows = 0;
+    lockRegistry(&registry->lock);
+    clock_gettime(CLOCK_REALTIME, &snapshot->taken_at);
+    snapshot->list_generation = registry->list_generation;
+    for( Client_Node *client = fromOffset<Client_Node>(registry->client_list); client != NULL; client = fromOffset<Client_Node>(client->next) ) {
+      char address[INET_ADDRSTRLEN];
+      address[0] = '\0';
+      if( client->address != 0 ) {
+        inet_ntop(AF_INET, &client->address, address, sizeof(address));
+      }
+      dumpString(clients[0], client->hostname);
+      dumpInteger(clients[1], client->port_number);
+      dumpString(clients[2], client->os_string);
+      dumpInteger(clients[3], client->worker);
+      dumpString(clients[4], client->path);
+      dumpString(clients[5], address);
+      dumpInteger(clients[6], client->rtt_us);
+      dumpInteger(clients[7], client->active_transfers);
+      dumpInteger(clients[8], client->bytes_served);
+      snapshot->client_rows++;
+    }
+    unlockRegistry(&registry->lock);
+
+    snapshot->consistent = true;
+    for( int i = 0; i < RFC_SHARDS; i++ ) {
+      lockRegistry(&registry->shards[i].lock);
+      stale[i] = registry->shards[i].generation != copied[i];
+      unlockRegistry(&registry->shards[i].lock);
+      if( stale[i] ) {
+        snapshot->consistent = false;
+      }
+    }
+  }
+
+  snapshot->rfc_rows = 0;
+  for( int i = 0; i < RFC_SHARDS; i++ ) {
+    snapshot->rfc_rows += shard_counts[i];
+  }
+
+  char file_name[128];
+  snprintf(file_name, sizeof(file_name), "%s/registry-%ld-%06ld.dump", DUMP_DIR,
+           (long)snapshot->taken_at.tv_sec, snapshot->taken_at.tv_nsec / 1000);
+  snapshot->file_name = file_name;
+  return snapshot;
+}
+
+/**
+ * Thread function writing a registry snapshot to its file
+ * The file is written under a temporary name and renamed when complete,
+ * so a file in DUMP_DIR is always whole. The layout is described in the README.
+ * @param copy Registry_Snapshot to write, deleted when done
+*/
+void *writeDump( void *copy ) {
+  pthread_detach( pthread_self() );
+  Registry_Snapshot *snapshot = (Registry_Snapshot *)copy;
+
+  std::string out(DUMP_MAGIC, 8);
+  putLittleEndian(out, DUMP_VERSION, 4);
+  putLittleEndian(out, 2, 4);
+  putLittleEndian(out, snapshot->taken_at.tv_sec * 1000000L + snapshot->taken_at.tv_nsec / 1000, 8);
+  putLittleEndian(out, snapshot->list_generation, 8);
+  dumpTable(out, "clients", snapshot->client_rows, snapshot->clients);
+  std::vector<Dump_Column> rfcs;
+  rfcColumns(rfcs);
+  for( int i = 0; i < RFC_SHARDS; i++ ) {
+    for( size_t column = 0; column < rfcs.size(); column++ ) {
+      dumpAppend(rfcs[column], snapshot->rfcs[i][column]);
+    }
+  }
+  dumpTable(out, "rfcs", snapshot->rfc_rows, rfcs);
+
+  std::string temp_name = snapshot->file_name + ".tmp";
+  int output = open(temp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  size_t written = 0;
+  while( output != -1 && written < out.size() ) {
+    ssize_t bytes = write(output, out.data() + written, out.size() - written);
+    if( bytes <= 0 ) {
+      break;
+    }
+    written += bytes;
+  }
+  if( output != -1 ) {
+    close(output);
+  }
+  if( written == out.size() && rename(temp_name.c_str(), snapshot->file_name.c_str()) == 0 ) {
+    std::cout << "Registry dumped to " << snapshot->file_name << " (" << snapshot->client_rows << " clients, "
+              << snapshot->rfc_rows << " rfcs" << (snapshot->consistent ? "" : ", each shard consistent on its own") << ")" << std::endl;
+  } else {
+    std::cout << "Registry dump to " << snapshot->file_name << " failed: " << strerror(errno) << std::endl;
+    unlink(temp_name.c_str());
+  }
+  delete snapshot;
+  return NULL;
+}
+
+/**
+ * Takes a registry snapshot and starts a thread writing it to DUMP_DIR
+ * @param file_name receives the name of the file, if not NULL
+ * @param clients receives the number of clients in it, if not NULL
+ * @param rfcs receives the number of rfcs in it, if not NULL
+ * @param consistent receives whether it shows a single instant, if not NULL
+ * @return false if the directory or thread could not be made
+*/
+bool startDump( std::string *file_name, size_t *clients, size_t *rfcs, bool *consistent ) {
+  if( mkdir(DUMP_DIR, 0755) == -1 && errno != EEXIST ) {
+    std::cout << "Registry dump failed: " << strerror(errno) << std::endl;
+    return false;
+  }
+  Registry_Snapshot *snapshot = snapshotRegistry();
+  if( file_name != NULL ) {
+    *file_name = snapshot->file_name;
+  }
+  if( clients != NULL ) {
+    *clients = snapshot->client_rows;
+  }
+  if( rfcs != NULL ) {
+    *rfcs = snapshot->rfc_rows;
+  }
+  if( consistent != NULL ) {
+    *consistent = snapshot->consistent;
+  }
+  pthread_t dumpThread;
+  if( pthread_create( &dumpThread, NULL, writeDump, snapshot ) != 0 ) {
+    std::cout << "Registry dump failed: thread not started" << std::endl;
+    delete snapshot;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Dump command, writes a snapshot of the client and RFC lists for offline analysis
+ * DUMP REGISTRY P2P-CI/1.0, accepted from the server's own host only
+ * The response names the file, which appears once it is completely written,
+ * and says whether the snapshot is of one instant or of each shard alone
+ * @param buffer client input
+ * @param __port port of client
+ * @param address address of the client's connection
+ * @return response of the server
+*/
+char* dumpCommand(char *buffer, int __port, in_addr_t address) {
+  char *response = new char[1024];
+  response[0] = '\0';
+  char command[6];
+  char table[10];
+  char version[12];
+  command[0] = table[0] = version[0] = '\0';
+  sscanf(buffer, "%5s%9s%11s", command, table, version);
+  char *second_line = strchr(buffer, '\n');
+  char str_host[50];
+  int user_port = 0;
+  str_host[0] = '\0';
+  if( second_line != NULL ) {
+    sscanf(second_line + 1, "%49s%d", str_host, &user_port);
+  }
+
+  if(strcmp(command, "DUMP") != 0 || strcmp(table, "REGISTRY") != 0 || __port != user_port) {
+    strcat(response, "P2P-CI/1.0 400 Bad Request\n");
+    return response;
+  }
+  if(strcmp(version, "P2P-CI/1.0") != 0) {
+    strcat(response, "P2P-CI/1.0 505 P2P-CI Version Not Supported\n");
+    return response;
+  }
+  // An admin command, the operator runs it on the server's host
+  if((ntohl(address) >> 24) != 127) {
+    strcat(response, "P2P-CI/1.0 403 Forbidden\n");
+    return response;
+  }
+
+  std::string file_name;
+  size_t clients = 0;
+  size_t rfcs = 0;
+  bool consistent = false;
+  if( !startDump(&file_name, &clients, &rfcs, &consistent) ) {
+    strcat(response, "P2P-CI/1.0 500 Internal Server Error\n");
+    return response;
+  }
+  snprintf(response, 1024, "P2P-CI/1.0 200 OK\nFile: %s\nClients: %zu\nRFCs: %zu\nConsistent: %s\n", file_name.c_str(),
+           clients, rfcs, consistent ? "instant" : "shard");
+  return response;
+}
+
+int cheap_rate = CHEAP_RATE;
+int expensive_rate = EXPENSIVE_RATE;
+int expensive_limit = EXPENSIVE_LIMIT;
+// LIST and GET commands admitted and not yet finished in this worker
+std::atomic<int> expensive_running(0);
+
+/**
+ * Finds the buckets of a peer address, taking a slot for it if it has none
+ * An unused slot is taken first, then the least recently used one. A slot
+ * untouched for two seconds holds full buckets anyway, and giving up a
+ * busier one only lets that peer burst again. Caller holds buckets_lock.
+ * @param address peer IPv4 address
+ * @param now monotonicMicros() of the command
+ * @return the address's buckets
+*/
+Peer_Buckets *peerBuckets( in_addr_t address, long now ) {
+  unsigned int start = (address * 2654435761u) % PEER_BUCKETS;
+  Peer_Buckets *chosen = NULL;
+  for( int i = 0; i < PEER_BUCKET_PROBE; i++ ) {
+    Peer_Buckets *slot = &registry->buckets[(start + i) % PEER_BUCKETS];
+    if( slot->used && slot->address == address ) {
+      return slot;
+    }
+    if( chosen == NULL || (chosen->used && (!slot->used || slot->refilled < chosen->refilled)) ) {
+      chosen = slot;
+    }
+  }
+  chosen->used = true;
+  chosen->address = address;
+  chosen->cheap_tokens = 2.0 * cheap_rate;
+  chosen->expensive_tokens = 2.0 * expensive_rate;
+  chosen->refilled = now;
+  return chosen;
+}
+
+/**
+ * Takes a token for one command from a refilled bucket
+ * @param tokens tokens in the bucket, updated
+ * @param rate commands per second
+ * @return 0 if the command may run, otherwise seconds until a token is available
+*/
+int bucketTake( double *tokens, double rate ) {
+  if( *tokens >= 1.0 ) {
+    *tokens -= 1.0;
+    return 0;
+  }
+  return (int)((1.0 - *tokens) / rate) + 1;
+}
+
+/**
+ * Claims one of the worker's slots for a LIST or GET
+ * @return false if expensive_limit commands are already running
+*/
+bool expensiveAcquire() {
+  if( expensive_running.fetch_add(1) >= expensive_limit ) {
+    expensive_running--;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Decides whether a command may run, from its class and the peer's address alone
+ * Every connection from the address, in any worker, draws on the same buckets.
+ * An admitted expensive command holds a slot until expensive_running is decremented
+ * @param address peer IPv4 address
+ * @param expensive the command is a LIST or GET
+ * @return 0 if the command may run, otherwise seconds the client should wait
+*/
+int admitCommand( in_addr_t address, bool expensive ) {
+  long now = monotonicMicros();
+  lockRegistry(&registry->buckets_lock);
+  Peer_Buckets *buckets = peerBuckets(address, now);
+  double elapsed = (now - buckets->refilled) / 1e6;
+  // Both classes are refilled together, so one timestamp serves them
+  buckets->cheap_tokens = std::min(2.0 * cheap_rate, buckets->cheap_tokens + elapsed * cheap_rate);
+  buckets->expensive_tokens = std::min(2.0 * expensive_rate, buckets->expensive_tokens + elapsed * expensive_rate);
+  buckets->refilled = now;
+  int retry_after = expensive ? bucketTake(&buckets->expensive_tokens, expensive_rate) : bucketTake(&buckets->cheap_tokens, cheap_rate);
+  unlockRegistry(&registry->buckets_lock);
+  if( retry_after == 0 && expensive && !expensiveAcquire() ) {
+    retry_after = 1;
+  }
+  return retry_after;
+}
+
+/**
+ * Adds a connection to the set a drain walks
+ * @param conn client connection whose handler started
+*/
+void trackConn( Client_Conn *conn ) {
+  pthread_mutex_lock(&client_conns_lock);
+  client_conns.insert(conn);
+  pthread_mutex_unlock(&client_conns_lock);
+}
+
+/**
+ * Removes a connection from the set a drain walks
+ * @param conn client connection whose handler is ending
+*/
+void untrackConn( Client_Conn *conn ) {
+  pthread_mutex_lock(&client_conns_lock);
+  client_conns.erase(conn);
+  pthread_mutex_unlock(&client_conns_lock);
+}
+
+/**
+ * Runs the TLS handshake of a client whose first byte opens one
+ * Any other first byte is left unread for the OS line of a plaintext
+ * client or the greeting of a cluster link. The session is only given to
+ * the connection once the handshake is done, so a heartbeat never goes
+ * out in the middle of it.
+ * @param conn client connection, parked until its first byte arrives
+ * @return false if the client left, the handshake failed or the server stops
+*/
+Co<bool> tlsAccept( Client_Conn *conn ) {
+  unsigned char first;
+  conn->parked = true;
+  while( true ) {
+    if( draining ) {
+      co_return false;
+    }
+    ssize_t bytes = recv(conn->socket, &first, 1, MSG_PEEK);
+    if( bytes == 1 ) {
+      break;
+    }
+    if( bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ) {
+      co_await IO_Wait{conn, EPOLLIN};
+    } else if( bytes == 0 || errno != EINTR ) {
+      co_return false;
+    }
+  }
+  conn->parked = false;
+  if( first != TLS_HANDSHAKE_RECORD ) {
+    co_return true;
+  }
+
+  SSL *tls = SSL_new(tls_context);
+  SSL_set_fd(tls, conn->socket);
+  SSL_set_accept_state(tls);
+  while( true ) {
+    ERR_clear_error();
+    int result = SSL_do_handshake(tls);
+    if( result == 1 ) {
+      break;
+    }
+    int error = SSL_get_error(tls, result);
+    if( error == SSL_ERROR_WANT_READ ) {
+      co_await IO_Wait{conn, EPOLLIN};
+    } else if( error == SSL_ERROR_WANT_WRITE ) {
+      co_await IO_Wait{conn, EPOLLOUT};
+    } else {
+      std::cout << "TLS handshake failed on socket " << conn->socket << std::endl;
+      SSL_free(tls);
+      co_return false;
+    }
+  }
+  std::cout << "TLS client on socket " << conn->socket << ", " << SSL_get_cipher_name(tls) << ", kernel TLS "
+            << (BIO_get_ktls_send(SSL_get_wbio(tls)) ? "on" : "off") << std::endl;
+  pthread_mutex_lock(&conn->send_lock);
+  conn->tls = tls;
+  pthread_mutex_unlock(&conn->send_lock);
+  co_return true;
+}
+
+/**
+ * Ends the TLS session of a connection about to be closed, if it has one
+ * The close notify is sent only if the socket takes it right away
+ * @param conn client connection
+*/
+void tlsClose( Client_Conn *conn ) {
+  if( conn->tls == NULL ) {
+    return;
+  }
+  if( !conn->send_failed ) {
+    ERR_clear_error();
+    SSL_shutdown(conn->tls);
+  }
+  SSL_free(conn->tls);
+  conn->tls = NULL;
+}
+
+/**
+ * Describes a connection stopped between requests for the server taking
+ * it over, and removes its subscription so no more events are queued
+ * @param conn client connection
+ * @param reader the connection's reader, its unread bytes go along
+ * @param registered the client finished its upload
+ * @param wire the connection accepted binary frames
+ * @param strings_sent binary string ids the client already knows
+ * @return handoff record
+*/
+std::string handoffRecord( Client_Conn *conn, Conn_Reader *reader, bool registered, bool wire, unsigned long strings_sent ) {
+  std::string record;
+  putVarint(record, registered);
+  putVarint(record, wire);
+  putVarint(record, strings_sent);
+  // 0 without a subscription, 1 for every rfc, 2 followed by its ranges
+  pthread_mutex_lock(&subscriber_lock);
+  Subscriber *subscriber = subscriber_list;
+  while( subscriber != NULL && subscriber->conn != conn ) {
+    subscriber = subscriber->next;
+  }
+  if( subscriber == NULL || subscriber->all ) {
+    putVarint(record, subscriber == NULL ? 0 : 1);
+  } else {
+    putVarint(record, 2);
+    putVarint(record, subscriber->ranges.size());
+    for( const std::pair<int, int> &range : subscriber->ranges ) {
+      putVarint(record, range.first);
+      putVarint(record, range.second);
+    }
+  }
+  pthread_mutex_unlock(&subscriber_lock);
+  unsubscribe(conn);
+  putVarint(record, reader->end - reader->start);
+  record.append(reader->data + reader->start, reader->end - reader->start);
+  return record;
+}
+
+/**
+ * Restores the state of a connection taken over from the previous server
+ * @param record handoff record built by handoffRecord
+ * @param conn client connection, subscribed again if it was
+ * @param reader the connection's reader, given back its unread bytes
+ * @param registered set if the client finished its upload
+ * @param wire set if the connection accepted binary frames
+ * @param strings_sent binary string ids the client already knows
+ * @return false if the record is malformed
+*/
+bool takeHandoff( const std::string &record, Client_Conn *conn, Conn_Reader *reader, bool *registered, bool *wire, unsigned long *strings_sent ) {
+  const char *data = record.data();
+  size_t at = 0;
+  unsigned long fields[4];
+  for( int i = 0; i < 4; i++ ) {
+    if( !takeVarint(data, record.size(), &at, &fields[i]) ) {
+      return false;
+    }
+  }
+  *registered = fields[0] != 0;
+  *wire = fields[1] != 0;
+  *strings_sent = fields[2];
+  unsigned long count = 0;
+  if( fields[3] == 2 && !takeVarint(data, record.size(), &at, &count) ) {
+    return false;
+  }
+  std::vector<std::pair<int, int>> ranges;
+  for( unsigned long i = 0; i < count; i++ ) {
+    unsigned long first;
+    unsigned long last;
+    if( !takeVarint(data, record.size(), &at, &first) || !takeVarint(data, record.size(), &at, &last) ) {
+      return false;
+    }
+    ranges.push_back(std::make_pair((int)first, (int)last));
+  }
+  unsigned long buffered = 0;
+  if( !takeVarint(data, record.size(), &at, &buffered) || buffered > sizeof(reader->data) || at + buffered != record.size() ) {
+    return false;
+  }
+  if( fields[3] != 0 ) {
+    subscribe(conn, fields[3] == 1, ranges);
+  }
+  memcpy(reader->data, data + at, buffered);
+  reader->start = 0;
+  reader->end = buffered;
+  return true;
+}
+
+/**
+ * Ends a handler stopped by a drain without closing its connection,
+ * queueing the socket and its handoff record for the next server
+ * Output still queued is flushed first
+ * @param conn client connection
+ * @param reader the connection's reader
+ * @param registered the client finished its upload
+ * @param wire the connection accepted binary frames
+ * @param strings_sent binary string ids the client already knows
+ * @return false if the flush failed, the connection is handed over anyway
+*/
+Co<bool> handOff( Client_Conn *conn, Conn_Reader *reader, bool registered, bool wire, unsigned long strings_sent ) {
+  timerStop(conn);
+  std::string record = handoffRecord(conn, reader, registered, wire, strings_sent);
+  bool flushed = co_await outboxDrain(conn, 0, 0);
+  epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+  pthread_mutex_destroy(&conn->send_lock);
+  pthread_mutex_lock(&client_conns_lock);
+  handoff_conns.push_back(std::make_pair(conn->socket, record));
+  client_conns.erase(conn);
+  pthread_mutex_unlock(&client_conns_lock);
+  co_return flushed;
+}
+
+/**
+ * Reads the three lines of a text command: request, host and port/OS
+ * Heartbeat replies before the request line only refresh the timer
+ * @param conn connection of the client
+ * @param reader reader of the connection
+ * @param line buffer for one line, holding the request line if already read
+ * @param line_size size of line
+ * @param line_taken true if line already holds the request line
+ * @param buffer receives the lines, each newline terminated
+ * @param size size of buffer
+ * @param __port port of client
+ * @return length of the last line, 0 on disconnect and -1 on error
+*/
+Co<ssize_t> readRequest(Client_Conn *conn, Conn_Reader *reader, char *line, size_t line_size, bool line_taken, char *buffer, size_t size, int __port) {
+  ssize_t bytesRead = 1;
+  for( int i = 0; i < 3 && bytesRead > 0; i++ ) {
+    if( i > 0 || !line_taken ) {
+      bytesRead = co_await readLine(reader, line, line_size);
+    }
+    line_taken = false;
+    if( i == 0 && strncmp(line, heartbeat_frame, strlen(heartbeat_frame) - 1) == 0 ) {
+      heartbeatEchoed(conn, __port);
+      conn->parked = reader->start == reader->end;
+      i--;
+      continue;
+    }
+    strncat(buffer, line, size - strlen(buffer) - 2);
+    strcat(buffer, "\n");
+  }
+  co_return bytesRead;
+}
+
+/**
+ * Reads one binary request frame and answers it, after checking it against
+ * the peer address's rate limits
+ * @param conn connection of the client
+ * @param reader reader of the connection, positioned at the frame's opcode
+ * @param client_hostname hostname of client
+ * @param __port port of client
+ * @param address address of the client's connection
+ * @param strings_sent binary string ids the client already knows, updated
+ * @return false if the frame was cut off or too long
+*/
+Co<bool> wireRequest(Client_Conn *conn, Conn_Reader *reader, char *client_hostname, int __port, in_addr_t address, unsigned long *strings_sent) {
+  // Awaited one statement at a time, GCC 12 mishandles co_await in || chains
+  char opcode;
+  unsigned long length = 0;
+  char payload[WIRE_MAX_REQUEST];
+  bool received = co_await readBytes(reader, &opcode, 1);
+  if( received ) {
+    received = co_await readVarint(reader, &length);
+  }
+  if( received && length <= sizeof(payload) ) {
+    received = co_await readBytes(reader, payload, length);
+  }
+  if( !received || length > sizeof(payload) ) {
+    co_return false;
+  }
+  unsigned long argument = 0;
+  unsigned long flags = 0;
+  size_t at = 0;
+  if( !takeVarint(payload, length, &at, &argument) ) {
+    opcode = 0;
+  }
+  if( at < length && !takeVarint(payload, length, &at, &flags) ) {
+    opcode = 0;
+  }
+  bool expensive = opcode == WIRE_LIST;
+  int retry_after = admitCommand(address, expensive);
+  if( retry_after != 0 ) {
+    std::string body;
+    putVarint(body, retry_after);
+    std::string frame = wireHeader(429, strings_sent, body, 0);
+    co_await connWrite(conn, frame.data(), frame.size());
+    co_return true;
+  }
+  co_await wireCommand(conn, opcode, argument, flags, client_hostname, __port, strings_sent);
+  if( expensive ) {
+    expensive_running--;
+  }
+  co_return true;
+}
+
+/**
+ * Get command, sends an rfc file in the response or places a copy of it
+ * in the requester's directory, from the least loaded holder running the
+ * requested OS
+ * @param conn connection of the requesting client
+ * @param buffer client input; Range, Piece and Accept-Encoding are taken
+ *               off the request line
+ * @param client_hostname hostname of client
+ * @param __port port of client
+ * @param nearest take the holder nearest the client instead of the least loaded
+ * @return false if the connection is to be closed, after an error response
+*/
+Co<bool> getCommand(Client_Conn *conn, char *buffer, char *client_hostname, int __port, bool nearest) {
+  char serverSendBuffer[512];
+  memset(serverSendBuffer, '\0', sizeof(serverSendBuffer));
+  char command[4];
+  char rfc[4];
+  int rfc_num = 0;
+  char version[11];
+  char host_name_parse[70];
+  char os_input_from_string[32];
+  char encodings[64];
+  encodings[0] = '\0';
+  command[0] = rfc[0] = version[0] = '\0';
+  sscanf(buffer, "%3s%3s%d%10s", command, rfc, &rfc_num, version);
+  // Range: bytes=<offset>- on the request line resumes an interrupted
+  // in-band download, it is taken out before the codings are read
+  char *second_line = strchr(buffer, '\n');
+  char *range = strstr(buffer, "Range: bytes=");
+  off_t range_start = 0;
+  if( range != NULL && range < second_line ) {
+    char *range_end = NULL;
+    range_start = strtoll(range + strlen("Range: bytes="), &range_end, 10);
+    range_end += strspn(range_end, "-");
+    memmove(range, range_end, strlen(range_end) + 1);
+    second_line = strchr(buffer, '\n');
+  }
+  // Piece: <index> asks for one piece of a swarm download
+  char *piece_header = strstr(buffer, "Piece: ");
+  long piece = -1;
+  if( piece_header != NULL && piece_header < second_line ) {
+    char *piece_end = NULL;
+    piece = strtol(piece_header + strlen("Piece: "), &piece_end, 10);
+    if( piece < 0 || piece_end == piece_header + strlen("Piece: ") ) {
+      piece = LONG_MAX;
+    }
+    memmove(piece_header, piece_end, strlen(piece_end) + 1);
+    second_line = strchr(buffer, '\n');
+  }
+  // The request line may end with Accept-Encoding: <codings>, which
+  // asks for the body on this connection instead of a server-side copy
+  char *accept = strstr(buffer, "Accept-Encoding:");
+  if( accept != NULL && accept < second_line ) {
+    sscanf(accept + strlen("Accept-Encoding:"), " %63[^\n]", encodings);
+  }
+  host_name_parse[0] = os_input_from_string[0] = '\0';
+  sscanf(second_line + 1, "%69s%31s", host_name_parse, os_input_from_string);
+  bool in_band = encodings[0] != '\0';
+  bool deflate_body = in_band && acceptsEncoding(encodings, "deflate");
+  // A server-side copy is placed whole, so only in-band bodies are ranged
+  if( !in_band || range_start < 0 ) {
+    range_start = 0;
+  }
+  // Pieces are sent as they are checked, never compressed
+  if( !in_band ) {
+    piece = -1;
+  } else if( piece >= 0 ) {
+    range_start = 0;
+    deflate_body = false;
+  }
+  bool flag = false;
+  bool port_flag = false;
+  char file_name[48];
+  file_name[0] = '\0';
+
+  if(strcmp(command, "GET") != 0) {
+    strcat(serverSendBuffer, "P2P-CI/1.0 400 Bad Request\n");
+    co_await connWrite(conn, serverSendBuffer, sizeof(serverSendBuffer));
+    co_return false;
+  }
+
+  if(strcmp(rfc, "RFC") != 0) {
+    strcat(serverSendBuffer, "P2P-CI/1.0 400 Bad Request\n");
+    co_await connWrite(conn, serverSendBuffer, sizeof(serverSendBuffer));
+    co_return false;
+  }
+
+ if(strcmp(version, "P2P-CI/1.0") != 0) {
+    strcat(serverSendBuffer, "P2P-CI/1.0 505 P2P-CI Version Not Supported\n");
+    co_await connWrite(conn, serverSendBuffer, sizeof(serverSendBuffer));
+    co_return false;
+ }
+
+  // Pick the least loaded holder running the requested OS
+  char temp_os_arr[32];
+  RFC_Node current;
+  co_await clusterCall(conn->loop, rfc_num, [&]() { resolveRFC(rfc_num, os_input_from_string, __port, &current, temp_os_arr, nearest); });
+  int current_port = current.port_number;
+  if( current_port != 0 ) {
+    flag = true;
+    strcat(file_name, current.path);
+  }
+
+  //Not found, or no holder with a matching OS
+  if(flag == false) {
+      strcat(serverSendBuffer, "P2P-CI/1.0 400 Bad Request\n");
+      co_await connWrite(conn, serverSendBuffer, sizeof(serverSendBuffer));
+      co_return false;
+  }
+
+  if(clientHostKnown(client_hostname, host_name_parse) == false) {
+      strcat(serverSendBuffer, "P2P-CI/1.0 404 Not Found\n");
+      co_await connWrite(conn, serverSendBuffer, sizeof(serverSendBuffer));
+      co_return false;
+  }
+
+
+  // Responsible for getting the response time 
+  char time_string[50];
+  time_t rawTime;
+  struct tm *timeInfo;
+  time(&rawTime); 
+  timeInfo = localtime(&rawTime); 
+  strftime(time_string, sizeof(time_string), "%a, %d %b %Y %H:%M:%S %Z", timeInfo);
+
+  // Format for file string path/rfcXXX.txt
+  char numberChar[16];
+  numberChar[0] = '\0';
+  strcat(file_name, "/rfc");
+  snprintf(numberChar, sizeof(numberChar), "%d", rfc_num);
+  strcat(file_name, numberChar);
+  strcat(file_name, ".txt");
+
+  // One statx gives both the modification time and the length
+  struct statx fileStat;
+  memset(&fileStat, 0, sizeof(fileStat));
+  co_await fileStatx(conn->loop, file_name, &fileStat);
+  time_t modificationTime = fileStat.stx_mtime.tv_sec;
+  struct tm* timeinfo = localtime(&modificationTime);
+  char timeStr[100];
+  strftime(timeStr, sizeof(timeStr), "%a, %d %b %Y %H:%M:%S EST", timeinfo);
+
+  char requester_path[20];
+  requester_path[0] = '\0';
+  port_flag = in_band || findPeerPath(__port, requester_path);
+
+  if( port_flag == false) {
+    strcat(serverSendBuffer, "P2P-CI/1.0 404 Not Found\n");
+    co_await connWrite(conn, serverSendBuffer, sizeof(serverSendBuffer));
+    co_return false;
+  } 
+
+  // Unreadable, or no longer the file the holder registered
+  bool verified = co_await verifyContent(conn->loop, &current, file_name);
+  if( verified == false ) {
+    strcat(serverSendBuffer, "P2P-CI/1.0 404 Not Found\n");
+    co_await connWrite(conn, serverSendBuffer, sizeof(serverSendBuffer));
+    co_return false;
+  }
+
+  char file_name_write[48];
+  file_name_write[0] = '\0';
+  strcat(file_name_write, requester_path);
+  strcat(file_name_write, "/rfc");
+  snprintf(numberChar, sizeof(numberChar), "%d", rfc_num);
+  strcat(file_name_write, numberChar);
+  strcat(file_name_write, ".txt");
+
+  off_t content_length = fileStat.stx_size;
+  // A piece is the range its index covers in the checked file
+  std::vector<std::string> hashes;
+  off_t piece_size = swarmPieceSize(current.hash_size);
+  bool pieces_read = true;
+  if( piece >= 0 ) {
+    co_await offload(conn->loop, [&]() { pieces_read = pieceHashes(&current, file_name, hashes); });
+  }
+  if( !pieces_read ) {
+    strcat(serverSendBuffer, "P2P-CI/1.0 404 Not Found\n");
+    co_await connWrite(conn, serverSendBuffer, sizeof(serverSendBuffer));
+    co_return false;
+  }
+  if( piece >= (long)hashes.size() ) {
+    range_start = content_length;
+  } else if( piece >= 0 ) {
+    range_start = piece * piece_size;
+  }
+  if( (range_start > 0 || piece >= 0) && range_start >= content_length ) {
+    snprintf(serverSendBuffer, sizeof(serverSendBuffer), "P2P-CI/1.0 416 Range Not Satisfiable\nContent-Range: bytes */%lld\n",
+             (long long)content_length);
+    co_await connWrite(conn, serverSendBuffer, sizeof(serverSendBuffer));
+    co_return false;
+  }
+  // Content-Length counts the bytes sent, Content-Hash stays the whole file's
+  content_length -= range_start;
+  if( piece >= 0 ) {
+    content_length = std::min(content_length, piece_size);
+  }
+  bool partial = range_start > 0 || piece >= 0;
+  std::string fileSizeStr = std::to_string(content_length);
+  char contentSizeCString[64];
+  strcpy(contentSizeCString, fileSizeStr.c_str());
+  const char *status_line = partial ? "P2P-CI/1.0 206 Partial Content" : "P2P-CI/1.0 200 OK";
+
+  //OUTPUT   
+  std::cout << status_line << std::endl;
+  std::cout << "Date: " << time_string << std::endl;
+  std::cout << "OS: " << temp_os_arr <<  std::endl; 
+  std::cout << "Last-Modified: " << timeStr << std::endl;
+  std::cout << "Content-Length: " << contentSizeCString << std::endl;
+
+
+  std::cout << "Content-Type: text/text" << std::endl;
+  strcat(serverSendBuffer, status_line);
+  strcat(serverSendBuffer, "\n");
+  strcat(serverSendBuffer, "Date: ");
+  strcat(serverSendBuffer, time_string);
+  strcat(serverSendBuffer, "\n");
+  strcat(serverSendBuffer, "OS: ");
+  strcat(serverSendBuffer, temp_os_arr);
+  strcat(serverSendBuffer, "\n");
+  strcat(serverSendBuffer, "Last-Modified: ");
+  strcat(serverSendBuffer, timeStr);
+  strcat(serverSendBuffer, "\n");
+  strcat(serverSendBuffer, "Content-Length: ");
+  strcat(serverSendBuffer, contentSizeCString);
+  strcat(serverSendBuffer, "\n");
+  if( partial ) {
+    char content_range[80];
+    snprintf(content_range, sizeof(content_range), "Content-Range: bytes %lld-%lld/%lld\n", (long long)range_start,
+             (long long)(range_start + content_length) - 1, (long long)fileStat.stx_size);
+    strcat(serverSendBuffer, content_range);
+  }
+  strcat(serverSendBuffer, "Content-Type: text/text\n");
+  strcat(serverSendBuffer, "Content-Hash: sha256:");
+  strcat(serverSendBuffer, current.content_hash);
+  strcat(serverSendBuffer, "\n");
+  if( deflate_body ) {
+    strcat(serverSendBuffer, "Content-Encoding: deflate\n");
+  }
+  if( in_band ) {
+    strcat(serverSendBuffer, "Transfer-Encoding: chunked\n");
+  }
+
+
+
+  // A piece keeps its own account of the peer that served it
+  if( piece >= 0 ) {
+    if( !co_await sendPiece(conn, &current, file_name, piece, range_start, content_length, hashes[piece], __port,
+                            serverSendBuffer, sizeof(serverSendBuffer)) ) {
+      co_return false;
+    }
+  } else if(in_band || strcmp(file_name, file_name_write) != 0) {
+
+    // Load is only tracked for holders connected to this server
+    lockRegistry(&registry->lock);
+    Client_Node *holder_peer = holderPeer(&current);
+    if( holder_peer != NULL ) {
+      holder_peer->active_transfers++;
+    }
+    unlockRegistry(&registry->lock);
+
+    bool placed = true;
+    if( in_band ) {
+      co_await sendEncodedBody(conn, file_name, deflate_body, range_start, serverSendBuffer, sizeof(serverSendBuffer));
+    } else {
+      // Copying into the store reads the whole file, done beside the loop
+      placed = contentHashCurrent(&current, file_name) && linkFromStore(&current, file_name_write);
+      if( !placed ) {
+        co_await offload(conn->loop, [&]() { placed = placeFromStore(&current, file_name, file_name_write); });
+      }
+    }
+
+    // Holder may have disconnected during the copy
+    lockRegistry(&registry->lock);
+    holder_peer = holderPeer(&current);
+    if( holder_peer != NULL ) {
+      peerLoad(holder_peer);
+      holder_peer->active_transfers--;
+      if( placed ) {
+        holder_peer->bytes_served += content_length;
+        holder_peer->recent_bytes += content_length;
+      }
+    }
+    unlockRegistry(&registry->lock);
+
+    // Only this request fails, the header already built is replaced
+    if( !placed ) {
+      std::cout << "Trouble copying rfc file " << file_name << " to " << file_name_write << std::endl;
+      memset(serverSendBuffer, '\0', sizeof(serverSendBuffer));
+      strcat(serverSendBuffer, "P2P-CI/1.0 500 Internal Server Error\n");
+    }
+  }
+
+  // Encoded bodies were sent together with their header
+  if( !in_band ) {
+    co_await connWrite(conn, serverSendBuffer, sizeof(serverSendBuffer));
+  }
+  co_return true;
+}
+
+/**
+ * Answers one text command, after checking it against the peer address's
+ * rate limits and the worker's cap on running LIST and GET commands
+ * @param conn connection of the client
+ * @param buffer request, host and port/OS lines of the command
+ * @param client_hostname hostname of client
+ * @param __port port of client
+ * @param address address of the client's connection
+ * @return false if the connection is to be closed
+*/
+Co<bool> textCommand(Client_Conn *conn, char *buffer, char *client_hostname, int __port, in_addr_t address) {
+  char serverSendBuffer[512];
+  memset(serverSendBuffer, '\0', sizeof(serverSendBuffer));
+  bool open = true;
+  char command[12];
+  command[0] = '\0';
+  sscanf(buffer, "%11s", command);
+
+  // LOOKUP and GET may carry Prefer: nearest on the request line, which
+  // is taken out and asks for the holder nearest the client
+  char *prefer = strstr(buffer, PREFER_NEAREST);
+  bool nearest = prefer != NULL && prefer < strchr(buffer, '\n');
+  if( nearest ) {
+    memmove(prefer, prefer + strlen(PREFER_NEAREST), strlen(prefer + strlen(PREFER_NEAREST)) + 1);
+  }
+
+  // LIST may end its request line with If-None-Match: <etag>, which is
+  // taken out of the request and asks for the streamed, conditional form
+  char *second_line = strchr(buffer, '\n');
+  char *match = strstr(buffer, "If-None-Match:");
+  bool conditional = strncmp("LIST", command, 4) == 0 && match != NULL && match < second_line;
+  unsigned long etag = 0;
+  if( conditional ) {
+    etag = strtoul(match + strlen("If-None-Match:"), NULL, 10);
+    memmove(match, second_line, strlen(second_line) + 1);
+  }
+
+  // Admission is decided from the request line alone, before any registry
+  // work. A swarm GET asks for one bounded piece and counts as cheap
+  char *piece_header = strstr(buffer, "Piece: ");
+  bool piece_get = strncmp("GET", command, 3) == 0 && piece_header != NULL && piece_header < strchr(buffer, '\n');
+  bool expensive = strncmp("LIST", command, 4) == 0 || (strncmp("GET", command, 3) == 0 && !piece_get) ||
+                   strncmp("PIECES", command, 6) == 0 || strncmp("DUMP", command, 4) == 0;
+  int retry_after = admitCommand(address, expensive);
+  if( retry_after != 0 ) {
+    snprintf(serverSendBuffer, sizeof(serverSendBuffer), "P2P-CI/1.0 429 Too Many Requests\nRetry-After: %d\n", retry_after);
+    // Streamed responses end with END instead of being padded
+    char selector[256];
+    selector[0] = '\0';
+    sscanf(buffer, "%*s%*s%255s", selector);
+    if( conditional || (strncmp("LOOKUP", command, 6) == 0 && strpbrk(selector, "-,") != NULL) || strncmp("PIECES", command, 6) == 0 ) {
+      strcat(serverSendBuffer, "END\n");
+      co_await connWrite(conn, serverSendBuffer, strlen(serverSendBuffer));
+    } else {
+      co_await connWrite(conn, serverSendBuffer, sizeof(serverSendBuffer));
+    }
+    co_return true;
+  }
+
+  // List command
+  if( conditional ) {
+    co_await listConditionalCommand(conn, buffer, etag, client_hostname, __port);
+
+  } else if( strncmp("LIST", command, 4) == 0) {
+
+    char *response = NULL;
+    co_await clusterCall(conn->loop, [&]() { response = listCommand(buffer, client_hostname, __port); });
+    strncpy(serverSendBuffer, response, sizeof(serverSendBuffer) - 1);
+    serverSendBuffer[sizeof(serverSendBuffer) - 1] = '\0';
+    delete[] response;
+    co_await connWrite(conn, serverSendBuffer, sizeof(serverSendBuffer));
+
+    // Swarm piece map and piece announcements
+  } else if (strncmp("PIECES", command, 6) == 0) {
+    co_await piecesCommand(conn, buffer, client_hostname, __port);
+
+  } else if (strncmp("DUMP", command, 4) == 0) {
+    // Copying the registry takes every shard lock in turn, off the loop
+    char *response = NULL;
+    co_await offload(conn->loop, [&]() { response = dumpCommand(buffer, __port, address); });
+    strncpy(serverSendBuffer, response, sizeof(serverSendBuffer) - 1);
+    serverSendBuffer[sizeof(serverSendBuffer) - 1] = '\0';
+    delete[] response;
+    co_await connWrite(conn, serverSendBuffer, sizeof(serverSendBuffer));
+
+  } else if (strncmp("HAVE", command, 4) == 0) {
+    char *response = haveCommand(buffer, client_hostname, __port);
+    strncpy(serverSendBuffer, response, sizeof(serverSendBuffer) - 1);
+    serverSendBuffer[sizeof(serverSendBuffer) - 1] = '\0';
+    delete[] response;
+    co_await connWrite(conn, serverSendBuffer, sizeof(serverSendBuffer));
+
+    // Subscribe and unsubscribe commands
+  } else if (strncmp("SUBSCRIBE", command, 9) == 0 || strncmp("UNSUBSCRIBE", command, 11) == 0) {
+    char *response = subscribeCommand(conn, buffer, client_hostname, __port);
+    strncpy(serverSendBuffer, response, sizeof(serverSendBuffer) - 1);
+    serverSendBuffer[sizeof(serverSendBuffer) - 1] = '\0';
+    delete[] response;
+    co_await connWrite(conn, serverSendBuffer, sizeof(serverSendBuffer));
+
+    // Search command
+  } else if (strncmp("SEARCH", command, 6) == 0) {
+    char *response = searchCommand(buffer, client_hostname, __port);
+    strncpy(serverSendBuffer, response, sizeof(serverSendBuffer) - 1);
+    serverSendBuffer[sizeof(serverSendBuffer) - 1] = '\0';
+    delete[] response;
+    co_await connWrite(conn, serverSendBuffer, sizeof(serverSendBuffer));
+
+    // Lookup command
+  } else if (strncmp("LOOKUP", command, 6) == 0) {
+    // Ranges and batches are streamed straight to the socket
+    char selector[256];
+    selector[0] = '\0';
+    sscanf(buffer, "%*s%*s%255s", selector);
+    if( strpbrk(selector, "-,") != NULL ) {
+      co_await lookupBulkCommand(conn, buffer, client_hostname, __port);
+      co_return true;
+    }
+    char *response = NULL;
+    co_await clusterCall(conn->loop, atoi(selector), [&]() { response = lookupCommand(buffer, client_hostname, __port, nearest); });
+    strncpy(serverSendBuffer, response, sizeof(serverSendBuffer) - 1);
+    serverSendBuffer[sizeof(serverSendBuffer) - 1] = '\0';
+    delete[] response;
+    co_await connWrite(conn, serverSendBuffer, sizeof(serverSendBuffer));
+    //Add command
+  } else if( strncmp("ADD", command, 3) == 0 ) {
+    char *response = NULL;
+    int rfc_number = 0;
+    sscanf(buffer, "%*s%*s%d", &rfc_number);
+    co_await clusterCall(conn->loop, rfc_number, [&]() { response = addCommand(buffer, client_hostname, __port); });
+    strncpy(serverSendBuffer, response, sizeof(serverSendBuffer) - 1);
+    serverSendBuffer[sizeof(serverSendBuffer) - 1] = '\0';
+    delete[] response;
+    co_await connWrite(conn, serverSendBuffer, sizeof(serverSendBuffer));
+    //Get command
+  } else if(strncmp("GET", command, 3) == 0) {
+    if( !co_await getCommand(conn, buffer, client_hostname, __port, nearest) ) {
+      open = false;
+    }
+  }
+
+  //Invalid command provided
+  else {
+    strcat(serverSendBuffer, "P2P-CI/1.0 400 Bad Request\n");
+    co_await connWrite(conn, serverSendBuffer, sizeof(serverSendBuffer));
+  }
+
+  if( expensive ) {
+    expensive_running--;
+  }
+  co_return open;
+}
+
+/**
+ * Coroutine responsible for dealing with client requests
+ * Runs on its event loop and suspends whenever the socket is not ready
+ * @param clntSocket non-blocking socket connection to the client
+ * @param loop event loop the connection belongs to
+ * @param handoff handoff record of a connection taken over from the
+ *                previous server, empty for a new one
+*/
+Detached handleClient( int clntSocket, Event_Loop *loop, std::string handoff ) {
+
+    //Setup connection
+    struct sockaddr_in clntAddr;
+    socklen_t clntAddrLen = sizeof( clntAddr );
+    // Get the port name and host
+    int status = getpeername(clntSocket, (struct sockaddr* ) &clntAddr, &clntAddrLen);
+    if( status != 0 ) {
+      fail("getpeername() error");
+    } 
+
+
+    // Addition of client connection
+    int client_port = ntohs( clntAddr.sin_port);
+    // Hosts without a reverse name, such as loopback aliases, are known
+    // by their numeric address
+    char client_host[254];
+    if( getnameinfo((struct sockaddr *)&clntAddr, clntAddrLen, client_host, sizeof(client_host), NULL, 0, 0) != 0
+        && getnameinfo((struct sockaddr *)&clntAddr, clntAddrLen, client_host, sizeof(client_host), NULL, 0, NI_NUMERICHOST) != 0 ) {
+      fail("getnameinfo() error");
+    }
+
+    Client_Conn conn;
+    conn.socket = clntSocket;
+    pthread_mutex_init(&conn.send_lock, NULL);
+    conn.outbox_sent = 0;
+    conn.streaming = false;
+    conn.send_failed = false;
+    conn.tls = NULL;
+    conn.loop = loop;
+    conn.waiter = nullptr;
+    conn.parked = false;
+    // Registered disarmed, each wait arms it for one event
+    struct epoll_event event;
+    event.events = EPOLLONESHOT;
+    event.data.ptr = &conn;
+    if( epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, clntSocket, &event) == -1 ) {
+      fail("epoll_ctl() error");
+    }
+    configureKeepalive(clntSocket);
+    // Output is already coalesced in the outbox, Nagle would only hold back
+    // the tail of a streamed response until the client's delayed ACK
+    int no_delay = 1;
+    setsockopt(clntSocket, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+    timerStart(&conn);
+
+    Conn_Reader reader;
+    reader.socket = clntSocket;
+    reader.conn = &conn;
+    reader.start = 0;
+    reader.end = 0;
+    trackConn(&conn);
+
+    // A connection taken over from the previous server resumes where it
+    // stopped, a registered one skips the handshake
+    bool registered = false;
+    bool wire = false;
+    unsigned long wire_strings_sent = 0;
+    if( !handoff.empty() && !takeHandoff(handoff, &conn, &reader, &registered, &wire, &wire_strings_sent) ) {
+      std::cout << "Malformed handoff record for socket " << clntSocket << std::endl;
+      reader.start = reader.end = 0;
+    }
+
+    // A new connection starts with a TLS handshake if the client opens one
+    ssize_t bytes_recieved = 1;
+    if( tls_context != NULL && handoff.empty() ) {
+      bytes_recieved = co_await tlsAccept(&conn) ? 1 : -1;
+    }
+
+    // Nothing is registered yet if the OS never arrives
+    char intital_OS[32];
+    intital_OS[0] = '\0';
+    if( !registered && bytes_recieved > 0 ) {
+      conn.parked = reader.start == reader.end;
+      bytes_recieved = co_await readLine(&reader, intital_OS, sizeof(intital_OS));
+    }
+    if(bytes_recieved <= 0 ) {
+      // A TLS session cannot move to another process, its client reconnects
+      if( handing_off && conn.parked && conn.tls == NULL ) {
+        co_await handOff(&conn, &reader, false, false, 0);
+        co_return;
+      }
+      if( !draining ) {
+        std::cout << "Problems with recieving OS" << std::endl;
+      }
+      timerStop(&conn);
+      epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, clntSocket, NULL);
+      tlsClose(&conn);
+      pthread_mutex_destroy(&conn.send_lock);
+      close(clntSocket);
+      untrackConn(&conn);
+      co_return;
+    } 
+
+    // Only a cluster member may open a link, anyone else is refused
+    if( strcmp(intital_OS, CLUSTER_GREETING) == 0 && (conn.tls != NULL || !clusterMemberAt(clntAddr.sin_addr.s_addr)) ) {
+      std::cout << "Refused a cluster link from " << client_host << std::endl;
+      char refused[512] = "P2P-CI/1.0 400 Bad Request\n";
+      co_await connWrite(&conn, refused, sizeof(refused));
+      timerStop(&conn);
+      epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, clntSocket, NULL);
+      tlsClose(&conn);
+      pthread_mutex_destroy(&conn.send_lock);
+      close(clntSocket);
+      untrackConn(&conn);
+      co_return;
+    }
+
+    // Another cluster member opening its link, served off the loop, links are plaintext
+    if( strcmp(intital_OS, CLUSTER_GREETING) == 0 ) {
+      untrackConn(&conn);
+      timerStop(&conn);
+      epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, clntSocket, NULL);
+      pthread_mutex_destroy(&conn.send_lock);
+      fcntl(clntSocket, F_SETFL, fcntl(clntSocket, F_GETFL) & ~O_NONBLOCK);
+      Conn_Reader *link = new Conn_Reader(reader);
+      link->conn = NULL;
+      pthread_t linkThread;
+      if( pthread_create( &linkThread, NULL, servePeerLink, link ) != 0 ) {
+        fail( "Link thread incorrect ");
+      }
+      co_return;
+    }
+
+    // An OS ending in WIRE_OFFER also accepts binary LOOKUP, ADD and LIST frames
+    char *offer = strstr(intital_OS, WIRE_OFFER);
+    if( offer != NULL && strcmp(offer, WIRE_OFFER) == 0 ) {
+      wire = true;
+      *offer = '\0';
+    }
+
+    lockRegistry(&registry->lock);
+    //Create client node, a taken over client's node is still registered
+    Client_Node *client_node = registered ? findClientNode(client_port) : NULL;
+    if( client_node != NULL ) {
+      client_node->worker = getpid();
+      conn.handshake_done = true;
+    } else {
+      client_node = createClientNode(client_host, client_port, intital_OS);
+      client_node->address = clntAddr.sin_addr.s_addr;
+      addClientNode(client_node);
+    }
+    unlockRegistry(&registry->lock);
+
+    //Client's buffer
+    char buffer[254];
+
+    //Printout Client Port
+    std::cout << "Client is listening on port: " << client_port << std::endl;
+    
+    //Uploading rfcs to list 
+    bool connected = true;
+    while( !conn.handshake_done )  {
+      ssize_t bytes_recieved = co_await readLine(&reader, buffer, sizeof(buffer));
+      //Disconnected or evicted during the upload
+      if( bytes_recieved <= 0) {
+        connected = false;
+        break;
+      }
+    
+      //END call from client to stop adding rfc nodes
+      if( strncmp("END", buffer, 3) == 0) {
+        conn.handshake_done = true;
+        // The kernel's RTT estimate from the handshake and upload seeds the peer's
+        struct tcp_info info;
+        socklen_t info_length = sizeof(info);
+        if( getsockopt(clntSocket, IPPROTO_TCP, TCP_INFO, &info, &info_length) == 0 ) {
+          peerRttSample(client_port, info.tcpi_rtt);
+        }
+        // Accepting the offer, the client waits for this before sending frames
+        if( wire ) {
+          std::string accepted = wireHeader(200, &wire_strings_sent, std::string(), 0);
+          co_await connWrite(&conn, accepted.data(), accepted.size());
+        }
+        break;
+      } 
+
+      // A malformed line ends the registration, its client reads the 400 as its next response
+      RFC_Node node;
+      if( !createRFC_node(&node, buffer, client_port, client_host) ) {
+        char bad_request[512] = "P2P-CI/1.0 400 Bad Request\n";
+        co_await connWrite(&conn, bad_request, sizeof(bad_request));
+        connected = false;
+        break;
+      }
+      if( client_node->path[0] == '\0' ) {
+        lockRegistry(&registry->lock);
+        strcpy(client_node->path, node.path);
+        unlockRegistry(&registry->lock);
+      }
+      co_await clusterCall(loop, node.rfc_number, [&]() { registerRFC(&node); });
+    }
+
+    char clientSentBuffer[512];
+    bool stopped = false;
+
+
+   //Loop for server-side constant connection and commands
+    while( connected ) {
+      memset(clientSentBuffer,'\0', sizeof(clientSentBuffer)); 
+
+      // A drain stops the handler between requests
+      if( draining ) {
+        stopped = true;
+        break;
+      }
+      conn.parked = reader.start == reader.end;
+      char line[254];
+      // Set when the request line was already read looking for a heartbeat
+      bool line_taken = false;
+
+      // Binary frames start with an opcode byte, text commands with a letter
+      if( wire ) {
+        int first = co_await readerPeek(&reader);
+        if( first == -1 ) {
+          break;
+        }
+        // HAVE starts like a heartbeat reply, the whole line tells them apart
+        if( first == heartbeat_frame[0] ) {
+          if( co_await readLine(&reader, line, sizeof(line)) <= 0 ) {
+            break;
+          }
+          if( strncmp(line, heartbeat_frame, strlen(heartbeat_frame) - 1) == 0 ) {
+            heartbeatEchoed(&conn, client_port);
+            continue;
+          }
+          line_taken = true;
+        }
+        if( first < ' ' ) {
+          if( !co_await wireRequest(&conn, &reader, client_host, client_port, clntAddr.sin_addr.s_addr, &wire_strings_sent) ) {
+            break;
+          }
+          continue;
+        }
+      }
+      // A command is three lines: request, host and port/OS
+      if( co_await readRequest(&conn, &reader, line, sizeof(line), line_taken, clientSentBuffer, sizeof(clientSentBuffer), client_port) <= 0 ) {
+        break;
+      }
+      if( !co_await textCommand(&conn, clientSentBuffer, client_host, client_port, clntAddr.sin_addr.s_addr) ) {
+        break;
+      }
+   } // End of server-thread while loop logic 
+  // Stopped between requests, the next server keeps the registration.
+  // A TLS client is disconnected instead and resumes its session with the next server
+  if( handing_off && conn.tls == NULL && (stopped || (connected && conn.parked)) ) {
+    co_await handOff(&conn, &reader, true, wire, wire_strings_sent);
+    co_return;
+  }
+  // A response queued just before the loop ended, such as a GET error,
+  // still reaches the client, the idle timer bounds the wait
+  co_await outboxDrain(&conn, 0, 0);
+  // Every exit path removes the registration, shards before the client lock
+  timerStop(&conn);
+  deleteRFCNode(client_port);
+  swarmForget(client_port);
+  lockRegistry(&registry->lock);
+  deleteClientNode(client_port);
+  unlockRegistry(&registry->lock);
+  co_await clusterCall(loop, [&]() { clusterUnregister(client_port); });
+  unsubscribe(&conn);
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, clntSocket, NULL);
+  tlsClose(&conn);
+  pthread_mutex_destroy(&conn.send_lock);
+  close(clntSocket);
+  untrackConn(&conn);
+}
+
+/**
+ * Thread function running one event loop: starts handlers for the
+ * connections dealt to it and resumes handlers whose sockets are ready
+ * or whose file operations completed
+ * @param arg event loop
+*/
+void *runEventLoop( void *arg ) {
+  Event_Loop *loop = (Event_Loop *)arg;
+  // Handler frames and connection buffers are first touched on this thread
+  if( loop->node != -1 ) {
+    preferNode(loop->node);
+  }
+  struct epoll_event events[64];
+  while( true ) {
+    // File operations queued by the last round go out in one batch
+    uringSubmit(&loop->ring);
+    int ready = epoll_wait(loop->epoll_fd, events, 64, -1);
+    if( ready == -1 ) {
+      if( errno == EINTR ) {
+        continue;
+      }
+      fail("epoll_wait() error");
+    }
+    for( int i = 0; i < ready; i++ ) {
+      // Accepted sockets or finished calls were queued for this loop
+      if( events[i].data.ptr == NULL ) {
+        uint64_t count;
+        if( read(loop->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN ) {
+          fail("eventfd read() error");
+        }
+        std::vector<std::pair<int, std::string>> accepted;
+        pthread_mutex_lock(&loop->lock);
+        accepted.swap(loop->accepted);
+        pthread_mutex_unlock(&loop->lock);
+        for( std::pair<int, std::string> &socket : accepted ) {
+          handleClient(socket.first, loop, socket.second);
+        }
+        // Handlers whose offloaded calls finished
+        std::vector<std::coroutine_handle<>> offloaded;
+        pthread_mutex_lock(&loop->lock);
+        offloaded.swap(loop->offloaded);
+        pthread_mutex_unlock(&loop->lock);
+        for( std::coroutine_handle<> handler : offloaded ) {
+          handler.resume();
+        }
+        // A drain wakes the handlers parked between requests so they stop
+        if( draining ) {
+          std::vector<Client_Conn *> parked;
+          pthread_mutex_lock(&client_conns_lock);
+          for( Client_Conn *conn : client_conns ) {
+            if( conn->loop == loop && conn->parked && conn->waiter ) {
+              parked.push_back(conn);
+            }
+          }
+          pthread_mutex_unlock(&client_conns_lock);
+          for( Client_Conn *conn : parked ) {
+            conn->waiter.resume();
+          }
+        }
+        continue;
+      }
+      if( events[i].data.ptr == &loop->ring ) {
+        uringReap(&loop->ring);
+        continue;
+      }
+      Client_Conn *conn = (Client_Conn *)events[i].data.ptr;
+      if( conn->waiter ) {
+        conn->waiter.resume();
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Number of event loop threads each process runs
+ * @return -t, or one per processor
+*/
+int eventLoopCount() {
+  int count = loop_threads > 0 ? loop_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  return count < 1 ? 1 : count;
+}
+
+/**
+ * Confines this process's threads to its share of the -a CPUs, before any
+ * of them is started. A single process gets all of them and its event
+ * loops each prefer the memory of their own CPU's node. -w workers take
+ * the nodes in turn: a worker runs on one node's CPUs only and allocates
+ * from that node, so its connections' buffers are local, and workers
+ * sharing a node pin their loops starting from different CPUs.
+*/
+void placeWorker() {
+  if( affinity_cpus.empty() ) {
+    return;
+  }
+  std::vector<int> nodes = affinityNodeList();
+  std::vector<int> cpus;
+  if( worker_slot == -1 ) {
+    cpus = affinity_cpus;
+  } else {
+    int node = nodes[worker_slot % nodes.size()];
+    for( size_t i = 0; i < affinity_cpus.size(); i++ ) {
+      if( affinity_nodes[i] == node ) {
+        cpus.push_back(affinity_cpus[i]);
+      }
+    }
+    size_t first = (size_t)(worker_slot / nodes.size()) * eventLoopCount() % cpus.size();
+    std::rotate(cpus.begin(), cpus.begin() + first, cpus.end());
+    if( nodes.size() > 1 ) {
+      preferNode(node);
+    }
+  }
+
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  for( int cpu : cpus ) {
+    CPU_SET(cpu, &allowed);
+  }
+  if( sched_setaffinity(0, sizeof(allowed), &allowed) == -1 ) {
+    fail("sched_setaffinity() error");
+  }
+  loop_cpus = cpus;
+}
+
+/**
+ * Creates the event loops of this process and starts their threads
+ * With -a each loop thread is pinned to one CPU of loop_cpus
+*/
+void startEventLoops() {
+  int count = eventLoopCount();
+  bool spans_nodes = affinityNodeList().size() > 1;
+  for( int i = 0; i < count; i++ ) {
+    Event_Loop *loop = new Event_Loop;
+    loop->node = -1;
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if( loop->epoll_fd == -1 || loop->wake_fd == -1 ) {
+      fail("Error creating event loop");
+    }
+    pthread_mutex_init(&loop->lock, NULL);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if( epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &event) == -1 ) {
+      fail("epoll_ctl() error");
+    }
+    // Without io_uring file operations run inline on the loop thread
+    uringInit(&loop->ring);
+    event.data.ptr = &loop->ring;
+    if( loop->ring.fd != -1 && epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->ring.event_fd, &event) == -1 ) {
+      fail("epoll_ctl() error");
+    }
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    if( !loop_cpus.empty() ) {
+      int cpu = loop_cpus[i % loop_cpus.size()];
+      cpu_set_t pinned;
+      CPU_ZERO(&pinned);
+      CPU_SET(cpu, &pinned);
+      pthread_attr_setaffinity_np(&attributes, sizeof(pinned), &pinned);
+      if( spans_nodes ) {
+        loop->node = affinity_nodes[std::find(affinity_cpus.begin(), affinity_cpus.end(), cpu) - affinity_cpus.begin()];
+      }
+    }
+    if( pthread_create( &loop->thread, &attributes, runEventLoop, loop ) != 0 ) {
+      fail( "Event loop thread incorrect ");
+    }
+    pthread_attr_destroy(&attributes);
+    event_loops.push_back(loop);
+  }
+}
+
+/**
+ * Wakes an event loop to take its queued connections and finished calls
+ * @param loop event loop
+*/
+void wakeLoop( Event_Loop *loop ) {
+  uint64_t one = 1;
+  if( write(loop->wake_fd, &one, sizeof(one)) == -1 ) {
+    fail("eventfd write() error");
+  }
+}
+
+/**
+ * Thread function of the offload pool, makes queued calls one at a time
+ * and wakes the loop of each handler whose call finished
+ * @param unused not used
+*/
+void *runOffload( void *unused ) {
+  while( true ) {
+    pthread_mutex_lock(&offload_lock);
+    while( offload_queue.empty() ) {
+      pthread_cond_wait(&offload_ready, &offload_lock);
+    }
+    Offload_Op *op = offload_queue.front();
+    offload_queue.pop_front();
+    pthread_mutex_unlock(&offload_lock);
+
+    op->work();
+    // The handler may resume and free op as soon as it is queued
+    Event_Loop *loop = op->loop;
+    pthread_mutex_lock(&loop->lock);
+    loop->offloaded.push_back(op->waiter);
+    pthread_mutex_unlock(&loop->lock);
+    wakeLoop(loop);
+  }
+  return NULL;
+}
+
+/**
+ * Starts the offload pool's threads
+*/
+void startOffloadPool() {
+  for( int i = 0; i < OFFLOAD_THREADS; i++ ) {
+    pthread_t offloadThread;
+    if( pthread_create( &offloadThread, NULL, runOffload, NULL ) != 0 ) {
+      fail( "Offload thread incorrect ");
+    }
+  }
+}
+
+/**
+ * Hands an accepted connection to the next event loop
+ * @param socket non-blocking client socket
+ * @param handoff handoff record of a connection taken over from the
+ *                previous server, empty for a new one
+*/
+void postConnection( int socket, const std::string &handoff ) {
+  Event_Loop *loop = event_loops[next_loop++ % event_loops.size()];
+  pthread_mutex_lock(&loop->lock);
+  loop->accepted.push_back(std::make_pair(socket, handoff));
+  pthread_mutex_unlock(&loop->lock);
+  wakeLoop(loop);
+}
+
+// Executable and arguments the server was started with, run again by an upgrade
+char server_path[PATH_MAX];
+char **server_argv = NULL;
+
+/**
+ * Opens the listening socket on the server port
+ * @param reuse_port share the port with the other workers through SO_REUSEPORT
+ * @return non-blocking listening socket
+*/
+int openListener( bool reuse_port ) {
+    // Create a socket
+    int serverSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (serverSocket == -1) {
+        fail("Error creating socket");
+    }
+
+    // A restarted server binds again while old connections sit in TIME_WAIT
+    int enable = 1;
+    if( setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) == -1 ) {
+        fail("Error setting SO_REUSEADDR");
+    }
+    // Every worker binds its own listener, the kernel spreads connections
+    if( reuse_port && setsockopt(serverSocket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1 ) {
+        fail("Error setting SO_REUSEPORT");
+    }
+
+    // Bind to an IP address and port
+    sockaddr_in serverAddr;
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = INADDR_ANY;
+    serverAddr.sin_port = htons( server_port );
 
+    if (bind(serverSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1) {
+        fail("Error creating socket. Please wait a few seconds to re-try.");
+    }
 
-  // Look for the host
-  bool client_flag_found = false;
-  bool rfc_flag = false;
-  Client_Node *search = client_list;
-  while( search != NULL) {
-      if(strcmp(str_host, search->hostname) == 0 && strcmp(client_hostname, search->hostname) == 0) {
-        client_flag_found = true; 
-        break;
-      }
-      search = search->next;
-  }
+    // Connections arriving during a drain or handoff wait in the backlog
+    if (listen(serverSocket, SOMAXCONN) == -1) {
+        fail("Error listening on socket");
+    }
+    return serverSocket;
+}
 
-  RFC_Node *current = rfc_list;
-  while( current != NULL ) {
-    if(rfc_number_str == current->rfc_number) {
-      rfc_flag = true;
+/**
+ * Stops every handler at its next request boundary and waits for them
+ * Handlers still inside a command after DRAIN_TIMEOUT seconds have their
+ * connections shut down and clean up like disconnected clients
+ * @param handoff stopped handlers queue their connections in handoff_conns
+ *                instead of closing them
+*/
+void drainConnections( bool handoff ) {
+  handing_off = handoff;
+  draining = true;
+  for( Event_Loop *loop : event_loops ) {
+    wakeLoop(loop);
+  }
+  time_t deadline = time(NULL) + DRAIN_TIMEOUT;
+  bool forced = false;
+  while( true ) {
+    pthread_mutex_lock(&client_conns_lock);
+    size_t running = client_conns.size();
+    if( running > 0 && !forced && time(NULL) >= deadline ) {
+      std::cout << "Dropping " << running << " clients still running commands" << std::endl;
+      for( Client_Conn *conn : client_conns ) {
+        shutdown(conn->socket, SHUT_RDWR);
+      }
+      forced = true;
+    }
+    pthread_mutex_unlock(&client_conns_lock);
+    if( running == 0 ) {
       break;
     }
-    current = current->next;
+    usleep(10000);
   }
+}
 
-  if(rfc_flag == false) {
-    strcat(response, "P2P-CI/1.0 404 Not Found\n");
-    return response;
+/**
+ * Sends one message on the handoff socket
+ * @param socket handoff socket
+ * @param payload message bytes, not empty
+ * @param fds descriptors passed along with it
+ * @param count number of descriptors, at most two
+ * @return false if the message was not sent
+*/
+bool sendHandoff( int socket, const std::string &payload, const int *fds, int count ) {
+  struct iovec part;
+  part.iov_base = (void *)payload.data();
+  part.iov_len = payload.size();
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &part;
+  message.msg_iovlen = 1;
+  char control[CMSG_SPACE(sizeof(int) * 2)];
+  memset(control, 0, sizeof(control));
+  if( count > 0 ) {
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(header), fds, sizeof(int) * count);
   }
+  return sendmsg(socket, &message, MSG_NOSIGNAL) == (ssize_t)payload.size();
+}
 
-  if(client_flag_found == false) {
-    strcat(response, "P2P-CI/1.0 404 Not Found\n");
-    return response;
+/**
+ * Receives one message on the handoff socket
+ * @param socket handoff socket
+ * @param payload message bytes
+ * @param fds descriptors passed along with it, opened close-on-exec
+ * @param count number of descriptors expected
+ * @return false if the message or its descriptors did not arrive
+*/
+bool recvHandoff( int socket, std::string &payload, int *fds, int count ) {
+  char data[HANDOFF_MESSAGE_SIZE];
+  struct iovec part;
+  part.iov_base = data;
+  part.iov_len = sizeof(data);
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &part;
+  message.msg_iovlen = 1;
+  char control[CMSG_SPACE(sizeof(int) * 2)];
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  ssize_t length = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+  if( length <= 0 || (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0 ) {
+    return false;
   }
-
-  if( rfc_flag == true && client_flag_found == true) {
-    strcat(response, "Title: ");
-    strcat(response, current->title);
-    strcat(response, "\n");
+  payload.assign(data, length);
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+  if( count == 0 ) {
+    return header == NULL;
   }
-
-  return response;
+  if( header == NULL || header->cmsg_type != SCM_RIGHTS || header->cmsg_len != CMSG_LEN(sizeof(int) * count) ) {
+    return false;
+  }
+  memcpy(fds, CMSG_DATA(header), sizeof(int) * count);
+  return true;
 }
 
 /**
- * List command function 
- * @param buffer client's input char array
- * @param client_hostname clients hostname
- * @return response message for server to send to client
+ * Starts the server binary again and passes it the listener, the registry
+ * and the connections in handoff_conns over a SOCK_SEQPACKET socket
+ * Must be called once every handler has stopped
+ * @param serverSocket listening socket
+ * @return true once the new server confirmed it took over
 */
-char* listCommand(char *buffer, char *client_hostname, int __port) {
-
-  char *response = new char[1024];
-  response[0] = '\0';
-  char f_line[512];
-  int user_port = 0;
-  char command[5];
-  char all[4];
-  char version[12];
-  char str_host[50];
-  sscanf(buffer, "%s%s%s%s%d", command, all, version, str_host, &user_port);
+bool upgradeServer( int serverSocket ) {
+  int pair[2];
+  if( socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == -1 ) {
+    return false;
+  }
+  // The new server finds its end of the pair through the environment
+  fcntl(pair[1], F_SETFD, 0);
+  setenv(HANDOFF_ENV, std::to_string(pair[1]).c_str(), 1);
+  pid_t successor = fork();
+  if( successor == 0 ) {
+    execv(server_path, server_argv);
+    _exit(EXIT_FAILURE);
+  }
+  unsetenv(HANDOFF_ENV);
+  close(pair[1]);
 
-  //First string should be list
-  if(strcmp(command, "LIST") != 0) {
-    strcat(response, "P2P-CI/1.0 400 Bad Request\n");
-    return response;
+  // Listener and registry first, then the binary string table in id
+  // order and one message per connection carrying its socket. The session
+  // ticket keys go along, so the TLS clients dropped by the upgrade resume
+  std::string header;
+  pthread_mutex_lock(&wire_string_lock);
+  std::vector<std::string> strings = wire_strings;
+  pthread_mutex_unlock(&wire_string_lock);
+  putVarint(header, strings.size());
+  putVarint(header, handoff_conns.size());
+  char ticket_keys[TLS_TICKET_KEYS_LENGTH];
+  if( tls_context != NULL && SSL_CTX_get_tlsext_ticket_keys(tls_context, ticket_keys, sizeof(ticket_keys)) == 1 ) {
+    putVarint(header, sizeof(ticket_keys));
+    header.append(ticket_keys, sizeof(ticket_keys));
+  } else {
+    putVarint(header, 0);
   }
-  //Second string should be all
-  if(strcmp(all, "ALL") != 0) {
-    strcat(response, "P2P-CI/1.0 400 Bad Request\n");
-    return response;
+  int fds[2] = { serverSocket, registry_fd };
+  bool sent = successor != -1 && sendHandoff(pair[0], header, fds, 2);
+  for( size_t i = 0; i < strings.size() && sent; i++ ) {
+    sent = sendHandoff(pair[0], strings[i], NULL, 0);
   }
-  //Thrid string should be P2P
-  if(strcmp(version, "P2P-CI/1.0") != 0) {
-    strcat(response, "P2P-CI/1.0 505 P2P-CI Version Not Supported\n");
-    return response;
+  for( size_t i = 0; i < handoff_conns.size() && sent; i++ ) {
+    sent = sendHandoff(pair[0], handoff_conns[i].second, &handoff_conns[i].first, 1);
   }
-  //Fifth string should be user's port
-  if(__port != user_port) {
-    strcat(response, "P2P-CI/1.0 400 Bad Request\n");
-    return response;
+  char ready = 0;
+  sent = sent && recv(pair[0], &ready, 1, 0) == 1;
+  close(pair[0]);
+  if( !sent && successor > 0 ) {
+    kill(successor, SIGKILL);
+    waitpid(successor, NULL, 0);
+  }
+  if( sent ) {
+    std::cout << "Handed " << handoff_conns.size() << " clients over to server " << successor << std::endl;
   }
+  return sent;
+}
 
-  //Flag for searching if host is correct
-  bool client_flag_found = false;
-  //Search for client and verify host name
-  Client_Node *search = client_list;
-  while( search != NULL) {
-      if(strcmp(str_host, search->hostname) == 0 && strcmp(client_hostname, search->hostname) == 0) {
-        client_flag_found = true;
-      }
-      search = search->next;
+/**
+ * Takes over from the server that started this one: maps its registry,
+ * restores its binary string table and queues its connections in
+ * handoff_conns
+ * @param socket handoff socket
+ * @return listening socket of the previous server
+*/
+int receiveHandoff( int socket ) {
+  std::string header;
+  int fds[2];
+  if( !recvHandoff(socket, header, fds, 2) ) {
+    fail("Handoff from the previous server failed");
   }
-  //If host not found then print error response
-  if(client_flag_found == false) {
-    strcat(response, "P2P-CI/1.0 404 Not Found\n");
-    return response;
+  attachRegistry(fds[1]);
+  size_t at = 0;
+  unsigned long strings = 0;
+  unsigned long conns = 0;
+  unsigned long keys = 0;
+  if( !takeVarint(header.data(), header.size(), &at, &strings) || !takeVarint(header.data(), header.size(), &at, &conns) ) {
+    fail("Handoff from the previous server failed");
   }
-
-  //Once validated
-   RFC_Node *current = rfc_list;
-       while( current != NULL ) {
-        //remove of new line character
-          std::cout << "RFC " << current->rfc_number << " ";
-          std::cout << current->title << " ";
-          std::cout << current->hostname << " ";
-          std::cout << current->port_number << std::endl;
-          snprintf(f_line, sizeof(f_line), "RFC %d %s %s %d\n", current->rfc_number, current->title, current->hostname, current->port_number);
-          strcat(response, f_line);
-         current = current->next;
-        }
-    return response;
+  // A server from before TLS support sends no ticket keys
+  if( at < header.size() && (!takeVarint(header.data(), header.size(), &at, &keys) || at + keys != header.size()) ) {
+    fail("Handoff from the previous server failed");
+  }
+  // Kept only if this server also has TLS, a different length is ignored
+  if( tls_context != NULL && keys == TLS_TICKET_KEYS_LENGTH ) {
+    SSL_CTX_set_tlsext_ticket_keys(tls_context, (void *)(header.data() + at), keys);
+  }
+  for( unsigned long i = 0; i < strings; i++ ) {
+    std::string text;
+    if( !recvHandoff(socket, text, NULL, 0) ) {
+      fail("Handoff from the previous server failed");
+    }
+    wire_string_ids[text] = wire_strings.size();
+    wire_strings.push_back(text);
+  }
+  for( unsigned long i = 0; i < conns; i++ ) {
+    std::pair<int, std::string> conn;
+    if( !recvHandoff(socket, conn.second, &conn.first, 1) ) {
+      fail("Handoff from the previous server failed");
+    }
+    handoff_conns.push_back(conn);
+  }
+  return fds[0];
 }
 
 /**
- * Thread function responsible for dealing with client requests
- * @param socket socket connection to the client
+ * Runs one accepting process: the timer, notifier and event loop threads
+ * plus a listener on the server port. SIGTERM drains the connections and
+ * exits, SIGHUP drains them into a new copy of the server that keeps them
+ * and SIGUSR1 writes a registry snapshot while serving goes on
+ * @param reuse_port share the port with the other workers through SO_REUSEPORT
+ * @param serverSocket listener taken over from the previous server, or -1
+ * @param handoff_socket socket the previous server waits on, or -1
 */
-void *handleClient( void *socket ) {
-
-    //Setup connection
-    int clntSocket = *( ( int* ) socket );
-    struct sockaddr_in clntAddr;
-    socklen_t clntAddrLen = sizeof( clntAddr );
-    // Get the port name and host
-    int status = getpeername(clntSocket, (struct sockaddr* ) &clntAddr, &clntAddrLen);
-    if( status != 0 ) {
-      fail("getpeername() error");
-    } 
-
-
-    // Addition of client connection
-    int client_port = ntohs( clntAddr.sin_port);
-    struct hostent* hostInfo;
-    hostInfo = gethostbyaddr( (char *)&clntAddr.sin_addr, sizeof(clntAddr), AF_INET );
-
-    char intital_OS[32];
-    ssize_t bytes_recieved = recv(clntSocket, &intital_OS, sizeof(intital_OS), 0);
-    if(bytes_recieved == -1 ) {
-      fail("Problems with recieving OS");
-    } 
-
-    pthread_mutex_lock( &lock );
-    //Create client node 
-    Client_Node *node = createClientNode(hostInfo->h_name, client_port, intital_OS);
-    addClientNode(&client_list, node);
-    pthread_mutex_unlock( &lock );
-
-    //Client's buffer
-    char buffer[254];
-
-    //Printout Client Port
-    std::cout << "Client is listening on port: " << client_port << std::endl;
-    
-    //Uploading rfcs to list 
-    while( true )  {
-      ssize_t bytes_recieved = recv(clntSocket, &buffer, sizeof(buffer), 0);
-      if( bytes_recieved == -1) {
-        /** Filler */
-      }
-    
-      //END call from client to stop adding rfc nodes
-      if( strncmp("END", buffer, 3) == 0) {
-        break;
-      } 
-
-      RFC_Node *node = createRFC_node(buffer, client_port, hostInfo->h_name);
-      addRFC_Node(&rfc_list, node);
+void runWorker( bool reuse_port, int serverSocket, int handoff_socket ) {
+    // Signals are read from a signalfd by this thread, every thread started
+    // below inherits the blocked mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    if( signal_fd == -1 ) {
+      fail("signalfd() error");
     }
+    // Every thread started below inherits the placement too
+    placeWorker();
 
-    char clientSentBuffer[512];
-    char serverSendBuffer[512];
-
+    if( pthread_create( &timerThread, NULL, runTimerWheel, NULL ) != 0 ) {
+      fail( "Timer thread incorrect ");
+    }
+    if( pthread_create( &notifierThread, NULL, notifyClients, NULL ) != 0 ) {
+      fail( "Notifier thread incorrect ");
+    }
+    startOffloadPool();
+    startEventLoops();
+    if( serverSocket == -1 ) {
+      serverSocket = openListener(reuse_port);
+    }
 
-   //Loop for server-side constant connection and commands
     while( true ) {
-      memset(clientSentBuffer,'\0', sizeof(clientSentBuffer)); 
-      memset(serverSendBuffer,'\0', sizeof(serverSendBuffer));               
-      ssize_t bytesRead = recv(clntSocket, clientSentBuffer, sizeof(clientSentBuffer), 0);
-
-      //Disconnect client
-      if(bytesRead <= 0) {
-        pthread_mutex_lock(&lock);
-        deleteRFCNode(client_port);
-        deleteClientNode(client_port);
-        pthread_mutex_unlock(&lock);
-        break;
+      // Connections taken over from the previous server, or kept after a
+      // failed upgrade
+      for( std::pair<int, std::string> &conn : handoff_conns ) {
+        postConnection(conn.first, conn.second);
+      }
+      handoff_conns.clear();
+      if( handoff_socket != -1 ) {
+        char ready = 1;
+        send(handoff_socket, &ready, 1, MSG_NOSIGNAL);
+        close(handoff_socket);
+        handoff_socket = -1;
       }
 
-      char command[7];
-      sscanf(clientSentBuffer, "%s", command);
-
-        // List command
-      if( strncmp("LIST", command, 4) == 0) {
-
-        char *response = listCommand(clientSentBuffer, hostInfo->h_name, client_port);
-        strncpy(serverSendBuffer, response, sizeof(serverSendBuffer) - 1);
-        serverSendBuffer[sizeof(serverSendBuffer) - 1] = '\0';
-        send(clntSocket, serverSendBuffer, sizeof(serverSendBuffer), 0);
-
-        // Lookup command
-      } else if (strncmp("LOOKUP", command, 6) == 0) {
-        char *response = lookupCommand(clientSentBuffer, hostInfo->h_name, client_port);
-        strncpy(serverSendBuffer, response, sizeof(serverSendBuffer) - 1);
-        serverSendBuffer[sizeof(serverSendBuffer) - 1] = '\0';
-        send(clntSocket, serverSendBuffer, sizeof(serverSendBuffer), 0);
-        //Add command
-      } else if( strncmp("ADD", command, 3) == 0 ) {
-        char *response = addCommand(clientSentBuffer, hostInfo->h_name, client_port);
-        strncpy(serverSendBuffer, response, sizeof(serverSendBuffer) - 1);
-        serverSendBuffer[sizeof(serverSendBuffer) - 1] = '\0';
-        send(clntSocket, serverSendBuffer, sizeof(serverSendBuffer), 0);
-        //Get command (inlined)
-      } else if(strncmp("GET", command, 3) == 0) {
-  
-        char command[4];
-        char rfc[4];
-        int rfc_num = 0;
-        char version[11];
-        char host_name_parse[70];
-        char os_input_from_string[32];
-        sscanf(clientSentBuffer, "%s%s%d%s%s%s", command, rfc, &rfc_num, version, host_name_parse, os_input_from_string);
-        bool flag = false;
-        bool port_flag = false;
-        char file_name[35];
-        file_name[0] = '\0';
-
-        if(strcmp(command, "GET") != 0) {
-          strcat(serverSendBuffer, "P2P-CI/1.0 400 Bad Request\n");
-          send(clntSocket, serverSendBuffer, sizeof(serverSendBuffer), 0);
-          break;
-        }
-
-        if(strcmp(rfc, "RFC") != 0) {
-          strcat(serverSendBuffer, "P2P-CI/1.0 400 Bad Request\n");
-          send(clntSocket, serverSendBuffer, sizeof(serverSendBuffer), 0);
-          break;
-        }
-
-       if(strcmp(version, "P2P-CI/1.0") != 0) {
-          strcat(serverSendBuffer, "P2P-CI/1.0 505 P2P-CI Version Not Supported\n");
-          send(clntSocket, serverSendBuffer, sizeof(serverSendBuffer), 0);
-          break;
-       }
-
-        int current_port = 0;
-        RFC_Node *current = rfc_list;
-        while( current != NULL ) {
-          if(rfc_num == current->rfc_number) {
-             flag = true;
-             strcat(file_name, current->path);
-             current_port = current->port_number;
-             break;
+      int signal = 0;
+      while ( signal == 0 ) {
+        struct pollfd waits[2];
+        waits[0].fd = serverSocket;
+        waits[0].events = POLLIN;
+        waits[1].fd = signal_fd;
+        waits[1].events = POLLIN;
+        if( poll(waits, 2, -1) == -1 ) {
+          if( errno == EINTR ) {
+            continue;
           }
-          current = current->next;
-        }
-        //Not found
-        if(flag == false) {
-            strcat(serverSendBuffer, "P2P-CI/1.0 400 Bad Request\n");
-            send(clntSocket, serverSendBuffer, sizeof(serverSendBuffer), 0);
-            break;
+          fail("poll() error");
         }
-
-        char temp_os_arr[32];
-        bool os_flag = false;
-        Client_Node *look = client_list;
-        while( look != NULL ) {
-          if(current_port == look->port_number) {
-             os_flag = true;
-             strcpy(temp_os_arr, look->os_string);
-             break;
+        if( waits[1].revents & POLLIN ) {
+          struct signalfd_siginfo info;
+          if( read(signal_fd, &info, sizeof(info)) == sizeof(info) ) {
+            signal = info.ssi_signo;
           }
-          look = look->next;
-        }
-
-        //Client not found
-        if(os_flag == false) {
-            strcat(serverSendBuffer, "P2P-CI/1.0 400 Bad Request\n");
-            send(clntSocket, serverSendBuffer, sizeof(serverSendBuffer), 0);
-            break;
-        }
-
-        //Checking for OS match
-        if(strcmp(os_input_from_string, temp_os_arr) != 0) {
-            strcat(serverSendBuffer, "P2P-CI/1.0 400 Bad Request\n");
-            send(clntSocket, serverSendBuffer, sizeof(serverSendBuffer), 0);
-            break;
-        }
-
-        bool client_flag_found = false;
-        Client_Node *search = client_list;
-        while( search != NULL) {
-          if(strcmp(hostInfo->h_name, search->hostname) == 0 && strcmp(host_name_parse, search->hostname) == 0) {
-            client_flag_found = true; 
-            break;
+          // Workers share the port and registry, replacing one alone gains nothing
+          if( signal == SIGHUP && reuse_port ) {
+            std::cout << "Ignoring SIGHUP, hot reload needs a single process without -w" << std::endl;
+            signal = 0;
           }
-          search = search->next;
+          if( signal == SIGUSR1 ) {
+            startDump(NULL, NULL, NULL, NULL);
+            signal = 0;
+          }
+          continue;
         }
 
-        if(client_flag_found == false) {
-            strcat(serverSendBuffer, "P2P-CI/1.0 404 Not Found\n");
-            send(clntSocket, serverSendBuffer, sizeof(serverSendBuffer), 0);
-            break;
+      // Accept a client connection. -- structures that contain the address of client 
+        struct sockaddr_in clientAddr;
+        socklen_t clientAddrLen = sizeof(clientAddr);
+        int clientSocket = accept4(serverSocket, (struct sockaddr*)&clientAddr, &clientAddrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientSocket == -1) {
+            // Another worker took it, or it was reset while queued
+            if( errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EINTR ) {
+              continue;
+            }
+            fail("Error accepting connection");
         }
 
+      // printf("This is the client's port number:%d \n", ntohs(clntAddr.sin_port)); //Line for peer's port
 
-        // Responsible for getting the response time 
-        char time_string[50];
-        time_t rawTime;
-        struct tm *timeInfo;
-        time(&rawTime); 
-        timeInfo = localtime(&rawTime); 
-        strftime(time_string, sizeof(time_string), "%a, %d %b %Y %H:%M:%S %Z", timeInfo);
-
-        // Format for file string path/rfcXXX.txt
-        char numberChar[5];
-        numberChar[0] = '\0';
-        strcat(file_name, "/rfc");
-        snprintf(numberChar, sizeof(numberChar), "%d", rfc_num);
-        strcat(file_name, numberChar);
-        strcat(file_name, ".txt");
-
-        struct stat fileStat;
-        stat(file_name, &fileStat);
-        time_t modificationTime = fileStat.st_mtime;
-        struct tm* timeinfo = localtime(&modificationTime);
-        char timeStr[100];
-        strftime(timeStr, sizeof(timeStr), "%a, %d %b %Y %H:%M:%S EST", timeinfo);
-
-        current = rfc_list;
-        while( current != NULL ) {
-          if(client_port == current->port_number) {
-            port_flag = true;
-            break;
-          }
-         current = current->next;
-        }
-
-        if( port_flag == false) {
-          strcat(serverSendBuffer, "P2P-CI/1.0 404 Not Found\n");
-          send(clntSocket, serverSendBuffer, sizeof(serverSendBuffer), 0);
-          break;
-        } 
-        
-        char file_name_write[35];
-        file_name_write[0] = '\0';
-        strcat(file_name_write, current->path);
-        strcat(file_name_write, "/rfc");
-        snprintf(numberChar, sizeof(numberChar), "%d", rfc_num);
-        strcat(file_name_write, numberChar);
-        strcat(file_name_write, ".txt");
-     
-        std::ifstream fp(file_name, std::ios::binary);
-        fp.seekg(0, std::ios::end);
-        std::streampos content_length = fp.tellg();
-        fp.seekg(0, std::ios::beg);
-        std::string fileSizeStr = std::to_string(content_length);
-        char contentSizeCString[64];
-        strcpy(contentSizeCString, fileSizeStr.c_str());
-        fp.close();
-
-        //OUTPUT   
-        std::cout << "P2P-CI/1.0 200 OK" << std::endl;
-        std::cout << "Date: " << time_string << std::endl;
-        std::cout << "OS: " << temp_os_arr <<  std::endl; 
-        std::cout << "Last-Modified: " << timeStr << std::endl;
-        std::cout << "Content-Length: " << contentSizeCString << std::endl;
-
-
-        std::cout << "Content-Type: text/text" << std::endl;
-        strcat(serverSendBuffer, "P2P-CI/1.0 200 OK\n");
-        strcat(serverSendBuffer, "Date: ");
-        strcat(serverSendBuffer, time_string);
-        strcat(serverSendBuffer, "\n");
-        strcat(serverSendBuffer, "OS: ");
-        strcat(serverSendBuffer, temp_os_arr);
-        strcat(serverSendBuffer, "\n");
-        strcat(serverSendBuffer, "Last-Modified: ");
-        strcat(serverSendBuffer, timeStr);
-        strcat(serverSendBuffer, "\n");
-        strcat(serverSendBuffer, "Content-Length: ");
-        strcat(serverSendBuffer, contentSizeCString);
-        strcat(serverSendBuffer, "\n");
-        strcat(serverSendBuffer, "Content-Type: text/text\n");
-
-
-
-        if(strcmp(file_name, file_name_write) != 0) {
-
-          std::ifstream inputFile(file_name);
-          if( !inputFile.is_open() ) {
-            fail("Trouble opening input file");
-          }
+        postConnection(clientSocket, std::string());
+      }
 
-          std::ofstream outputFile(file_name_write);
-          if(!outputFile.is_open() ) {
-            fail("Trouble opening output file");
-          }
+      // New connections wait in the listener's backlog from here on
+      std::cout << (signal == SIGHUP ? "Upgrading, draining clients" : "Stopping, draining clients") << std::endl;
+      drainConnections(signal == SIGHUP);
+      if( signal != SIGHUP ) {
+        close(serverSocket);
+        std::cout << "Drained, exiting" << std::endl;
+        exit(EXIT_SUCCESS);
+      }
+      if( upgradeServer(serverSocket) ) {
+        exit(EXIT_SUCCESS);
+      }
+      std::cout << "Upgrade failed, resuming with " << handoff_conns.size() << " clients" << std::endl;
+      draining = false;
+      handing_off = false;
+    }
+}
 
-          std::string reading_line; 
-          while(std::getline(inputFile, reading_line)) {
-            // std::cout << reading_line << std::endl;
-            outputFile << reading_line << std::endl;
-          }
+/**
+ * Forks a worker process
+ * @param slot slot of the worker, which decides its share of the -a CPUs
+ * @return pid of the worker
+*/
+pid_t spawnWorker( int slot ) {
+  pid_t pid = fork();
+  if( pid == -1 ) {
+    fail("fork() worker error");
+  }
+  if( pid == 0 ) {
+    // The supervisor's blocked SIGCHLD is its own, runWorker blocks what a worker reads
+    sigset_t children;
+    sigemptyset(&children);
+    sigaddset(&children, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &children, NULL);
+    worker_slot = slot;
+    runWorker(true, -1, -1);
+    exit(EXIT_SUCCESS);
+  }
+  return pid;
+}
 
-          inputFile.close();
-          outputFile.close();
-        }
+/**
+ * Drops the registrations of every peer a dead worker was serving
+ * Their connections died with the worker, so nothing else will
+ * @param worker pid of the dead worker
+*/
+void reapWorker( pid_t worker ) {
+  std::vector<int> ports;
+  lockRegistry(&registry->lock);
+  for( Client_Node *search = fromOffset<Client_Node>(registry->client_list); search != NULL; search = fromOffset<Client_Node>(search->next) ) {
+    if( search->worker == worker ) {
+      ports.push_back(search->port_number);
+    }
+  }
+  unlockRegistry(&registry->lock);
 
-        send(clntSocket, serverSendBuffer, sizeof(serverSendBuffer), 0);
+  for( int port : ports ) {
+    deleteRFCNode(port);
+    lockRegistry(&registry->lock);
+    deleteClientNode(port);
+    unlockRegistry(&registry->lock);
+    clusterUnregister(port);
+  }
+}
 
+/**
+ * Reads a CPU or node list file from sysfs, such as "0-3,8-11"
+ * @param file_name file to read
+ * @param ranges receives the ranges in the list
+ * @return false if the file is missing or not a list
+*/
+bool readSysList( const char *file_name, std::vector<std::pair<int, int>> &ranges ) {
+  std::ifstream file(file_name);
+  std::string list;
+  if( !std::getline(file, list) ) {
+    return false;
+  }
+  return parseRFCSelector(list.c_str(), ranges);
+}
 
-      
+/**
+ * Takes the -a CPU list and finds the NUMA node of each CPU
+ * The CPUs are ordered by node so a worker's share is contiguous. Without
+ * node information in sysfs every CPU is on node 0.
+ * @param list CPUs as "0-7,16-23"
+*/
+void initAffinity( const char *list ) {
+  std::vector<std::pair<int, int>> ranges;
+  if( !parseRFCSelector(list, ranges) || ranges.back().second >= CPU_SETSIZE ) {
+    fail("-a needs a CPU list such as 0-7,16-23");
+  }
+  std::map<int, int> cpu_nodes;
+  std::vector<std::pair<int, int>> nodes;
+  readSysList("/sys/devices/system/node/online", nodes);
+  for( std::pair<int, int> &range : nodes ) {
+    for( int node = range.first; node <= range.second && node < NUMA_MAX_NODES; node++ ) {
+      std::vector<std::pair<int, int>> cpus;
+      std::string file_name = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+      readSysList(file_name.c_str(), cpus);
+      for( std::pair<int, int> &cpu_range : cpus ) {
+        for( int cpu = cpu_range.first; cpu <= cpu_range.second; cpu++ ) {
+          cpu_nodes[cpu] = node;
+        }
       }
+    }
+  }
 
-      //Invalid command provided
-      else {
-        strcat(serverSendBuffer, "P2P-CI/1.0 400 Bad Request\n");
-        send(clntSocket, serverSendBuffer, sizeof(serverSendBuffer), 0);
+  std::vector<std::pair<int, int>> placed;
+  for( std::pair<int, int> &range : ranges ) {
+    for( int cpu = range.first; cpu <= range.second; cpu++ ) {
+      if( !cpu_nodes.empty() && cpu_nodes.count(cpu) == 0 ) {
+        fail("-a names a CPU that is not online");
       }
+      placed.push_back(std::make_pair(cpu_nodes.empty() ? 0 : cpu_nodes[cpu], cpu));
+    }
+  }
+  std::sort(placed.begin(), placed.end());
+  for( std::pair<int, int> &cpu : placed ) {
+    affinity_nodes.push_back(cpu.first);
+    affinity_cpus.push_back(cpu.second);
+  }
+}
 
-    
-   } // End of server-thread while loop logic 
-  close(clntSocket);
-  return NULL;
+/**
+ * Sets up the TLS context every worker accepts clients with
+ * Made before any worker is forked, so they share the session ticket key
+ * and a client resumes its session with whichever worker accepts it.
+ * The kernel takes over the records where it supports kTLS, which keeps
+ * sendfile working for GET bodies, unless -u keeps them in user space.
+ * @param cert_file PEM certificate chain of the server
+ * @param key_file PEM private key of the certificate
+*/
+void initTLS( const char *cert_file, const char *key_file ) {
+  tls_context = SSL_CTX_new(TLS_server_method());
+  if( tls_context == NULL ) {
+    fail("SSL_CTX_new() error");
+  }
+  SSL_CTX_set_min_proto_version(tls_context, TLS1_2_VERSION);
+  if( kernel_tls ) {
+    SSL_CTX_set_options(tls_context, SSL_OP_ENABLE_KTLS);
+  }
+  // The outbox is retried from wherever it was left, possibly moved by a compaction
+  SSL_CTX_set_mode(tls_context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  // Stateless tickets only, a per process session cache would miss across workers
+  SSL_CTX_set_session_cache_mode(tls_context, SSL_SESS_CACHE_OFF);
+  if( SSL_CTX_use_certificate_chain_file(tls_context, cert_file) != 1 ) {
+    fail("Trouble loading the TLS certificate");
+  }
+  if( SSL_CTX_use_PrivateKey_file(tls_context, key_file, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(tls_context) != 1 ) {
+    fail("Trouble loading the TLS private key");
+  }
+  // Closing sessions write to sockets outside flushOutbox, whose sends never raise it
+  signal(SIGPIPE, SIG_IGN);
 }
 
 /**
  * Main function of the server.
  * Passes off function to thread
+ * @param argc number of arguments
+ * @param argv -s handshake timeout and -i idle timeout in seconds,
+ *             -w worker processes, -t event loop threads per worker,
+ *             -p port, -c cluster members, -r and -e per-connection
+ *             command rates, -m running LIST/GET limit, -C
+ *             certificate and -K key files for TLS clients, -u TLS
+ *             without kernel offload and -a CPUs to pin threads to
  * @return 0
 */
-int main( void ) {
-    // Create a socket
-    int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverSocket == -1) {
-        fail("Error creating socket");
-        exit(EXIT_FAILURE);
+int main( int argc, char *argv[] ) {
+    // -s handshake timeout, -i idle timeout, both in seconds
+    // -w number of worker processes sharing the registry
+    // -t number of event loop threads in each worker
+    // -p port to listen on, -c host:port list of every cluster member
+    // -r and -e commands per second a peer address may send, cheap and LIST/GET
+    // -m LIST and GET commands running at once in each worker
+    // -C and -K PEM certificate and key, clients may then open with TLS
+    // -u TLS records made in user space even where the kernel could take them
+    // -a CPUs the threads are pinned to, split between the workers by NUMA node
+    int workers = 0;
+    char *members = NULL;
+    char *cert_file = NULL;
+    char *key_file = NULL;
+    int option;
+    while( (option = getopt(argc, argv, "s:i:w:t:p:c:r:e:m:C:K:ua:")) != -1 ) {
+      if( option == 's' && atoi(optarg) > 0 ) {
+        handshake_timeout = atoi(optarg);
+      } else if( option == 'i' && atoi(optarg) > 1 ) {
+        idle_timeout = atoi(optarg);
+      } else if( option == 'w' && atoi(optarg) > 0 && atoi(optarg) <= MAX_WORKERS ) {
+        workers = atoi(optarg);
+      } else if( option == 't' && atoi(optarg) > 0 ) {
+        loop_threads = atoi(optarg);
+      } else if( option == 'p' && atoi(optarg) > 0 && atoi(optarg) < 65536 ) {
+        server_port = atoi(optarg);
+      } else if( option == 'c' ) {
+        members = optarg;
+      } else if( option == 'r' && atoi(optarg) > 0 ) {
+        cheap_rate = atoi(optarg);
+      } else if( option == 'e' && atoi(optarg) > 0 ) {
+        expensive_rate = atoi(optarg);
+      } else if( option == 'm' && atoi(optarg) > 0 ) {
+        expensive_limit = atoi(optarg);
+      } else if( option == 'C' ) {
+        cert_file = optarg;
+      } else if( option == 'K' ) {
+        key_file = optarg;
+      } else if( option == 'u' ) {
+        kernel_tls = false;
+      } else if( option == 'a' ) {
+        initAffinity(optarg);
+      } else {
+        fail("usage: server [-s handshake_seconds] [-i idle_seconds] [-w workers] [-t threads] [-p port] [-c host:port,...] [-r rate] [-e rate] [-m max] [-C cert -K key] [-u] [-a cpus]");
+      }
     }
-
-    // Bind to an IP address and port
-    sockaddr_in serverAddr;
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = INADDR_ANY;
-    serverAddr.sin_port = htons(  PORT );
-
-    if (bind(serverSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1) {
-        fail("Error creating socket. Please wait a few seconds to re-try.");
-        close(serverSocket);
-        exit(EXIT_FAILURE);
+    if( (cert_file == NULL) != (key_file == NULL) ) {
+      fail("TLS needs both -C and -K");
+    }
+    if( cert_file != NULL ) {
+      initTLS(cert_file, key_file);
+    }
+    if( members != NULL ) {
+      initCluster(members);
     }
+    if( realpath(argv[0], server_path) == NULL ) {
+      strncpy(server_path, argv[0], sizeof(server_path) - 1);
+    }
+    server_argv = argv;
 
-    // Listen for incoming connections
-    if (listen(serverSocket, 10) == -1) {
-        fail("Error listening on socket");
-        close(serverSocket);
-        exit(EXIT_FAILURE);
+    // Started by an upgrade, the registry and listener come from the old server
+    char *handoff = getenv(HANDOFF_ENV);
+    if( handoff != NULL ) {
+      int handoff_socket = atoi(handoff);
+      unsetenv(HANDOFF_ENV);
+      fcntl(handoff_socket, F_SETFD, FD_CLOEXEC);
+      int serverSocket = receiveHandoff(handoff_socket);
+      std::cout << "Took over " << handoff_conns.size() << " clients" << std::endl;
+      runWorker(false, serverSocket, handoff_socket);
+      return 0;
     }
 
+    initRegistry();
+    if( mkdir(RFC_STORE_DIR, 0755) == -1 && errno != EEXIST ) {
+      fail("mkdir() rfc store error");
+    }
+    if( workers == 0 ) {
+      runWorker(false, -1, -1);
+      return 0;
+    }
 
+    // Signals and worker exits are read from a signalfd like a worker's, so
+    // one arriving while the last is handled waits there instead of being lost
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    if( signal_fd == -1 ) {
+      fail("signalfd() error");
+    }
 
-    while ( true  ) {
-      // Accept a client connection. -- structures that contain the address of client 
-        struct sockaddr_in clientAddr;
-        socklen_t clientAddrLen = sizeof(clientAddr);
-        int clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddr, &clientAddrLen);
-        if (clientSocket == -1) {
-            fail("Error accepting connection");
-            close(serverSocket);
-            exit(EXIT_FAILURE);
+    // Supervise the workers, replacing any that exit in the same slot
+    std::map<pid_t, int> running;
+    for( int i = 0; i < workers; i++ ) {
+      running[spawnWorker(i)] = i;
+    }
+    bool stopping = false;
+    while( true ) {
+      // SIGCHLD is not queued per child, so every exited worker is reaped
+      int status;
+      pid_t worker;
+      while( (worker = waitpid(-1, &status, WNOHANG)) > 0 ) {
+        std::map<pid_t, int>::iterator exited = running.find(worker);
+        if( exited == running.end() ) {
+          continue;
         }
+        int slot = exited->second;
+        running.erase(exited);
+        if( stopping ) {
+          continue;
+        }
+        std::cout << "Worker " << worker << " exited, restarting" << std::endl;
+        reapWorker(worker);
+        running[spawnWorker(slot)] = slot;
+      }
+      if( stopping && running.empty() ) {
+        break;
+      }
 
-      // printf("This is the client's port number:%d \n", ntohs(clntAddr.sin_port)); //Line for peer's port
-
-      // Thread error checking 
-      if( pthread_create( &userLock, NULL, handleClient, &clientSocket ) != 0 ) { 
-        fail( "Thread incorrect ");
+      struct signalfd_siginfo info;
+      if( read(signal_fd, &info, sizeof(info)) != sizeof(info) ) {
+        if( errno == EINTR ) {
+          continue;
+        }
+        fail("read() signalfd error");
+      }
+      if( info.ssi_signo == SIGTERM && !stopping ) {
+        // Each worker drains its own connections
+        for( std::pair<const pid_t, int> &worker : running ) {
+          kill(worker.first, SIGTERM);
+        }
+        stopping = true;
+      } else if( info.ssi_signo == SIGHUP ) {
+        std::cout << "Ignoring SIGHUP, hot reload needs a single process without -w" << std::endl;
+      } else if( info.ssi_signo == SIGUSR1 ) {
+        // The registry is shared, one snapshot covers every worker
+        startDump(NULL, NULL, NULL, NULL);
       }
     }
 
-    // close(clientSocket);
-    close(serverSocket);
-
     return 0;
-}
\ No newline at end of file
+}
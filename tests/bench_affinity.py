@@ -0,0 +1,102 @@
+"""
+LOOKUP and GET throughput and p99 latency with and without -a, on every CPU
+of the machine, both as one process and with a worker per NUMA node. The
+machine's nodes and CPUs are printed first, and the CPUs each server
+thread may run on are checked against the -a list. numactl is not needed:
+the nodes are whatever /sys/devices/system/node shows, a single node when
+there is no NUMA.
+"""
+
+import glob
+import os
+import threading
+import time
+
+from harness import Server, check, percentile, report, run
+
+REQUESTERS = 8
+SECONDS = 4
+SIZE = 64 << 10
+
+
+def sys_list(path):
+    try:
+        with open(path) as listing:
+            return listing.read().strip()
+    except OSError:
+        return ""
+
+
+def cpu_set(listing):
+    cpus = set()
+    for part in listing.split(","):
+        if part:
+            first, _, last = part.partition("-")
+            cpus.update(range(int(first), int(last or first) + 1))
+    return cpus
+
+
+def thread_cpus(pid):
+    """Returns the CPUs each thread of pid and its workers may run on."""
+    allowed = []
+    pids = [pid] + [int(child) for child in sys_list("/proc/%d/task/%d/children" % (pid, pid)).split()]
+    for process in pids:
+        for status in glob.glob("/proc/%d/task/*/status" % process):
+            allowed.append(cpu_set(dict(line.split(":\t", 1) for line in open(status) if ":\t" in line)
+                                   ["Cpus_allowed_list"].strip()))
+    return allowed
+
+
+def requester(server, number, latencies, failures, stop):
+    # Half the requesters look up, half fetch a file in the response
+    peer = server.peer()
+    while not stop.is_set():
+        started = time.perf_counter()
+        if number % 2:
+            response = peer.request("LOOKUP RFC %d P2P-CI/1.0" % (1 + number % 8))
+            failed = "Pinned document" not in response.text
+        else:
+            response = peer.request("GET RFC %d P2P-CI/1.0 Accept-Encoding: identity" % (1 + number % 8), "Linux")
+            failed = response.status != 200 or len(response.body) != SIZE
+        latencies[number % 2].append((time.perf_counter() - started) * 1000)
+        if failed:
+            failures.append(response.text)
+            break
+    peer.close()
+
+
+def bench_affinity():
+    nodes = sys_list("/sys/devices/system/node/online") or "0"
+    cpus = sys_list("/sys/devices/system/cpu/online")
+    print("numa nodes %s, cpus %s" % (nodes, cpus), flush=True)
+    for node in sorted(cpu_set(nodes)):
+        print("  node %d cpus %s" % (node, sys_list("/sys/devices/system/node/node%d/cpulist" % node) or cpus), flush=True)
+    workers = len(cpu_set(nodes))
+    for options in ([], ["-a", cpus], ["-w", workers], ["-w", workers, "-a", cpus]):
+        with Server("-r", 1000000, "-e", 1000000, *options) as server:
+            directory = server.client_dir("holder", [(n, "Pinned document %d" % n) for n in range(1, 9)], SIZE)
+            holder = server.peer(server.records(directory))
+            holder.request("LOOKUP RFC 1 P2P-CI/1.0")
+            if "-a" in options:
+                check(all(allowed <= cpu_set(cpus) for allowed in thread_cpus(server.pid)), "a thread runs off the -a CPUs")
+            latencies = ([], [])
+            failures = []
+            stop = threading.Event()
+            threads = [threading.Thread(target=requester, args=(server, i, latencies, failures, stop))
+                       for i in range(REQUESTERS)]
+            for thread in threads:
+                thread.start()
+            time.sleep(SECONDS)
+            stop.set()
+            for thread in threads:
+                thread.join()
+            gets, lookups = latencies
+            report("affinity %s" % (" ".join(str(option) for option in options) or "floating"),
+                   lookups_per_second=len(lookups) / SECONDS, lookup_p99_ms=percentile(lookups, 0.99),
+                   gets_per_second=len(gets) / SECONDS, get_p99_ms=percentile(gets, 0.99), cpus=os.cpu_count())
+            check(not failures, failures[:1])
+            holder.close()
+
+
+if __name__ == "__main__":
+    run([bench_affinity])
@@ -0,0 +1,95 @@
+"""
+LOOKUP throughput of a cluster of 1, 2 and 3 servers. Holders register 3000
+RFCs through the first server, then requester processes spread over every
+member look up random RFCs. In the forwarded runs each requester asks its
+own member, so about (n - 1) / n of the lookups are forwarded to the owner;
+in the routed runs each lookup goes to the member owning the RFC, as a
+client that hashes the ring itself would send it. Aggregate lookups per
+second is reported with the p99 latency; every answer is checked for the
+registered title. Requesters are processes, so the client side is not held
+to one CPU, but the members can only scale with the CPUs the machine has.
+"""
+
+import multiprocessing
+import os
+import random
+import time
+
+from harness import Peer, Server, check, free_port, percentile, report, ring_owner, run
+
+RFCS = 3000
+REQUESTERS = 6
+LOOKUPS = 5000
+
+
+def requester(ports, owners, seed, results):
+    """
+    Looks up random RFCs, at the port owners gives for each when routed,
+    and puts its latencies and failures on results.
+    """
+    peers = {}
+    for port in ports:
+        peers[port] = Peer(port)
+    own = ports[seed % len(ports)]
+    chooser = random.Random(seed)
+    latencies = []
+    failures = []
+    for _ in range(LOOKUPS):
+        n = chooser.randint(1, RFCS)
+        port = owners[n] if owners else own
+        started = time.perf_counter()
+        response = peers[port].request("LOOKUP RFC %d P2P-CI/1.0" % n)
+        latencies.append((time.perf_counter() - started) * 1000)
+        if "Clustered title %d" % n not in response.text:
+            failures.append(response.text)
+    for peer in peers.values():
+        peer.close()
+    results.put((latencies, failures))
+
+
+def bench_cluster():
+    for size in (1, 2, 3):
+        ports = [free_port() for _ in range(size)]
+        members = ["localhost:%d" % port for port in ports]
+        options = ["-r", 1000000] + (["-c", ",".join(members)] if size > 1 else [])
+        first = Server(*options, port=ports[0]).start()
+        servers = [first] + [Server(*options, port=port, root=first.root).start() for port in ports[1:]]
+        try:
+            holders = []
+            for index in range(3):
+                numbers = range(1 + index * RFCS // 3, 1 + (index + 1) * RFCS // 3)
+                holders.append(first.peer(["holder%d rfc%d.txt %d Clustered title %d" % (index, n, n, n) for n in numbers]))
+            for holder in holders:
+                holder.request("LOOKUP RFC 1 P2P-CI/1.0")
+
+            owners = {n: int(ring_owner(members, n).rsplit(":", 1)[1]) for n in range(1, RFCS + 1)}
+            for routed in ((False, True) if size > 1 else (False,)):
+                results = multiprocessing.Queue()
+                processes = [multiprocessing.Process(target=requester, args=(ports, owners if routed else None, i, results))
+                             for i in range(REQUESTERS)]
+                started = time.time()
+                for process in processes:
+                    process.start()
+                latencies = []
+                failures = []
+                for _ in processes:
+                    done, failed = results.get()
+                    latencies += done
+                    failures += failed
+                elapsed = time.time() - started
+                for process in processes:
+                    process.join()
+                report("cluster members=%d %s" % (size, "routed" if routed else "forwarded"), lookups=len(latencies),
+                       failed=len(failures), lookups_per_second=len(latencies) / elapsed,
+                       p99_ms=percentile(latencies, 0.99), cpus=os.cpu_count())
+                check(len(latencies) == REQUESTERS * LOOKUPS, "a requester did not finish")
+                check(not failures, "LOOKUP failed: %s" % failures[:1])
+            for holder in holders:
+                holder.close()
+        finally:
+            for server in servers:
+                server.stop()
+
+
+if __name__ == "__main__":
+    run([bench_cluster])
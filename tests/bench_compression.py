@@ -0,0 +1,59 @@
+"""
+Bytes on the wire and end-to-end time of GET with and without deflate, for
+the RFC texts shipped in the client directories. Each file is fetched
+ROUNDS times per encoding, so deflate bodies are compressed while sent at
+first and then come from the cache. The link is a relay paced to
+RATE_MBIT, as tc netem is not available everywhere, and an unpaced run
+shows the server-side cost. Every body is checked against the file.
+"""
+
+import glob
+import hashlib
+import os
+import shutil
+import time
+
+from harness import REPO, Peer, Server, Throttle, check, report, run
+
+ROUNDS = 4
+RATE_MBIT = 20
+
+
+def bench_compression():
+    with Server("-e", 100000) as server:
+        directory = server.client_dir("holder")
+        for path in glob.glob(os.path.join(REPO, "client_directory[12]", "rfc*.txt")):
+            shutil.copy(path, directory)
+        records = server.records(directory)
+        holder = server.peer(records)
+        holder.request("LOOKUP RFC 1 P2P-CI/1.0")
+        files = {}
+        for record in records:
+            number = int(record.split()[2])
+            with open(os.path.join(directory, "rfc%d.txt" % number), "rb") as source:
+                files[number] = hashlib.sha256(source.read()).hexdigest()
+        total = sum(os.path.getsize(path) for path in glob.glob(os.path.join(directory, "rfc*.txt")))
+
+        for paced in (True, False):
+            for encoding in ("identity", "deflate"):
+                throttle = Throttle(server.port, RATE_MBIT * 125000) if paced else None
+                peer = server.peer() if throttle is None else Peer(throttle.port)
+                started = time.time()
+                for _ in range(ROUNDS):
+                    for number, digest in files.items():
+                        response = peer.request("GET RFC %d P2P-CI/1.0 Accept-Encoding: %s" % (number, encoding), "Linux")
+                        check(response.status == 200, response.text)
+                        check(hashlib.sha256(response.body).hexdigest() == digest, "RFC %d body differs" % number)
+                elapsed = time.time() - started
+                peer.close()
+                figures = {"files": len(files) * ROUNDS, "file_bytes": total * ROUNDS, "seconds": elapsed}
+                if throttle is not None:
+                    figures["wire_bytes"] = throttle.received
+                    figures["ratio"] = total * ROUNDS / throttle.received
+                    throttle.close()
+                report("compression %s %s" % (encoding, "%dMbit" % RATE_MBIT if paced else "unpaced"), **figures)
+        holder.close()
+
+
+if __name__ == "__main__":
+    run([bench_compression])
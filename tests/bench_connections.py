@@ -0,0 +1,85 @@
+"""
+Cost of idle connections: 1k and 10k registered peers are connected and left
+idle, then the server's resident memory and thread count are read and
+LOOKUP latency is measured, both on a fresh connection and spread over the
+idle ones. The same runs are made against the thread-per-connection server
+from before the event loops, built from git history, or the binary named
+by P2P_BASELINE_SERVER. Every LOOKUP is checked for the registered title;
+the baseline frames requests by recv() calls and sometimes answers with an
+empty block, so its failures are only counted.
+"""
+
+import os
+import random
+import resource
+import tempfile
+import time
+
+from harness import Server, check, percentile, proc_status, report, run, server_before
+
+COUNTS = (1000, 10000)
+LOOKUPS = 2000
+
+
+def lookup(peer, latencies, failures):
+    started = time.perf_counter()
+    response = peer.request("LOOKUP RFC 1 P2P-CI/1.0")
+    latencies.append((time.perf_counter() - started) * 1000)
+    if "Idle title" not in response.text:
+        failures.append(response.text)
+
+
+def measure(name, binary, count, *args):
+    with Server(*args, binary=binary) as server:
+        holder = server.peer([server.client_dir("holder") + " rfc1.txt 1 Idle title"])
+        holder.request("LOOKUP RFC 1 P2P-CI/1.0")
+        idle = []
+        for index in range(count):
+            idle.append(server.peer())
+            if index % 500 == 499:
+                # Every handshake so far has been read once this answers
+                idle[-1].request("LOOKUP RFC 1 P2P-CI/1.0")
+        time.sleep(1)
+        rss = proc_status(server.pid, "VmRSS")
+        threads = proc_status(server.pid, "Threads")
+
+        fresh = []
+        failures = []
+        active = server.peer()
+        for _ in range(LOOKUPS):
+            lookup(active, fresh, failures)
+        spread = []
+        chooser = random.Random(count)
+        for _ in range(LOOKUPS):
+            lookup(chooser.choice(idle), spread, failures)
+        report("connections %s %d" % (name, count), rss_kb=rss, rss_kb_per_connection=rss / count, threads=threads,
+               p50_ms=percentile(fresh, 0.5), p99_ms=percentile(fresh, 0.99),
+               spread_p50_ms=percentile(spread, 0.5), spread_p99_ms=percentile(spread, 0.99), failed=len(failures))
+        check(binary is not None or not failures, "LOOKUP failed: %s" % failures[:1])
+        active.close()
+        for peer in idle:
+            peer.close()
+        holder.close()
+
+
+def bench_connections():
+    # Both ends of every connection are in this machine, this process holds one of them
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+    with tempfile.TemporaryDirectory(prefix="p2p-baseline-") as directory:
+        baseline = os.environ.get("P2P_BASELINE_SERVER") or server_before("user-037", directory)
+        for count in COUNTS:
+            check(count + 100 < hard, "open file limit %d is too low for %d connections" % (hard, count))
+            measure("coroutines", None, count, "-r", 100000, "-e", 100000)
+            if baseline is not None:
+                try:
+                    measure("threads", baseline, count)
+                except OSError as error:
+                    # A thread per connection runs out of threads or memory before this
+                    report("connections threads %d" % count, error=error.strerror)
+        if baseline is None:
+            print("no thread-per-connection server to compare with", flush=True)
+
+
+if __name__ == "__main__":
+    run([bench_connections])
@@ -0,0 +1,66 @@
+"""
+GET throughput, with system calls and context switches per request read
+from /proc for the whole server, for a file placed into the requester's
+directory (no Accept-Encoding) and for one sent in the response (Accept-
+Encoding: identity). The same runs are made against the server from before
+the io_uring backend, built from git history, or the binary named by
+P2P_BASELINE_SERVER. System calls count reads and writes only, as that is
+what /proc/<pid>/io records; calls made through the ring are not counted.
+"""
+
+import os
+import tempfile
+import time
+
+from harness import Server, check, context_switches, file_hash, report, run, server_before, syscalls
+
+FILES = 16
+SIZE = 1 << 20
+REQUESTS = 400
+
+
+def measure(name, binary, *args):
+    with Server(*args, binary=binary) as server:
+        directory = server.client_dir("holder", [(n, "Fetched document %d" % n) for n in range(1, FILES + 1)], SIZE)
+        holder = server.peer(server.records(directory))
+        server.client_dir("requester")
+        requester = server.peer(["requester rfc%d.txt %d Requester document" % (FILES + 1, FILES + 1)])
+        holder.request("LOOKUP RFC 1 P2P-CI/1.0")
+        digests = [file_hash(os.path.join(directory, "rfc%d.txt" % n)) for n in range(1, FILES + 1)]
+
+        for mode, suffix in (("placed", ""), ("identity", " Accept-Encoding: identity")):
+            # One round first, so files are hashed and in the store before timing
+            for n in range(1, FILES + 1):
+                check(requester.request("GET RFC %d P2P-CI/1.0%s" % (n, suffix), "Linux").status == 200, "GET failed")
+            switches = context_switches(server.pid)
+            calls = syscalls(server.pid)
+            started = time.perf_counter()
+            for index in range(REQUESTS):
+                n = 1 + index % FILES
+                response = requester.request("GET RFC %d P2P-CI/1.0%s" % (n, suffix), "Linux")
+                check(response.status == 200, response.text)
+            elapsed = time.perf_counter() - started
+            switches = context_switches(server.pid) - switches
+            calls = syscalls(server.pid) - calls
+            for n in range(1, FILES + 1):
+                if mode == "placed":
+                    check(file_hash(os.path.join(server.root, "requester", "rfc%d.txt" % n)) == digests[n - 1],
+                          "RFC %d placed corrupt" % n)
+            report("get %s %s" % (name, mode), requests_per_second=REQUESTS / elapsed,
+                   syscalls_per_request=calls / REQUESTS, switches_per_request=switches / REQUESTS)
+        requester.close()
+        holder.close()
+
+
+def bench_get():
+    with tempfile.TemporaryDirectory(prefix="p2p-baseline-") as directory:
+        measure("current", None, "-r", 100000, "-e", 100000)
+        baseline = os.environ.get("P2P_BASELINE_SERVER") or server_before("user-038", directory)
+        if baseline is not None:
+            measure("blocking", baseline)
+        else:
+            print("no server from before io_uring to compare with", flush=True)
+
+
+if __name__ == "__main__":
+    run([bench_get])
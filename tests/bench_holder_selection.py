@@ -0,0 +1,63 @@
+"""
+Holder selection under a skewed workload: every RFC is held by the same
+eight peers and requesters GET RFCs in a Zipf mix, so a few RFCs take most
+of the traffic. The bytes each holder served are read from a registry
+dump, and their max/mean should stay close to 1.
+"""
+
+import collections
+import random
+import threading
+
+from harness import Server, check, report, run
+
+HOLDERS = 8
+RFCS = 20
+REQUESTERS = 4
+GETS = 2000
+SIZE = 16384
+
+
+def bench_holder_selection():
+    with Server("-r", 100000, "-e", 100000) as server:
+        holders = []
+        for index in range(HOLDERS):
+            directory = server.client_dir("holder%d" % index, [(1000 + n, "Skewed document %d" % n) for n in range(RFCS)], SIZE)
+            holders.append(server.peer(server.records(directory)))
+        for holder in holders:
+            holder.request("LOOKUP RFC 1000 P2P-CI/1.0")
+
+        weights = [1.0 / (rank + 1) ** 1.2 for rank in range(RFCS)]
+        random.seed(26)
+        wanted = random.choices(range(RFCS), weights, k=GETS)
+        per_rfc = collections.Counter(wanted)
+        failures = []
+
+        def requester(share):
+            peer = server.peer()
+            for n in share:
+                response = peer.request("GET RFC %d P2P-CI/1.0 Accept-Encoding: identity" % (1000 + n), "Linux")
+                if response.status != 200 or len(response.body) != SIZE:
+                    failures.append(response.text.splitlines()[:1])
+            peer.close()
+
+        threads = [threading.Thread(target=requester, args=(wanted[i::REQUESTERS],)) for i in range(REQUESTERS)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+
+        clients = server.dump()["clients"]
+        ports = {holder.port for holder in holders}
+        served = [clients["bytes_served"][row] for row in range(len(clients["port"])) if clients["port"][row] in ports]
+        mean = sum(served) / len(served)
+        report("holder_selection", gets=GETS, failed=len(failures), holders=len(served),
+               max_over_mean=max(served) / mean, min_over_mean=min(served) / mean,
+               hottest_rfc_share=per_rfc.most_common(1)[0][1] / GETS)
+        for holder in holders:
+            holder.close()
+        check(not failures, "%d GETs failed, first %s" % (len(failures), failures[:1]))
+
+
+if __name__ == "__main__":
+    run([bench_holder_selection])
@@ -0,0 +1,96 @@
+"""
+LIST ALL throughput over a registry of 100k rows with a 99:1 read:write mix.
+Each reader repeats conditional LIST ALL with the last ETag it saw and adds
+itself as a holder of one RFC every hundredth request, so most LISTs are
+answered 304 and the rest stream every row. An unconditional run, where
+every LIST streams every row, is shown for comparison. Every 200 is checked
+for the rows added so far and every 304 for an unchanged ETag.
+"""
+
+import threading
+import time
+
+from harness import Server, check, report, run
+
+HOLDERS = 10
+ROWS_PER_HOLDER = 10000
+READERS = 4
+SECONDS = 5
+
+
+def list_all(peer, etag):
+    """Returns the answer's status, ETag and rows."""
+    peer.send("LIST ALL P2P-CI/1.0 If-None-Match: %d" % etag)
+    answer = peer.read_until(b"END\n").decode()
+    lines = answer.split("\n", 2)
+    status = int(lines[0].split()[1])
+    check(lines[1].startswith("ETag: "), "no ETag in %r" % answer[:100])
+    return status, int(lines[1].split()[1]), lines[2]
+
+
+def reader(server, index, conditional, counts, failures, stop):
+    number = HOLDERS * ROWS_PER_HOLDER + 1 + index
+    peer = server.peer(["reader%d rfc%d.txt %d Reader title %d" % (index, number, number, number)])
+    if "Reader title %d" % number not in peer.request("LOOKUP RFC %d P2P-CI/1.0" % number).text:
+        failures.append("RFC %d not registered" % number)
+    etag = 0
+    added = []
+    requests = 0
+    while not stop.is_set():
+        requests += 1
+        if requests % 100 == 0:
+            rfc = 1 + (index * 7919 + requests) % (HOLDERS * ROWS_PER_HOLDER)
+            if "Title:" not in peer.request("ADD RFC %d P2P-CI/1.0" % rfc).text:
+                failures.append("ADD RFC %d failed" % rfc)
+            added.append("RFC %d Row title %d localhost %d\n" % (rfc, rfc, peer.port))
+            counts["writes"] += 1
+            continue
+        status, new_etag, rows = list_all(peer, etag if conditional else 0)
+        counts[status] += 1
+        if status == 304:
+            if new_etag != etag:
+                failures.append("304 with ETag %d for %d" % (new_etag, etag))
+        elif not all(row in rows for row in added[-3:]):
+            failures.append("200 lacks an added row")
+        counts["bytes"] += len(rows)
+        etag = new_etag
+    peer.close()
+
+
+def bench_list():
+    with Server("-r", 1000000, "-e", 1000000) as server:
+        holders = []
+        for holder in range(HOLDERS):
+            numbers = range(1 + holder * ROWS_PER_HOLDER, 1 + (holder + 1) * ROWS_PER_HOLDER)
+            holders.append(server.peer(["holder%d rfc%d.txt %d Row title %d" % (holder, n, n, n) for n in numbers]))
+        for holder in holders:
+            holder.request("LOOKUP RFC 1 P2P-CI/1.0")
+        last = HOLDERS * ROWS_PER_HOLDER
+        check("Row title %d" % last in holders[0].request("LOOKUP RFC %d P2P-CI/1.0" % last).text, "RFC %d not registered" % last)
+
+        for conditional in (True, False):
+            counts = {200: 0, 304: 0, "writes": 0, "bytes": 0}
+            failures = []
+            stop = threading.Event()
+            threads = [threading.Thread(target=reader, args=(server, i, conditional, counts, failures, stop))
+                       for i in range(READERS)]
+            started = time.time()
+            for thread in threads:
+                thread.start()
+            time.sleep(SECONDS)
+            stop.set()
+            for thread in threads:
+                thread.join()
+            elapsed = time.time() - started
+            lists = counts[200] + counts[304]
+            report("list %s" % ("conditional" if conditional else "full"), lists_per_second=lists / elapsed,
+                   not_modified=counts[304], full=counts[200], writes=counts["writes"],
+                   mb_per_second=counts["bytes"] / elapsed / 1e6)
+            check(not failures, failures[:1])
+            check(not conditional or counts[304] > counts[200], "conditional LISTs were mostly full")
+        for holder in holders:
+            holder.close()
+
+
+if __name__ == "__main__":
+    run([bench_list])
@@ -0,0 +1,66 @@
+"""
+LOOKUP latency of a well-behaved peer while another address floods LIST ALL
+over 1 and then 8 connections, with the default limits. The victim looks
+up at 50 a second from 127.0.0.2; the flooder sends conditional LIST ALL of
+a 20000 row registry from 127.0.0.1 as fast as its answers come back.
+Reported are the victim's p50/p99 and the flooder's LISTs admitted and
+refused per second, which should not grow with its connections.
+"""
+
+import threading
+import time
+
+from harness import Server, check, percentile, report, run
+
+RFCS = 20000
+SECONDS = 5
+VICTIM_RATE = 50
+
+
+def victim(server, latencies, stop):
+    peer = server.peer(source="127.0.0.2")
+    while not stop.is_set():
+        started = time.perf_counter()
+        response = peer.request("LOOKUP RFC 7 P2P-CI/1.0")
+        latencies.append((time.perf_counter() - started) * 1000)
+        check("Flooded title 7" in response.text, response.text)
+        time.sleep(max(0.0, 1.0 / VICTIM_RATE - (time.perf_counter() - started)))
+    peer.close()
+
+
+def flooder(server, counts, stop):
+    peer = server.peer()
+    while not stop.is_set():
+        peer.send("LIST ALL P2P-CI/1.0 If-None-Match: 0")
+        answer = peer.read_until(b"END\n")
+        counts["refused" if answer.startswith(b"P2P-CI/1.0 429") else "admitted"] += 1
+    peer.close()
+
+
+def bench_rate_limit():
+    with Server() as server:
+        holder = server.peer(["holder rfc%d.txt %d Flooded title %d" % (n, n, n) for n in range(1, RFCS + 1)],
+                             source="127.0.0.3")
+        holder.request("LOOKUP RFC 1 P2P-CI/1.0")
+        for connections in (0, 1, 8):
+            latencies = []
+            counts = {"admitted": 0, "refused": 0}
+            stop = threading.Event()
+            threads = [threading.Thread(target=victim, args=(server, latencies, stop))]
+            threads += [threading.Thread(target=flooder, args=(server, counts, stop)) for _ in range(connections)]
+            for thread in threads:
+                thread.start()
+            time.sleep(SECONDS)
+            stop.set()
+            for thread in threads:
+                thread.join()
+            report("rate_limit flood=%d" % connections, lookups=len(latencies), p50_ms=percentile(latencies, 0.5),
+                   p99_ms=percentile(latencies, 0.99), lists_admitted_per_second=counts["admitted"] / SECONDS,
+                   refused_per_second=counts["refused"] / SECONDS)
+            # Wait out the flooder's burst before the next round
+            time.sleep(2)
+        holder.close()
+
+
+if __name__ == "__main__":
+    run([bench_rate_limit])
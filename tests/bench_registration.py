@@ -0,0 +1,62 @@
+"""
+Registration throughput with 1 to 32 peers registering and ADDing at once.
+Each thread repeatedly connects, registers RECORDS RFCs of its own, ADDs
+itself as a holder of ADDS RFCs a seed peer registered and disconnects,
+which removes its rows again. Rows per second is registrations plus ADDs
+plus the removals at disconnect, over the wall time of the run. The load
+comes from one Python process, so on a machine with few CPUs the figures
+show the cost of contention rather than scaling.
+"""
+
+import os
+import threading
+import time
+
+from harness import Server, check, report, run
+
+RECORDS = 50
+ADDS = 50
+ROUNDS = 256
+
+
+def register(server, thread, rounds, failures):
+    for round_number in range(rounds):
+        base = 100000 + (thread * rounds + round_number) * RECORDS
+        records = ["peer%d rfc%d.txt %d Registered document %d" % (thread, n, n, n) for n in range(base, base + RECORDS)]
+        peer = server.peer(records)
+        for n in range(ADDS):
+            peer.send("ADD RFC %d P2P-CI/1.0 localhost %d" % (1 + n, peer.port), "Title")
+        for n in range(ADDS):
+            response = peer.read_response()
+            # A successful ADD answers with the title alone
+            if response.status != 0:
+                failures.append(response.text)
+        peer.close()
+
+
+def bench_registration():
+    for threads in (1, 2, 4, 8, 16, 32):
+        with Server("-r", 100000) as server:
+            seed = server.peer(["seed rfc%d.txt %d Seed document %d" % (n, n, n) for n in range(1, ADDS + 1)])
+            seed.request("LOOKUP RFC 1 P2P-CI/1.0")
+            rounds = max(1, ROUNDS // threads)
+            failures = []
+            workers = [threading.Thread(target=register, args=(server, index, rounds, failures)) for index in range(threads)]
+            started = time.time()
+            for worker in workers:
+                worker.start()
+            for worker in workers:
+                worker.join()
+            # Disconnects are processed after the sockets close, wait for the last removal
+            while len(server.dump()["rfcs"]["rfc_number"]) > ADDS:
+                time.sleep(0.01)
+            elapsed = time.time() - started
+            rows = threads * rounds * (RECORDS + ADDS) * 2
+            report("registration threads=%d" % threads, rows=rows, seconds=elapsed, rows_per_second=rows / elapsed,
+                   failed=len(failures), cpus=os.cpu_count())
+            check(not failures, "ADD failed: %s" % failures[:1])
+            seed.close()
+
+
+if __name__ == "__main__":
+    run([bench_registration])
@@ -0,0 +1,75 @@
+"""
+SEARCH over 100k synthetic titles. Ten peers register 10k RFCs each, titled
+with five words drawn from a Zipf-weighted vocabulary, then one peer runs
+queries of each kind and the latency of each kind is reported. Every result
+row is checked against the titles that were registered.
+"""
+
+import random
+import time
+
+from harness import Server, check, percentile, report, run
+
+TITLES = 100000
+PEERS = 10
+QUERIES = 300
+VOCABULARY = ["w%04d" % n for n in range(3000)]
+
+
+def bench_search():
+    random.seed(28)
+    weights = [1.0 / (rank + 1) for rank in range(len(VOCABULARY))]
+    titles = {}
+    for n in range(1, TITLES + 1):
+        titles[n] = " ".join(random.choices(VOCABULARY, weights, k=5))
+    with Server("-r", 100000) as server:
+        peers = []
+        share = TITLES // PEERS
+        for index in range(PEERS):
+            numbers = range(1 + index * share, 1 + (index + 1) * share)
+            peers.append(server.peer(["peer%d rfc%d.txt %d %s" % (index, n, n, titles[n]) for n in numbers]))
+        started = time.time()
+        for peer in peers:
+            peer.request("LOOKUP RFC 1 P2P-CI/1.0")
+        report("search_register", titles=TITLES, seconds=time.time() - started)
+        # The last number has six digits, the longest file name registered
+        check(titles[TITLES] in peers[0].request("LOOKUP RFC %d P2P-CI/1.0" % TITLES).text, "RFC %d not registered" % TITLES)
+
+        searcher = peers[0]
+        kinds = {
+            "common_term": lambda: [VOCABULARY[random.randrange(5)]],
+            "rare_term": lambda: [VOCABULARY[random.randrange(2000, 3000)]],
+            "two_terms": lambda: [VOCABULARY[random.randrange(20)], VOCABULARY[random.randrange(20, 200)]],
+            "prefix": lambda: ["w%02d*" % random.randrange(30)],
+            "limit_100": lambda: [VOCABULARY[random.randrange(50)], "LIMIT", "100"],
+        }
+        for kind, make_query in kinds.items():
+            latencies = []
+            rows = 0
+            for _ in range(QUERIES):
+                words = make_query()
+                started = time.perf_counter()
+                response = searcher.request("SEARCH %s P2P-CI/1.0" % " ".join(words))
+                latencies.append((time.perf_counter() - started) * 1000)
+                terms = [word for word in words if word not in ("LIMIT", "100")]
+                # Rows past the fixed size response are cut off, the last may be partial
+                for line in response.text.split("\n")[:-1]:
+                    if not line.startswith("RFC "):
+                        continue
+                    number, title = line.split(" ", 2)[1:]
+                    title_words = titles[int(number)].split()
+                    check(title == titles[int(number)], "RFC %s title %r" % (number, title))
+                    for term in terms:
+                        if term.endswith("*"):
+                            check(any(word.startswith(term[:-1]) for word in title_words), "%s does not match %s" % (line, term))
+                        else:
+                            check(term in title_words, "%s does not match %s" % (line, term))
+                    rows += 1
+            report("search %s" % kind, queries=QUERIES, rows_per_query=rows / QUERIES, p50_ms=percentile(latencies, 0.5),
+                   p99_ms=percentile(latencies, 0.99))
+        for peer in peers:
+            peer.close()
+
+
+if __name__ == "__main__":
+    run([bench_search])
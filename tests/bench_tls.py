@@ -0,0 +1,77 @@
+"""
+Identity GET throughput of a 64MB file over plaintext, over TLS with the
+records made in user space (-u), and over TLS with kernel offload allowed.
+Each run reports MB/s, the p99 GET latency and the server's CPU seconds per
+GB sent. The kTLS run prints whether the kernel took the records: without
+the tls module (modprobe tls) it falls back to the user-space path, and
+the last two runs measure the same thing.
+"""
+
+import os
+import shutil
+import tempfile
+import threading
+import time
+
+from harness import Server, check, cpu_seconds, percentile, report, run, tls_files
+
+SIZE = 64 << 20
+REQUESTERS = 2
+SECONDS = 5
+
+
+def requester(server, context, body, latencies, failures, stop):
+    peer = server.peer(tls=context)
+    while not stop.is_set():
+        started = time.perf_counter()
+        response = peer.request("GET RFC 7200 P2P-CI/1.0 Accept-Encoding: identity", "Linux")
+        latencies.append((time.perf_counter() - started) * 1000)
+        if response.status != 200 or response.body != body:
+            failures.append(response.text)
+            break
+    peer.close()
+
+
+def bench_tls():
+    directory = tempfile.mkdtemp(prefix="p2p-tls-")
+    try:
+        cert, key, context = tls_files(directory)
+        for name, options, tls in (("plaintext", [], None), ("tls user-space", ["-u"], context),
+                                   ("tls kernel", [], context)):
+            with Server("-C", cert, "-K", key, "-r", 1000000, "-e", 1000000, *options, quiet=False) as server:
+                source = server.client_dir("holder", [(7200, "Benched document")], SIZE)
+                with open(os.path.join(source, "rfc7200.txt"), "rb") as original:
+                    body = original.read()
+                holder = server.peer(server.records(source))
+                holder.request("LOOKUP RFC 7200 P2P-CI/1.0")
+
+                latencies = []
+                failures = []
+                stop = threading.Event()
+                threads = [threading.Thread(target=requester, args=(server, tls, body, latencies, failures, stop))
+                           for _ in range(REQUESTERS)]
+                cpu_before = cpu_seconds(server.pid)
+                started = time.time()
+                for thread in threads:
+                    thread.start()
+                time.sleep(SECONDS)
+                stop.set()
+                for thread in threads:
+                    thread.join()
+                elapsed = time.time() - started
+                sent = len(latencies) * SIZE
+                with open(server.log_path) as log:
+                    states = {line.rsplit(" ", 1)[1] for line in log.read().splitlines() if line.startswith("TLS client on socket")}
+                report(name, gets=len(latencies), mb_per_second=sent / elapsed / (1 << 20),
+                       p99_ms=percentile(latencies, 0.99),
+                       server_cpu_s_per_gb=(cpu_seconds(server.pid) - cpu_before) / max(sent / (1 << 30), 1e-9),
+                       ktls="/".join(sorted(states)) or "-", cpus=os.cpu_count())
+                check(not failures, failures[:1])
+                check(latencies, "no GET finished")
+                holder.close()
+    finally:
+        shutil.rmtree(directory, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    run([bench_tls])
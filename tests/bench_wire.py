@@ -0,0 +1,57 @@
+"""
+Requests per second and bytes per response of the text and binary (-b)
+encodings, measured by the client itself in script mode over its default 4
+connections, with the server's CPU time per request. LOOKUP, ADD and LIST ALL (every row, If-None-Match: 0) run
+as separate scripts against a registry of 1000 rows, each RUNS times, and
+the median run is reported. The LOOKUP answers of both encodings are checked to
+decode to the same titles.
+"""
+
+import os
+import re
+
+from harness import Server, check, cpu_seconds, report, run, script_summary
+
+ROWS = 1000
+RUNS = 3
+SCRIPTS = {
+    "LOOKUP": ["LOOKUP RFC %d P2P-CI/1.0" % (1 + i % ROWS) for i in range(20000)],
+    "ADD": ["ADD RFC %d P2P-CI/1.0" % (1 + i % ROWS) for i in range(2000)],
+    "LIST": ["LIST ALL P2P-CI/1.0 If-None-Match: 0"] * 500,
+}
+
+
+def titles(output):
+    return sorted(re.findall(r"Title: Wire title \d+", output))
+
+
+def bench_wire():
+    with Server("-r", 1000000, "-e", 1000000) as server:
+        holder = server.peer(["holder rfc%d.txt %d Wire title %d" % (n, n, n) for n in range(1, ROWS + 1)])
+        holder.request("LOOKUP RFC 1 P2P-CI/1.0")
+        directory = server.client_dir("runner", [(ROWS + 1, "Runner document")], 4096)
+        for command, lines in SCRIPTS.items():
+            with open(os.path.join(directory, "script"), "w") as script:
+                script.write("\n".join(lines) + "\n")
+            outputs = {}
+            for encoding, options in (("text", []), ("binary", ["-b"])):
+                runs = []
+                for _ in range(RUNS):
+                    cpu = cpu_seconds(server.pid)
+                    output = server.client(directory, "-f", "script", *options, server.port)
+                    figures = script_summary(output)
+                    figures["server_cpu_us"] = (cpu_seconds(server.pid) - cpu) * 1e6 / len(lines)
+                    check(figures.get("operations") == len(lines) and figures.get("failed") == 0, output[-400:])
+                    runs.append(figures)
+                figures = sorted(runs, key=lambda figures: figures["ops_per_second"])[RUNS // 2]
+                report("wire %s %s" % (command, encoding), ops_per_second=figures["ops_per_second"],
+                       bytes_per_response=figures["bytes_per_response"], p99_ms=figures["p99"],
+                       server_cpu_us_per_request=figures["server_cpu_us"])
+                outputs[encoding] = output
+            if command == "LOOKUP":
+                check(titles(outputs["text"]) == titles(outputs["binary"]), "binary LOOKUPs decode differently")
+        holder.close()
+
+
+if __name__ == "__main__":
+    run([bench_wire])
@@ -0,0 +1,543 @@
+"""
+Helpers shared by the tests and benchmarks: starting servers, making client
+directories full of rfc files, talking the text protocol over raw sockets,
+running the client binary and reading registry dumps.
+
+Every server runs in its own temporary directory on a free port, so the
+checkout is never touched and several runs can share a machine.
+"""
+
+import glob
+import hashlib
+import os
+import shutil
+import signal
+import socket
+import ssl
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import zlib
+
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SERVER = os.path.join(REPO, "server")
+CLIENT = os.path.join(REPO, "client_directory1", "client")
+BLOCK = 512
+
+
+def free_port():
+    """Returns a TCP port nothing is listening on right now."""
+    with socket.socket() as probe:
+        probe.bind(("127.0.0.1", 0))
+        return probe.getsockname()[1]
+
+
+def percentile(values, fraction):
+    """Returns the value below which the given fraction of values fall."""
+    ordered = sorted(values)
+    if not ordered:
+        return 0.0
+    return ordered[min(len(ordered) - 1, int(fraction * len(ordered)))]
+
+
+def report(name, **figures):
+    """Prints one benchmark result line, figures in the order given."""
+    parts = []
+    for key, value in figures.items():
+        parts.append("%s=%s" % (key, ("%.3f" % value) if isinstance(value, float) else value))
+    print("%-28s %s" % (name, " ".join(parts)), flush=True)
+
+
+def check(condition, message):
+    """Fails the running test with the message unless condition holds."""
+    if not condition:
+        raise AssertionError(message)
+
+
+def proc_status(pid, field):
+    """Returns a numeric field of /proc/<pid>/status, such as VmRSS or Threads."""
+    with open("/proc/%d/status" % pid) as status:
+        for line in status:
+            if line.startswith(field + ":"):
+                return int(line.split()[1])
+    return 0
+
+
+def context_switches(pid):
+    """Returns the voluntary plus involuntary context switches of every thread of pid."""
+    total = 0
+    for task in glob.glob("/proc/%d/task/*/status" % pid):
+        try:
+            with open(task) as status:
+                for line in status:
+                    if "ctxt_switches" in line:
+                        total += int(line.split()[1])
+        except OSError:
+            pass
+    return total
+
+
+def cpu_seconds(pid):
+    """Returns the user plus system CPU time pid has used, from /proc/<pid>/stat."""
+    with open("/proc/%d/stat" % pid) as stat:
+        fields = stat.read().rsplit(")", 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+
+def syscalls(pid):
+    """Returns the read and write system calls pid has made, from /proc/<pid>/io."""
+    total = 0
+    with open("/proc/%d/io" % pid) as io:
+        for line in io:
+            if line.startswith(("syscr:", "syscw:")):
+                total += int(line.split()[1])
+    return total
+
+
+def server_before(request_id, directory):
+    """
+    Builds the server as it was before the first commit of request_id into
+    directory, for benchmarks comparing against it. Returns the binary, or
+    None without the git history or a compiler.
+    """
+    try:
+        revisions = subprocess.run(["git", "-C", REPO, "log", "--format=%H", "--grep=^\\[%s\\]" % request_id],
+                                   capture_output=True, text=True, check=True).stdout.split()
+        source = subprocess.run(["git", "-C", REPO, "show", revisions[-1] + "^:server.cpp"],
+                                capture_output=True, check=True).stdout
+    except (OSError, subprocess.CalledProcessError, IndexError):
+        return None
+    with open(os.path.join(directory, "server.cpp"), "wb") as output:
+        output.write(source)
+    binary = os.path.join(directory, "server")
+    built = subprocess.run(["g++", "-std=c++20", "-w", "server.cpp", "-o", binary,
+                            "-lpthread", "-lz", "-lssl", "-lcrypto"], cwd=directory)
+    return binary if built.returncode == 0 else None
+
+
+def tls_files(directory):
+    """
+    Makes a self-signed certificate for localhost and its key in directory
+    with the openssl command. Returns the two paths and a client context
+    trusting the certificate.
+    """
+    cert = os.path.join(directory, "server.crt")
+    key = os.path.join(directory, "server.key")
+    subprocess.run(["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes", "-keyout", key, "-out", cert,
+                    "-days", "1", "-subj", "/CN=localhost"], check=True, capture_output=True)
+    context = ssl.create_default_context(cafile=cert)
+    return cert, key, context
+
+
+def write_rfc(directory, number, title, size=0):
+    """
+    Writes rfc<number>.txt in the layout the client parses: a 'Request for
+    Comments' line, two blank lines and the title, padded with text to size bytes.
+    Returns the file's SHA-256.
+    """
+    head = "Network Working Group\r\nRequest for Comments: %d\r\n\r\n\r\n   %s\r\n\r\n" % (number, title)
+    body = head.encode()
+    line = ("   RFC %d filler text, line of a synthetic document for testing.\r\n" % number).encode()
+    if size > len(body):
+        body += line * ((size - len(body)) // len(line) + 1)
+        body = body[:size]
+    with open(os.path.join(directory, "rfc%d.txt" % number), "wb") as output:
+        output.write(body)
+    return hashlib.sha256(body).hexdigest()
+
+
+def file_hash(path):
+    """Returns the SHA-256 of a file in hex."""
+    digest = hashlib.sha256()
+    with open(path, "rb") as source:
+        for block in iter(lambda: source.read(1 << 20), b""):
+            digest.update(block)
+    return digest.hexdigest()
+
+
+class Response:
+    """One response: its status code, its text block and any body."""
+
+    def __init__(self, text, body=b""):
+        self.text = text
+        self.body = body
+        words = text.split()
+        self.status = int(words[1]) if len(words) > 1 and words[1].isdigit() else 0
+
+    def header(self, name):
+        for line in self.text.splitlines():
+            if line.startswith(name + ":"):
+                return line[len(name) + 1:].strip()
+        return None
+
+
+class Peer:
+    """
+    A client speaking the text protocol on a raw socket. It registers the
+    given records ('<path> rfc<N>.txt <N> [sha256:<hash>] <title>') and then
+    sends requests one at a time, its own port standing in for the OS line
+    where the protocol asks for it.
+    """
+
+    def __init__(self, port, records=(), os_name="Linux", host="127.0.0.1", source=None, tls=None):
+        # Any 127.x.y.z address is local, so a source address makes a distinct peer
+        self.sock = socket.create_connection((host, port), source_address=(source, 0) if source else None)
+        # Requests name the host the server resolves for the address
+        self.hostname = source or "localhost"
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        if tls is not None:
+            self.sock = tls.wrap_socket(self.sock, server_hostname="localhost")
+        self.port = self.sock.getsockname()[1]
+        lines = [os_name] + list(records) + ["END"]
+        self.sock.sendall(("\n".join(lines) + "\n").encode())
+
+    def close(self):
+        self.sock.close()
+
+    def send(self, line, third=None):
+        """Sends a request without reading its response."""
+        third = self.port if third is None else third
+        self.sock.sendall(("%s\n%s\n%s\n" % (line, self.hostname, third)).encode())
+
+    def read_exact(self, length):
+        data = bytearray()
+        while len(data) < length:
+            part = self.sock.recv(length - len(data))
+            if not part:
+                raise ConnectionError("server closed the connection")
+            data += part
+        return bytes(data)
+
+    def read_line(self):
+        line = bytearray()
+        while not line.endswith(b"\n"):
+            part = self.sock.recv(1)
+            if not part:
+                raise ConnectionError("server closed the connection")
+            line += part
+        return bytes(line)
+
+    def read_response(self):
+        """Reads one fixed size response block, and the body of a chunked GET."""
+        text = self.read_exact(BLOCK).split(b"\0", 1)[0].decode(errors="replace")
+        response = Response(text)
+        if response.header("Transfer-Encoding") == "chunked":
+            body = bytearray()
+            while True:
+                length = int(self.read_line(), 16)
+                if length == 0:
+                    break
+                body += self.read_exact(length)
+            if response.header("Content-Encoding") == "deflate":
+                body = zlib.decompress(bytes(body))
+            response.body = bytes(body)
+        return response
+
+    def request(self, line, third=None):
+        self.send(line, third)
+        return self.read_response()
+
+    def read_until(self, marker):
+        """Reads a streamed response such as LIST ALL up to its last line."""
+        data = bytearray()
+        while not data.endswith(marker):
+            part = self.sock.recv(65536)
+            if not part:
+                raise ConnectionError("server closed the connection")
+            data += part
+        return bytes(data)
+
+
+class Throttle:
+    """
+    A TCP relay to a server that paces the server's replies to a given rate,
+    standing in for a slow link where tc netem is not available. It counts
+    the bytes it relays each way.
+    """
+
+    def __init__(self, port, bytes_per_second):
+        self.target = port
+        self.rate = bytes_per_second
+        self.listener = socket.socket()
+        self.listener.bind(("127.0.0.1", 0))
+        self.listener.listen(64)
+        self.port = self.listener.getsockname()[1]
+        self.sent = 0
+        self.received = 0
+        threading.Thread(target=self.accept, daemon=True).start()
+
+    def accept(self):
+        while True:
+            try:
+                inside, _ = self.listener.accept()
+            except OSError:
+                return
+            outside = socket.create_connection(("127.0.0.1", self.target))
+            for sock in (inside, outside):
+                sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            threading.Thread(target=self.pump, args=(inside, outside, False), daemon=True).start()
+            threading.Thread(target=self.pump, args=(outside, inside, True), daemon=True).start()
+
+    def pump(self, source, destination, paced):
+        started = time.time()
+        relayed = 0
+        try:
+            while True:
+                data = source.recv(4096)
+                if not data:
+                    break
+                if paced:
+                    relayed += len(data)
+                    self.received += len(data)
+                    delay = started + relayed / self.rate - time.time()
+                    if delay > 0:
+                        time.sleep(delay)
+                    else:
+                        # An idle link does not bank credit for a later burst
+                        started -= delay
+                else:
+                    self.sent += len(data)
+                destination.sendall(data)
+        except OSError:
+            pass
+        for sock in (source, destination):
+            try:
+                sock.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+
+    def close(self):
+        self.listener.close()
+
+
+class Server:
+    """
+    A server process in a fresh directory. Client directories made with
+    client_dir are its children, as the protocol expects.
+    """
+
+    def __init__(self, *args, port=None, quiet=True, root=None, binary=None):
+        # Servers of one cluster share a directory, so each finds every holder's files
+        self.owns_root = root is None
+        self.root = root or tempfile.mkdtemp(prefix="p2p-")
+        self.port = port or free_port()
+        self.args = ["-p", str(self.port)] + [str(arg) for arg in args]
+        self.log_path = os.path.join(self.root, "server.log")
+        self.quiet = quiet
+        self.binary = binary
+        self.process = None
+
+    def start(self):
+        log = open(os.devnull if self.quiet else self.log_path, "wb")
+        self.process = subprocess.Popen([self.binary or SERVER] + self.args, cwd=self.root, stdout=log, stderr=subprocess.STDOUT,
+                                        stdin=subprocess.DEVNULL)
+        log.close()
+        deadline = time.time() + 10
+        while time.time() < deadline:
+            if self.process.poll() is not None:
+                raise RuntimeError("server exited with %d" % self.process.returncode)
+            try:
+                socket.create_connection(("127.0.0.1", self.port), timeout=1).close()
+                return self
+            except OSError:
+                time.sleep(0.05)
+        raise RuntimeError("server did not start listening")
+
+    def stop(self):
+        if self.process is not None and self.process.poll() is None:
+            self.process.send_signal(signal.SIGTERM)
+            try:
+                self.process.wait(timeout=40)
+            except subprocess.TimeoutExpired:
+                self.process.kill()
+                self.process.wait()
+        if self.owns_root:
+            shutil.rmtree(self.root, ignore_errors=True)
+
+    def __enter__(self):
+        return self.start()
+
+    def __exit__(self, *exc):
+        self.stop()
+
+    @property
+    def pid(self):
+        return self.process.pid
+
+    def alive(self):
+        return self.process.poll() is None
+
+    def peer(self, records=(), **options):
+        return Peer(self.port, records, **options)
+
+    def client_dir(self, name, rfcs=(), size=0):
+        """
+        Makes a client directory under the server's directory holding the
+        given rfcs, a list of (number, title). Returns its path.
+        """
+        directory = os.path.join(self.root, name)
+        os.makedirs(directory, exist_ok=True)
+        for number, title in rfcs:
+            write_rfc(directory, number, title, size)
+        return directory
+
+    def records(self, directory):
+        """Returns the registration records a client in directory would send."""
+        rows = []
+        for path in sorted(glob.glob(os.path.join(directory, "rfc*.txt"))):
+            name = os.path.basename(path)
+            with open(path, "rb") as source:
+                lines = source.read(8192).decode(errors="replace").splitlines()
+            # As the client reads it: the title follows the first two blank lines after the number
+            at = next(i for i, line in enumerate(lines) if "Request for Comments:" in line)
+            number = int(lines[at].split(":")[1].split()[0])
+            blank = 0
+            for at in range(at + 1, len(lines)):
+                if blank == 2:
+                    break
+                blank = blank + 1 if lines[at].strip() == "" else 0
+            title = " ".join(lines[at].split())
+            rows.append("%s %s %d sha256:%s %s" % (os.path.basename(directory), name, number, file_hash(path), title))
+        return rows
+
+    def client(self, directory, *args, timeout=300):
+        """Runs the client binary in script mode from directory and returns its output."""
+        command = [CLIENT] + [str(arg) for arg in args]
+        finished = subprocess.run(command, cwd=directory, stdin=subprocess.DEVNULL, stdout=subprocess.PIPE,
+                                  stderr=subprocess.STDOUT, timeout=timeout)
+        return finished.stdout.decode(errors="replace")
+
+    def dump(self, pid=None):
+        """Has the server write a registry snapshot and returns it parsed."""
+        directory = os.path.join(self.root, ".registry_dumps")
+        before = set(glob.glob(os.path.join(directory, "*")))
+        os.kill(pid or self.pid, signal.SIGUSR1)
+        deadline = time.time() + 10
+        while time.time() < deadline:
+            written = [path for path in glob.glob(os.path.join(directory, "*"))
+                       if path not in before and not path.endswith(".tmp")]
+            if written:
+                return read_dump(written[0])
+            time.sleep(0.05)
+        raise RuntimeError("no registry dump written")
+
+
+def worker_of(server, port, timeout=5):
+    """
+    Returns the worker whose socket is connected to a peer's local port,
+    waiting for a worker to accept the connection.
+    """
+    deadline = time.time() + timeout
+    while True:
+        inodes = set()
+        with open("/proc/net/tcp") as table:
+            for line in table.readlines()[1:]:
+                fields = line.split()
+                local, remote = fields[1].split(":")[1], fields[2].split(":")[1]
+                if int(local, 16) == server.port and int(remote, 16) == port:
+                    inodes.add("socket:[%s]" % fields[9])
+        with open("/proc/%d/task/%d/children" % (server.pid, server.pid)) as children:
+            for worker in children.read().split():
+                for fd in glob.glob("/proc/%s/fd/*" % worker):
+                    try:
+                        if os.readlink(fd) in inodes:
+                            return int(worker)
+                    except OSError:
+                        pass
+        if time.time() > deadline:
+            return None
+        time.sleep(0.01)
+
+
+def ring_hash(key):
+    """The server's consistent hash: FNV-1a and a final avalanche."""
+    value = 2166136261
+    for byte in key.encode():
+        value = ((value ^ byte) * 16777619) & 0xFFFFFFFF
+    value ^= value >> 16
+    value = (value * 0x85EBCA6B) & 0xFFFFFFFF
+    value ^= value >> 13
+    value = (value * 0xC2B2AE35) & 0xFFFFFFFF
+    return value ^ (value >> 16)
+
+
+def ring_owner(members, rfc_number, points=64):
+    """Returns the member of a -c list that owns an rfc number."""
+    ring = sorted((ring_hash("%s#%d" % (member, i)), member) for member in members for i in range(points))
+    key = ring_hash("RFC %d" % rfc_number)
+    for point, member in ring:
+        if point >= key:
+            return member
+    return ring[0][1]
+
+
+def script_summary(output):
+    """Picks the figures out of the summary a client script prints."""
+    figures = {}
+    for line in output.splitlines():
+        words = line.replace(",", "").split()
+        if "operations" in line and "failed" in line and "over" in line:
+            figures["operations"] = int(words[0])
+            figures["failed"] = int(words[2])
+            figures["seconds"] = float(words[4])
+        elif line.startswith("latency ms:"):
+            for name in ("min", "avg", "p50", "p99", "max"):
+                figures[name] = float(words[words.index(name) + 1])
+        elif "operations/s" in line:
+            figures["ops_per_second"] = float(words[0])
+            figures["bytes_per_response"] = float(words[2])
+    return figures
+
+
+def read_dump(path):
+    """Parses a registry dump into {table: {column: [values]}}."""
+    with open(path, "rb") as source:
+        data = source.read()
+    if data[:8] != b"P2PDUMP\0":
+        raise ValueError("not a registry dump")
+    at = 8
+    version, tables, _, _ = struct.unpack_from("<IIqQ", data, at)
+    at += struct.calcsize("<IIqQ")
+    parsed = {}
+    for _ in range(tables):
+        length = data[at]
+        name = data[at + 1:at + 1 + length].decode()
+        at += 1 + length
+        rows, columns = struct.unpack_from("<QI", data, at)
+        at += 12
+        table = {}
+        for _ in range(columns):
+            length = data[at]
+            column = data[at + 1:at + 1 + length].decode()
+            at += 1 + length
+            kind, size = struct.unpack_from("<BQ", data, at)
+            at += 9
+            values = data[at:at + size]
+            at += size
+            if kind == 1:
+                table[column] = list(struct.unpack_from("<%di" % rows, values))
+            elif kind == 2:
+                table[column] = list(struct.unpack_from("<%dq" % rows, values))
+            else:
+                offsets = struct.unpack_from("<%dI" % (rows + 1), values)
+                strings = values[4 * (rows + 1):]
+                table[column] = [strings[offsets[i]:offsets[i + 1]].decode() for i in range(rows)]
+        parsed[name] = table
+    return parsed
+
+
+def run(tests):
+    """Runs test functions, printing one line each. Exits 1 if any failed."""
+    failed = 0
+    for test in tests:
+        started = time.time()
+        try:
+            test()
+            print("PASS %s (%.1fs)" % (test.__name__, time.time() - started), flush=True)
+        except Exception as error:
+            failed += 1
+            print("FAIL %s: %s: %s" % (test.__name__, type(error).__name__, error), flush=True)
+    sys.exit(1 if failed else 0)
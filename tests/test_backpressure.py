@@ -0,0 +1,68 @@
+"""
+A client that keeps sending LIST ALL without reading any of the answers is
+not read from once its queue is full: the server's memory stays bounded
+while it pushes requests, another client on the same loop thread keeps
+being answered, and the slow client still gets whole answers once it reads.
+"""
+
+import time
+
+from harness import Server, check, proc_status, run
+
+RFCS = 20000
+PUSH_SECONDS = 5
+REQUEST = "LIST ALL P2P-CI/1.0 If-None-Match: 0\nlocalhost\n%d\n"
+
+
+def test_slow_reader_bounded():
+    with Server("-t", 1, "-r", 1000000, "-e", 1000000) as server:
+        holder = server.peer(["holder rfc%d.txt %d Backpressure title %d" % (n, n, n) for n in range(1, RFCS + 1)])
+        holder.request("LOOKUP RFC 1 P2P-CI/1.0")
+        other = server.peer()
+        other.request("LOOKUP RFC 1 P2P-CI/1.0")
+        slow = server.peer()
+        slow.request("LOOKUP RFC 1 P2P-CI/1.0")
+        rss_before = proc_status(server.pid, "VmRSS")
+
+        request = (REQUEST % slow.port).encode()
+        slow.sock.setblocking(False)
+        pushed = 0
+        pending = b""
+        rss_peak = rss_before
+        slowest = 0.0
+        deadline = time.time() + PUSH_SECONDS
+        while time.time() < deadline:
+            try:
+                pending = pending or request
+                pending = pending[slow.sock.send(pending):]
+                if not pending:
+                    pushed += 1
+                    continue
+            except BlockingIOError:
+                pass
+            started = time.perf_counter()
+            check("Backpressure title 7" in other.request("LOOKUP RFC 7 P2P-CI/1.0").text, "LOOKUP failed")
+            slowest = max(slowest, time.perf_counter() - started)
+            rss_peak = max(rss_peak, proc_status(server.pid, "VmRSS"))
+        # Every answer pushed would be about 900KB; they are never queued at once
+        check(pushed > 10, "only %d requests were taken" % pushed)
+        check(rss_peak - rss_before < 32 * 1024, "server grew from %dKB to %dKB" % (rss_before, rss_peak))
+        check(slowest < 0.5, "a LOOKUP waited %.3fs" % slowest)
+
+        # Answers follow each other, so read three whole ones in one go
+        slow.sock.setblocking(True)
+        data = bytearray()
+        while data.count(b"END\n") < 3:
+            part = slow.sock.recv(65536)
+            check(part, "server closed the connection")
+            data += part
+        for rows in data.decode().split("END\n")[:3]:
+            check(rows.count("Backpressure title") == RFCS, "LIST answer incomplete")
+        slow.close()
+        check(server.alive(), "server exited")
+        holder.close()
+        other.close()
+
+
+if __name__ == "__main__":
+    run([test_slow_reader_bounded])
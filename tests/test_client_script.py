@@ -0,0 +1,64 @@
+"""
+The client runs a script over a pool of connections: comment lines are
+skipped, every command before a WAIT finishes before any after it starts,
+the directory is registered and every ADD is sent on the first connection
+only, GETs on any connection save their files, and a failed command is
+counted in the summary and the exit status.
+"""
+
+import os
+import subprocess
+
+from harness import CLIENT, Server, check, file_hash, run, script_summary
+
+FILES = range(4700, 4708)
+SIZE = 64 << 10
+
+
+def test_script_phases():
+    with Server() as server:
+        directory = server.client_dir("holder", [(n, "Scripted document %d" % n) for n in FILES], SIZE)
+        digests = {n: file_hash(os.path.join(directory, "rfc%d.txt" % n)) for n in FILES}
+        holder = server.peer(server.records(directory))
+        holder.request("LOOKUP RFC %d P2P-CI/1.0" % FILES[0])
+        listener = server.peer()
+        check(listener.request("SUBSCRIBE ALL P2P-CI/1.0").status == 200, "SUBSCRIBE refused")
+        listener.sock.settimeout(10)
+
+        requester = server.client_dir("requester", [(4800, "Own document")], 4096)
+        script = os.path.join(server.root, "fetch.script")
+        with open(script, "w") as output:
+            output.write("# Fetch every file, then register them\n")
+            output.writelines("GET RFC %d P2P-CI/1.0\n" % n for n in FILES)
+            output.write("WAIT\n")
+            output.writelines("ADD RFC %d P2P-CI/1.0\n" % n for n in FILES)
+            output.write("WAIT\nLOOKUP RFC 4800 P2P-CI/1.0\nLOOKUP RFC 9999 P2P-CI/1.0\n")
+        finished = subprocess.run([CLIENT, "-f", script, "-c", "4", str(server.port)],
+                                  cwd=requester, stdin=subprocess.DEVNULL, stdout=subprocess.PIPE,
+                                  stderr=subprocess.STDOUT, timeout=120)
+        output = finished.stdout.decode(errors="replace")
+        summary = script_summary(output)
+        check(summary.get("operations") == 2 * len(FILES) + 2 and summary.get("failed") == 1, output[-500:])
+        check(finished.returncode == 1, "exit status %d with a failed command" % finished.returncode)
+
+        results = [line.split("<- ", 1)[1] for line in output.splitlines() if "<- " in line]
+        last_get = max(i for i, request in enumerate(results) if request.startswith("GET"))
+        first_add = min(i for i, request in enumerate(results) if request.startswith("ADD"))
+        check(last_get < first_add, "an ADD ran before every GET finished")
+        for n in FILES:
+            placed = os.path.join(requester, "rfc%d.txt" % n)
+            check(os.path.exists(placed) and file_hash(placed) == digests[n], "rfc%d.txt not saved whole" % n)
+
+        # Events name the connection each registration came from
+        sources = {}
+        while len(sources) < len(FILES) + 1:
+            words = listener.read_line().decode().split()
+            if words[1] == "ADD" and int(words[5]) != holder.port:
+                sources[int(words[3])] = int(words[5])
+        check(len(set(sources.values())) == 1, "registrations came from several connections: %s" % sources)
+        listener.close()
+        holder.close()
+
+
+if __name__ == "__main__":
+    run([test_script_phases])
@@ -0,0 +1,114 @@
+"""
+Clustered servers forward LOOKUP, GET and LIST to the member owning each
+RFC, and a member that stops answering holds up only the requests that
+need it, not the other clients of the same event loop. Only members may
+open a cluster link: a server started without -c, or a connection from an
+address no member has, is refused.
+"""
+
+import socket
+import threading
+import time
+
+from harness import Server, check, free_port, ring_owner, run
+
+SIZE = 4096
+
+
+def test_requests_forwarded_to_owner():
+    ports = [free_port() for _ in range(3)]
+    members = ",".join("localhost:%d" % port for port in ports)
+    first = Server("-c", members, port=ports[0]).start()
+    servers = [first] + [Server("-c", members, port=port, root=first.root).start() for port in ports[1:]]
+    try:
+        numbers = range(5000, 5030)
+        owners = {ring_owner(members.split(","), n) for n in numbers}
+        check(len(owners) == 3, "test RFCs all owned by %s" % owners)
+        directory = first.client_dir("holder", [(n, "Clustered document %d" % n) for n in numbers], SIZE)
+        holder = servers[0].peer(first.records(directory))
+        holder.request("LOOKUP RFC 5000 P2P-CI/1.0")
+
+        asker = servers[1].peer()
+        for n in numbers:
+            response = asker.request("LOOKUP RFC %d P2P-CI/1.0" % n)
+            check("Clustered document %d" % n in response.text, "LOOKUP %d: %s" % (n, response.text))
+        getter = servers[2].peer()
+        for n in numbers[:5]:
+            response = getter.request("GET RFC %d P2P-CI/1.0 Accept-Encoding: identity" % n, "Linux")
+            check(response.status == 200 and len(response.body) == SIZE, "GET %d: %s" % (n, response.text))
+        getter.send("LIST ALL P2P-CI/1.0 If-None-Match: 0")
+        rows = getter.read_until(b"END\n").decode()
+        for n in numbers:
+            check("RFC %d Clustered document %d" % (n, n) in rows, "LIST ALL lacks RFC %d" % n)
+
+        holder.close()
+        deadline = time.time() + 5
+        while "Clustered document" in asker.request("LOOKUP RFC 5001 P2P-CI/1.0").text:
+            check(time.time() < deadline, "rows of a disconnected holder kept")
+            time.sleep(0.05)
+    finally:
+        for server in servers:
+            server.stop()
+
+
+def test_silent_member_does_not_block_loop():
+    # A member that accepts links but never answers them
+    silent = socket.socket()
+    silent.bind(("127.0.0.1", 0))
+    silent.listen(64)
+    port = free_port()
+    members = ["localhost:%d" % port, "localhost:%d" % silent.getsockname()[1]]
+    local = next(n for n in range(6000, 7000) if ring_owner(members, n) == members[0])
+    remote = next(n for n in range(6000, 7000) if ring_owner(members, n) == members[1])
+    with Server("-c", ",".join(members), "-t", 1, port=port) as server:
+        holder = server.peer(["holder rfc%d.txt %d Local document" % (local, local)])
+        holder.request("LOOKUP RFC %d P2P-CI/1.0" % local)
+
+        stuck = server.peer()
+        waiting = threading.Thread(target=stuck.request, args=("LOOKUP RFC %d P2P-CI/1.0" % remote,))
+        waiting.daemon = True
+        waiting.start()
+        time.sleep(0.3)
+        other = server.peer()
+        started = time.time()
+        response = other.request("LOOKUP RFC %d P2P-CI/1.0" % local)
+        elapsed = time.time() - started
+        check("Local document" in response.text, response.text)
+        check(elapsed < 1, "LOOKUP waited %.1fs behind the silent member" % elapsed)
+        # Links still queued are reset, so the stop does not wait out their timeouts
+        silent.close()
+
+
+def refused(port, source):
+    """Opens a cluster link from source and asks for every row, returns True if refused."""
+    link = socket.create_connection(("127.0.0.1", port), source_address=(source, 0))
+    link.sendall(b"PEER P2P-CI/1.0\nLIST ALL\n")
+    link.settimeout(5)
+    answer = bytearray()
+    while True:
+        part = link.recv(4096)
+        if not part:
+            break
+        answer += part
+    link.close()
+    return answer.startswith(b"P2P-CI/1.0 400") and b"Linked document" not in answer
+
+
+def test_links_only_from_members():
+    with Server() as server:
+        holder = server.peer(["holder rfc7000.txt 7000 Linked document"])
+        holder.request("LOOKUP RFC 7000 P2P-CI/1.0")
+        check(refused(server.port, "127.0.0.1"), "a server without -c served a cluster link")
+        holder.close()
+    ports = [free_port() for _ in range(2)]
+    members = ",".join("localhost:%d" % port for port in ports)
+    with Server("-c", members, port=ports[0]) as server:
+        holder = server.peer(["holder rfc7000.txt 7000 Linked document"])
+        holder.request("LOOKUP RFC 7000 P2P-CI/1.0")
+        check(refused(server.port, "127.0.0.2"), "a link from an address no member has was served")
+        check(server.alive(), "server exited")
+        holder.close()
+
+
+if __name__ == "__main__":
+    run([test_requests_forwarded_to_owner, test_silent_member_does_not_block_loop, test_links_only_from_members])
@@ -0,0 +1,55 @@
+"""
+Deflate GET bodies match the file, also once they come from the cache,
+and a file rewritten within the same second is not served from a body
+cached for its old content.
+"""
+
+import os
+import time
+
+from harness import Server, check, file_hash, run, write_rfc
+
+SIZE = 65536
+
+
+def get_deflate(peer, number):
+    response = peer.request("GET RFC %d P2P-CI/1.0 Accept-Encoding: deflate" % number, "Linux")
+    check(response.status == 200 and response.header("Content-Encoding") == "deflate", response.text)
+    return response.body
+
+
+def test_cached_body_follows_rewrite():
+    with Server("-e", 1000) as server:
+        directory = server.client_dir("holder", [(7000, "Compressed document")], SIZE)
+        path = os.path.join(directory, "rfc7000.txt")
+        with open(path, "rb") as source:
+            original = source.read()
+        holder = server.peer(server.records(directory))
+        requester = server.peer()
+        for _ in range(3):
+            check(get_deflate(requester, 7000) == original, "deflate body differs from the file")
+
+        holder.close()
+        deadline = time.time() + 5
+        while holder.port in server.dump()["clients"]["port"]:
+            check(time.time() < deadline, "holder still registered")
+            time.sleep(0.05)
+        # Same length, and the same second of modification time
+        stat = os.stat(path)
+        write_rfc(directory, 7000, "Compressed document, revised", SIZE)
+        second = stat.st_mtime_ns - stat.st_mtime_ns % 1000000000
+        os.utime(path, ns=(stat.st_atime_ns, second + (stat.st_mtime_ns + 1) % 1000000000))
+        check(os.path.getsize(path) == SIZE, "rewritten file changed length")
+        with open(path, "rb") as source:
+            revised = source.read()
+        check(revised != original, "rewrite did not change the file")
+
+        holder = server.peer(server.records(directory))
+        holder.request("LOOKUP RFC 7000 P2P-CI/1.0")
+        for _ in range(3):
+            body = get_deflate(requester, 7000)
+            check(body == revised, "stale deflate body served, hash %s" % file_hash(path))
+
+
+if __name__ == "__main__":
+    run([test_cached_body_follows_rewrite])
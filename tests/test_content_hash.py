@@ -0,0 +1,46 @@
+"""
+A holder's file is served only while it has the hash registered for it,
+also after it has been checked once and then changed.
+"""
+
+import os
+
+from harness import Server, check, run, write_rfc
+
+SIZE = 8192
+
+
+def get(server, number):
+    # A failed GET ends the connection, so each one gets its own
+    peer = server.peer()
+    response = peer.request("GET RFC %d P2P-CI/1.0 Accept-Encoding: identity" % number, "Linux")
+    peer.close()
+    return response
+
+
+def test_changed_file_not_served():
+    with Server("-e", 1000) as server:
+        directory = server.client_dir("holder", [(9100, "Hashed document")], SIZE)
+        holder = server.peer(server.records(directory))
+        path = os.path.join(directory, "rfc9100.txt")
+        with open(path, "rb") as source:
+            original = source.read()
+        response = get(server, 9100)
+        check(response.status == 200 and response.body == original, response.text)
+
+        write_rfc(directory, 9100, "Hashed document, edited", SIZE)
+        os.utime(path, ns=(0, os.stat(path).st_mtime_ns + 1000000000))
+        check(get(server, 9100).status == 404, "edited file served")
+        write_rfc(directory, 9100, "Hashed document, edited again", SIZE)
+        os.utime(path, ns=(0, os.stat(path).st_mtime_ns + 1000000000))
+        check(get(server, 9100).status == 404, "file edited twice served")
+
+        with open(path, "wb") as output:
+            output.write(original)
+        response = get(server, 9100)
+        check(response.status == 200 and response.body == original, "restored file not served: " + response.text)
+        holder.close()
+
+
+if __name__ == "__main__":
+    run([test_changed_file_not_served])
@@ -0,0 +1,99 @@
+"""
+DUMP writes a snapshot while LOOKUP and ADD traffic carries on: LOOKUPs
+from another client on the same loop thread are answered while 100k rows
+are copied, holders keep adding rows, and every file written holds every
+row registered before its DUMP with the row counts its response gave. A
+DUMP once the traffic stops is of one instant.
+"""
+
+import os
+import threading
+import time
+
+from harness import Server, check, read_dump, run
+
+ROWS = 100000
+DUMPS = 5
+
+
+def test_dump_during_traffic():
+    with Server("-t", 1, "-r", 1000000, "-e", 1000000) as server:
+        holder = server.peer(["holder rfc%d.txt %d Dumped title %d" % (n, n, n) for n in range(1, ROWS + 1)])
+        holder.request("LOOKUP RFC 1 P2P-CI/1.0")
+        adder = server.peer(["adder rfc%d.txt %d Adder title" % (ROWS + 1, ROWS + 1)])
+        adder.request("LOOKUP RFC 1 P2P-CI/1.0")
+
+        stop = threading.Event()
+        failures = []
+        counts = {"lookups": 0, "adds": 0}
+        slowest = [0.0]
+
+        def looker():
+            peer = server.peer()
+            number = 0
+            while not stop.is_set():
+                number = number % ROWS + 1
+                started = time.perf_counter()
+                response = peer.request("LOOKUP RFC %d P2P-CI/1.0" % number)
+                slowest[0] = max(slowest[0], time.perf_counter() - started)
+                if "Dumped title %d" % number not in response.text:
+                    failures.append(response.text)
+                counts["lookups"] += 1
+            peer.close()
+
+        def adding():
+            number = 0
+            while not stop.is_set():
+                number = number % ROWS + 1
+                if "Title:" not in adder.request("ADD RFC %d P2P-CI/1.0" % number).text:
+                    failures.append("ADD RFC %d failed" % number)
+                counts["adds"] += 1
+
+        threads = [threading.Thread(target=looker), threading.Thread(target=adding)]
+        for thread in threads:
+            thread.start()
+        dumper = server.peer()
+        answers = []
+        dump_seconds = 0.0
+        for _ in range(DUMPS):
+            before = dict(counts)
+            started = time.perf_counter()
+            response = dumper.request("DUMP REGISTRY P2P-CI/1.0")
+            dump_seconds += time.perf_counter() - started
+            check(response.status == 200, response.text)
+            answers.append((response, before["adds"]))
+        stop.set()
+        for thread in threads:
+            thread.join()
+        check(not failures, failures[:1])
+        check(counts["lookups"] > DUMPS, "only %d LOOKUPs answered during %d DUMPs" % (counts["lookups"], DUMPS))
+        check(counts["adds"] > DUMPS, "only %d ADDs answered during %d DUMPs" % (counts["adds"], DUMPS))
+        # One shard of 16 is locked at a time and the loop never waits on the copy
+        check(slowest[0] < dump_seconds / DUMPS, "a LOOKUP waited %.3fs, a DUMP takes %.3fs" % (slowest[0], dump_seconds / DUMPS))
+        # Nothing changes now, so the copy is of one instant
+        response = dumper.request("DUMP REGISTRY P2P-CI/1.0")
+        check(response.header("Consistent") == "instant", response.text)
+        answers.append((response, counts["adds"]))
+
+        for response, adds_before in answers:
+            path = os.path.join(server.root, response.header("File"))
+            deadline = time.time() + 10
+            while not os.path.exists(path):
+                check(time.time() < deadline, "%s not written" % path)
+                time.sleep(0.05)
+            dump = read_dump(path)
+            rfcs = dump["rfcs"]
+            check(len(rfcs["rfc_number"]) == int(response.header("RFCs")), "row count differs from the response")
+            check(len(dump["clients"]["port"]) == int(response.header("Clients")), "client count differs from the response")
+            check(response.header("Consistent") in ("instant", "shard"), response.text)
+            holder_rows = {n for n, port in zip(rfcs["rfc_number"], rfcs["port"]) if port == holder.port}
+            check(len(holder_rows) == ROWS, "dump has %d of the holder's %d rows" % (len(holder_rows), ROWS))
+            added = sum(1 for port in rfcs["port"] if port == adder.port)
+            check(added >= min(adds_before, ROWS), "dump has %d added rows, %d were added before it" % (added, adds_before))
+        dumper.close()
+        holder.close()
+        adder.close()
+
+
+if __name__ == "__main__":
+    run([test_dump_during_traffic])
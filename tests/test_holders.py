@@ -0,0 +1,49 @@
+"""
+GET spreads downloads over the peers holding an RFC and skips holders that
+have disconnected.
+"""
+
+import os
+import time
+
+from harness import Server, check, run
+
+SIZE = 8192
+
+
+def test_downloads_spread_over_holders():
+    with Server("-e", 1000) as server:
+        holders = []
+        for index in range(4):
+            directory = server.client_dir("holder%d" % index, [(4000, "Shared document")], SIZE)
+            holders.append(server.peer(server.records(directory)))
+        requester = server.peer()
+        for _ in range(40):
+            response = requester.request("GET RFC 4000 P2P-CI/1.0 Accept-Encoding: identity", "Linux")
+            check(response.status == 200 and len(response.body) == SIZE, response.text)
+        clients = server.dump()["clients"]
+        served = dict(zip(clients["port"], clients["bytes_served"]))
+        loads = [served[holder.port] for holder in holders]
+        check(min(loads) > 0, "a holder served nothing: %s" % loads)
+        check(max(loads) <= 2 * min(loads), "holders unevenly loaded: %s" % loads)
+
+
+def test_disconnected_holder_skipped():
+    with Server() as server:
+        first = server.peer(server.records(server.client_dir("first", [(4001, "Document")], SIZE)))
+        second = server.peer(server.records(server.client_dir("second", [(4001, "Document")], SIZE)))
+        requester = server.peer()
+        check(requester.request("GET RFC 4001 P2P-CI/1.0 Accept-Encoding: identity", "Linux").status == 200, "first GET")
+        first.close()
+        os.remove(os.path.join(server.root, "first", "rfc4001.txt"))
+        deadline = time.time() + 5
+        while first.port in server.dump()["clients"]["port"]:
+            check(time.time() < deadline, "first holder still registered")
+            time.sleep(0.05)
+        for _ in range(5):
+            response = requester.request("GET RFC 4001 P2P-CI/1.0 Accept-Encoding: identity", "Linux")
+            check(response.status == 200 and len(response.body) == SIZE, response.text)
+
+
+if __name__ == "__main__":
+    run([test_downloads_spread_over_holders, test_disconnected_holder_skipped])
@@ -0,0 +1,55 @@
+"""
+Range and batch LOOKUP streams one row per registered rfc in the selector,
+in ascending order and once each however the items overlap, followed by
+END. A malformed selector is answered 400 with no rows and the connection
+stays usable.
+"""
+
+from harness import Server, check, run
+
+ROWS = 5000
+
+
+def rows(peer, selector):
+    """Sends a range LOOKUP and returns its status line and row numbers."""
+    peer.send("LOOKUP RFC %s P2P-CI/1.0" % selector)
+    lines = peer.read_until(b"END\n").decode().splitlines()
+    check(lines[-1] == "END", "response does not end with END")
+    numbers = []
+    for line in lines[1:-1]:
+        words = line.split()
+        check(words[0] == "RFC" and " ".join(words[2:]) == "Ranged title %s" % words[1], "bad row %r" % line)
+        numbers.append(int(words[1]))
+    return lines[0], numbers
+
+
+def test_ranges_and_batches():
+    with Server() as server:
+        # Even numbers only, so the ranges have gaps
+        holder = server.peer(["holder rfc%d.txt %d Ranged title %d" % (n, n, n) for n in range(2, 2 * ROWS + 1, 2)])
+        holder.request("LOOKUP RFC 2 P2P-CI/1.0")
+        status, numbers = rows(holder, "10-20")
+        check(status == "P2P-CI/1.0 200 OK", status)
+        check(numbers == [10, 12, 14, 16, 18, 20], numbers)
+        status, numbers = rows(holder, "40-45,7,15-25,4,20-30")
+        check(numbers == [4] + list(range(16, 31, 2)) + [40, 42, 44], numbers)
+        # Far more rows than fit in one chunk
+        status, numbers = rows(holder, "1-%d" % (2 * ROWS))
+        check(numbers == list(range(2, 2 * ROWS + 1, 2)), "whole range returned %d rows" % len(numbers))
+        status, numbers = rows(holder, "%d-%d" % (2 * ROWS + 1, 3 * ROWS))
+        check(status == "P2P-CI/1.0 200 OK" and numbers == [], numbers)
+        holder.close()
+
+
+def test_malformed_selector():
+    with Server() as server:
+        peer = server.peer(["holder rfc1.txt 1 Ranged title 1"])
+        for selector in ("5-1", "1,,2", "1-", "a-b", "1-2x"):
+            status, numbers = rows(peer, selector)
+            check(status == "P2P-CI/1.0 400 Bad Request" and numbers == [], "%r answered %r" % (selector, status))
+        check("Ranged title 1" in peer.request("LOOKUP RFC 1 P2P-CI/1.0").text, "connection unusable after a 400")
+        peer.close()
+
+
+if __name__ == "__main__":
+    run([test_ranges_and_batches, test_malformed_selector])
@@ -0,0 +1,40 @@
+"""
+LOOKUP with Prefer: nearest names a holder on the client's own address
+first, then one in the client's /24, whichever holder the plain LOOKUP
+would pick. Holders are loopback aliases, so each has an address of its own.
+"""
+
+from harness import Server, check, run
+
+HOLDERS = ("127.0.0.2", "127.0.0.3", "127.0.1.9")
+
+
+def holder_of(peer, preference=""):
+    response = peer.request("LOOKUP RFC 1 P2P-CI/1.0%s" % preference)
+    check(response.status == 0 and "Near title" in response.text, response.text)
+    return response.header("Holder").split()[0]
+
+
+def test_nearest_holder_preferred():
+    with Server() as server:
+        holders = []
+        for address in HOLDERS:
+            holders.append(server.peer(["holder rfc1.txt 1 Near title"], source=address))
+            holders[-1].request("LOOKUP RFC 1 P2P-CI/1.0")
+        plain = set()
+        for requester, nearest in (("127.0.0.2", "127.0.0.2"), ("127.0.0.3", "127.0.0.3"),
+                                   ("127.0.1.9", "127.0.1.9"), ("127.0.1.5", "127.0.1.9")):
+            peer = server.peer(source=requester)
+            for _ in range(5):
+                chosen = holder_of(peer, " Prefer: nearest")
+                check(chosen == nearest, "%s was sent to %s instead of %s" % (requester, chosen, nearest))
+            plain.add(holder_of(peer))
+            peer.close()
+        # Without the preference the same holder serves every client
+        check(len(plain) == 1, "plain LOOKUP depends on the client: %s" % plain)
+        for holder in holders:
+            holder.close()
+
+
+if __name__ == "__main__":
+    run([test_nearest_holder_preferred])
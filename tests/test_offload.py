@@ -0,0 +1,72 @@
+"""
+Reading whole files for a request runs beside the event loop: while the
+first GET of a large file hashes it, and while the first placement copies
+it into the store, LOOKUPs from another client on the same loop thread
+keep being answered.
+"""
+
+import threading
+import time
+
+from harness import Server, check, run
+
+SIZE = 256 << 20
+
+
+def lookups_during(server, action):
+    """Runs action in a thread, returns its seconds and the slowest LOOKUP meanwhile in seconds."""
+    peer = server.peer()
+    peer.request("LOOKUP RFC 1 P2P-CI/1.0")
+    timing = {}
+
+    def timed():
+        started = time.perf_counter()
+        action()
+        timing["seconds"] = time.perf_counter() - started
+
+    thread = threading.Thread(target=timed)
+    thread.start()
+    slowest = 0.0
+    while thread.is_alive():
+        started = time.perf_counter()
+        peer.request("LOOKUP RFC 1 P2P-CI/1.0")
+        slowest = max(slowest, time.perf_counter() - started)
+    thread.join()
+    peer.close()
+    return timing["seconds"], slowest
+
+
+def test_hashing_does_not_block_loop():
+    with Server("-t", 1, "-r", 100000, "-e", 1000) as server:
+        directory = server.client_dir("holder", [(1, "Large hashed document")], SIZE)
+        holder = server.peer(server.records(directory))
+        requester = server.peer()
+        holder.request("LOOKUP RFC 1 P2P-CI/1.0")
+        responses = []
+        # Only the last bytes are sent, so the time goes to hashing the file
+        request = "GET RFC 1 P2P-CI/1.0 Accept-Encoding: identity Range: bytes=%d-" % (SIZE - 16)
+        seconds, slowest = lookups_during(server, lambda: responses.append(requester.request(request, "Linux")))
+        check(responses[0].status == 206, responses[0].text)
+        check(slowest < seconds / 4, "a LOOKUP waited %.3fs of the %.3fs GET" % (slowest, seconds))
+        holder.close()
+
+
+def test_placement_does_not_block_loop():
+    with Server("-t", 1, "-r", 100000, "-e", 1000) as server:
+        directory = server.client_dir("holder", [(1, "Large placed document")], SIZE)
+        holder = server.peer(server.records(directory))
+        server.client_dir("requester")
+        requester = server.peer(["requester rfc2.txt 2 Requester document"])
+        holder.request("LOOKUP RFC 1 P2P-CI/1.0")
+        # Hashed here, so the placement below only copies
+        request = "GET RFC 1 P2P-CI/1.0 Accept-Encoding: identity Range: bytes=%d-" % (SIZE - 16)
+        check(requester.request(request, "Linux").status == 206, "ranged GET failed")
+        responses = []
+        seconds, slowest = lookups_during(server, lambda: responses.append(requester.request("GET RFC 1 P2P-CI/1.0", "Linux")))
+        check(responses[0].status == 200, responses[0].text)
+        check(slowest < seconds / 4, "a LOOKUP waited %.3fs of the %.3fs GET" % (slowest, seconds))
+        holder.close()
+
+
+if __name__ == "__main__":
+    run([test_hashing_does_not_block_loop, test_placement_does_not_block_loop])
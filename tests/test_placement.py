@@ -0,0 +1,56 @@
+"""
+GET without Accept-Encoding places the file in the requester's directory
+through .rfc_store. A placement that fails is answered with a 500 and the
+server keeps serving, and workers placing the same new file at once each
+stage their own copy.
+"""
+
+import os
+import threading
+
+from harness import Server, check, file_hash, run
+
+SIZE = 4 << 20
+
+
+def test_failed_placement_answers_500():
+    with Server() as server:
+        holder = server.peer(server.records(server.client_dir("holder", [(8000, "Placed document")], 4096)))
+        # The requester's directory does not exist, so nothing can be placed in it
+        requester = server.peer(["missing rfc1.txt 8001 Requester document"])
+        response = requester.request("GET RFC 8000 P2P-CI/1.0", "Linux")
+        check(response.status == 500, response.text)
+        check(server.alive(), "server exited")
+        check("Placed document" in requester.request("LOOKUP RFC 8000 P2P-CI/1.0").text, "server stopped answering")
+        holder.close()
+
+
+def test_concurrent_placement_across_workers():
+    with Server("-w", 2, "-e", 1000) as server:
+        directory = server.client_dir("holder", [(8100, "Large placed document")], SIZE)
+        digest = file_hash(os.path.join(directory, "rfc8100.txt"))
+        holder = server.peer(server.records(directory))
+        requesters = []
+        for index in range(8):
+            server.client_dir("requester%d" % index)
+            requesters.append(server.peer(["requester%d rfc1.txt %d Requester document" % (index, 8200 + index)]))
+        for requester in requesters:
+            requester.request("LOOKUP RFC 8100 P2P-CI/1.0")
+        responses = []
+        threads = [threading.Thread(target=lambda peer=peer: responses.append(peer.request("GET RFC 8100 P2P-CI/1.0", "Linux")))
+                   for peer in requesters]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        check(all(response.status == 200 for response in responses), [r.text.splitlines()[:1] for r in responses])
+        for index in range(8):
+            placed = os.path.join(server.root, "requester%d" % index, "rfc8100.txt")
+            check(file_hash(placed) == digest, "requester%d got a corrupt copy" % index)
+        store = os.listdir(os.path.join(server.root, ".rfc_store"))
+        check(store == [digest], "store holds %s" % store)
+        holder.close()
+
+
+if __name__ == "__main__":
+    run([test_failed_placement_answers_500, test_concurrent_placement_across_workers])
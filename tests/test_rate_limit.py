@@ -0,0 +1,44 @@
+"""
+Rate limits belong to the peer address: connections from one address,
+spread over two workers, share one budget, while another address keeps
+its own.
+"""
+
+import time
+
+from harness import Server, check, run
+
+RATE = 20
+CONNECTIONS = 4
+LOOKUPS = 30
+
+
+def admitted(peers):
+    """Sends LOOKUPS on each peer in turn, returns how many were not refused."""
+    count = 0
+    for _ in range(LOOKUPS):
+        for peer in peers:
+            if peer.request("LOOKUP RFC 1 P2P-CI/1.0").status != 429:
+                count += 1
+    return count
+
+
+def test_limit_shared_by_address():
+    with Server("-w", 2, "-r", RATE) as server:
+        holder = server.peer(["holder rfc1.txt 1 Limited title"], source="127.0.0.3")
+        holder.request("LOOKUP RFC 1 P2P-CI/1.0")
+        peers = [server.peer() for _ in range(CONNECTIONS)]
+        started = time.time()
+        count = admitted(peers)
+        elapsed = time.time() - started
+        # The burst is two seconds' worth, then RATE a second for the address
+        allowed = 2 * RATE + RATE * elapsed + 2
+        check(count <= allowed, "%d of %d LOOKUPs admitted in %.2fs" % (count, CONNECTIONS * LOOKUPS, elapsed))
+        other = server.peer(source="127.0.0.2")
+        check("Limited title" in other.request("LOOKUP RFC 1 P2P-CI/1.0").text, "another address was limited")
+        for peer in peers + [other, holder]:
+            peer.close()
+
+
+if __name__ == "__main__":
+    run([test_limit_shared_by_address])
@@ -0,0 +1,42 @@
+"""
+Registration lines are parsed within their buffers: RFC numbers of six and
+more digits register and are fetched by name, and a line whose path or file
+name is too long is answered 400 without taking the server down.
+"""
+
+from harness import Server, check, run
+
+SIZE = 4096
+
+
+def test_large_numbers_register():
+    with Server() as server:
+        numbers = (9999, 10000, 100000, 2147483647)
+        directory = server.client_dir("holder", [(n, "Large number %d" % n) for n in numbers], SIZE)
+        holder = server.peer(server.records(directory))
+        for number in numbers:
+            response = holder.request("LOOKUP RFC %d P2P-CI/1.0" % number)
+            check("Large number %d" % number in response.text, response.text)
+        requester = server.peer()
+        response = requester.request("GET RFC 100000 P2P-CI/1.0 Accept-Encoding: identity", "Linux")
+        check(response.status == 200 and len(response.body) == SIZE, response.text)
+        holder.close()
+        requester.close()
+
+
+def test_long_names_rejected():
+    with Server() as server:
+        for record in ("holder rfc%s.txt 1 Long name" % ("1" * 60),
+                       "%s rfc1.txt 1 Long path" % ("p" * 40),
+                       "holder rfc1.txt"):
+            peer = server.peer([record])
+            check(peer.read_response().status == 400, "%r was not rejected" % record)
+            peer.close()
+        check(server.alive(), "server exited")
+        peer = server.peer()
+        check(peer.request("LOOKUP RFC 1 P2P-CI/1.0").status == 404, "server stopped answering")
+        peer.close()
+
+
+if __name__ == "__main__":
+    run([test_large_numbers_register, test_long_names_rejected])
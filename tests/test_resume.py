@@ -0,0 +1,59 @@
+"""
+A GET cut off by killing the client mid-transfer leaves its partial file
+and progress record, and running the same GET again fetches only the rest
+and ends with the whole file, checked against its hash.
+"""
+
+import os
+import signal
+import subprocess
+import time
+
+from harness import CLIENT, Server, Throttle, check, file_hash, run, write_rfc
+
+SIZE = 16 << 20
+RATE = 4 << 20
+
+
+def test_killed_get_resumes():
+    with Server("-e", 1000) as server:
+        directory = server.client_dir("holder")
+        write_rfc(directory, 4600, "Resumed document", 4096)
+        # Random bytes, so deflate cannot shrink the transfer out of the slow link's reach
+        with open(os.path.join(directory, "rfc4600.txt"), "ab") as output:
+            output.write(os.urandom(SIZE))
+        digest = file_hash(os.path.join(directory, "rfc4600.txt"))
+        holder = server.peer(server.records(directory))
+        holder.request("LOOKUP RFC 1 P2P-CI/1.0")
+
+        requester = server.client_dir("requester", [(4601, "Requester document")], 4096)
+        part = os.path.join(requester, "rfc4600.txt.part")
+        throttle = Throttle(server.port, RATE)
+        client = subprocess.Popen([CLIENT, str(throttle.port), "GET RFC 4600 P2P-CI/1.0"], cwd=requester,
+                                  stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        deadline = time.time() + 10
+        while not os.path.exists(part) or os.path.getsize(part) < SIZE // 4:
+            check(client.poll() is None, "client finished before it could be killed")
+            check(time.time() < deadline, "no partial file written")
+            time.sleep(0.01)
+        client.send_signal(signal.SIGKILL)
+        client.wait()
+        throttle.close()
+        kept = os.path.getsize(part)
+        check(kept < SIZE, "whole file arrived before the kill")
+        check(os.path.exists(os.path.join(requester, "rfc4600.txt.progress")), "no progress record kept")
+
+        counter = Throttle(server.port, 1 << 30)
+        output = server.client(requester, counter.port, "GET RFC 4600 P2P-CI/1.0")
+        counter.close()
+        placed = os.path.join(requester, "rfc4600.txt")
+        check(os.path.exists(placed), "resumed GET did not finish: " + output[-300:])
+        check(file_hash(placed) == digest, "resumed file has the wrong hash")
+        check(not os.path.exists(part), "partial file left behind")
+        check(counter.received < SIZE - kept + SIZE // 8,
+              "resumed GET fetched %d bytes with %d of %d kept" % (counter.received, kept, SIZE))
+        holder.close()
+
+
+if __name__ == "__main__":
+    run([test_killed_get_resumes])
@@ -0,0 +1,85 @@
+"""
+SUBSCRIBE connections are sent an EVENT line for every registration and
+removal they cover, whichever worker the change was made through. A range
+subscription only hears of its own rfcs, and UNSUBSCRIBE stops the events.
+"""
+
+import socket
+import time
+
+from harness import Server, check, run, worker_of
+
+ATTEMPTS = 40
+
+
+def subscriber(server, selector="ALL"):
+    peer = server.peer()
+    check(peer.request("SUBSCRIBE %s P2P-CI/1.0" % selector).status == 200, "SUBSCRIBE refused")
+    # A missing event fails the test instead of hanging it
+    peer.sock.settimeout(5)
+    return peer
+
+
+def test_range_subscription():
+    with Server() as server:
+        listener = subscriber(server, "RFC 1-10,20")
+        holder = server.peer(["holder rfc%d.txt %d Watched title %d" % (n, n, n) for n in (5, 15, 20)])
+        holder.request("LOOKUP RFC 5 P2P-CI/1.0")
+        for number in (5, 20):
+            line = listener.read_line().decode()
+            check(line == "EVENT ADD RFC %d localhost %d\n" % (number, holder.port), line)
+        # RFC 15 is outside the subscription, the next thing read is the response
+        check(listener.request("UNSUBSCRIBE ALL P2P-CI/1.0").status == 200, "UNSUBSCRIBE refused")
+        holder.close()
+        deadline = time.time() + 5
+        while True:
+            response = listener.request("LOOKUP RFC 5 P2P-CI/1.0")
+            check(response.status in (200, 404), "event sent after UNSUBSCRIBE: %r" % response.text)
+            if response.status == 404:
+                break
+            check(time.time() < deadline, "holder not removed")
+            time.sleep(0.05)
+        listener.sock.settimeout(0.3)
+        try:
+            late = listener.sock.recv(512)
+        except socket.timeout:
+            late = b""
+        check(late == b"", "event sent after UNSUBSCRIBE: %r" % late)
+        listener.close()
+
+
+def test_events_from_other_workers():
+    with Server("-w", 2) as server:
+        holder = server.peer(["holder rfc1.txt 1 Spread title"])
+        holder.request("LOOKUP RFC 1 P2P-CI/1.0")
+        adder = server.peer()
+        adder_worker = worker_of(server, adder.port)
+        check(adder_worker is not None, "adder's worker not found")
+        # Connections are spread by the kernel, so subscribe until one lands on each worker
+        subscribers = {}
+        for _ in range(ATTEMPTS):
+            peer = subscriber(server)
+            worker = worker_of(server, peer.port)
+            if worker in subscribers:
+                peer.close()
+            else:
+                subscribers[worker] = peer
+            if len(subscribers) == 2:
+                break
+        check(len(subscribers) == 2 and adder_worker in subscribers, "subscribers did not reach both workers")
+
+        check("Spread title" in adder.request("ADD RFC 1 P2P-CI/1.0").text, "ADD failed")
+        adder.close()
+        for event in ("ADD", "DEL"):
+            expected = "EVENT %s RFC 1 localhost %d\n" % (event, adder.port)
+            for worker, peer in subscribers.items():
+                line = peer.read_line().decode()
+                check(line == expected, "subscriber on %s worker got %r for %s" %
+                      ("the adder's" if worker == adder_worker else "the other", line, event))
+        for peer in subscribers.values():
+            peer.close()
+        holder.close()
+
+
+if __name__ == "__main__":
+    run([test_range_subscription, test_events_from_other_workers])
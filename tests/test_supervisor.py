@@ -0,0 +1,86 @@
+"""
+The -w supervisor acts on every signal: a SIGTERM sent right behind a
+SIGUSR1 still stops the server, and a worker that dies is replaced while
+snapshots keep being written. Every worker answers for every registration,
+and a worker that dies only takes its own clients' registrations with it.
+"""
+
+import os
+import signal
+import subprocess
+import time
+
+from harness import Server, check, run, worker_of
+
+ROUNDS = 5
+
+
+def workers(pid):
+    with open("/proc/%d/task/%d/children" % (pid, pid)) as children:
+        return set(int(child) for child in children.read().split())
+
+
+def test_term_behind_usr1_stops():
+    for _ in range(ROUNDS):
+        with Server("-w", 2) as server:
+            server.peer().request("LOOKUP RFC 1 P2P-CI/1.0")
+            os.kill(server.pid, signal.SIGUSR1)
+            os.kill(server.pid, signal.SIGTERM)
+            try:
+                server.process.wait(timeout=10)
+            except subprocess.TimeoutExpired:
+                check(False, "SIGTERM right after SIGUSR1 was lost")
+
+
+def test_dead_worker_replaced():
+    with Server("-w", 2) as server:
+        deadline = time.time() + 5
+        while len(workers(server.pid)) < 2:
+            check(time.time() < deadline, "workers did not start")
+            time.sleep(0.05)
+        started = workers(server.pid)
+        victim = min(started)
+        os.kill(victim, signal.SIGKILL)
+        dump = server.dump()
+        check("clients" in dump, "no snapshot after a worker died")
+        deadline = time.time() + 5
+        while len(workers(server.pid) - {victim}) < 2 or victim in workers(server.pid):
+            check(time.time() < deadline, "worker %d not replaced: %s" % (victim, workers(server.pid)))
+            time.sleep(0.05)
+        peer = server.peer()
+        check(peer.request("LOOKUP RFC 1 P2P-CI/1.0").status == 404, "replaced workers do not answer")
+        peer.close()
+
+
+def test_registry_shared_by_workers():
+    with Server("-w", 2) as server:
+        # Connections are spread by the kernel, so connect until a holder lands on each worker
+        holders = {}
+        for n in range(1, 41):
+            peer = server.peer(["holder%d rfc%d.txt %d Shared title %d" % (n, n, n, n)])
+            peer.request("LOOKUP RFC %d P2P-CI/1.0" % n)
+            worker = worker_of(server, peer.port)
+            if worker in holders:
+                peer.close()
+            else:
+                holders[worker] = (n, peer)
+            if len(holders) == 2:
+                break
+        check(len(holders) == 2, "holders did not reach both workers")
+        (victim, (lost, lost_peer)), (survivor, (kept, kept_peer)) = holders.items()
+        check("Shared title %d" % lost in kept_peer.request("LOOKUP RFC %d P2P-CI/1.0" % lost).text,
+              "a registration made through one worker is not seen by the other")
+
+        os.kill(victim, signal.SIGKILL)
+        deadline = time.time() + 5
+        while kept_peer.request("LOOKUP RFC %d P2P-CI/1.0" % lost).status != 404:
+            check(time.time() < deadline, "dead worker's registration kept")
+            time.sleep(0.05)
+        check("Shared title %d" % kept in kept_peer.request("LOOKUP RFC %d P2P-CI/1.0" % kept).text,
+              "a live worker's registration was lost")
+        lost_peer.close()
+        kept_peer.close()
+
+
+if __name__ == "__main__":
+    run([test_term_behind_usr1_stops, test_dead_worker_replaced, test_registry_shared_by_workers])
@@ -0,0 +1,48 @@
+"""
+Twenty-four client processes SWARM one file from a single holder at once.
+Every one of them saves the whole file with its hash, and most pieces are
+read from other downloaders' copies rather than the holder's file. The
+server still sends every piece itself, so this spreads which files are
+read, not the upload.
+"""
+
+import os
+import re
+import subprocess
+
+from harness import CLIENT, Server, check, file_hash, run
+
+CLIENTS = 24
+SIZE = 16 << 20
+PIECE = 256 << 10
+
+
+def test_swarm_of_processes():
+    with Server("-r", 1000000, "-e", 1000000) as server:
+        source = server.client_dir("holder", [(7300, "Popular document")], SIZE)
+        digest = file_hash(os.path.join(source, "rfc7300.txt"))
+        holder = server.peer(server.records(source))
+        holder.request("LOOKUP RFC 7300 P2P-CI/1.0")
+
+        clients = []
+        for i in range(CLIENTS):
+            directory = server.client_dir("swarmer%d" % i, [(7400 + i, "Own document %d" % i)], 4096)
+            clients.append((directory, subprocess.Popen([CLIENT, "-c", "1", str(server.port), "SWARM RFC 7300 P2P-CI/1.0"],
+                                                        cwd=directory, stdin=subprocess.DEVNULL, stdout=subprocess.PIPE,
+                                                        stderr=subprocess.STDOUT)))
+        pieces = 0
+        shared = 0
+        for directory, client in clients:
+            output = client.communicate(timeout=300)[0].decode(errors="replace")
+            saved = re.search(r"Saved \S+: (\d+) bytes in (\d+) pieces, (\d+) from other downloaders", output)
+            check(client.returncode == 0 and saved is not None, "SWARM in %s failed: %s" % (directory, output[-300:]))
+            check(int(saved.group(1)) == SIZE and int(saved.group(2)) == SIZE // PIECE, saved.group(0))
+            check(file_hash(os.path.join(directory, "rfc7300.txt")) == digest, "%s saved the wrong file" % directory)
+            pieces += int(saved.group(2))
+            shared += int(saved.group(3))
+        check(shared * 2 > pieces, "only %d of %d pieces came from other downloaders" % (shared, pieces))
+        holder.close()
+
+
+if __name__ == "__main__":
+    run([test_swarm_of_processes])
@@ -0,0 +1,67 @@
+"""
+A TLS client gets whole identity and deflate GET bodies whether or not the
+kernel takes over its records. Kernel TLS is on for the connection where
+the tls module is loaded and the cipher is one it supports, and off with
+-u or without the module, in which case the body is encrypted in user
+space instead. Plaintext clients share the port.
+"""
+
+import os
+import shutil
+import tempfile
+
+from harness import Server, check, file_hash, run, tls_files
+
+SIZE = 4 << 20
+
+
+def tls_stat(name):
+    """Returns a counter of /proc/net/tls_stat, None without the tls module."""
+    try:
+        with open("/proc/net/tls_stat") as stat:
+            for line in stat:
+                if line.startswith(name):
+                    return int(line.split()[1])
+    except OSError:
+        pass
+    return None
+
+
+def test_ktls_engages_or_falls_back():
+    directory = tempfile.mkdtemp(prefix="p2p-tls-")
+    try:
+        cert, key, context = tls_files(directory)
+        for options in ([], ["-u"]):
+            with Server("-C", cert, "-K", key, *options, quiet=False) as server:
+                source = server.client_dir("holder", [(7100, "Encrypted document")], SIZE)
+                digest = file_hash(os.path.join(source, "rfc7100.txt"))
+                with open(os.path.join(source, "rfc7100.txt"), "rb") as original:
+                    body = original.read()
+                holder = server.peer(server.records(source))
+                holder.request("LOOKUP RFC 7100 P2P-CI/1.0")
+
+                sent_before = tls_stat("TlsTxSw")
+                requester = server.peer(tls=context)
+                for encoding in ("identity", "deflate"):
+                    response = requester.request("GET RFC 7100 P2P-CI/1.0 Accept-Encoding: %s" % encoding, "Linux")
+                    check(response.status == 200 and response.body == body, "%s GET over TLS: %s" % (encoding, response.text))
+                    check(response.header("Content-Hash") == "sha256:" + digest, response.text)
+                cipher = requester.sock.cipher()[0]
+                requester.close()
+                holder.close()
+
+                with open(server.log_path) as log:
+                    states = [line.rsplit(" ", 1)[1] for line in log.read().splitlines() if line.startswith("TLS client on socket")]
+                check(len(states) == 1, "expected one TLS connection logged: %s" % states)
+                module = sent_before is not None
+                if "-u" in options or not module:
+                    check(states[0] == "off", "kernel TLS on with %s" % ("-u" if module else "no tls module"))
+                elif "GCM" in cipher:
+                    check(states[0] == "on", "kernel TLS did not engage for %s with the tls module loaded" % cipher)
+                    check(tls_stat("TlsTxSw") > sent_before, "kernel did not count the connection")
+    finally:
+        shutil.rmtree(directory, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    run([test_ktls_engages_or_falls_back])